@@ -94,11 +94,13 @@
 #include "misc.h"
 #include "buffer.h"
 #include "channels.h"
+#include "eventloop.h"
 #include "compat.h"
 #include "canohost.h"
 #include "key.h"
 #include "authfd.h"
 #include "pathnames.h"
+#include "resolver.h"
 
 /*
  * Include the NX specific functions and
@@ -126,11 +128,33 @@ static Channel **channels = NULL;
  */
 static u_int channels_alloc = 0;
 
-/*
- * Maximum file descriptor value used in any of the channels.  This is
- * updated in channel_new.
- */
-static int channel_max_fd = 0;
+/* Lowest slot of the array that may be free */
+static u_int channels_free_hint = 0;
+
+/* Number of allocated channels */
+static u_int channels_count = 0;
+
+/* Channels that may have data or an EOF to send to the peer */
+TAILQ_HEAD(channel_list, Channel);
+static struct channel_list channel_output =
+    TAILQ_HEAD_INITIALIZER(channel_output);
+
+/* The same, for the channels the scheduler serves ahead of the others */
+static struct channel_list channel_output_first =
+    TAILQ_HEAD_INITIALIZER(channel_output_first);
+static u_int channel_output_count = 0;	/* on channel_output */
+
+static int channel_sched_class(Channel *);
+
+/* Names of the output scheduling classes, for the counters */
+static const char *channel_sched_names[CHAN_SCHED_MAX] = {
+	"latency", "display", "forward", "bulk"
+};
+
+/* Channels hashed by the id the peer knows them by */
+#define CHAN_REMOTE_BUCKETS	1024
+#define CHAN_REMOTE_HASH(id)	((u_int)(id) % CHAN_REMOTE_BUCKETS)
+static LIST_HEAD(, Channel) channel_remote_ids[CHAN_REMOTE_BUCKETS];
 
 
 /* -- tcp forwarding */
@@ -178,6 +202,16 @@ static int num_adm_permitted_opens = 0;
  */
 static int all_opens_permitted = 0;
 
+/* Connections taken from a forwarding listener each time it is ready */
+static u_int channel_accept_batch = CHAN_ACCEPT_BATCH;
+
+/*
+ * Accept counters for the statistics.  The delay is from the start of
+ * the post handlers of a round to the accept of a connection.
+ */
+static u_int64_t channel_accepts, channel_accept_rounds, channel_accept_full;
+static double channel_accept_delay, channel_accept_delay_max;
+static double channel_round_start;
 
 /* -- X11 forwarding */
 
@@ -205,6 +239,64 @@ static u_char *x11_fake_data = NULL;
 static u_int x11_fake_data_len;
 
 
+/* -- receive window autotuning */
+
+/*
+ * The receive window of an open channel grows while the peer runs it
+ * dry, the data is written out as fast as it arrives and, when the
+ * round trip time of the connection is known, the data received per
+ * round trip fills at least half of the window. It grows up to the
+ * ceiling and as long as all windows together fit in a share of the
+ * free memory. When they no longer fit, the windows shrink back
+ * towards the size they were opened with.
+ */
+
+/* Ceiling for the tuned windows, 0 turns tuning off */
+static u_int channel_window_ceiling = 0;
+
+/* Sum of the receive windows of all channels */
+static u_int64_t channel_window_sum = 0;
+
+/* Shortest sample of a window, in seconds */
+#define CHAN_TUNE_INTERVAL	0.1
+
+/* How often the free memory is looked at, in seconds */
+#define CHAN_TUNE_MEM_INTERVAL	1.0
+
+/* All windows together may take 1/CHAN_TUNE_MEM_SHARE of free memory */
+#define CHAN_TUNE_MEM_SHARE	8
+
+
+/* -- channel buffers */
+
+/*
+ * The storage of the buffers of freed channels is kept in a pool, by
+ * powers of two from CHAN_POOL_MIN to CHAN_POOL_MAX, and handed to the
+ * buffers of new channels.  The buffers of all channels, with the pool,
+ * are held to the same share of free memory as the windows.  Above it,
+ * only channels with nothing buffered read more or open their windows,
+ * empty buffers give back their storage and the pool is emptied.
+ */
+#define CHAN_POOL_MIN		256
+#define CHAN_POOL_CLASSES	9		/* up to 64k */
+#define CHAN_POOL_MAX		(CHAN_POOL_MIN << (CHAN_POOL_CLASSES - 1))
+#define CHAN_POOL_KEEP		(4*1024*1024)	/* most storage pooled */
+
+/* The budget is never taken below this */
+#define CHAN_BUFFER_MIN_BUDGET	(32*1024*1024)
+
+struct channel_pool_block {
+	struct channel_pool_block *next;
+};
+static struct channel_pool_block *channel_pool[CHAN_POOL_CLASSES];
+static size_t channel_pool_bytes = 0;
+
+/* Storage of all channel buffers as of the last pre pass, and the budget */
+static size_t channel_buffer_bytes = 0;
+static u_int64_t channel_buffer_budget = 0;
+static int channel_buffer_over = 0;
+
+
 /* -- agent forwarding */
 
 #define	NUM_SOCKS	10
@@ -219,6 +311,8 @@ static const char *channel_rfwd_bind_host(const char *listen_host);
 /* non-blocking connect helpers */
 static int connect_next(struct channel_connect *);
 static void channel_connect_ctx_free(struct channel_connect *);
+static void channel_output_dequeue(Channel *);
+static u_int64_t channel_window_budget(double);
 
 /* -- channel core */
 
@@ -242,15 +336,29 @@ channel_by_id(int id)
 Channel *
 channel_by_remote_id(int remote_id)
 {
-	Channel *c;
-	u_int i;
+	Channel *c, *found = NULL;
 
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c != NULL && c->remote_id == remote_id)
-			return c;
+	if (remote_id == -1)
+		return NULL;
+	LIST_FOREACH(c, &channel_remote_ids[CHAN_REMOTE_HASH(remote_id)],
+	    remote_entry) {
+		if (c->remote_id == remote_id &&
+		    (found == NULL || c->self < found->self))
+			found = c;
 	}
-	return NULL;
+	return found;
+}
+
+/* Sets the id the peer knows the channel by, -1 for none */
+void
+channel_set_remote_id(Channel *c, int remote_id)
+{
+	if (c->remote_id != -1)
+		LIST_REMOVE(c, remote_entry);
+	c->remote_id = remote_id;
+	if (remote_id != -1)
+		LIST_INSERT_HEAD(&channel_remote_ids[CHAN_REMOTE_HASH(remote_id)],
+		    c, remote_entry);
 }
 
 /*
@@ -282,6 +390,16 @@ channel_lookup(int id)
 	return (NULL);
 }
 
+/* Whether writes to the descriptor return instead of blocking */
+static int
+channel_fd_nonblock(int fd)
+{
+	int flags;
+
+	return fd != -1 && (flags = fcntl(fd, F_GETFL)) != -1 &&
+	    (flags & O_NONBLOCK) != 0;
+}
+
 /*
  * Register filedescriptors for a channel, used when allocating a channel or
  * when the channel consumer/producer is ready, e.g. shell exec'd
@@ -290,11 +408,6 @@ static void
 channel_register_fds(Channel *c, int rfd, int wfd, int efd,
     int extusage, int nonblock, int is_tty)
 {
-	/* Update the maximum file descriptor value. */
-	channel_max_fd = MAXIMUM(channel_max_fd, rfd);
-	channel_max_fd = MAXIMUM(channel_max_fd, wfd);
-	channel_max_fd = MAXIMUM(channel_max_fd, efd);
-
 	if (rfd != -1)
 		fcntl(rfd, F_SETFD, FD_CLOEXEC);
 	if (wfd != -1 && wfd != rfd)
@@ -324,6 +437,131 @@ channel_register_fds(Channel *c, int rfd, int wfd, int efd,
 		if (efd != -1)
 			set_nonblock(efd);
 	}
+	c->wfd_nonblock = channel_fd_nonblock(wfd);
+}
+
+/*
+ * To be called after other files have been dup2()ed onto the descriptors
+ * of the channel.  The new wfd may be blocking.
+ */
+void
+channel_fds_replaced(Channel *c)
+{
+	c->wfd_nonblock = channel_fd_nonblock(c->wfd);
+}
+
+/* Sets up a channel buffer, with storage from the pool if there is any */
+static void
+channel_buffer_init(Buffer *b)
+{
+	struct channel_pool_block *blk;
+	u_int i;
+
+	for (i = 0; i < CHAN_POOL_CLASSES; i++) {
+		if ((blk = channel_pool[i]) == NULL)
+			continue;
+		channel_pool[i] = blk->next;
+		channel_pool_bytes -= CHAN_POOL_MIN << i;
+		blk->next = NULL;
+		sshbuf_init_storage(b, (u_char *)blk, CHAN_POOL_MIN << i);
+		return;
+	}
+	buffer_init(b);
+}
+
+/* Frees a channel buffer, keeping its storage in the pool if it fits */
+static void
+channel_buffer_free(Buffer *b)
+{
+	struct channel_pool_block *blk;
+	size_t alloc;
+	u_int i;
+
+	if ((blk = (struct channel_pool_block *)sshbuf_release(b,
+	    &alloc)) == NULL)
+		return;
+	if (alloc < CHAN_POOL_MIN || alloc >= 2 * CHAN_POOL_MAX ||
+	    channel_pool_bytes + alloc > CHAN_POOL_KEEP ||
+	    channel_buffer_over) {
+		free(blk);
+		return;
+	}
+	for (i = 0; i + 1 < CHAN_POOL_CLASSES &&
+	    alloc >= (size_t)CHAN_POOL_MIN << (i + 1); i++)
+		;
+	blk->next = channel_pool[i];
+	channel_pool[i] = blk;
+	channel_pool_bytes += CHAN_POOL_MIN << i;
+}
+
+static void
+channel_pool_drain(void)
+{
+	struct channel_pool_block *blk;
+	u_int i;
+
+	for (i = 0; i < CHAN_POOL_CLASSES; i++) {
+		while ((blk = channel_pool[i]) != NULL) {
+			channel_pool[i] = blk->next;
+			free(blk);
+		}
+	}
+	channel_pool_bytes = 0;
+}
+
+/*
+ * Returns the storage held by the buffers of the channel.  Over the
+ * budget, empty buffers give back what they grew to first.
+ */
+static size_t
+channel_buffer_account(Channel *c)
+{
+	Buffer *bufs[4] = { &c->input, &c->output, &c->extended,
+	    &c->nx_buffer };
+	size_t bytes = 0;
+	u_int i;
+
+	for (i = 0; i < 4; i++) {
+		if (channel_buffer_over && buffer_len(bufs[i]) == 0 &&
+		    sshbuf_alloc(bufs[i]) > CHAN_POOL_MIN)
+			sshbuf_reset(bufs[i]);
+		bytes += sshbuf_alloc(bufs[i]);
+	}
+	return bytes;
+}
+
+/* Compares the storage counted in the pre pass with the budget */
+static void
+channel_buffer_check(size_t bytes)
+{
+	u_int64_t budget;
+	int over;
+
+	budget = MAXIMUM(channel_window_budget(monotime_double()),
+	    CHAN_BUFFER_MIN_BUDGET);
+	if (channel_buffer_budget == 0)
+		debug("channel buffer budget: %llu bytes",
+		    (unsigned long long)budget);
+	channel_buffer_budget = budget;
+	channel_buffer_bytes = bytes + channel_pool_bytes;
+	over = channel_buffer_bytes > budget;
+	if (over && !channel_buffer_over) {
+		debug("channel buffers: %zu bytes over the budget of %llu, "
+		    "throttling reads", channel_buffer_bytes,
+		    (unsigned long long)budget);
+		channel_pool_drain();
+	} else if (!over && channel_buffer_over)
+		debug("channel buffers: %zu bytes, back within the budget "
+		    "of %llu", channel_buffer_bytes,
+		    (unsigned long long)budget);
+	channel_buffer_over = over;
+}
+
+/* Whether a channel holding "b" should wait before taking in more data */
+static int
+channel_buffer_throttled(Buffer *b)
+{
+	return channel_buffer_over && buffer_len(b) > 0;
 }
 
 /*
@@ -346,7 +584,7 @@ channel_new(char *ctype, int type, int rfd, int wfd, int efd,
 			channels[i] = NULL;
 	}
 	/* Try to find a free slot where to put the new channel. */
-	for (found = -1, i = 0; i < channels_alloc; i++)
+	for (found = -1, i = channels_free_hint; i < channels_alloc; i++)
 		if (channels[i] == NULL) {
 			/* Found a free slot. */
 			found = (int)i;
@@ -367,9 +605,11 @@ channel_new(char *ctype, int type, int rfd, int wfd, int efd,
 	}
 	/* Initialize and return new channel. */
 	c = channels[found] = xcalloc(1, sizeof(Channel));
-	buffer_init(&c->input);
-	buffer_init(&c->output);
-	buffer_init(&c->extended);
+	channels_free_hint = found + 1;
+	channels_count++;
+	channel_buffer_init(&c->input);
+	channel_buffer_init(&c->output);
+	channel_buffer_init(&c->extended);
 	c->path = NULL;
 	c->listening_addr = NULL;
 	c->listening_port = 0;
@@ -389,6 +629,9 @@ channel_new(char *ctype, int type, int rfd, int wfd, int efd,
 	c->ctype = ctype;
 	c->local_window = window;
 	c->local_window_max = window;
+	c->local_window_base = window;
+	c->window_low = window;
+	channel_window_sum += window;
 	c->local_consumed = 0;
 	c->local_maxpacket = maxpack;
 	c->remote_id = -1;
@@ -409,45 +652,28 @@ channel_new(char *ctype, int type, int rfd, int wfd, int efd,
 	c->mux_rcb = NULL;
 	c->mux_ctx = NULL;
 	c->mux_pause = 0;
+	c->sched_class = CHAN_SCHED_AUTO;
 	c->delayed = 1;		/* prevent call to channel_post handler */
 	TAILQ_INIT(&c->status_confirms);
 	/*
 	* Initialize the NX members.
 	*/
 
-	buffer_init(&c->nx_buffer);
+	channel_buffer_init(&c->nx_buffer);
+	c->nx_matched = 0;
 	debug("channel %d: new [%s]", found, remote_name);
 	return c;
 }
 
-static int
-channel_find_maxfd(void)
-{
-	u_int i;
-	int max = 0;
-	Channel *c;
-
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c != NULL) {
-			max = MAXIMUM(max, c->rfd);
-			max = MAXIMUM(max, c->wfd);
-			max = MAXIMUM(max, c->efd);
-		}
-	}
-	return max;
-}
-
 int
 channel_close_fd(int *fdp)
 {
 	int ret = 0, fd = *fdp;
 
 	if (fd != -1) {
+		channel_forget_fd(fd);
 		ret = close(fd);
 		*fdp = -1;
-		if (fd == channel_max_fd)
-			channel_max_fd = channel_find_maxfd();
 	}
 	return ret;
 }
@@ -467,27 +693,24 @@ void
 channel_free(Channel *c)
 {
 	char *s;
-	u_int i, n;
+	u_int i;
 	Channel *other;
 	struct channel_confirm *cc;
 
-	for (n = 0, i = 0; i < channels_alloc; i++) {
-		if ((other = channels[i]) != NULL) {
-			n++;
-
-			/* detach from mux client and prepare for closing */
-			if (c->type == SSH_CHANNEL_MUX_CLIENT &&
-			    other->type == SSH_CHANNEL_MUX_PROXY &&
-			    other->mux_ctx == c) {
-				other->mux_ctx = NULL;
-				other->type = SSH_CHANNEL_OPEN;
-				other->istate = CHAN_INPUT_CLOSED;
-				other->ostate = CHAN_OUTPUT_CLOSED;
-			}
+	/* detach from mux client and prepare for closing */
+	for (i = 0; c->type == SSH_CHANNEL_MUX_CLIENT &&
+	    i < channels_alloc; i++) {
+		if ((other = channels[i]) != NULL &&
+		    other->type == SSH_CHANNEL_MUX_PROXY &&
+		    other->mux_ctx == c) {
+			other->mux_ctx = NULL;
+			other->type = SSH_CHANNEL_OPEN;
+			other->istate = CHAN_INPUT_CLOSED;
+			other->ostate = CHAN_OUTPUT_CLOSED;
 		}
 	}
 	debug("channel %d: free: %s, nchannels %u", c->self,
-	    c->remote_name ? c->remote_name : "???", n);
+	    c->remote_name ? c->remote_name : "???", channels_count);
 
 	/* XXX more MUX cleanup: remove remote forwardings */
 	if (c->type == SSH_CHANNEL_MUX_CLIENT) {
@@ -518,20 +741,24 @@ channel_free(Channel *c)
 		}
 	}
 
-	s = channel_open_message();
-	debug3("channel %d: status: %s", c->self, s);
-	free(s);
+	/* the status covers every channel, only build it when logged */
+	if (log_level_get() >= SYSLOG_LEVEL_DEBUG3) {
+		s = channel_open_message();
+		debug3("channel %d: status: %s", c->self, s);
+		free(s);
+	}
 
 	if (c->sock != -1)
 		shutdown(c->sock, SHUT_RDWR);
 	channel_close_fds(c);
-	buffer_free(&c->input);
-	buffer_free(&c->output);
-	buffer_free(&c->extended);
+	channel_connect_ctx_free(&c->connect_ctx);
+	channel_buffer_free(&c->input);
+	channel_buffer_free(&c->output);
+	channel_buffer_free(&c->extended);
 	/*
 	* Free the NX members.
 	*/
-	buffer_free(&c->nx_buffer);
+	channel_buffer_free(&c->nx_buffer);
 	free(c->remote_name);
 	c->remote_name = NULL;
 	free(c->path);
@@ -547,7 +774,12 @@ channel_free(Channel *c)
 	}
 	if (c->filter_cleanup != NULL && c->filter_ctx != NULL)
 		c->filter_cleanup(c->self, c->filter_ctx);
+	channel_output_dequeue(c);
+	channel_set_remote_id(c, -1);
+	channel_window_sum -= c->local_window_max;
 	channels[c->self] = NULL;
+	channels_free_hint = MINIMUM(channels_free_hint, (u_int)c->self);
+	channels_count--;
 	free(c);
 }
 
@@ -789,6 +1021,66 @@ channel_open_message(void)
 	return cp;
 }
 
+/*
+ * Appends the buffer and accept counters, and the window counters of
+ * the open channels, to "b", one "name value" pair per line, as for
+ * ssh_packet_get_stats().
+ */
+int
+channel_get_stats(struct sshbuf *b)
+{
+	Channel *c;
+	double stall;
+	u_int i;
+	int r;
+
+	if ((r = sshbuf_putf(b, "channels.buffer_bytes %zu\n"
+	    "channels.buffer_budget %llu\n"
+	    "channels.buffer_pooled %zu\n"
+	    "channels.accepts %llu\n"
+	    "channels.accept_rounds %llu\n"
+	    "channels.accept_full_batches %llu\n"
+	    "channels.accept_delay_avg_ms %.3f\n"
+	    "channels.accept_delay_max_ms %.3f\n",
+	    channel_buffer_bytes, (unsigned long long)channel_buffer_budget,
+	    channel_pool_bytes,
+	    (unsigned long long)channel_accepts,
+	    (unsigned long long)channel_accept_rounds,
+	    (unsigned long long)channel_accept_full,
+	    channel_accepts == 0 ? 0.0 :
+	    channel_accept_delay * 1000 / channel_accepts,
+	    channel_accept_delay_max * 1000)) != 0)
+		return r;
+	for (i = 0; i < channels_alloc; i++) {
+		c = channels[i];
+		if (c == NULL || c->type != SSH_CHANNEL_OPEN)
+			continue;
+		stall = c->window_stall_time;
+		if (c->window_stall_start != 0)
+			stall += monotime_double() - c->window_stall_start;
+		if ((r = sshbuf_putf(b, "channel.%d.type %s\n"
+		    "channel.%d.remote_window %u\n"
+		    "channel.%d.local_window %u\n"
+		    "channel.%d.local_window_max %u\n"
+		    "channel.%d.input_bytes %u\n"
+		    "channel.%d.output_bytes %u\n"
+		    "channel.%d.window_stalls %u\n"
+		    "channel.%d.window_stall_ms %.3f\n"
+		    "channel.%d.output_class %s\n",
+		    c->self, c->ctype ? c->ctype : "unknown",
+		    c->self, c->remote_window,
+		    c->self, c->local_window,
+		    c->self, c->local_window_max,
+		    c->self, buffer_len(&c->input),
+		    c->self, buffer_len(&c->output),
+		    c->self, c->window_stalls,
+		    c->self, stall * 1000,
+		    c->self, channel_sched_names[channel_sched_class(c)])) != 0)
+			return r;
+	}
+	return 0;
+}
+
 void
 channel_send_open(int id)
 {
@@ -905,7 +1197,11 @@ channel_set_fds(int id, int rfd, int wfd, int efd,
 		fatal("channel_activate for non-larval channel %d.", id);
 	channel_register_fds(c, rfd, wfd, efd, extusage, nonblock, is_tty);
 	c->type = SSH_CHANNEL_OPEN;
+	channel_window_sum -= c->local_window_max;
 	c->local_window = c->local_window_max = window_max;
+	c->local_window_base = c->window_low = window_max;
+	channel_window_sum += window_max;
+	channel_output_wakeup(c);
 	packet_start(SSH2_MSG_CHANNEL_WINDOW_ADJUST);
 	packet_put_int(c->remote_id);
 	packet_put_int(c->local_window);
@@ -913,55 +1209,56 @@ channel_set_fds(int id, int rfd, int wfd, int efd,
 }
 
 /*
- * 'channel_pre*' are called just before select() to add any bits relevant to
- * channels in the select bitmasks.
+ * 'channel_pre*' are called just before the wait to state which events
+ * the descriptors of the channels wait for.
  */
 /*
  * 'channel_post*': perform any appropriate operations for channels which
  * have events pending.
  */
-typedef void chan_fn(Channel *c, fd_set *readset, fd_set *writeset);
+typedef void chan_fn(Channel *c);
 chan_fn *channel_pre[SSH_CHANNEL_MAX_TYPE];
 chan_fn *channel_post[SSH_CHANNEL_MAX_TYPE];
 
-/* ARGSUSED */
 static void
-channel_pre_listener(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_listener(Channel *c)
 {
-	FD_SET(c->sock, readset);
+	channel_want_fd(c->sock, EVENTLOOP_READ);
 }
 
-/* ARGSUSED */
 static void
-channel_pre_connecting(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_connecting(Channel *c)
 {
+	if (c->connect_ctx.query != NULL)
+		return;
 	debug3("channel %d: waiting for connection", c->self);
-	FD_SET(c->sock, writeset);
+	channel_want_fd(c->sock, EVENTLOOP_WRITE);
 }
 
 static void
-channel_pre_open_13(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_open_13(Channel *c)
 {
 	if (buffer_len(&c->input) < packet_get_maxsize())
-		FD_SET(c->sock, readset);
+		channel_want_fd(c->sock, EVENTLOOP_READ);
 	if (buffer_len(&c->output) > 0)
-		FD_SET(c->sock, writeset);
+		channel_want_fd(c->sock, EVENTLOOP_WRITE);
 }
 
 static void
-channel_pre_open(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_open(Channel *c)
 {
 	u_int limit = compat20 ? c->remote_window : packet_get_maxsize();
 
 	if (c->istate == CHAN_INPUT_OPEN &&
 	    limit > 0 &&
 	    buffer_len(&c->input) < limit &&
-	    buffer_check_alloc(&c->input, CHAN_RBUF))
-		FD_SET(c->rfd, readset);
+	    buffer_check_alloc(&c->input, CHAN_RBUF) &&
+	    !channel_buffer_throttled(&c->input))
+		channel_want_fd(c->rfd, EVENTLOOP_READ);
 	if (c->ostate == CHAN_OUTPUT_OPEN ||
 	    c->ostate == CHAN_OUTPUT_WAIT_DRAIN) {
 		if (buffer_len(&c->output) > 0) {
-			FD_SET(c->wfd, writeset);
+			channel_want_fd(c->wfd, EVENTLOOP_WRITE);
 		} else if (c->ostate == CHAN_OUTPUT_WAIT_DRAIN) {
 			if (CHANNEL_EFD_OUTPUT_ACTIVE(c))
 				debug2("channel %d: obuf_empty delayed efd %d/(%d)",
@@ -975,19 +1272,19 @@ channel_pre_open(Channel *c, fd_set *readset, fd_set *writeset)
 	    !(c->istate == CHAN_INPUT_CLOSED && c->ostate == CHAN_OUTPUT_CLOSED)) {
 		if (c->extended_usage == CHAN_EXTENDED_WRITE &&
 		    buffer_len(&c->extended) > 0)
-			FD_SET(c->efd, writeset);
+			channel_want_fd(c->efd, EVENTLOOP_WRITE);
 		else if (c->efd != -1 && !(c->flags & CHAN_EOF_SENT) &&
 		    (c->extended_usage == CHAN_EXTENDED_READ ||
 		    c->extended_usage == CHAN_EXTENDED_IGNORE) &&
-		    buffer_len(&c->extended) < c->remote_window)
-			FD_SET(c->efd, readset);
+		    buffer_len(&c->extended) < c->remote_window &&
+		    !channel_buffer_throttled(&c->extended))
+			channel_want_fd(c->efd, EVENTLOOP_READ);
 	}
 	/* XXX: What about efd? races? */
 }
 
-/* ARGSUSED */
 static void
-channel_pre_input_draining(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_input_draining(Channel *c)
 {
 	if (buffer_len(&c->input) == 0) {
 		packet_start(SSH_MSG_CHANNEL_CLOSE);
@@ -998,14 +1295,13 @@ channel_pre_input_draining(Channel *c, fd_set *readset, fd_set *writeset)
 	}
 }
 
-/* ARGSUSED */
 static void
-channel_pre_output_draining(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_output_draining(Channel *c)
 {
 	if (buffer_len(&c->output) == 0)
 		chan_mark_dead(c);
 	else
-		FD_SET(c->sock, writeset);
+		channel_want_fd(c->sock, EVENTLOOP_WRITE);
 }
 
 /*
@@ -1083,14 +1379,14 @@ x11_open_helper(Buffer *b)
 }
 
 static void
-channel_pre_x11_open_13(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_x11_open_13(Channel *c)
 {
 	int ret = x11_open_helper(&c->output);
 
 	if (ret == 1) {
 		/* Start normal processing for the channel. */
 		c->type = SSH_CHANNEL_OPEN;
-		channel_pre_open_13(c, readset, writeset);
+		channel_pre_open_13(c);
 	} else if (ret == -1) {
 		/*
 		 * We have received an X11 connection that has bad
@@ -1109,7 +1405,7 @@ channel_pre_x11_open_13(Channel *c, fd_set *readset, fd_set *writeset)
 }
 
 static void
-channel_pre_x11_open(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_x11_open(Channel *c)
 {
 	int ret = x11_open_helper(&c->output);
 
@@ -1117,7 +1413,7 @@ channel_pre_x11_open(Channel *c, fd_set *readset, fd_set *writeset)
 
 	if (ret == 1) {
 		c->type = SSH_CHANNEL_OPEN;
-		channel_pre_open(c, readset, writeset);
+		channel_pre_open(c);
 	} else if (ret == -1) {
 		logit("X11 connection rejected because of wrong authentication.");
 		debug2("X11 rejected %d i%d/o%d", c->self, c->istate, c->ostate);
@@ -1135,11 +1431,11 @@ channel_pre_x11_open(Channel *c, fd_set *readset, fd_set *writeset)
 }
 
 static void
-channel_pre_mux_client(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_mux_client(Channel *c)
 {
 	if (c->istate == CHAN_INPUT_OPEN && !c->mux_pause &&
 	    buffer_check_alloc(&c->input, CHAN_RBUF))
-		FD_SET(c->rfd, readset);
+		channel_want_fd(c->rfd, EVENTLOOP_READ);
 	if (c->istate == CHAN_INPUT_WAIT_DRAIN) {
 		/* clear buffer immediately (discard any partial packet) */
 		buffer_clear(&c->input);
@@ -1150,16 +1446,15 @@ channel_pre_mux_client(Channel *c, fd_set *readset, fd_set *writeset)
 	if (c->ostate == CHAN_OUTPUT_OPEN ||
 	    c->ostate == CHAN_OUTPUT_WAIT_DRAIN) {
 		if (buffer_len(&c->output) > 0)
-			FD_SET(c->wfd, writeset);
+			channel_want_fd(c->wfd, EVENTLOOP_WRITE);
 		else if (c->ostate == CHAN_OUTPUT_WAIT_DRAIN)
 			chan_obuf_empty(c);
 	}
 }
 
 /* try to decode a socks4 header */
-/* ARGSUSED */
 static int
-channel_decode_socks4(Channel *c, fd_set *readset, fd_set *writeset)
+channel_decode_socks4(Channel *c)
 {
 	char *p, *host;
 	u_int len, have, i, found, need;
@@ -1270,9 +1565,8 @@ channel_decode_socks4(Channel *c, fd_set *readset, fd_set *writeset)
 #define SSH_SOCKS5_CONNECT	0x01
 #define SSH_SOCKS5_SUCCESS	0x00
 
-/* ARGSUSED */
 static int
-channel_decode_socks5(Channel *c, fd_set *readset, fd_set *writeset)
+channel_decode_socks5(Channel *c)
 {
 	struct {
 		u_int8_t version;
@@ -1312,7 +1606,7 @@ channel_decode_socks5(Channel *c, fd_set *readset, fd_set *writeset)
 		buffer_consume(&c->input, nmethods + 2);
 		buffer_put_char(&c->output, 0x05);		/* version */
 		buffer_put_char(&c->output, SSH_SOCKS5_NOAUTH);	/* method */
-		FD_SET(c->sock, writeset);
+		channel_want_fd(c->sock, EVENTLOOP_WRITE);
 		c->flags |= SSH_SOCKS5_AUTHDONE;
 		debug2("channel %d: socks5 auth done", c->self);
 		return 0;				/* need more */
@@ -1412,7 +1706,7 @@ channel_connect_stdio_fwd(const char *host_to_connect, u_short port_to_connect,
 
 /* dynamic port forwarding */
 static void
-channel_pre_dynamic(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_dynamic(Channel *c)
 {
 	u_char *p;
 	u_int have;
@@ -1424,17 +1718,17 @@ channel_pre_dynamic(Channel *c, fd_set *readset, fd_set *writeset)
 	/* check if the fixed size part of the packet is in buffer. */
 	if (have < 3) {
 		/* need more */
-		FD_SET(c->sock, readset);
+		channel_want_fd(c->sock, EVENTLOOP_READ);
 		return;
 	}
 	/* try to guess the protocol */
 	p = buffer_ptr(&c->input);
 	switch (p[0]) {
 	case 0x04:
-		ret = channel_decode_socks4(c, readset, writeset);
+		ret = channel_decode_socks4(c);
 		break;
 	case 0x05:
-		ret = channel_decode_socks5(c, readset, writeset);
+		ret = channel_decode_socks5(c);
 		break;
 	default:
 		ret = -1;
@@ -1445,7 +1739,7 @@ channel_pre_dynamic(Channel *c, fd_set *readset, fd_set *writeset)
 	} else if (ret == 0) {
 		debug2("channel %d: pre_dynamic: need more", c->self);
 		/* need more */
-		FD_SET(c->sock, readset);
+		channel_want_fd(c->sock, EVENTLOOP_READ);
 	} else {
 		/* switch to the next state */
 		c->type = SSH_CHANNEL_OPENING;
@@ -1454,9 +1748,8 @@ channel_pre_dynamic(Channel *c, fd_set *readset, fd_set *writeset)
 }
 
 /* This is our fake X11 server socket. */
-/* ARGSUSED */
 static void
-channel_post_x11_listener(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_x11_listener(Channel *c)
 {
 	Channel *nc;
 	struct sockaddr_storage addr;
@@ -1465,7 +1758,7 @@ channel_post_x11_listener(Channel *c, fd_set *readset, fd_set *writeset)
 	char buf[16384], *remote_ipaddr;
 	int remote_port;
 
-	if (FD_ISSET(c->sock, readset)) {
+	if (channel_fd_ready(c->sock, EVENTLOOP_READ)) {
 		debug("X11 connection requested.");
 		addrlen = sizeof(addr);
 		newsock = accept(c->sock, (struct sockaddr *)&addr, &addrlen);
@@ -1607,51 +1900,95 @@ channel_set_x11_refuse_time(u_int refuse_time)
 	x11_refuse_time = refuse_time;
 }
 
+/*
+ * Accepts a connection on a listening socket, non-blocking and
+ * close-on-exec from the start where accept4(2) is available.
+ */
+static int
+channel_accept(int sock, struct sockaddr *addr, socklen_t *addrlenp)
+{
+	int fd;
+#if defined(HAVE_ACCEPT4) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+	static int no_accept4;
+
+	if (!no_accept4) {
+		if ((fd = accept4(sock, addr, addrlenp,
+		    SOCK_NONBLOCK|SOCK_CLOEXEC)) != -1 || errno != ENOSYS)
+			return fd;
+		no_accept4 = 1;
+	}
+#endif
+	if ((fd = accept(sock, addr, addrlenp)) == -1)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	set_nonblock(fd);
+	return fd;
+}
+
 /*
  * This socket is listening for connections to a forwarded TCP/IP port.
+ * The backlog is taken up to channel_accept_batch connections at a
+ * time, so that a burst of clients does not wait a round each.
  */
-/* ARGSUSED */
 static void
-channel_post_port_listener(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_port_listener(Channel *c)
 {
 	Channel *nc;
 	struct sockaddr_storage addr;
 	int newsock, nextstate;
 	socklen_t addrlen;
 	char *rtype;
+	double delay;
+	u_int retries = 0, accepted = 0;
 
-	if (FD_ISSET(c->sock, readset)) {
-		debug("Connection to port %d forwarding "
-		    "to %.100s port %d requested.",
-		    c->listening_port, c->path, c->host_port);
+	if (!channel_fd_ready(c->sock, EVENTLOOP_READ))
+		return;
 
-		if (c->type == SSH_CHANNEL_RPORT_LISTENER) {
-			nextstate = SSH_CHANNEL_OPENING;
-			rtype = "forwarded-tcpip";
-		} else if (c->type == SSH_CHANNEL_RUNIX_LISTENER) {
-			nextstate = SSH_CHANNEL_OPENING;
-			rtype = "forwarded-streamlocal@openssh.com";
-		} else if (c->host_port == PORT_STREAMLOCAL) {
-			nextstate = SSH_CHANNEL_OPENING;
-			rtype = "direct-streamlocal@openssh.com";
-		} else if (c->host_port == 0) {
-			nextstate = SSH_CHANNEL_DYNAMIC;
-			rtype = "dynamic-tcpip";
-		} else {
-			nextstate = SSH_CHANNEL_OPENING;
-			rtype = "direct-tcpip";
-		}
+	if (c->type == SSH_CHANNEL_RPORT_LISTENER) {
+		nextstate = SSH_CHANNEL_OPENING;
+		rtype = "forwarded-tcpip";
+	} else if (c->type == SSH_CHANNEL_RUNIX_LISTENER) {
+		nextstate = SSH_CHANNEL_OPENING;
+		rtype = "forwarded-streamlocal@openssh.com";
+	} else if (c->host_port == PORT_STREAMLOCAL) {
+		nextstate = SSH_CHANNEL_OPENING;
+		rtype = "direct-streamlocal@openssh.com";
+	} else if (c->host_port == 0) {
+		nextstate = SSH_CHANNEL_DYNAMIC;
+		rtype = "dynamic-tcpip";
+	} else {
+		nextstate = SSH_CHANNEL_OPENING;
+		rtype = "direct-tcpip";
+	}
 
+	while (accepted < channel_accept_batch) {
 		addrlen = sizeof(addr);
-		newsock = accept(c->sock, (struct sockaddr *)&addr, &addrlen);
+		newsock = channel_accept(c->sock, (struct sockaddr *)&addr,
+		    &addrlen);
 		if (newsock < 0) {
-			if (errno != EINTR && errno != EWOULDBLOCK &&
-			    errno != ECONNABORTED)
+			if (errno == ECONNABORTED || errno == EINTR) {
+				/* Not counted in the batch, up to a bound */
+				if (retries++ < channel_accept_batch)
+					continue;
+				break;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
 				error("accept: %.100s", strerror(errno));
 			if (errno == EMFILE || errno == ENFILE)
 				c->notbefore = monotime() + 1;
-			return;
+			break;
 		}
+		delay = monotime_double() - channel_round_start;
+		channel_accept_delay += delay;
+		channel_accept_delay_max = MAXIMUM(channel_accept_delay_max,
+		    delay);
+		if (accepted++ == 0)
+			channel_accept_rounds++;
+		channel_accepts++;
+
+		debug("Connection to port %d forwarding "
+		    "to %.100s port %d requested.",
+		    c->listening_port, c->path, c->host_port);
 		if (c->host_port != PORT_STREAMLOCAL)
 			set_nodelay(newsock);
 		nc = channel_new(rtype, nextstate, newsock, newsock, -1,
@@ -1664,22 +2001,26 @@ channel_post_port_listener(Channel *c, fd_set *readset, fd_set *writeset)
 		if (nextstate != SSH_CHANNEL_DYNAMIC)
 			port_open_helper(nc, rtype);
 	}
+	if (accepted == channel_accept_batch) {
+		debug3("channel %d: accept batch of %u full", c->self,
+		    accepted);
+		channel_accept_full++;
+	}
 }
 
 /*
  * This is the authentication agent socket listening for connections from
  * clients.
  */
-/* ARGSUSED */
 static void
-channel_post_auth_listener(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_auth_listener(Channel *c)
 {
 	Channel *nc;
 	int newsock;
 	struct sockaddr_storage addr;
 	socklen_t addrlen;
 
-	if (FD_ISSET(c->sock, readset)) {
+	if (channel_fd_ready(c->sock, EVENTLOOP_READ)) {
 		addrlen = sizeof(addr);
 		newsock = accept(c->sock, (struct sockaddr *)&addr, &addrlen);
 		if (newsock < 0) {
@@ -1707,14 +2048,34 @@ channel_post_auth_listener(Channel *c, fd_set *readset, fd_set *writeset)
 	}
 }
 
-/* ARGSUSED */
+/* Tells the peer that the connection for a CONNECTING channel failed */
 static void
-channel_post_connecting(Channel *c, fd_set *readset, fd_set *writeset)
+channel_connect_failed(Channel *c, const char *errmsg)
+{
+	channel_connect_ctx_free(&c->connect_ctx);
+	if (compat20) {
+		packet_start(SSH2_MSG_CHANNEL_OPEN_FAILURE);
+		packet_put_int(c->remote_id);
+		packet_put_int(SSH2_OPEN_CONNECT_FAILED);
+		if (!(datafellows & SSH_BUG_OPENFAILURE)) {
+			packet_put_cstring(errmsg);
+			packet_put_cstring("");
+		}
+	} else {
+		packet_start(SSH_MSG_CHANNEL_OPEN_FAILURE);
+		packet_put_int(c->remote_id);
+	}
+	packet_send();
+	chan_mark_dead(c);
+}
+
+static void
+channel_post_connecting(Channel *c)
 {
 	int err = 0, sock;
 	socklen_t sz = sizeof(err);
 
-	if (FD_ISSET(c->sock, writeset)) {
+	if (channel_fd_ready(c->sock, EVENTLOOP_WRITE)) {
 		if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &sz) < 0) {
 			err = errno;
 			error("getsockopt SO_ERROR failed");
@@ -1740,44 +2101,84 @@ channel_post_connecting(Channel *c, fd_set *readset, fd_set *writeset)
 			    c->self, strerror(err));
 			/* Try next address, if any */
 			if ((sock = connect_next(&c->connect_ctx)) > 0) {
+				channel_forget_fd(c->sock);
 				close(c->sock);
 				c->sock = c->rfd = c->wfd = sock;
-				channel_max_fd = channel_find_maxfd();
 				return;
 			}
 			/* Exhausted all addresses */
 			error("connect_to %.100s port %d: failed.",
 			    c->connect_ctx.host, c->connect_ctx.port);
-			channel_connect_ctx_free(&c->connect_ctx);
-			if (compat20) {
-				packet_start(SSH2_MSG_CHANNEL_OPEN_FAILURE);
-				packet_put_int(c->remote_id);
-				packet_put_int(SSH2_OPEN_CONNECT_FAILED);
-				if (!(datafellows & SSH_BUG_OPENFAILURE)) {
-					packet_put_cstring(strerror(err));
-					packet_put_cstring("");
-				}
-			} else {
-				packet_start(SSH_MSG_CHANNEL_OPEN_FAILURE);
-				packet_put_int(c->remote_id);
-			}
-			chan_mark_dead(c);
+			channel_connect_failed(c, strerror(err));
+			return;
 		}
 		packet_send();
 	}
 }
 
-/* ARGSUSED */
+/*
+ * Returns how much to read straight into the input buffer of the
+ * channel, or 0 to read through the stack buffer.  Channels whose reads
+ * keep filling the space offered skip the copy; the read grows up to
+ * what the remote window can still take.
+ */
+static u_int
+channel_read_size(Channel *c)
+{
+	u_int limit, have = buffer_len(&c->input), len;
+
+	if (c->read_size <= CHAN_RBUF || nx_check_switch ||
+	    c->input_filter != NULL || c->datagram)
+		return 0;
+	limit = compat20 ? c->remote_window : packet_get_maxsize();
+	if (limit <= have || limit - have <= CHAN_RBUF)
+		return 0;
+	len = MINIMUM(c->read_size, limit - have);
+	if (sshbuf_check_reserve(&c->input, len) != 0)
+		return 0;
+	return len;
+}
+
+/* Queues data read from the channel descriptor for the peer */
+static void
+channel_input_append(Channel *c, char *buf, int len)
+{
+	if (c->input_filter != NULL) {
+		if (c->input_filter(c, buf, len) == -1) {
+			debug("channel %d: filter stops", c->self);
+			chan_read_failed(c);
+		}
+	} else if (c->datagram) {
+		buffer_put_string(&c->input, buf, len);
+	} else {
+		buffer_append(&c->input, buf, len);
+	}
+}
+
 static int
-channel_handle_rfd(Channel *c, fd_set *readset, fd_set *writeset)
+channel_handle_rfd(Channel *c)
 {
 	char buf[CHAN_RBUF];
-	int len, force;
+	u_char *p;
+	u_int want;
+	int r, len, force;
 
 	force = c->isatty && c->detach_close && c->istate != CHAN_INPUT_CLOSED;
-	if (c->rfd != -1 && (force || FD_ISSET(c->rfd, readset))) {
+	if (c->rfd != -1 && (force || channel_fd_ready(c->rfd, EVENTLOOP_READ))) {
 		errno = 0;
 
+		if ((want = channel_read_size(c)) > 0) {
+			if ((r = sshbuf_reserve(&c->input, want, &p)) != 0)
+				fatal("%s: channel %d: reserve: %s", __func__,
+				    c->self, ssh_err(r));
+			len = read(c->rfd, p, want);
+			if ((r = sshbuf_consume_end(&c->input,
+			    len > 0 ? want - len : want)) != 0)
+				fatal("%s: channel %d: consume: %s", __func__,
+				    c->self, ssh_err(r));
+			goto done;
+		}
+
 		/*
 		* To print the content of the buffer need
 		* to ensure that it is null-terminated.
@@ -1790,8 +2191,15 @@ channel_handle_rfd(Channel *c, fd_set *readset, fd_set *writeset)
 			sizeof(buf) - 1, c->rfd);
 		#endif
 
-		len = read(c->rfd, buf, sizeof(buf) - 1);
+		/*
+		* Leave room for the bytes that the check of
+		* the NX command may have held back.
+		*/
+
+		len = read(c->rfd, buf, sizeof(buf) - 1 -
+		    (nx_check_switch ? NX_SWITCH_HOLD_SIZE : 0));
 
+ done:
 		#ifdef TEST
 		logit("NX> 280 Read: %d bytes error: %d in context: 4",
 			len, (len < 0 ? errno : 0));
@@ -1817,15 +2225,39 @@ channel_handle_rfd(Channel *c, fd_set *readset, fd_set *writeset)
 				c->type = SSH_CHANNEL_INPUT_DRAINING;
 				debug2("channel %d: input draining.", c->self);
 			} else {
-				chan_read_failed(c);
+				/*
+				 * Pass on what was held back as a possible
+				 * NX command before the end of the input.
+				 */
+				if (nx_check_switch && (len =
+				    nx_flush_channel_input(c, buf,
+				    sizeof(buf) - 1)) > 0)
+					channel_input_append(c, buf, len);
+				if (c->istate == CHAN_INPUT_OPEN)
+					chan_read_failed(c);
 			}
 			return -1;
 		}
 
 		/*
-		* Append input to the buffer and then search for the NX
-		* command. Can modify both buffer and length in order to
-		* return more data if there were intermediate newlines.
+		 * Double the direct reads while they come back full, drop
+		 * to the stack buffer once they turn small.
+		 */
+		if (want > 0) {
+			if ((u_int)len == want)
+				c->read_size = MINIMUM(c->read_size * 2,
+				    CHAN_RBUF_MAX);
+			else if (len < CHAN_RBUF)
+				c->read_size = 0;
+			return 1;
+		}
+		if ((size_t)len == sizeof(buf) - 1 && !nx_check_switch)
+			c->read_size = 2 * CHAN_RBUF;
+
+		/*
+		* Search the input for the NX command. Can modify both
+		* buffer and length in order to remove the command or
+		* to return the data held back by the previous read.
 		*/
 
 		if (nx_check_switch)
@@ -1845,25 +2277,13 @@ channel_handle_rfd(Channel *c, fd_set *readset, fd_set *writeset)
 		*/
 
 		if (len)
-		{
-			if (c->input_filter != NULL) {
-				if (c->input_filter(c, buf, len) == -1) {
-					debug("channel %d: filter stops", c->self);
-					chan_read_failed(c);
-				}
-			} else if (c->datagram) {
-				buffer_put_string(&c->input, buf, len);
-			} else {
-				buffer_append(&c->input, buf, len);
-			}
-		}
+			channel_input_append(c, buf, len);
 	}
 	return 1;
 }
 
-/* ARGSUSED */
 static int
-channel_handle_wfd(Channel *c, fd_set *readset, fd_set *writeset)
+channel_handle_wfd(Channel *c)
 {
 	struct termios tio;
 	u_char *data = NULL, *buf;
@@ -1872,7 +2292,7 @@ channel_handle_wfd(Channel *c, fd_set *readset, fd_set *writeset)
 
 	/* Send buffered output data to the socket. */
 	if (c->wfd != -1 &&
-	    FD_ISSET(c->wfd, writeset) &&
+	    channel_fd_ready(c->wfd, EVENTLOOP_WRITE) &&
 	    buffer_len(&c->output) > 0) {
 		olen = buffer_len(&c->output);
 		if (c->output_filter != NULL) {
@@ -1969,7 +2389,7 @@ channel_handle_wfd(Channel *c, fd_set *readset, fd_set *writeset)
 }
 
 static int
-channel_handle_efd(Channel *c, fd_set *readset, fd_set *writeset)
+channel_handle_efd(Channel *c)
 {
 	char buf[CHAN_RBUF];
 	int len;
@@ -1977,7 +2397,7 @@ channel_handle_efd(Channel *c, fd_set *readset, fd_set *writeset)
 /** XXX handle drain efd, too */
 	if (c->efd != -1) {
 		if (c->extended_usage == CHAN_EXTENDED_WRITE &&
-		    FD_ISSET(c->efd, writeset) &&
+		    channel_fd_ready(c->efd, EVENTLOOP_WRITE) &&
 		    buffer_len(&c->extended) > 0) {
 			#ifdef TEST
 			logit("NX> 280 Writing: %d bytes to fd: %d in context 6",
@@ -2008,7 +2428,7 @@ channel_handle_efd(Channel *c, fd_set *readset, fd_set *writeset)
 		} else if (c->efd != -1 &&
 		    (c->extended_usage == CHAN_EXTENDED_READ ||
 		    c->extended_usage == CHAN_EXTENDED_IGNORE) &&
-		    (c->detach_close || FD_ISSET(c->efd, readset))) {
+		    (c->detach_close || channel_fd_ready(c->efd, EVENTLOOP_READ))) {
 			#ifdef TEST
 			logit("NX> 280 Reading: %u bytes from fd: %d in context: 5",
 				sizeof(buf), c->efd);
@@ -2042,15 +2462,110 @@ channel_handle_efd(Channel *c, fd_set *readset, fd_set *writeset)
 	return 1;
 }
 
+/* Bytes the windows of all channels may take together */
+static u_int64_t
+channel_window_budget(double now)
+{
+	static u_int64_t budget;
+	static double checked;
+#if defined(_SC_AVPHYS_PAGES) && defined(_SC_PAGESIZE)
+	long pages, pagesize;
+#endif
+
+	if (checked != 0 && now - checked < CHAN_TUNE_MEM_INTERVAL)
+		return budget;
+	checked = now;
+	budget = ~(u_int64_t)0;
+#if defined(_SC_AVPHYS_PAGES) && defined(_SC_PAGESIZE)
+	if ((pages = sysconf(_SC_AVPHYS_PAGES)) > 0 &&
+	    (pagesize = sysconf(_SC_PAGESIZE)) > 0)
+		budget = (u_int64_t)pages * pagesize / CHAN_TUNE_MEM_SHARE;
+#endif
+	return budget;
+}
+
+static void
+channel_tune_window(Channel *c)
+{
+	u_int64_t budget;
+	double now, elapsed, rtt;
+	u_int grow, cancel;
+	int limited;
+
+	if (channel_window_ceiling == 0 || c->type != SSH_CHANNEL_OPEN ||
+	    (c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD)))
+		return;
+	now = monotime_double();
+	if (c->window_sample == 0)
+		c->window_sample = now;
+	if ((elapsed = now - c->window_sample) < CHAN_TUNE_INTERVAL)
+		return;
+	rtt = packet_get_rtt();
+	if (elapsed < rtt)
+		return;
+
+	/* The peer ran the window dry, and not because we are slow */
+	limited = c->window_low < c->local_maxpacket &&
+	    buffer_len(&c->output) < c->local_window_max / 4;
+	if (limited && rtt > 0 &&
+	    c->window_bytes / elapsed * rtt < c->local_window_max / 2)
+		limited = 0;
+	c->window_sample = now;
+	c->window_bytes = 0;
+	c->window_low = c->local_window;
+
+	budget = channel_window_budget(now);
+	if (channel_window_sum > budget) {
+		if (c->local_window_max <= c->local_window_base)
+			return;
+		/* give back half, held back from the following adjusts */
+		grow = c->local_window_max -
+		    MAXIMUM(c->local_window_base, c->local_window_max / 2);
+		c->local_window_max -= grow;
+		c->local_window_debt += grow;
+		channel_window_sum -= grow;
+		debug2("channel %d: window shrunk to %u", c->self,
+		    c->local_window_max);
+		return;
+	}
+	if (!limited || c->local_window_max >= channel_window_ceiling)
+		return;
+	grow = MINIMUM(c->local_window_max,
+	    channel_window_ceiling - c->local_window_max);
+	if (channel_window_sum + grow > budget)
+		grow = budget - channel_window_sum;
+	if (grow < c->local_maxpacket)
+		return;
+	c->local_window_max += grow;
+	channel_window_sum += grow;
+	/* the peer gets the extra room with the next adjust */
+	cancel = MINIMUM(grow, c->local_window_debt);
+	c->local_window_debt -= cancel;
+	c->local_consumed += grow - cancel;
+	debug2("channel %d: window grown to %u (rtt %.3fs)", c->self,
+	    c->local_window_max, rtt);
+}
+
 static int
 channel_check_window(Channel *c)
 {
+	u_int pay;
+
+	channel_tune_window(c);
+
+	/* data consumed since the window shrank is not handed back */
+	if (c->local_window_debt > 0) {
+		pay = MINIMUM(c->local_window_debt, c->local_consumed);
+		c->local_window_debt -= pay;
+		c->local_consumed -= pay;
+	}
 	if (c->type == SSH_CHANNEL_OPEN &&
 	    !(c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD)) &&
 	    ((c->local_window_max - c->local_window >
 	    c->local_maxpacket*3) ||
 	    c->local_window < c->local_window_max/2) &&
-	    c->local_consumed > 0) {
+	    c->local_consumed > 0 &&
+	    !channel_buffer_throttled(&c->output)) {
 		packet_start(SSH2_MSG_CHANNEL_WINDOW_ADJUST);
 		packet_put_int(c->remote_id);
 		packet_put_int(c->local_consumed);
@@ -2065,13 +2580,13 @@ channel_check_window(Channel *c)
 }
 
 static void
-channel_post_open(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_open(Channel *c)
 {
-	channel_handle_rfd(c, readset, writeset);
-	channel_handle_wfd(c, readset, writeset);
+	channel_handle_rfd(c);
+	channel_handle_wfd(c);
 	if (!compat20)
 		return;
-	channel_handle_efd(c, readset, writeset);
+	channel_handle_efd(c);
 	channel_check_window(c);
 
 	/*
@@ -2141,7 +2656,7 @@ read_mux(Channel *c, u_int need)
 }
 
 static void
-channel_post_mux_client(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_mux_client(Channel *c)
 {
 	u_int need;
 	ssize_t len;
@@ -2149,7 +2664,7 @@ channel_post_mux_client(Channel *c, fd_set *readset, fd_set *writeset)
 	if (!compat20)
 		fatal("%s: entered with !compat20", __func__);
 
-	if (c->rfd != -1 && !c->mux_pause && FD_ISSET(c->rfd, readset) &&
+	if (c->rfd != -1 && !c->mux_pause && channel_fd_ready(c->rfd, EVENTLOOP_READ) &&
 	    (c->istate == CHAN_INPUT_OPEN ||
 	    c->istate == CHAN_INPUT_WAIT_DRAIN)) {
 		/*
@@ -2175,7 +2690,7 @@ channel_post_mux_client(Channel *c, fd_set *readset, fd_set *writeset)
 		}
 	}
 
-	if (c->wfd != -1 && FD_ISSET(c->wfd, writeset) &&
+	if (c->wfd != -1 && channel_fd_ready(c->wfd, EVENTLOOP_WRITE) &&
 	    buffer_len(&c->output) > 0) {
 		len = write(c->wfd, buffer_ptr(&c->output),
 		    buffer_len(&c->output));
@@ -2190,7 +2705,7 @@ channel_post_mux_client(Channel *c, fd_set *readset, fd_set *writeset)
 }
 
 static void
-channel_post_mux_listener(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_mux_listener(Channel *c)
 {
 	Channel *nc;
 	struct sockaddr_storage addr;
@@ -2199,7 +2714,7 @@ channel_post_mux_listener(Channel *c, fd_set *readset, fd_set *writeset)
 	uid_t euid;
 	gid_t egid;
 
-	if (!FD_ISSET(c->sock, readset))
+	if (!channel_fd_ready(c->sock, EVENTLOOP_READ))
 		return;
 
 	debug("multiplexing control connection");
@@ -2241,14 +2756,13 @@ channel_post_mux_listener(Channel *c, fd_set *readset, fd_set *writeset)
 	nc->flags |= CHAN_LOCAL;
 }
 
-/* ARGSUSED */
 static void
-channel_post_output_drain_13(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_output_drain_13(Channel *c)
 {
 	int len;
 
 	/* Send buffered output data to the socket. */
-	if (FD_ISSET(c->sock, writeset) && buffer_len(&c->output) > 0) {
+	if (channel_fd_ready(c->sock, EVENTLOOP_WRITE) && buffer_len(&c->output) > 0) {
 		#ifdef TEST
 		logit("NX> 280 Writing: %d bytes to fd: %d in context 7",
 			buffer_len(&c->output), c->sock);
@@ -2379,13 +2893,13 @@ channel_garbage_collect(Channel *c)
 }
 
 static void
-channel_handler(chan_fn *ftab[], fd_set *readset, fd_set *writeset,
-    time_t *unpause_secs)
+channel_handler(chan_fn *ftab[], time_t *unpause_secs)
 {
 	static int did_init = 0;
 	u_int i, oalloc;
 	Channel *c;
 	time_t now;
+	size_t bytes = 0;
 
 	if (!did_init) {
 		channel_handler_init();
@@ -2409,7 +2923,7 @@ channel_handler(chan_fn *ftab[], fd_set *readset, fd_set *writeset,
 			 * Run handlers that are not paused.
 			 */
 			if (c->notbefore <= now)
-				(*ftab[c->type])(c, readset, writeset);
+				(*ftab[c->type])(c);
 			else if (unpause_secs != NULL) {
 				/*
 				 * Collect the time that the earliest
@@ -2423,183 +2937,618 @@ channel_handler(chan_fn *ftab[], fd_set *readset, fd_set *writeset,
 					*unpause_secs = c->notbefore - now;
 			}
 		}
+		if (ftab == channel_post)
+			channel_output_wakeup(c);
+		else if (ftab == channel_pre)
+			bytes += channel_buffer_account(c);
 		channel_garbage_collect(c);
 	}
+	if (ftab == channel_pre)
+		channel_buffer_check(bytes);
 	if (unpause_secs != NULL && *unpause_secs != 0)
 		debug3("%s: first channel unpauses in %d seconds",
 		    __func__, (int)*unpause_secs);
 }
 
+/* -- descriptor events */
+
 /*
- * Allocate/update select bitmasks and add any bits relevant to channels in
- * select bitmasks.
+ * The descriptors of the channels and of the main loop stay registered
+ * with an event loop between waits.  Every round the pre handlers and
+ * the main loop state what each descriptor waits for; only the
+ * descriptors whose interest changed since the previous round reach the
+ * kernel.  The post handlers then look up the ready events by
+ * descriptor.
  */
+static struct eventloop *channel_events = NULL;
+static u_int *events_want = NULL;	/* interest this round, by fd */
+static u_int *events_ready = NULL;	/* ready events, by fd */
+static int events_size = 0;		/* entries of the two above */
+static int *events_fds = NULL;		/* fds with interest this round */
+static int *events_prev = NULL;		/* fds with interest last round */
+static u_int events_nfds = 0, events_nprev = 0, events_alloc = 0;
+
+/* Adds events to the interest of a descriptor for this round */
 void
-channel_prepare_select(fd_set **readsetp, fd_set **writesetp, int *maxfdp,
-    u_int *nallocp, time_t *minwait_secs, int rekeying)
+channel_want_fd(int fd, u_int events)
 {
-	u_int n, sz, nfdset;
+	int n;
 
-	n = MAXIMUM(*maxfdp, channel_max_fd);
+	if (fd < 0 || events == 0)
+		return;
+	if (fd >= events_size) {
+		n = MAXIMUM(MAXIMUM(fd + 1, events_size * 2), 64);
+		events_want = xreallocarray(events_want, n, sizeof(u_int));
+		events_ready = xreallocarray(events_ready, n, sizeof(u_int));
+		memset(events_want + events_size, 0,
+		    (n - events_size) * sizeof(u_int));
+		memset(events_ready + events_size, 0,
+		    (n - events_size) * sizeof(u_int));
+		events_size = n;
+	}
+	if (events_want[fd] == 0) {
+		if (events_nfds == events_alloc) {
+			events_alloc = MAXIMUM(events_alloc * 2, 64);
+			events_fds = xreallocarray(events_fds, events_alloc,
+			    sizeof(int));
+			events_prev = xreallocarray(events_prev, events_alloc,
+			    sizeof(int));
+		}
+		events_fds[events_nfds++] = fd;
+	}
+	events_want[fd] |= events;
+}
 
-	nfdset = howmany(n+1, NFDBITS);
-	/* Explicitly test here, because xrealloc isn't always called */
-	if (nfdset && SIZE_MAX / nfdset < sizeof(fd_mask))
-		fatal("channel_prepare_select: max_fd (%d) is too large", n);
-	sz = nfdset * sizeof(fd_mask);
+/* Whether any of the events was reported ready for the descriptor */
+int
+channel_fd_ready(int fd, u_int events)
+{
+	return fd >= 0 && fd < events_size && (events_ready[fd] & events);
+}
+
+/*
+ * Drops a descriptor that is about to be closed or replaced.  The event
+ * loop would otherwise still count a new descriptor with the same
+ * number as registered.
+ */
+void
+channel_forget_fd(int fd)
+{
+	if (fd < 0)
+		return;
+	if (channel_events != NULL)
+		eventloop_set(channel_events, fd, 0);
+	if (fd < events_size)
+		events_want[fd] = events_ready[fd] = 0;
+	nx_proxy_forget_fd(fd);
+}
+
+/* Hands the interest of this round to the event loop */
+static void
+channel_events_commit(void)
+{
+	u_int i;
+	int fd;
+
+	if (channel_events == NULL) {
+		if ((channel_events = eventloop_new()) == NULL)
+			fatal("%s: eventloop_new: %s", __func__,
+			    strerror(errno));
+		debug("channel events: %s",
+		    eventloop_backend(channel_events));
+	}
+	for (i = 0; i < events_nprev; i++) {
+		fd = events_prev[i];
+		if (events_want[fd] == 0)
+			eventloop_set(channel_events, fd, 0);
+	}
+	for (i = 0; i < events_nfds; i++) {
+		fd = events_fds[i];
+		if (eventloop_set(channel_events, fd, events_want[fd]) == -1)
+			fatal("%s: fd %d: %s", __func__, fd, strerror(errno));
+	}
+}
+
+/*
+ * Starts a round: forgets the ready events of the previous one and runs
+ * the pre handlers, which state the interest of the channels.  The main
+ * loop adds its own descriptors with channel_want_fd() before waiting.
+ */
+void
+channel_prepare_poll(time_t *minwait_secs, int rekeying)
+{
+	u_int i;
+	int fd, *tmp;
+
+	for (i = 0; i < events_nfds; i++) {
+		fd = events_fds[i];
+		events_want[fd] = events_ready[fd] = 0;
+	}
+	tmp = events_prev;
+	events_prev = events_fds;
+	events_fds = tmp;
+	events_nprev = events_nfds;
+	events_nfds = 0;
 
-	/* perhaps check sz < nalloc/2 and shrink? */
+	if (!rekeying) {
+		channel_handler(channel_pre, minwait_secs);
+		channel_want_fd(resolver_fd(), EVENTLOOP_READ);
+	}
+}
+
+/*
+ * Waits up to timeout_ms milliseconds, forever if negative, for one of
+ * the descriptors of this round.  Returns the number of ready ones, or
+ * -1 with errno set.
+ */
+int
+channel_poll(int timeout_ms)
+{
+	u_int events;
+	int fd, n;
+
+	channel_events_commit();
+	if ((n = eventloop_wait(channel_events, timeout_ms)) <= 0)
+		return n;
+	for (n = 0; eventloop_next(channel_events, &fd, &events); ) {
+		if (fd >= events_size || (events &= events_want[fd]) == 0)
+			continue;
+		events_ready[fd] = events;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * For a main loop that has to wait in select(2): fills the sets with the
+ * interest of this round and returns the highest descriptor, or -1.
+ * The sets grow as needed and may be larger than FD_SETSIZE.
+ */
+int
+channel_poll_fdsets(fd_set **readsetp, fd_set **writesetp, u_int *nallocp)
+{
+	fd_mask *r, *w;
+	u_int i, sz, nfdset;
+	int fd, maxfd = -1;
+
+	channel_events_commit();
+	for (i = 0; i < events_nfds; i++)
+		maxfd = MAXIMUM(maxfd, events_fds[i]);
+	nfdset = MAXIMUM(howmany(maxfd + 1, NFDBITS), 1);
+	sz = nfdset * sizeof(fd_mask);
 	if (*readsetp == NULL || sz > *nallocp) {
 		*readsetp = xreallocarray(*readsetp, nfdset, sizeof(fd_mask));
 		*writesetp = xreallocarray(*writesetp, nfdset, sizeof(fd_mask));
 		*nallocp = sz;
 	}
-	*maxfdp = n;
-	memset(*readsetp, 0, sz);
-	memset(*writesetp, 0, sz);
+	memset(*readsetp, 0, *nallocp);
+	memset(*writesetp, 0, *nallocp);
+	r = (fd_mask *)*readsetp;
+	w = (fd_mask *)*writesetp;
+	for (i = 0; i < events_nfds; i++) {
+		fd = events_fds[i];
+		if (events_want[fd] & EVENTLOOP_READ)
+			r[fd / NFDBITS] |= (fd_mask)1 << (fd % NFDBITS);
+		if (events_want[fd] & EVENTLOOP_WRITE)
+			w[fd / NFDBITS] |= (fd_mask)1 << (fd % NFDBITS);
+	}
+	return maxfd;
+}
 
-	if (!rekeying)
-		channel_handler(channel_pre, *readsetp, *writesetp,
-		    minwait_secs);
+/* Takes the ready events of this round from sets filled in by select(2) */
+void
+channel_poll_fdsets_ready(fd_set *readset, fd_set *writeset)
+{
+	fd_mask *r = (fd_mask *)readset, *w = (fd_mask *)writeset;
+	fd_mask bit;
+	u_int i, events;
+	int fd;
+
+	for (i = 0; i < events_nfds; i++) {
+		fd = events_fds[i];
+		bit = (fd_mask)1 << (fd % NFDBITS);
+		events = 0;
+		if (r[fd / NFDBITS] & bit)
+			events |= EVENTLOOP_READ;
+		if (w[fd / NFDBITS] & bit)
+			events |= EVENTLOOP_WRITE;
+		events_ready[fd] = events & events_want[fd];
+	}
 }
 
 /*
- * After select, perform any appropriate operations for channels which have
- * events pending.
+ * Runs the post handlers for the events of this round, after starting
+ * the connections whose names have been resolved.
  */
 void
-channel_after_select(fd_set *readset, fd_set *writeset)
+channel_after_poll(void)
+{
+	channel_round_start = monotime_double();
+	if (channel_fd_ready(resolver_fd(), EVENTLOOP_READ))
+		resolver_dispatch();
+	channel_handler(channel_post, NULL);
+}
+
+/* Whether the channel has data or an EOF waiting to go to the peer */
+static int
+channel_output_pending(Channel *c)
 {
-	channel_handler(channel_post, readset, writeset, NULL);
+	if (c->type != SSH_CHANNEL_OPEN &&
+	    (!compat13 || c->type != SSH_CHANNEL_INPUT_DRAINING))
+		return 0;
+	if (compat20 && (c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD)))
+		return 0;
+	return (c->istate == CHAN_INPUT_OPEN && buffer_len(&c->input) > 0) ||
+	    c->istate == CHAN_INPUT_WAIT_DRAIN ||
+	    (compat20 && buffer_len(&c->extended) > 0 &&
+	    c->extended_usage == CHAN_EXTENDED_READ);
 }
 
+/* -- output scheduling */
 
-/* If there is data to send to the connection, enqueue some of it now. */
+/*
+ * channel_output_poll() hands the data of the channels to the packet
+ * layer through one of these.  "fifo" serves the channels in the order
+ * they got data, each up to a run of packets.  "drr" first serves the
+ * latency class, then shares the rest between the other channels by
+ * deficit round robin, with a turn as large as the class' quantum.  It
+ * stops once the packet layer queues CHAN_SCHED_QUEUE bytes, so that a
+ * keystroke isn't queued behind megabytes of bulk data; the channel at
+ * the head keeps the rest of its turn for the next poll.
+ */
+struct channel_scheduler {
+	const char	*name;
+	int		 latency_first;	/* keeps a list for CHAN_SCHED_LATENCY */
+	void		(*poll)(struct ssh *);
+};
+
+static void channel_sched_fifo(struct ssh *);
+static void channel_sched_drr(struct ssh *);
+
+static const struct channel_scheduler channel_schedulers[] = {
+	{ "drr", 1, channel_sched_drr },
+	{ "fifo", 0, channel_sched_fifo },
+	{ NULL, 0, NULL }
+};
+static const struct channel_scheduler *channel_scheduler =
+    &channel_schedulers[0];
+
+/* Bytes of a scheduler turn, by class */
+static const size_t channel_sched_quantum[CHAN_SCHED_MAX] = {
+	4 * CHAN_SCHED_QUANTUM,		/* latency */
+	4 * CHAN_SCHED_QUANTUM,		/* display */
+	2 * CHAN_SCHED_QUANTUM,		/* forward */
+	CHAN_SCHED_QUANTUM,		/* bulk */
+};
+
+static int
+channel_sched_class(Channel *c)
+{
+	if (c->sched_class != CHAN_SCHED_AUTO)
+		return c->sched_class;
+	if (c->isatty || c->client_tty)
+		return CHAN_SCHED_LATENCY;
+	if (c->ctype == NULL)
+		return CHAN_SCHED_FORWARD;
+	if (strcmp(c->ctype, "x11") == 0 ||
+	    strcmp(c->ctype, "accepted x11 socket") == 0 ||
+	    strcmp(c->ctype, "connected x11 socket") == 0)
+		return CHAN_SCHED_DISPLAY;
+	if (strcmp(c->ctype, "session") == 0)
+		return CHAN_SCHED_BULK;
+	return CHAN_SCHED_FORWARD;
+}
+
+/*
+ * Puts the channel on the list that channel_output_poll() works through,
+ * if it has anything to send.  Called where data or an EOF can show up
+ * outside of the channel's post handler.
+ */
 void
-channel_output_poll(void)
+channel_output_wakeup(Channel *c)
+{
+	if (c->output_queued || !channel_output_pending(c))
+		return;
+	c->output_class = channel_sched_class(c);
+	c->output_deficit = 0;
+	c->output_queued = 1;
+	if (channel_scheduler->latency_first &&
+	    c->output_class == CHAN_SCHED_LATENCY) {
+		TAILQ_INSERT_TAIL(&channel_output_first, c, output_entry);
+		c->output_first = 1;
+	} else {
+		TAILQ_INSERT_TAIL(&channel_output, c, output_entry);
+		channel_output_count++;
+	}
+}
+
+static void
+channel_output_dequeue(Channel *c)
+{
+	if (!c->output_queued)
+		return;
+	if (c->output_first)
+		TAILQ_REMOVE(&channel_output_first, c, output_entry);
+	else {
+		TAILQ_REMOVE(&channel_output, c, output_entry);
+		channel_output_count--;
+	}
+	c->output_queued = c->output_first = 0;
+}
+
+/* Moves the channels queued ahead back to the common list */
+static void
+channel_output_unfirst(void)
 {
 	Channel *c;
-	u_int i, len;
 
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c == NULL)
-			continue;
+	while ((c = TAILQ_FIRST(&channel_output_first)) != NULL) {
+		TAILQ_REMOVE(&channel_output_first, c, output_entry);
+		TAILQ_INSERT_TAIL(&channel_output, c, output_entry);
+		channel_output_count++;
+		c->output_first = 0;
+	}
+}
 
-		/*
-		 * We are only interested in channels that can have buffered
-		 * incoming data.
-		 */
-		if (compat13) {
-			if (c->type != SSH_CHANNEL_OPEN &&
-			    c->type != SSH_CHANNEL_INPUT_DRAINING)
-				continue;
-		} else {
-			if (c->type != SSH_CHANNEL_OPEN)
-				continue;
-		}
-		if (compat20 &&
-		    (c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD))) {
-			/* XXX is this true? */
-			debug3("channel %d: will not send data after close", c->self);
-			continue;
+/* Selects the output scheduler by name; returns -1 if there is none such */
+int
+channel_set_scheduler(const char *name)
+{
+	const struct channel_scheduler *cs;
+
+	for (cs = channel_schedulers; cs->name != NULL; cs++) {
+		if (strcmp(cs->name, name) == 0) {
+			if (!cs->latency_first)
+				channel_output_unfirst();
+			channel_scheduler = cs;
+			debug2("channel scheduler: %s", cs->name);
+			return 0;
 		}
+	}
+	return -1;
+}
+
+int
+channel_scheduler_valid(const char *name)
+{
+	const struct channel_scheduler *cs;
+
+	for (cs = channel_schedulers; cs->name != NULL; cs++)
+		if (strcmp(cs->name, name) == 0)
+			return 1;
+	return 0;
+}
+
+/* Overrides the scheduling class derived from the type of the channel */
+void
+channel_set_output_class(Channel *c, int class)
+{
+	c->sched_class = class;
+	if (c->output_queued) {
+		channel_output_dequeue(c);
+		channel_output_wakeup(c);
+	}
+}
+
+/*
+ * Queues data of the channel to the packet layer, up to "limit" bytes
+ * and a run of packets.  Returns the number of data bytes queued.
+ */
+static size_t
+channel_output_poll_channel(struct ssh *ssh, Channel *c, size_t limit)
+{
+	u_int len;
+	size_t sent, total = 0;
+	int r;
 
-		/* Get the amount of buffered data for this channel. */
-		if ((c->istate == CHAN_INPUT_OPEN ||
-		    c->istate == CHAN_INPUT_WAIT_DRAIN) &&
-		    (len = buffer_len(&c->input)) > 0) {
-			if (c->datagram) {
-				if (len > 0) {
-					u_char *data;
-					u_int dlen;
-
-					data = buffer_get_string(&c->input,
-					    &dlen);
-					if (dlen > c->remote_window ||
-					    dlen > c->remote_maxpacket) {
-						debug("channel %d: datagram "
-						    "too big for channel",
-						    c->self);
-						free(data);
-						continue;
-					}
-					packet_start(SSH2_MSG_CHANNEL_DATA);
-					packet_put_int(c->remote_id);
-					packet_put_string(data, dlen);
-					packet_send();
-					c->remote_window -= dlen;
+	/*
+	 * We are only interested in channels that can have buffered
+	 * incoming data.
+	 */
+	if (compat13) {
+		if (c->type != SSH_CHANNEL_OPEN &&
+		    c->type != SSH_CHANNEL_INPUT_DRAINING)
+			return 0;
+	} else {
+		if (c->type != SSH_CHANNEL_OPEN)
+			return 0;
+	}
+	if (compat20 &&
+	    (c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD))) {
+		/* XXX is this true? */
+		debug3("channel %d: will not send data after close", c->self);
+		return 0;
+	}
+
+	/* Get the amount of buffered data for this channel. */
+	if ((c->istate == CHAN_INPUT_OPEN ||
+	    c->istate == CHAN_INPUT_WAIT_DRAIN) &&
+	    (len = buffer_len(&c->input)) > 0) {
+		if (c->datagram) {
+			if (len > 0) {
+				u_char *data;
+				u_int dlen;
+
+				data = buffer_get_string(&c->input,
+				    &dlen);
+				if (dlen > c->remote_window ||
+				    dlen > c->remote_maxpacket) {
+					debug("channel %d: datagram "
+					    "too big for channel",
+					    c->self);
 					free(data);
+					return 0;
 				}
-				continue;
-			}
-			/*
-			 * Send some data for the other side over the secure
-			 * connection.
-			 */
-			if (compat20) {
-				if (len > c->remote_window)
-					len = c->remote_window;
-				if (len > c->remote_maxpacket)
-					len = c->remote_maxpacket;
-			} else {
-				if (packet_is_interactive()) {
-					if (len > 1024)
-						len = 512;
-				} else {
-					/* Keep the packets at reasonable size. */
-					if (len > packet_get_maxsize()/2)
-						len = packet_get_maxsize()/2;
-				}
-			}
-			if (len > 0) {
-				packet_start(compat20 ?
-				    SSH2_MSG_CHANNEL_DATA : SSH_MSG_CHANNEL_DATA);
+				packet_start(SSH2_MSG_CHANNEL_DATA);
 				packet_put_int(c->remote_id);
-				packet_put_string(buffer_ptr(&c->input), len);
+				packet_put_string(data, dlen);
 				packet_send();
-				buffer_consume(&c->input, len);
-				c->remote_window -= len;
+				c->remote_window -= dlen;
+				free(data);
+				total = dlen;
 			}
-		} else if (c->istate == CHAN_INPUT_WAIT_DRAIN) {
-			if (compat13)
-				fatal("cannot happen: istate == INPUT_WAIT_DRAIN for proto 1.3");
-			/*
-			 * input-buffer is empty and read-socket shutdown:
-			 * tell peer, that we will not send more data: send IEOF.
-			 * hack for extended data: delay EOF if EFD still in use.
-			 */
-			if (CHANNEL_EFD_INPUT_ACTIVE(c))
-				debug2("channel %d: ibuf_empty delayed efd %d/(%d)",
-				    c->self, c->efd, buffer_len(&c->extended));
-			else
-				chan_ibuf_empty(c);
+			return total;
 		}
-		/* Send extended data, i.e. stderr */
-		if (compat20 &&
-		    !(c->flags & CHAN_EOF_SENT) &&
-		    c->remote_window > 0 &&
-		    (len = buffer_len(&c->extended)) > 0 &&
-		    c->extended_usage == CHAN_EXTENDED_READ) {
-			debug2("channel %d: rwin %u elen %u euse %d",
-			    c->self, c->remote_window, buffer_len(&c->extended),
-			    c->extended_usage);
+		/*
+		 * Send some data for the other side over the secure
+		 * connection.
+		 */
+		if (compat20) {
 			if (len > c->remote_window)
 				len = c->remote_window;
+			if (len / CHAN_OUTPUT_RUN > c->remote_maxpacket)
+				len = CHAN_OUTPUT_RUN * c->remote_maxpacket;
+			if (len > limit)
+				len = limit;
+			/* queue a run of packets in one pass */
+			if ((r = ssh_packet_send2_data(ssh, c->remote_id,
+			    -1, buffer_ptr(&c->input), len,
+			    c->remote_maxpacket, &sent)) != 0)
+				fatal("%s: %s", __func__, ssh_err(r));
+			buffer_consume(&c->input, sent);
+			c->remote_window -= sent;
+			total += sent;
+			len -= sent;
 			if (len > c->remote_maxpacket)
 				len = c->remote_maxpacket;
+		} else {
+			if (packet_is_interactive()) {
+				if (len > 1024)
+					len = 512;
+			} else {
+				/* Keep the packets at reasonable size. */
+				if (len > packet_get_maxsize()/2)
+					len = packet_get_maxsize()/2;
+			}
+		}
+		if (len > 0) {
+			packet_start(compat20 ?
+			    SSH2_MSG_CHANNEL_DATA : SSH_MSG_CHANNEL_DATA);
+			packet_put_int(c->remote_id);
+			packet_put_string(buffer_ptr(&c->input), len);
+			packet_send();
+			buffer_consume(&c->input, len);
+			c->remote_window -= len;
+			total += len;
+		}
+	} else if (c->istate == CHAN_INPUT_WAIT_DRAIN) {
+		if (compat13)
+			fatal("cannot happen: istate == INPUT_WAIT_DRAIN for proto 1.3");
+		/*
+		 * input-buffer is empty and read-socket shutdown:
+		 * tell peer, that we will not send more data: send IEOF.
+		 * hack for extended data: delay EOF if EFD still in use.
+		 */
+		if (CHANNEL_EFD_INPUT_ACTIVE(c))
+			debug2("channel %d: ibuf_empty delayed efd %d/(%d)",
+			    c->self, c->efd, buffer_len(&c->extended));
+		else
+			chan_ibuf_empty(c);
+	}
+	/* Send extended data, i.e. stderr */
+	if (compat20 &&
+	    !(c->flags & CHAN_EOF_SENT) &&
+	    c->remote_window > 0 && total < limit &&
+	    (len = buffer_len(&c->extended)) > 0 &&
+	    c->extended_usage == CHAN_EXTENDED_READ) {
+		debug2("channel %d: rwin %u elen %u euse %d",
+		    c->self, c->remote_window, buffer_len(&c->extended),
+		    c->extended_usage);
+		if (len > c->remote_window)
+			len = c->remote_window;
+		if (len > c->remote_maxpacket)
+			len = c->remote_maxpacket;
+		if (len > limit - total)
+			len = limit - total;
+		if ((r = ssh_packet_send2_data(ssh, c->remote_id,
+		    SSH2_EXTENDED_DATA_STDERR, buffer_ptr(&c->extended),
+		    len, c->remote_maxpacket, &sent)) != 0)
+			fatal("%s: %s", __func__, ssh_err(r));
+		if (sent == 0) {
 			packet_start(SSH2_MSG_CHANNEL_EXTENDED_DATA);
 			packet_put_int(c->remote_id);
 			packet_put_int(SSH2_EXTENDED_DATA_STDERR);
 			packet_put_string(buffer_ptr(&c->extended), len);
 			packet_send();
-			buffer_consume(&c->extended, len);
-			c->remote_window -= len;
-			debug2("channel %d: sent ext data %d", c->self, len);
+			sent = len;
+		}
+		buffer_consume(&c->extended, sent);
+		c->remote_window -= sent;
+		total += sent;
+		debug2("channel %d: sent ext data %zu", c->self, sent);
+	}
+	/* Nothing more can be sent until the peer adjusts the window */
+	if (compat20 && c->remote_window == 0 &&
+	    c->window_stall_start == 0) {
+		c->window_stalls++;
+		c->window_stall_start = monotime_double();
+	}
+	return total;
+}
+
+static void
+channel_sched_fifo(struct ssh *ssh)
+{
+	Channel *c, *next;
+
+	for (c = TAILQ_FIRST(&channel_output); c != NULL; c = next) {
+		next = TAILQ_NEXT(c, output_entry);
+		channel_output_poll_channel(ssh, c, SIZE_MAX);
+		if (!channel_output_pending(c))
+			channel_output_dequeue(c);
+	}
+}
+
+static void
+channel_sched_drr(struct ssh *ssh)
+{
+	Channel *c, *next;
+	size_t sent;
+	u_int idle = 0;
+
+	for (c = TAILQ_FIRST(&channel_output_first); c != NULL; c = next) {
+		next = TAILQ_NEXT(c, output_entry);
+		channel_output_poll_channel(ssh, c,
+		    channel_sched_quantum[CHAN_SCHED_LATENCY]);
+		if (!channel_output_pending(c))
+			channel_output_dequeue(c);
+	}
+
+	/*
+	 * A channel gives up the head of the list when its turn is used
+	 * up or it can't send, e.g. for lack of remote window.  Stop when
+	 * the packet layer is full or no channel can send any more.
+	 */
+	while ((c = TAILQ_FIRST(&channel_output)) != NULL &&
+	    idle < channel_output_count &&
+	    ssh_packet_output_len(ssh) < CHAN_SCHED_QUEUE) {
+		if (c->output_deficit == 0)
+			c->output_deficit =
+			    channel_sched_quantum[c->output_class];
+		sent = channel_output_poll_channel(ssh, c, c->output_deficit);
+		c->output_deficit -= MINIMUM(sent, c->output_deficit);
+		idle = sent == 0 ? idle + 1 : 0;
+		if (!channel_output_pending(c))
+			channel_output_dequeue(c);
+		else if (sent == 0 || c->output_deficit == 0) {
+			c->output_deficit = 0;
+			TAILQ_REMOVE(&channel_output, c, output_entry);
+			TAILQ_INSERT_TAIL(&channel_output, c, output_entry);
 		}
 	}
 }
 
+/*
+ * If there is data to send to the connection, enqueue some of it now.
+ * Only the channels that have something to send are looked at, in the
+ * order the output scheduler picks.
+ */
+void
+channel_output_poll(void)
+{
+	channel_scheduler->poll(active_state);
+}
+
 /* -- mux proxy support  */
 
 /*
@@ -2714,7 +3663,7 @@ channel_proxy_downstream(Channel *downstream)
 		   -1, -1, -1, 0, 0, 0, "mux-down-connect", 1);
 		c->mux_ctx = downstream;	/* point to mux client */
 		c->mux_downstream_id = id;
-		c->remote_id = remote_id;
+		channel_set_remote_id(c, remote_id);
 		if ((r = sshbuf_put_u32(modified, remote_id)) != 0 ||
 		    (r = sshbuf_put_u32(modified, c->self)) != 0 ||
 		    (r = sshbuf_putb(modified, original)) != 0) {
@@ -2866,7 +3815,7 @@ channel_proxy_upstream(Channel *c, int type, u_int32_t seq, void *ctxt)
 	case SSH2_MSG_CHANNEL_OPEN_CONFIRMATION:
 		/* record remote_id for SSH2_MSG_CHANNEL_CLOSE */
 		if (cp && len > 4)
-			c->remote_id = PEEK_U32(cp);
+			channel_set_remote_id(c, PEEK_U32(cp));
 		break;
 	case SSH2_MSG_CHANNEL_CLOSE:
 		if (c->flags & CHAN_CLOSE_SENT)
@@ -2888,6 +3837,7 @@ channel_input_data(int type, u_int32_t seq, void *ctxt)
 	int id;
 	const u_char *data;
 	u_int data_len, win_len;
+	ssize_t len;
 	Channel *c;
 
 	/* Get the channel number and verify it. */
@@ -2935,11 +3885,27 @@ channel_input_data(int type, u_int32_t seq, void *ctxt)
 			return 0;
 		}
 		c->local_window -= win_len;
+		c->window_bytes += win_len;
+		if (c->local_window < c->window_low)
+			c->window_low = c->local_window;
 	}
-	if (c->datagram)
+	if (c->datagram) {
 		buffer_put_string(&c->output, data, data_len);
-	else
+	} else {
+		/*
+		 * Nothing queued ahead: write straight from the packet and
+		 * buffer only what the descriptor doesn't take.
+		 */
+		if (compat20 && c->type == SSH_CHANNEL_OPEN && c->wfd != -1 &&
+		    c->wfd_nonblock && !c->isatty && c->output_filter == NULL &&
+		    data_len > 0 && buffer_len(&c->output) == 0 &&
+		    (len = write(c->wfd, data, data_len)) > 0) {
+			data += len;
+			data_len -= len;
+			c->local_consumed += len;
+		}
 		buffer_append(&c->output, data, data_len);
+	}
 	packet_check_eom();
 	return 0;
 }
@@ -3133,8 +4099,9 @@ channel_input_open_confirmation(int type, u_int32_t seq, void *ctxt)
 		    "non-opening channel %d.", id);
 	remote_id = packet_get_int();
 	/* Record the remote channel number and mark that the channel is now open. */
-	c->remote_id = remote_id;
+	channel_set_remote_id(c, remote_id);
 	c->type = SSH_CHANNEL_OPEN;
+	channel_output_wakeup(c);
 
 	if (compat20) {
 		c->remote_window = packet_get_int();
@@ -3236,6 +4203,11 @@ channel_input_window_adjust(int type, u_int32_t seq, void *ctxt)
 		fatal("channel %d: adjust %u overflows remote window %u",
 		    id, adjust, c->remote_window);
 	c->remote_window = tmp;
+	if (c->window_stall_start != 0 && c->remote_window > 0) {
+		c->window_stall_time += monotime_double() -
+		    c->window_stall_start;
+		c->window_stall_start = 0;
+	}
 	return 0;
 }
 
@@ -3267,7 +4239,7 @@ channel_input_port_open(int type, u_int32_t seq, void *ctxt)
 		packet_put_int(remote_id);
 		packet_send();
 	} else
-		c->remote_id = remote_id;
+		channel_set_remote_id(c, remote_id);
 	return 0;
 }
 
@@ -3309,6 +4281,20 @@ channel_set_af(int af)
 	IPv4or6 = af;
 }
 
+/* Sets the ceiling for the autotuned receive windows, 0 for none */
+void
+channel_set_window_max(u_int max)
+{
+	channel_window_ceiling = max;
+}
+
+/* Sets how many connections a forwarding listener takes per wakeup */
+void
+channel_set_accept_batch(u_int batch)
+{
+	channel_accept_batch = MINIMUM(MAXIMUM(batch, 1), CHAN_ACCEPT_BATCH_MAX);
+}
+
 
 /*
  * Determine whether or not a port forward listens to loopback, the
@@ -4213,15 +5199,35 @@ static void
 channel_connect_ctx_free(struct channel_connect *cctx)
 {
 	free(cctx->host);
-	if (cctx->aitop) {
-		if (cctx->aitop->ai_family == AF_UNIX)
-			free(cctx->aitop);
-		else
-			freeaddrinfo(cctx->aitop);
-	}
+	resolver_cancel(cctx->query);
+	resolver_freeaddrinfo(cctx->aitop);
 	memset(cctx, 0, sizeof(*cctx));
 }
 
+/* Starts connecting a channel whose name has been resolved */
+static void
+channel_connect_resolved(int gaierr, struct addrinfo *ai, void *arg)
+{
+	Channel *c = arg;
+	int sock;
+
+	c->connect_ctx.query = NULL;
+	if (gaierr != 0) {
+		error("connect_to %.100s: unknown host (%s)",
+		    c->connect_ctx.host, ssh_gai_strerror(gaierr));
+		channel_connect_failed(c, ssh_gai_strerror(gaierr));
+		return;
+	}
+	c->connect_ctx.aitop = c->connect_ctx.ai = ai;
+	if ((sock = connect_next(&c->connect_ctx)) == -1) {
+		error("connect to %.100s port %d failed: %s",
+		    c->connect_ctx.host, c->connect_ctx.port, strerror(errno));
+		channel_connect_failed(c, strerror(errno));
+		return;
+	}
+	channel_register_fds(c, sock, sock, -1, 0, 1, 0);
+}
+
 /*
  * Return CONNECTING channel to remote host:port or local socket path,
  * passing back the failure reason if appropriate.
@@ -4231,9 +5237,9 @@ connect_to_reason(const char *name, int port, char *ctype, char *rname,
      int *reason, const char **errmsg)
 {
 	struct addrinfo hints;
+	struct resolver_query *query = NULL;
 	int gaierr;
 	int sock = -1;
-	char strport[NI_MAXSERV];
 	struct channel_connect cctx;
 	Channel *c;
 
@@ -4249,9 +5255,8 @@ connect_to_reason(const char *name, int port, char *ctype, char *rname,
 		}
 
 		/*
-		 * Fake up a struct addrinfo for AF_UNIX connections.
-		 * channel_connect_ctx_free() must check ai_family
-		 * and use free() not freeaddirinfo() for AF_UNIX.
+		 * Fake up a struct addrinfo for AF_UNIX connections,
+		 * in one allocation as resolver_freeaddrinfo() expects.
 		 */
 		ai = xmalloc(sizeof(*ai) + sizeof(*sunaddr));
 		memset(ai, 0, sizeof(*ai) + sizeof(*sunaddr));
@@ -4268,9 +5273,9 @@ connect_to_reason(const char *name, int port, char *ctype, char *rname,
 		memset(&hints, 0, sizeof(hints));
 		hints.ai_family = IPv4or6;
 		hints.ai_socktype = SOCK_STREAM;
-		snprintf(strport, sizeof strport, "%d", port);
-		if ((gaierr = getaddrinfo(name, strport, &hints, &cctx.aitop))
-		    != 0) {
+		query = resolver_start(name, port, &hints, &cctx.aitop,
+		    &gaierr);
+		if (query == NULL && gaierr != 0) {
 			if (errmsg != NULL)
 				*errmsg = ssh_gai_strerror(gaierr);
 			if (reason != NULL)
@@ -4285,6 +5290,18 @@ connect_to_reason(const char *name, int port, char *ctype, char *rname,
 	cctx.port = port;
 	cctx.ai = cctx.aitop;
 
+	/* Connect once the name is known, without holding up the others */
+	if (query != NULL) {
+		debug("connect_to %.100s port %d: resolving", name, port);
+		c = channel_new(ctype, SSH_CHANNEL_CONNECTING, -1, -1, -1,
+		    CHAN_TCP_WINDOW_DEFAULT, CHAN_TCP_PACKET_DEFAULT, 0,
+		    rname, 1);
+		cctx.query = query;
+		c->connect_ctx = cctx;
+		resolver_notify(query, channel_connect_resolved, c);
+		return c;
+	}
+
 	if ((sock = connect_next(&cctx)) == -1) {
 		error("connect to %.100s port %d failed: %s",
 		    name, port, strerror(errno));
@@ -4742,7 +5759,7 @@ x11_input_open(int type, u_int32_t seq, void *ctxt)
 		c = channel_new("connected x11 socket",
 		    SSH_CHANNEL_X11_OPEN, sock, sock, -1, 0, 0, 0,
 		    remote_host, 1);
-		c->remote_id = remote_id;
+		channel_set_remote_id(c, remote_id);
 		c->force_drain = 1;
 	}
 	free(remote_host);
@@ -105,6 +105,7 @@ struct channel_connect {
 	char *host;
 	int port;
 	struct addrinfo *ai, *aitop;
+	struct resolver_query *query;	/* name still being resolved */
 };
 
 /* Callbacks for mux channels back into client-specific code */
@@ -126,6 +127,7 @@ struct Channel {
 #ifdef _AIX
 	int     wfd_isatty;	/* wfd is a tty */
 #endif
+	int     wfd_nonblock;	/* wfd is in non-blocking mode */
 	int	client_tty;	/* (client) TTY has been requested */
 	int     force_drain;	/* force close on iEOF */
 	time_t	notbefore;	/* Pause IO until deadline (time_t) */
@@ -139,6 +141,7 @@ struct Channel {
 	Buffer  output;		/* data received over encrypted connection for
 				 * send on socket */
 	Buffer  extended;
+	u_int	read_size;	/* next read straight into input, 0 if none */
 	char    *path;
 		/* path for unix domain sockets, or host name for forwards */
 	int     listening_port;	/* port being listened for forwards */
@@ -155,6 +158,27 @@ struct Channel {
 	int     extended_usage;
 	int	single_connection;
 
+	/* channel table indexes */
+	TAILQ_ENTRY(Channel) output_entry; /* something to send */
+	LIST_ENTRY(Channel) remote_entry; /* remote id hash chain */
+	int	output_queued;		/* on the output list */
+	int	output_first;		/* ... of latency-first channels */
+	int	output_class;		/* CHAN_SCHED_* it was queued with */
+	size_t	output_deficit;		/* bytes left of its scheduler turn */
+	int	sched_class;		/* CHAN_SCHED_*, or derived if AUTO */
+
+	/* receive window autotuning */
+	u_int	local_window_base;	/* window the channel opened with */
+	u_int	local_window_debt;	/* shrunk, held back from adjusts */
+	u_int	window_low;		/* lowest window in the sample */
+	u_int64_t window_bytes;		/* data received in the sample */
+	double	window_sample;		/* start of the sample */
+
+	/* times the remote window ran out, and for how long */
+	u_int	window_stalls;
+	double	window_stall_start;
+	double	window_stall_time;
+
 	char   *ctype;		/* type */
 
 	/* callback */
@@ -183,11 +207,18 @@ struct Channel {
 	int     		mux_downstream_id;
 
 	/*
-	* Enqueue data read from the local side
-	* to intercept the switch command.
+	* Collect the parameters of the switch
+	* command read from the local side.
 	*/
 
 	Buffer nx_buffer;
+
+	/*
+	* Number of bytes of the command matched
+	* by the data read so far.
+	*/
+
+	int nx_matched;
 };
 
 #define CHAN_EXTENDED_IGNORE		0
@@ -221,6 +252,28 @@ struct Channel {
 #define CHAN_LOCAL			0x10
 
 #define CHAN_RBUF	16*1024
+/* largest read straight into the input buffer of a channel */
+#define CHAN_RBUF_MAX	(256*1024)
+
+/* most packets queued for one channel per channel_output_poll() */
+#define CHAN_OUTPUT_RUN		8
+
+/* output scheduling classes, see channel_output_poll() */
+#define CHAN_SCHED_AUTO		-1	/* derived from the channel type */
+#define CHAN_SCHED_LATENCY	0	/* tty sessions, sent first */
+#define CHAN_SCHED_DISPLAY	1	/* X11 and NX display traffic */
+#define CHAN_SCHED_FORWARD	2	/* forwarded connections */
+#define CHAN_SCHED_BULK		3	/* sessions without a tty */
+#define CHAN_SCHED_MAX		4
+
+/* bytes per scheduler turn of a bulk channel, the others get multiples */
+#define CHAN_SCHED_QUANTUM	(16*1024)
+/* channel data is held back while the packet layer queues this much */
+#define CHAN_SCHED_QUEUE	(64*1024)
+
+/* connections accepted per wakeup of a forwarding listener */
+#define CHAN_ACCEPT_BATCH	16
+#define CHAN_ACCEPT_BATCH_MAX	1024
 
 /* check whether 'efd' is still in use */
 #define CHANNEL_EFD_INPUT_ACTIVE(c) \
@@ -236,6 +289,8 @@ struct Channel {
 
 Channel	*channel_by_id(int);
 Channel	*channel_by_remote_id(int);
+void	 channel_set_remote_id(Channel *, int);
+void	 channel_output_wakeup(Channel *);
 Channel	*channel_lookup(int);
 Channel *channel_new(char *, int, int, int, int, u_int, u_int, int, char *, int);
 void	 channel_set_fds(int, int, int, int, int, int, int, u_int);
@@ -276,21 +331,33 @@ int	 channel_input_status_confirm(int, u_int32_t, void *);
 
 /* file descriptor handling (read/write) */
 
-void	 channel_prepare_select(fd_set **, fd_set **, int *, u_int*,
-	     time_t*, int);
-void     channel_after_select(fd_set *, fd_set *);
+void	 channel_prepare_poll(time_t *, int);
+void	 channel_want_fd(int, u_int);
+int	 channel_poll(int);
+int	 channel_poll_fdsets(fd_set **, fd_set **, u_int *);
+void	 channel_poll_fdsets_ready(fd_set *, fd_set *);
+int	 channel_fd_ready(int, u_int);
+void	 channel_forget_fd(int);
+void	 channel_fds_replaced(Channel *);
+void	 channel_after_poll(void);
 void     channel_output_poll(void);
 
 int      channel_not_very_much_buffered_data(void);
 void     channel_close_all(void);
 int      channel_still_open(void);
 char	*channel_open_message(void);
+int	 channel_get_stats(struct sshbuf *);
 int	 channel_find_open(void);
 
 /* tcp forwarding */
 struct Forward;
 struct ForwardOptions;
 void	 channel_set_af(int af);
+void	 channel_set_window_max(u_int);
+void	 channel_set_accept_batch(u_int);
+int	 channel_set_scheduler(const char *);
+int	 channel_scheduler_valid(const char *);
+void	 channel_set_output_class(Channel *, int);
 void     channel_permit_all_opens(void);
 void	 channel_add_permitted_opens(char *, int);
 int	 channel_add_adm_permitted_opens(char *, int);
@@ -0,0 +1,456 @@
+/*
+ * Copyright (c) 2026 Etersoft
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#ifdef WITH_CTR_THREADS
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WITH_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#include "cipher-ctr-mt.h"
+#include "cipher-aesctr.h"
+#include "ssherr.h"
+
+#include "openbsd-compat/openssl-compat.h"
+
+#define CTRMT_BLOCK_SIZE	16
+#define CTRMT_SLOT_SIZE		(32 * 1024)
+#define CTRMT_SLOT_BLOCKS	(CTRMT_SLOT_SIZE / CTRMT_BLOCK_SIZE)
+#define CTRMT_SLOTS_PER_THREAD	4
+
+/*
+ * Slot i of the ring holds the keystream slots i, i + nslots, ... in
+ * turn. "want" is written by the caller and names the stream slot to
+ * generate next, "done" is written by the owning worker and is one past
+ * the stream slot it holds.
+ */
+struct ctrmt_slot {
+	u_int64_t	 want;
+	u_int64_t	 done;
+	u_char		*ks;
+};
+
+struct ctrmt_worker {
+	struct ctrmt_ctx *ctx;
+	u_int		 index;
+	int		 idle;
+	pthread_t	 thread;
+	pthread_cond_t	 wakeup;
+#ifdef WITH_OPENSSL
+	EVP_CIPHER_CTX	*evp;
+#else
+	struct aesctr_ctx ac_ctx;
+#endif
+};
+
+struct ctrmt_ctx {
+	u_char		 iv[CTRMT_BLOCK_SIZE];	/* counter of stream slot 0 */
+	u_int		 nthreads;
+	u_int		 nslots;
+	struct ctrmt_slot *slots;
+	struct ctrmt_worker *workers;
+	u_char		*keystream;
+	u_int64_t	 stream;		/* stream slot in use */
+	size_t		 off;			/* bytes of it used */
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 ready;
+	int		 waiting;
+	int		 quit;
+	int		 error;
+	int		 started;
+	u_int		 running;
+	u_int		 forks;
+};
+
+/* Bumped in the child after fork(), whose copies have no workers */
+static u_int ctrmt_forks;
+
+static void
+ctrmt_atfork_child(void)
+{
+	ctrmt_forks++;
+}
+
+/* Add "blocks" to the big endian counter "iv" */
+static void
+ctrmt_counter(const u_char *iv, u_int64_t blocks, u_char *ctr)
+{
+	u_int carry = 0;
+	int i;
+
+	memcpy(ctr, iv, CTRMT_BLOCK_SIZE);
+	for (i = CTRMT_BLOCK_SIZE - 1; i >= 0 && (blocks || carry); i--) {
+		carry += ctr[i] + (blocks & 0xff);
+		ctr[i] = carry & 0xff;
+		carry >>= 8;
+		blocks >>= 8;
+	}
+}
+
+static int
+ctrmt_fill(struct ctrmt_worker *w, u_int64_t stream, u_char *ks)
+{
+	u_char ctr[CTRMT_BLOCK_SIZE];
+
+	ctrmt_counter(w->ctx->iv, stream * CTRMT_SLOT_BLOCKS, ctr);
+	memset(ks, 0, CTRMT_SLOT_SIZE);
+#ifdef WITH_OPENSSL
+	if (EVP_CipherInit(w->evp, NULL, NULL, ctr, 1) == 0 ||
+	    EVP_Cipher(w->evp, ks, ks, CTRMT_SLOT_SIZE) < 0)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+#else
+	aesctr_ivsetup(&w->ac_ctx, ctr);
+	aesctr_encrypt_bytes(&w->ac_ctx, ks, ks, CTRMT_SLOT_SIZE);
+#endif
+	return 0;
+}
+
+static int
+ctrmt_has_work(struct ctrmt_worker *w)
+{
+	struct ctrmt_ctx *ctx = w->ctx;
+	struct ctrmt_slot *slot;
+	u_int i;
+
+	for (i = w->index; i < ctx->nslots; i += ctx->nthreads) {
+		slot = &ctx->slots[i];
+		if (__atomic_load_n(&slot->done, __ATOMIC_RELAXED) !=
+		    __atomic_load_n(&slot->want, __ATOMIC_SEQ_CST) + 1)
+			return 1;
+	}
+	return 0;
+}
+
+static void *
+ctrmt_worker_main(void *arg)
+{
+	struct ctrmt_worker *w = arg;
+	struct ctrmt_ctx *ctx = w->ctx;
+	struct ctrmt_slot *slot;
+	u_int64_t want;
+	u_int i;
+	int busy;
+
+	for (;;) {
+		busy = 0;
+		for (i = w->index; i < ctx->nslots; i += ctx->nthreads) {
+			slot = &ctx->slots[i];
+			want = __atomic_load_n(&slot->want, __ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->done,
+			    __ATOMIC_RELAXED) == want + 1)
+				continue;
+			if (ctrmt_fill(w, want, slot->ks) != 0)
+				__atomic_store_n(&ctx->error, 1,
+				    __ATOMIC_RELAXED);
+			__atomic_store_n(&slot->done, want + 1,
+			    __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&ctx->waiting, __ATOMIC_SEQ_CST)) {
+				pthread_mutex_lock(&ctx->lock);
+				pthread_cond_signal(&ctx->ready);
+				pthread_mutex_unlock(&ctx->lock);
+			}
+			busy = 1;
+		}
+		if (busy)
+			continue;
+
+		pthread_mutex_lock(&ctx->lock);
+		__atomic_store_n(&w->idle, 1, __ATOMIC_SEQ_CST);
+		while (!ctx->quit && !ctrmt_has_work(w))
+			pthread_cond_wait(&w->wakeup, &ctx->lock);
+		__atomic_store_n(&w->idle, 0, __ATOMIC_RELAXED);
+		if (ctx->quit) {
+			pthread_mutex_unlock(&ctx->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&ctx->lock);
+	}
+}
+
+static int
+ctrmt_start(struct ctrmt_ctx *ctx)
+{
+	sigset_t all, saved;
+	u_int i;
+	int r = 0;
+
+	if (pthread_mutex_init(&ctx->lock, NULL) != 0 ||
+	    pthread_cond_init(&ctx->ready, NULL) != 0)
+		return SSH_ERR_SYSTEM_ERROR;
+	ctx->started = 1;
+	ctx->waiting = ctx->quit = 0;
+	ctx->forks = ctrmt_forks;
+
+	/* Signals are for the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	for (i = 0; i < ctx->nthreads; i++) {
+		ctx->workers[i].idle = 0;
+		if (pthread_cond_init(&ctx->workers[i].wakeup, NULL) != 0 ||
+		    pthread_create(&ctx->workers[i].thread, NULL,
+		    ctrmt_worker_main, &ctx->workers[i]) != 0) {
+			r = SSH_ERR_SYSTEM_ERROR;
+			break;
+		}
+		ctx->running++;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	return r;
+}
+
+static void
+ctrmt_stop(struct ctrmt_ctx *ctx)
+{
+	u_int i;
+
+	if (!ctx->started)
+		return;
+	ctx->started = 0;
+	/* After fork() the workers belong to the parent */
+	if (ctx->forks != ctrmt_forks) {
+		ctx->running = 0;
+		return;
+	}
+	pthread_mutex_lock(&ctx->lock);
+	ctx->quit = 1;
+	for (i = 0; i < ctx->running; i++)
+		pthread_cond_signal(&ctx->workers[i].wakeup);
+	pthread_mutex_unlock(&ctx->lock);
+	for (i = 0; i < ctx->running; i++) {
+		pthread_join(ctx->workers[i].thread, NULL);
+		pthread_cond_destroy(&ctx->workers[i].wakeup);
+	}
+	ctx->running = 0;
+	pthread_cond_destroy(&ctx->ready);
+	pthread_mutex_destroy(&ctx->lock);
+}
+
+static void
+ctrmt_reset(struct ctrmt_ctx *ctx)
+{
+	u_int i;
+
+	ctx->stream = 0;
+	ctx->off = 0;
+	ctx->error = 0;
+	for (i = 0; i < ctx->nslots; i++) {
+		ctx->slots[i].want = i;
+		ctx->slots[i].done = 0;
+	}
+}
+
+int
+ctrmt_init(struct ctrmt_ctx **ctxp, const u_char *key, u_int keylen,
+    const u_char *iv, u_int nthreads)
+{
+	static int registered;
+	struct ctrmt_ctx *ctx;
+	struct ctrmt_worker *w;
+	u_int i;
+	int r = SSH_ERR_INTERNAL_ERROR;
+#ifdef WITH_OPENSSL
+	const EVP_CIPHER *type;
+#endif
+
+	*ctxp = NULL;
+	if (nthreads == 0 || nthreads > CTRMT_MAX_THREADS)
+		return SSH_ERR_INVALID_ARGUMENT;
+#ifdef WITH_OPENSSL
+	switch (keylen) {
+	case 16:
+		type = EVP_aes_128_ctr();
+		break;
+	case 24:
+		type = EVP_aes_192_ctr();
+		break;
+	case 32:
+		type = EVP_aes_256_ctr();
+		break;
+	default:
+		return SSH_ERR_INVALID_ARGUMENT;
+	}
+#endif
+	if (!registered) {
+		if (pthread_atfork(NULL, NULL, ctrmt_atfork_child) != 0)
+			return SSH_ERR_SYSTEM_ERROR;
+		registered = 1;
+	}
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	memcpy(ctx->iv, iv, sizeof(ctx->iv));
+	ctx->nthreads = nthreads;
+	ctx->nslots = nthreads * CTRMT_SLOTS_PER_THREAD;
+	if ((ctx->slots = calloc(ctx->nslots, sizeof(*ctx->slots))) == NULL ||
+	    (ctx->workers = calloc(nthreads, sizeof(*ctx->workers))) == NULL ||
+	    (ctx->keystream = malloc(ctx->nslots * CTRMT_SLOT_SIZE)) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto fail;
+	}
+	for (i = 0; i < ctx->nslots; i++)
+		ctx->slots[i].ks = ctx->keystream + i * CTRMT_SLOT_SIZE;
+	for (i = 0; i < nthreads; i++) {
+		w = &ctx->workers[i];
+		w->ctx = ctx;
+		w->index = i;
+#ifdef WITH_OPENSSL
+		if ((w->evp = EVP_CIPHER_CTX_new()) == NULL) {
+			r = SSH_ERR_ALLOC_FAIL;
+			goto fail;
+		}
+		if (EVP_CipherInit(w->evp, type, key, NULL, 1) == 0) {
+			r = SSH_ERR_LIBCRYPTO_ERROR;
+			goto fail;
+		}
+#else
+		aesctr_keysetup(&w->ac_ctx, key, 8 * keylen,
+		    8 * CTRMT_BLOCK_SIZE);
+#endif
+	}
+	ctrmt_reset(ctx);
+	if ((r = ctrmt_start(ctx)) != 0)
+		goto fail;
+	*ctxp = ctx;
+	return 0;
+ fail:
+	ctrmt_free(ctx);
+	return r;
+}
+
+static void
+ctrmt_xor(u_char *dest, const u_char *src, const u_char *ks, size_t len)
+{
+	u_int64_t a, b;
+
+	for (; len >= sizeof(a); len -= sizeof(a)) {
+		memcpy(&a, src, sizeof(a));
+		memcpy(&b, ks, sizeof(b));
+		a ^= b;
+		memcpy(dest, &a, sizeof(a));
+		src += sizeof(a);
+		ks += sizeof(b);
+		dest += sizeof(a);
+	}
+	while (len-- > 0)
+		*dest++ = *src++ ^ *ks++;
+}
+
+int
+ctrmt_crypt(struct ctrmt_ctx *ctx, const u_char *src, u_char *dest,
+    size_t len)
+{
+	struct ctrmt_slot *slot;
+	struct ctrmt_worker *w;
+	size_t n;
+	int r;
+
+	if (ctx->forks != ctrmt_forks) {
+		ctrmt_stop(ctx);
+		if ((r = ctrmt_start(ctx)) != 0)
+			return r;
+	}
+	while (len > 0) {
+		slot = &ctx->slots[ctx->stream % ctx->nslots];
+		if (__atomic_load_n(&slot->done, __ATOMIC_ACQUIRE) !=
+		    ctx->stream + 1) {
+			pthread_mutex_lock(&ctx->lock);
+			__atomic_store_n(&ctx->waiting, 1, __ATOMIC_SEQ_CST);
+			while (__atomic_load_n(&slot->done,
+			    __ATOMIC_SEQ_CST) != ctx->stream + 1)
+				pthread_cond_wait(&ctx->ready, &ctx->lock);
+			__atomic_store_n(&ctx->waiting, 0, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&ctx->lock);
+		}
+		if (__atomic_load_n(&ctx->error, __ATOMIC_RELAXED))
+			return SSH_ERR_LIBCRYPTO_ERROR;
+
+		n = MIN(len, CTRMT_SLOT_SIZE - ctx->off);
+		ctrmt_xor(dest, src, slot->ks + ctx->off, n);
+		src += n;
+		dest += n;
+		len -= n;
+		if ((ctx->off += n) < CTRMT_SLOT_SIZE)
+			break;
+
+		/* Slot used up, hand it back for the next round */
+		__atomic_store_n(&slot->want, ctx->stream + ctx->nslots,
+		    __ATOMIC_SEQ_CST);
+		w = &ctx->workers[(ctx->stream % ctx->nslots) % ctx->nthreads];
+		if (__atomic_load_n(&w->idle, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&ctx->lock);
+			pthread_cond_signal(&w->wakeup);
+			pthread_mutex_unlock(&ctx->lock);
+		}
+		ctx->stream++;
+		ctx->off = 0;
+	}
+	return 0;
+}
+
+void
+ctrmt_get_iv(const struct ctrmt_ctx *ctx, u_char *iv)
+{
+	ctrmt_counter(ctx->iv, ctx->stream * CTRMT_SLOT_BLOCKS +
+	    (ctx->off + CTRMT_BLOCK_SIZE - 1) / CTRMT_BLOCK_SIZE, iv);
+}
+
+int
+ctrmt_set_iv(struct ctrmt_ctx *ctx, const u_char *iv)
+{
+	ctrmt_stop(ctx);
+	memcpy(ctx->iv, iv, sizeof(ctx->iv));
+	ctrmt_reset(ctx);
+	return ctrmt_start(ctx);
+}
+
+void
+ctrmt_free(struct ctrmt_ctx *ctx)
+{
+	u_int i;
+
+	if (ctx == NULL)
+		return;
+	ctrmt_stop(ctx);
+	if (ctx->workers != NULL) {
+		for (i = 0; i < ctx->nthreads; i++) {
+#ifdef WITH_OPENSSL
+			if (ctx->workers[i].evp != NULL)
+				EVP_CIPHER_CTX_free(ctx->workers[i].evp);
+#endif
+			explicit_bzero(&ctx->workers[i],
+			    sizeof(ctx->workers[i]));
+		}
+		free(ctx->workers);
+	}
+	if (ctx->keystream != NULL) {
+		explicit_bzero(ctx->keystream,
+		    ctx->nslots * CTRMT_SLOT_SIZE);
+		free(ctx->keystream);
+	}
+	free(ctx->slots);
+	explicit_bzero(ctx, sizeof(*ctx));
+	free(ctx);
+}
+
+#endif /* WITH_CTR_THREADS */
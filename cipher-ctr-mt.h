@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2026 Etersoft
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CIPHER_CTR_MT_H
+#define CIPHER_CTR_MT_H
+
+#include <sys/types.h>
+
+/*
+ * AES-CTR with the keystream generated ahead of use by worker threads.
+ * The keystream is cut into slots of CTRMT_SLOT_SIZE bytes. Each worker
+ * owns a fixed subset of a ring of slots and refills a slot as soon as
+ * the caller has used it up, so the ring holds the keystream for the
+ * next CTRMT_SLOTS_PER_THREAD * nthreads slots. Slots are handed over
+ * with atomic sequence numbers; the mutex is only taken to park and wake
+ * threads that ran out of work. The output is the same as that of the
+ * single threaded cipher.
+ */
+
+#define CTRMT_MAX_THREADS	32
+
+struct ctrmt_ctx;
+
+/* Starts "nthreads" workers. Returns 0 or an SSH_ERR_* code. */
+int	 ctrmt_init(struct ctrmt_ctx **, const u_char *key, u_int keylen,
+    const u_char *iv, u_int nthreads);
+int	 ctrmt_crypt(struct ctrmt_ctx *, const u_char *src, u_char *dest,
+    size_t len);
+
+/* Counter of the next unused keystream block, 16 bytes. */
+void	 ctrmt_get_iv(const struct ctrmt_ctx *, u_char *iv);
+int	 ctrmt_set_iv(struct ctrmt_ctx *, const u_char *iv);
+
+void	 ctrmt_free(struct ctrmt_ctx *);
+
+#endif /* CIPHER_CTR_MT_H */
@@ -44,6 +44,7 @@
 #include <stdio.h>
 
 #include "cipher.h"
+#include "cipher-ctr-mt.h"
 #include "misc.h"
 #include "sshbuf.h"
 #include "ssherr.h"
@@ -63,6 +64,7 @@ struct sshcipher_ctx {
 	EVP_CIPHER_CTX *evp;
 	struct chachapoly_ctx cp_ctx; /* XXX union with evp? */
 	struct aesctr_ctx ac_ctx; /* XXX union with evp? */
+	struct ctrmt_ctx *mt_ctx;
 	const struct sshcipher *cipher;
 };
 
@@ -79,6 +81,7 @@ struct sshcipher {
 #define CFLAG_CHACHAPOLY	(1<<1)
 #define CFLAG_AESCTR		(1<<2)
 #define CFLAG_NONE		(1<<3)
+#define CFLAG_THREADS		(1<<4)	/* may use keystream threads */
 #ifdef WITH_OPENSSL
 	const EVP_CIPHER	*(*evptype)(void);
 #else
@@ -115,9 +118,12 @@ static const struct sshcipher ciphers[] = {
 	{ "aes256-cbc",	SSH_CIPHER_SSH2, 16, 32, 0, 0, 0, 1, EVP_aes_256_cbc },
 	{ "rijndael-cbc@lysator.liu.se",
 			SSH_CIPHER_SSH2, 16, 32, 0, 0, 0, 1, EVP_aes_256_cbc },
-	{ "aes128-ctr",	SSH_CIPHER_SSH2, 16, 16, 0, 0, 0, 0, EVP_aes_128_ctr },
-	{ "aes192-ctr",	SSH_CIPHER_SSH2, 16, 24, 0, 0, 0, 0, EVP_aes_192_ctr },
-	{ "aes256-ctr",	SSH_CIPHER_SSH2, 16, 32, 0, 0, 0, 0, EVP_aes_256_ctr },
+	{ "aes128-ctr",	SSH_CIPHER_SSH2, 16, 16, 0, 0, 0,
+			CFLAG_THREADS, EVP_aes_128_ctr },
+	{ "aes192-ctr",	SSH_CIPHER_SSH2, 16, 24, 0, 0, 0,
+			CFLAG_THREADS, EVP_aes_192_ctr },
+	{ "aes256-ctr",	SSH_CIPHER_SSH2, 16, 32, 0, 0, 0,
+			CFLAG_THREADS, EVP_aes_256_ctr },
 # ifdef OPENSSL_HAVE_EVPGCM
 	{ "aes128-gcm@openssh.com",
 			SSH_CIPHER_SSH2, 16, 16, 12, 16, 0, 0, EVP_aes_128_gcm },
@@ -125,9 +131,12 @@ static const struct sshcipher ciphers[] = {
 			SSH_CIPHER_SSH2, 16, 32, 12, 16, 0, 0, EVP_aes_256_gcm },
 # endif /* OPENSSL_HAVE_EVPGCM */
 #else /* WITH_OPENSSL */
-	{ "aes128-ctr",	SSH_CIPHER_SSH2, 16, 16, 0, 0, 0, CFLAG_AESCTR, NULL },
-	{ "aes192-ctr",	SSH_CIPHER_SSH2, 16, 24, 0, 0, 0, CFLAG_AESCTR, NULL },
-	{ "aes256-ctr",	SSH_CIPHER_SSH2, 16, 32, 0, 0, 0, CFLAG_AESCTR, NULL },
+	{ "aes128-ctr",	SSH_CIPHER_SSH2, 16, 16, 0, 0, 0,
+			CFLAG_AESCTR|CFLAG_THREADS, NULL },
+	{ "aes192-ctr",	SSH_CIPHER_SSH2, 16, 24, 0, 0, 0,
+			CFLAG_AESCTR|CFLAG_THREADS, NULL },
+	{ "aes256-ctr",	SSH_CIPHER_SSH2, 16, 32, 0, 0, 0,
+			CFLAG_AESCTR|CFLAG_THREADS, NULL },
 	{ "none",	SSH_CIPHER_NONE, 8, 0, 0, 0, 0, CFLAG_NONE, NULL },
 #endif /* WITH_OPENSSL */
 	{ "chacha20-poly1305@openssh.com",
@@ -136,8 +145,31 @@ static const struct sshcipher ciphers[] = {
 	{ NULL,		SSH_CIPHER_INVALID, 0, 0, 0, 0, 0, 0, NULL }
 };
 
+#ifdef WITH_CTR_THREADS
+/* Keystream threads per AES-CTR context, none to run it inline */
+static u_int cipher_threads = 0;
+#endif
+
 /*--*/
 
+/*
+ * Sets the number of threads generating the keystream of AES-CTR
+ * contexts set up after the call. Zero keeps the keystream inline, as
+ * does any number when the platform has no threads.
+ */
+int
+cipher_set_threads(u_int n)
+{
+#ifdef WITH_CTR_THREADS
+	if (n > CTRMT_MAX_THREADS)
+		return SSH_ERR_INVALID_ARGUMENT;
+	cipher_threads = n;
+	return 0;
+#else
+	return 0;
+#endif
+}
+
 /* Returns a comma-separated list of supported ciphers. */
 char *
 cipher_alg_list(char sep, int auth_only)
@@ -353,6 +385,13 @@ cipher_init(struct sshcipher_ctx **ccp, const struct sshcipher *cipher,
 		ret = chachapoly_init(&cc->cp_ctx, key, keylen);
 		goto out;
 	}
+#ifdef WITH_CTR_THREADS
+	if ((cc->cipher->flags & CFLAG_THREADS) != 0 && cipher_threads > 0) {
+		ret = ctrmt_init(&cc->mt_ctx, key, cipher->key_len, iv,
+		    cipher_threads);
+		goto out;
+	}
+#endif
 #ifndef WITH_OPENSSL
 	if ((cc->cipher->flags & CFLAG_AESCTR) != 0) {
 		aesctr_keysetup(&cc->ac_ctx, key, 8 * keylen, 8 * ivlen);
@@ -439,6 +478,7 @@ cipher_init(struct sshcipher_ctx **ccp, const struct sshcipher *cipher,
  * Use 'authlen' bytes at offset 'len'+'aadlen' as the authentication tag.
  * This tag is written on encryption and verified on decryption.
  * Both 'aadlen' and 'authlen' can be set to 0.
+ * 'dest' may be the same as 'src' to operate in place.
  */
 int
 cipher_crypt(struct sshcipher_ctx *cc, u_int seqnr, u_char *dest,
@@ -448,16 +488,25 @@ cipher_crypt(struct sshcipher_ctx *cc, u_int seqnr, u_char *dest,
 		return chachapoly_crypt(&cc->cp_ctx, seqnr, dest, src,
 		    len, aadlen, authlen, cc->encrypt);
 	}
+#ifdef WITH_CTR_THREADS
+	if (cc->mt_ctx != NULL) {
+		if (aadlen && dest != src)
+			memcpy(dest, src, aadlen);
+		return ctrmt_crypt(cc->mt_ctx, src + aadlen, dest + aadlen,
+		    len);
+	}
+#endif
 #ifndef WITH_OPENSSL
 	if ((cc->cipher->flags & CFLAG_AESCTR) != 0) {
-		if (aadlen)
+		if (aadlen && dest != src)
 			memcpy(dest, src, aadlen);
 		aesctr_encrypt_bytes(&cc->ac_ctx, src + aadlen,
 		    dest + aadlen, len);
 		return 0;
 	}
 	if ((cc->cipher->flags & CFLAG_NONE) != 0) {
-		memcpy(dest, src, aadlen + len);
+		if (dest != src)
+			memcpy(dest, src, aadlen + len);
 		return 0;
 	}
 	return SSH_ERR_INVALID_ARGUMENT;
@@ -481,7 +530,8 @@ cipher_crypt(struct sshcipher_ctx *cc, u_int seqnr, u_char *dest,
 		if (authlen &&
 		    EVP_Cipher(cc->evp, NULL, (u_char *)src, aadlen) < 0)
 			return SSH_ERR_LIBCRYPTO_ERROR;
-		memcpy(dest, src, aadlen);
+		if (dest != src)
+			memcpy(dest, src, aadlen);
 	}
 	if (len % cc->cipher->block_size)
 		return SSH_ERR_INVALID_ARGUMENT;
@@ -525,6 +575,9 @@ cipher_free(struct sshcipher_ctx *cc)
 		explicit_bzero(&cc->cp_ctx, sizeof(cc->cp_ctx));
 	else if ((cc->cipher->flags & CFLAG_AESCTR) != 0)
 		explicit_bzero(&cc->ac_ctx, sizeof(cc->ac_ctx));
+#ifdef WITH_CTR_THREADS
+	ctrmt_free(cc->mt_ctx);
+#endif
 #ifdef WITH_OPENSSL
 	if (cc->evp != NULL) {
 		EVP_CIPHER_CTX_free(cc->evp);
@@ -572,6 +625,8 @@ cipher_get_keyiv_len(const struct sshcipher_ctx *cc)
 		ivlen = 24;
 	else if ((cc->cipher->flags & CFLAG_CHACHAPOLY) != 0)
 		ivlen = 0;
+	else if (cc->mt_ctx != NULL)
+		ivlen = cipher_ivlen(c);
 	else if ((cc->cipher->flags & CFLAG_AESCTR) != 0)
 		ivlen = sizeof(cc->ac_ctx.ctr);
 #ifdef WITH_OPENSSL
@@ -594,6 +649,14 @@ cipher_get_keyiv(struct sshcipher_ctx *cc, u_char *iv, u_int len)
 			return SSH_ERR_INVALID_ARGUMENT;
 		return 0;
 	}
+#ifdef WITH_CTR_THREADS
+	if (cc->mt_ctx != NULL) {
+		if (len != cipher_ivlen(c))
+			return SSH_ERR_INVALID_ARGUMENT;
+		ctrmt_get_iv(cc->mt_ctx, iv);
+		return 0;
+	}
+#endif
 	if ((cc->cipher->flags & CFLAG_AESCTR) != 0) {
 		if (len != sizeof(cc->ac_ctx.ctr))
 			return SSH_ERR_INVALID_ARGUMENT;
@@ -650,6 +713,10 @@ cipher_set_keyiv(struct sshcipher_ctx *cc, const u_char *iv)
 		return 0;
 	if ((cc->cipher->flags & CFLAG_NONE) != 0)
 		return 0;
+#ifdef WITH_CTR_THREADS
+	if (cc->mt_ctx != NULL)
+		return ctrmt_set_iv(cc->mt_ctx, iv);
+#endif
 
 	switch (c->number) {
 #ifdef WITH_OPENSSL
@@ -65,6 +65,7 @@
 struct sshcipher;
 struct sshcipher_ctx;
 
+int	 cipher_set_threads(u_int);
 u_int	 cipher_mask_ssh1(int);
 const struct sshcipher *cipher_by_name(const char *);
 const struct sshcipher *cipher_by_number(int);
@@ -112,6 +112,7 @@
 #include "buffer.h"
 #include "compat.h"
 #include "channels.h"
+#include "eventloop.h"
 #include "dispatch.h"
 #include "key.h"
 #include "cipher.h"
@@ -674,52 +675,50 @@ server_alive_check(void)
  * one of the file descriptors).
  */
 static void
-client_wait_until_can_do_something(fd_set **readsetp, fd_set **writesetp,
-    int *maxfdp, u_int *nallocp, int rekeying)
+client_wait_until_can_do_something(int rekeying)
 {
+	static fd_set *readset = NULL, *writeset = NULL;
+	static u_int nalloc = 0;
 	struct timeval tv, *tvp;
-	int timeout_secs;
+	int timeout_secs, idle_secs;
 	time_t minwait_secs = 0, server_alive_time = 0, now = monotime();
-	int ret;
+	int ret, maxfd;
 
-	/* Add any selections by the channel mechanism. */
-	channel_prepare_select(readsetp, writesetp, maxfdp, nallocp,
-	    &minwait_secs, rekeying);
+	/* Add any descriptors wanted by the channel mechanism. */
+	channel_prepare_poll(&minwait_secs, rekeying);
 
 	if (!compat20) {
 		/* Read from the connection, unless our buffers are full. */
 		if (buffer_len(&stdout_buffer) < buffer_high &&
 		    buffer_len(&stderr_buffer) < buffer_high &&
 		    channel_not_very_much_buffered_data())
-			FD_SET(connection_in, *readsetp);
+			channel_want_fd(connection_in, EVENTLOOP_READ);
 		/*
 		 * Read from stdin, unless we have seen EOF or have very much
 		 * buffered data to send to the server.
 		 */
 		if (!stdin_eof && packet_not_very_much_data_to_write())
-			FD_SET(fileno(stdin), *readsetp);
+			channel_want_fd(fileno(stdin), EVENTLOOP_READ);
 
-		/* Select stdout/stderr if have data in buffer. */
+		/* Wait for stdout/stderr if have data in buffer. */
 		if (buffer_len(&stdout_buffer) > 0)
-			FD_SET(fileno(stdout), *writesetp);
+			channel_want_fd(fileno(stdout), EVENTLOOP_WRITE);
 		if (buffer_len(&stderr_buffer) > 0)
-			FD_SET(fileno(stderr), *writesetp);
+			channel_want_fd(fileno(stderr), EVENTLOOP_WRITE);
 	} else {
-		/* channel_prepare_select could have closed the last channel */
+		/* channel_prepare_poll could have closed the last channel */
 		if (session_closed && !channel_still_open() &&
 		    !packet_have_data_to_write()) {
-			/* clear mask since we did not call select() */
-			memset(*readsetp, 0, *nallocp);
-			memset(*writesetp, 0, *nallocp);
+			/* nothing is ready since we did not wait */
 			return;
 		} else {
-			FD_SET(connection_in, *readsetp);
+			channel_want_fd(connection_in, EVENTLOOP_READ);
 		}
 	}
 
-	/* Select server connection if have data to write to the server. */
+	/* Wait for server connection if have data to write to the server. */
 	if (packet_have_data_to_write())
-		FD_SET(connection_out, *writesetp);
+		channel_want_fd(connection_out, EVENTLOOP_WRITE);
 
 	/*
 	 * Wait for something to happen.  This will suspend the process until
@@ -734,6 +733,9 @@ client_wait_until_can_do_something(fd_set **readsetp, fd_set **writesetp,
 	}
 	if (options.rekey_interval > 0 && compat20 && !rekeying)
 		timeout_secs = MINIMUM(timeout_secs, packet_get_rekey_timeout());
+	if (compat20 && !rekeying &&
+	    (idle_secs = ssh_packet_get_idle_rekey_timeout(active_state)) >= 0)
+		timeout_secs = MINIMUM(timeout_secs, idle_secs);
 	set_control_persist_exit_time();
 	if (control_persist_exit_time > 0) {
 		timeout_secs = MINIMUM(timeout_secs,
@@ -743,30 +745,37 @@ client_wait_until_can_do_something(fd_set **readsetp, fd_set **writesetp,
 	}
 	if (minwait_secs != 0)
 		timeout_secs = MINIMUM(timeout_secs, (int)minwait_secs);
-	if (timeout_secs == INT_MAX)
-		tvp = NULL;
-	else {
-		tv.tv_sec = timeout_secs;
-		tv.tv_usec = 0;
-		tvp = &tv;
-	}
 
-	ret = nx_proxy_select((*maxfdp)+1, *readsetp, *writesetp, NULL, tvp);
+	if (nx_proxy_running()) {
+		/*
+		 * The NX transport adds its own descriptors to the sets
+		 * and runs its loop from within the select.
+		 */
+		if (timeout_secs == INT_MAX)
+			tvp = NULL;
+		else {
+			tv.tv_sec = timeout_secs;
+			tv.tv_usec = 0;
+			tvp = &tv;
+		}
+		maxfd = channel_poll_fdsets(&readset, &writeset, &nalloc);
+		ret = nx_proxy_select(maxfd + 1, readset, writeset, NULL, tvp);
+		if (ret >= 0)
+			channel_poll_fdsets_ready(readset, writeset);
+	} else
+		ret = channel_poll(timeout_secs == INT_MAX ? -1 :
+		    MINIMUM(timeout_secs, INT_MAX / 1000) * 1000);
 	if (ret < 0) {
 		char buf[100];
 
 		/*
-		 * We have to clear the select masks, because we return.
 		 * We have to return, because the mainloop checks for the flags
-		 * set by the signal handlers.
+		 * set by the signal handlers.  Nothing is marked ready.
 		 */
-		memset(*readsetp, 0, *nallocp);
-		memset(*writesetp, 0, *nallocp);
-
 		if (errno == EINTR)
 			return;
 		/* Note: we might still have data in the buffers. */
-		snprintf(buf, sizeof buf, "select: %s\r\n", strerror(errno));
+		snprintf(buf, sizeof buf, "poll: %s\r\n", strerror(errno));
 		buffer_append(&stderr_buffer, buf, strlen(buf));
 		quit_pending = 1;
 	} else if (ret == 0) {
@@ -816,7 +825,7 @@ client_suspend_self(Buffer *bin, Buffer *bout, Buffer *berr)
 }
 
 static void
-client_process_net_input(fd_set *readset)
+client_process_net_input(void)
 {
 	int len;
 	char buf[SSH_IOBUFSZ];
@@ -825,7 +834,7 @@ client_process_net_input(fd_set *readset)
 	 * Read input from the server, and add any such data to the buffer of
 	 * the packet subsystem.
 	 */
-	if (FD_ISSET(connection_in, readset)) {
+	if (channel_fd_ready(connection_in, EVENTLOOP_READ)) {
 		/* Read as much as possible. */
 
 		#ifdef TEST
@@ -1405,13 +1414,13 @@ process_escapes(Channel *c, Buffer *bin, Buffer *bout, Buffer *berr,
 }
 
 static void
-client_process_input(fd_set *readset)
+client_process_input(void)
 {
 	int len;
 	char buf[SSH_IOBUFSZ];
 
 	/* Read input from stdin. */
-	if (FD_ISSET(fileno(stdin), readset)) {
+	if (channel_fd_ready(fileno(stdin), EVENTLOOP_READ)) {
 		/* Read as much as possible. */
 		#ifdef TEST
 		logit("NX> 280 Reading: %u bytes from fd: %d in context: 3",
@@ -1477,13 +1486,13 @@ client_process_input(fd_set *readset)
 }
 
 static void
-client_process_output(fd_set *writeset)
+client_process_output(void)
 {
 	int len;
 	char buf[100];
 
 	/* Write buffered output to stdout. */
-	if (FD_ISSET(fileno(stdout), writeset)) {
+	if (channel_fd_ready(fileno(stdout), EVENTLOOP_WRITE)) {
 		/* Write as much data as possible. */
 
 		#ifdef TEST
@@ -1519,7 +1528,7 @@ client_process_output(fd_set *writeset)
 		buffer_consume(&stdout_buffer, len);
 	}
 	/* Write buffered output to stderr. */
-	if (FD_ISSET(fileno(stderr), writeset)) {
+	if (channel_fd_ready(fileno(stderr), EVENTLOOP_WRITE)) {
 		/* Write as much data as possible. */
 
 		#ifdef TEST
@@ -1624,11 +1633,9 @@ client_channel_closed(int id, void *arg)
 int
 client_loop(int have_pty, int escape_char_arg, int ssh2_chan_id)
 {
-	fd_set *readset = NULL, *writeset = NULL;
 	double start_time, total_time;
-	int r, max_fd = 0, max_fd2 = 0, len;
+	int r, len;
 	u_int64_t ibytes, obytes;
-	u_int nalloc = 0;
 	char buf[100];
 
 	debug("Entering interactive session.");
@@ -1674,7 +1681,6 @@ client_loop(int have_pty, int escape_char_arg, int ssh2_chan_id)
 	buffer_high = 64 * 1024;
 	connection_in = packet_get_connection_in();
 	connection_out = packet_get_connection_out();
-	max_fd = MAXIMUM(connection_in, connection_out);
 
 	if (!compat20) {
 		/* enable nonblocking unless tty */
@@ -1684,9 +1690,6 @@ client_loop(int have_pty, int escape_char_arg, int ssh2_chan_id)
 			set_nonblock(fileno(stdout));
 		if (!isatty(fileno(stderr)))
 			set_nonblock(fileno(stderr));
-		max_fd = MAXIMUM(max_fd, fileno(stdin));
-		max_fd = MAXIMUM(max_fd, fileno(stdout));
-		max_fd = MAXIMUM(max_fd, fileno(stderr));
 	}
 	quit_pending = 0;
 	escape_char1 = escape_char_arg;
@@ -1751,6 +1754,13 @@ client_loop(int have_pty, int escape_char_arg, int ssh2_chan_id)
 				fatal("%s: kex_start_rekex: %s", __func__,
 				    ssh_err(r));
 			need_rekeying = 0;
+		} else if (compat20 &&
+		    ssh_packet_want_idle_rekey(active_state)) {
+			/* close to a rekey limit and nothing is moving */
+			debug("rekeying while the connection is idle");
+			if ((r = kex_start_rekex(active_state)) != 0)
+				fatal("%s: kex_start_rekex: %s", __func__,
+				    ssh_err(r));
 		} else {
 			/*
 			 * Make packets of buffered stdin data, and buffer
@@ -1779,38 +1789,37 @@ client_loop(int have_pty, int escape_char_arg, int ssh2_chan_id)
 		 * Wait until we have something to do (something becomes
 		 * available on one of the descriptors).
 		 */
-		max_fd2 = max_fd;
-		client_wait_until_can_do_something(&readset, &writeset,
-		    &max_fd2, &nalloc, ssh_packet_is_rekeying(active_state));
+		client_wait_until_can_do_something(
+		    ssh_packet_is_rekeying(active_state));
 
 		if (quit_pending)
 			break;
 
 		/* Do channel operations unless rekeying in progress. */
 		if (!ssh_packet_is_rekeying(active_state))
-			channel_after_select(readset, writeset);
+			channel_after_poll();
 
 		/* Buffer input from the connection.  */
-		client_process_net_input(readset);
+		client_process_net_input();
 
 		if (quit_pending)
 			break;
 
 		if (!compat20) {
 			/* Buffer data from stdin */
-			client_process_input(readset);
+			client_process_input();
 			/*
 			 * Process output to stdout and stderr.  Output to
 			 * the connection is processed elsewhere (above).
 			 */
-			client_process_output(writeset);
+			client_process_output();
 		}
 
 		/*
 		 * Send as much buffered packet data as possible to the
 		 * sender.
 		 */
-		if (FD_ISSET(connection_out, writeset))
+		if (channel_fd_ready(connection_out, EVENTLOOP_WRITE))
 			packet_write_poll();
 
 		/*
@@ -1825,8 +1834,6 @@ client_loop(int have_pty, int escape_char_arg, int ssh2_chan_id)
 			}
 		}
 	}
-	free(readset);
-	free(writeset);
 
 	/* Terminate the session. */
 
@@ -2023,7 +2030,7 @@ client_input_agent_open(int type, u_int32_t seq, void *ctxt)
 	if (sock >= 0) {
 		c = channel_new("", SSH_CHANNEL_OPEN, sock, sock,
 		    -1, 0, 0, 0, "authentication agent connection", 1);
-		c->remote_id = remote_id;
+		channel_set_remote_id(c, remote_id);
 		c->force_drain = 1;
 	}
 	if (c == NULL) {
@@ -2256,7 +2263,7 @@ client_input_channel_open(int type, u_int32_t seq, void *ctxt)
 		debug3("proxied to downstream: %s", ctype);
 	} else if (c != NULL) {
 		debug("confirm %s", ctype);
-		c->remote_id = rchan;
+		channel_set_remote_id(c, rchan);
 		c->remote_window = rwindow;
 		c->remote_maxpacket = rmaxpack;
 		if (c->type != SSH_CHANNEL_CONNECTING) {
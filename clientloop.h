@@ -72,6 +72,7 @@ void client_expect_confirm(int, const char *, enum confirm_action);
 #define SSHMUX_COMMAND_STOP		6	/* Disable mux but not conn */
 #define SSHMUX_COMMAND_CANCEL_FWD	7	/* Cancel forwarding(s) */
 #define SSHMUX_COMMAND_PROXY		8	/* Open new connection */
+#define SSHMUX_COMMAND_STATS		9	/* Print transport counters */
 
 void	muxserver_listen(void);
 int	muxclient(const char *);
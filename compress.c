@@ -0,0 +1,614 @@
+/*
+ * Copyright (c) 2026 Etersoft
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+#include "kex.h"
+#include "log.h"
+#include "misc.h"
+#include "sshbuf.h"
+#include "ssherr.h"
+
+/* First guess for the output of one call, grown while it fills up */
+#define COMPRESS_CHUNK_MIN	4096
+#define COMPRESS_CHUNK_MAX	(256 * 1024)
+
+/*
+ * The outgoing stream measures its ratio over samples of this many
+ * uncompressed bytes. A sample that saves less than 1/16 of its size
+ * is taken as incompressible data, and the stream drops to the fast
+ * level of the method until the data compresses again. As the fast
+ * level of zlib stores the data, which gives no ratio to go by, the
+ * stream also tries its own level on a shorter sample now and then,
+ * waiting twice as long each time the try fails.
+ */
+#define COMPRESS_SAMPLE		(256 * 1024)
+#define COMPRESS_PROBE_SAMPLE	(32 * 1024)
+#define COMPRESS_PROBE_MIN	4
+#define COMPRESS_PROBE_MAX	32
+
+#ifdef HAVE_ZSTD
+/*
+ * The zstd@etersoft.ru stream uses windows of up to 8MB, which is
+ * what the levels up to 19 pick for streams of unknown size. The
+ * decoder refuses larger ones, so the peer cannot make it allocate more.
+ */
+#define ZSTD_WINDOWLOG_LIMIT	23
+#define ZSTD_LEVEL_LIMIT	19
+#define ZSTD_LEVEL_FAST		(-5)
+#endif
+
+struct sshcompress_ctx {
+	const struct sshcompress *method;
+	int		 mode;
+	int		 failures;
+	u_int64_t	 raw;
+	u_int64_t	 compressed;
+
+	/* Outgoing stream: adaptive level */
+	int		 level;		/* chosen level */
+	int		 cur_level;	/* level of the stream */
+	int		 want_level;	/* level for the next packet */
+	size_t		 sample_raw;
+	size_t		 sample_compressed;
+	int		 probing;	/* trying the chosen level again */
+	u_int		 probe_wait;	/* samples until the next try */
+	u_int		 probe_interval;
+	u_int		 backoffs;
+	z_stream	 zs;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx	*zc;
+	ZSTD_DCtx	*zd;
+#endif
+};
+
+struct sshcompress {
+	char	*name;
+	u_int	 type;		/* COMP_ZLIB or COMP_DELAYED */
+	int	 level;		/* default level */
+	int	 max_level;
+	int	 fast_level;	/* level for incompressible data */
+	int	 (*init)(struct sshcompress_ctx *, int);
+	int	 (*set_level)(struct sshcompress_ctx *, int, struct sshbuf *);
+	int	 (*compress)(struct sshcompress_ctx *, const u_char *, size_t,
+	    struct sshbuf *);
+	int	 (*uncompress)(struct sshcompress_ctx *, const u_char *, size_t,
+	    struct sshbuf *);
+	void	 (*end)(struct sshcompress_ctx *);
+};
+
+static int	 zlib_init(struct sshcompress_ctx *, int);
+static int	 zlib_set_level(struct sshcompress_ctx *, int, struct sshbuf *);
+static int	 zlib_compress(struct sshcompress_ctx *, const u_char *, size_t,
+    struct sshbuf *);
+static int	 zlib_uncompress(struct sshcompress_ctx *, const u_char *, size_t,
+    struct sshbuf *);
+static void	 zlib_end(struct sshcompress_ctx *);
+#ifdef HAVE_ZSTD
+static int	 zstd_init(struct sshcompress_ctx *, int);
+static int	 zstd_set_level(struct sshcompress_ctx *, int, struct sshbuf *);
+static int	 zstd_compress(struct sshcompress_ctx *, const u_char *, size_t,
+    struct sshbuf *);
+static int	 zstd_uncompress(struct sshcompress_ctx *, const u_char *, size_t,
+    struct sshbuf *);
+static void	 zstd_end(struct sshcompress_ctx *);
+#endif
+
+static const struct sshcompress compressors[] = {
+#ifdef HAVE_ZSTD
+	{ "zstd@etersoft.ru", COMP_DELAYED, 3, ZSTD_LEVEL_LIMIT,
+	    ZSTD_LEVEL_FAST, zstd_init, zstd_set_level,
+	    zstd_compress, zstd_uncompress, zstd_end },
+#endif
+	{ "zlib@openssh.com", COMP_DELAYED, 6, 9, Z_NO_COMPRESSION,
+	    zlib_init, zlib_set_level,
+	    zlib_compress, zlib_uncompress, zlib_end },
+	{ "zlib", COMP_ZLIB, 6, 9, Z_NO_COMPRESSION,
+	    zlib_init, zlib_set_level,
+	    zlib_compress, zlib_uncompress, zlib_end },
+	{ "none", COMP_NONE, 0, 0, 0, NULL, NULL, NULL, NULL, NULL },
+	{ NULL, 0, 0, 0, 0, NULL, NULL, NULL, NULL, NULL }
+};
+
+/*--*/
+
+/* Returns a list of supported compression methods */
+char *
+compress_alg_list(char sep)
+{
+	char *tmp, *ret = NULL;
+	size_t nlen, rlen = 0;
+	const struct sshcompress *c;
+
+	for (c = compressors; c->name != NULL; c++) {
+		if (ret != NULL)
+			ret[rlen++] = sep;
+		nlen = strlen(c->name);
+		if ((tmp = realloc(ret, rlen + nlen + 2)) == NULL) {
+			free(ret);
+			return NULL;
+		}
+		ret = tmp;
+		memcpy(ret + rlen, c->name, nlen + 1);
+		rlen += nlen;
+	}
+	return ret;
+}
+
+const struct sshcompress *
+compress_by_name(const char *name)
+{
+	const struct sshcompress *c;
+
+	for (c = compressors; c->name != NULL; c++)
+		if (strcmp(c->name, name) == 0)
+			return c;
+	return NULL;
+}
+
+const char *
+compress_name(const struct sshcompress *c)
+{
+	return c->name;
+}
+
+u_int
+compress_type(const struct sshcompress *c)
+{
+	return c->type;
+}
+
+int
+compress_default_level(const struct sshcompress *c)
+{
+	return c->level;
+}
+
+int
+compress_init(struct sshcompress_ctx **ccp, const struct sshcompress *c,
+    int mode, int level)
+{
+	struct sshcompress_ctx *cc;
+	int r;
+
+	*ccp = NULL;
+	if (c->init == NULL)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if (level == 0)
+		level = c->level;
+	if (level < 1 || level > c->max_level)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if ((cc = calloc(1, sizeof(*cc))) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	cc->method = c;
+	cc->mode = mode;
+	cc->level = cc->cur_level = cc->want_level = level;
+	cc->probe_interval = COMPRESS_PROBE_MIN;
+	if ((r = c->init(cc, level)) != 0) {
+		free(cc);
+		return r;
+	}
+	*ccp = cc;
+	return 0;
+}
+
+void
+compress_free(struct sshcompress_ctx *cc)
+{
+	if (cc == NULL)
+		return;
+	cc->method->end(cc);
+	free(cc);
+}
+
+/* Picks the level for the next sample from the ratio of the last one */
+static void
+compress_adapt(struct sshcompress_ctx *cc)
+{
+	int fast = cc->method->fast_level;
+	int incompressible, probing;
+
+	incompressible = cc->sample_compressed >
+	    cc->sample_raw - cc->sample_raw / 16;
+	cc->sample_raw = cc->sample_compressed = 0;
+
+	if (cc->cur_level != fast) {
+		probing = cc->probing;
+		cc->probing = 0;
+		if (!incompressible) {
+			cc->probe_interval = COMPRESS_PROBE_MIN;
+			return;
+		}
+		/* After a failed try wait longer for the next one */
+		if (probing)
+			cc->probe_interval = MINIMUM(cc->probe_interval * 2,
+			    COMPRESS_PROBE_MAX);
+		cc->probe_wait = cc->probe_interval;
+		cc->want_level = fast;
+		if (!probing) {
+			cc->backoffs++;
+			debug2("compress outgoing: incompressible data, "
+			    "level %d -> %d", cc->level, fast);
+		}
+		return;
+	}
+	if (!incompressible) {
+		cc->probe_interval = COMPRESS_PROBE_MIN;
+		cc->want_level = cc->level;
+		debug2("compress outgoing: compressible data, "
+		    "level %d -> %d", fast, cc->level);
+	} else if (--cc->probe_wait == 0) {
+		cc->want_level = cc->level;
+		cc->probing = 1;
+	}
+}
+
+int
+compress_buffer(struct sshcompress_ctx *cc, const u_char *data, size_t len,
+    struct sshbuf *out)
+{
+	size_t olen = sshbuf_len(out);
+	int r;
+
+	if (cc->mode != COMPRESS_OUT)
+		return SSH_ERR_INTERNAL_ERROR;
+
+	/* An empty flush is not handled by the methods */
+	if (len == 0)
+		return 0;
+	if (cc->want_level != cc->cur_level) {
+		if ((r = cc->method->set_level(cc, cc->want_level, out)) != 0)
+			return r;
+		cc->cur_level = cc->want_level;
+	}
+	if ((r = cc->method->compress(cc, data, len, out)) != 0)
+		return r;
+	cc->raw += len;
+	cc->compressed += sshbuf_len(out) - olen;
+	cc->sample_raw += len;
+	cc->sample_compressed += sshbuf_len(out) - olen;
+	if (cc->sample_raw >= (cc->probing ?
+	    COMPRESS_PROBE_SAMPLE : COMPRESS_SAMPLE))
+		compress_adapt(cc);
+	return 0;
+}
+
+int
+uncompress_buffer(struct sshcompress_ctx *cc, const u_char *data, size_t len,
+    struct sshbuf *out)
+{
+	size_t olen = sshbuf_len(out);
+	int r;
+
+	if (cc->mode != COMPRESS_IN)
+		return SSH_ERR_INTERNAL_ERROR;
+	if ((r = cc->method->uncompress(cc, data, len, out)) != 0)
+		return r;
+	cc->compressed += len;
+	cc->raw += sshbuf_len(out) - olen;
+	return 0;
+}
+
+void
+compress_stats(const struct sshcompress_ctx *cc, u_int64_t *raw,
+    u_int64_t *compressed)
+{
+	*raw = cc->raw;
+	*compressed = cc->compressed;
+}
+
+u_int
+compress_backoffs(const struct sshcompress_ctx *cc)
+{
+	return cc->backoffs;
+}
+
+const char *
+compress_ctx_name(const struct sshcompress_ctx *cc)
+{
+	return cc->method->name;
+}
+
+/* Initial room for "len" bytes of input */
+static size_t
+compress_chunk(size_t len)
+{
+	if (len > COMPRESS_CHUNK_MAX)
+		return COMPRESS_CHUNK_MAX;
+	return len < COMPRESS_CHUNK_MIN ? COMPRESS_CHUNK_MIN : len;
+}
+
+static int
+zlib_init(struct sshcompress_ctx *cc, int level)
+{
+	int status;
+
+	if (cc->mode == COMPRESS_OUT)
+		status = deflateInit(&cc->zs, level);
+	else
+		status = inflateInit(&cc->zs);
+	switch (status) {
+	case Z_OK:
+		return 0;
+	case Z_MEM_ERROR:
+		return SSH_ERR_ALLOC_FAIL;
+	default:
+		return SSH_ERR_INTERNAL_ERROR;
+	}
+}
+
+/*
+ * Changes the level between packets. deflateParams() may flush the block
+ * compressed at the old level, which adds to the output of the packet.
+ */
+static int
+zlib_set_level(struct sshcompress_ctx *cc, int level, struct sshbuf *out)
+{
+	size_t chunk = COMPRESS_CHUNK_MIN;
+	u_char *p;
+	int r, status;
+
+	if ((r = sshbuf_reserve(out, chunk, &p)) != 0)
+		return r;
+	cc->zs.next_in = NULL;
+	cc->zs.avail_in = 0;
+	cc->zs.next_out = p;
+	cc->zs.avail_out = chunk;
+	status = deflateParams(&cc->zs, level, Z_DEFAULT_STRATEGY);
+	if ((r = sshbuf_consume_end(out, cc->zs.avail_out)) != 0)
+		return r;
+	switch (status) {
+	case Z_OK:
+		return 0;
+	case Z_BUF_ERROR:
+		/* Nothing was pending; the level is changed regardless */
+		return 0;
+	default:
+		cc->failures++;
+		return SSH_ERR_INTERNAL_ERROR;
+	}
+}
+
+static void
+zlib_end(struct sshcompress_ctx *cc)
+{
+	if (cc->failures != 0)
+		return;
+	if (cc->mode == COMPRESS_OUT)
+		deflateEnd(&cc->zs);
+	else
+		inflateEnd(&cc->zs);
+}
+
+static int
+zlib_compress(struct sshcompress_ctx *cc, const u_char *data, size_t len,
+    struct sshbuf *out)
+{
+	size_t chunk = compress_chunk(len + 64);
+	u_char *p;
+	int r, status;
+
+	cc->zs.next_in = (u_char *)data;
+	cc->zs.avail_in = len;
+
+	/* Loop compressing until deflate() returns with avail_out != 0. */
+	do {
+		if ((r = sshbuf_reserve(out, chunk, &p)) != 0)
+			return r;
+		cc->zs.next_out = p;
+		cc->zs.avail_out = chunk;
+		status = deflate(&cc->zs, Z_PARTIAL_FLUSH);
+		if ((r = sshbuf_consume_end(out, cc->zs.avail_out)) != 0)
+			return r;
+		switch (status) {
+		case Z_OK:
+			break;
+		case Z_MEM_ERROR:
+			return SSH_ERR_ALLOC_FAIL;
+		case Z_STREAM_ERROR:
+		default:
+			cc->failures++;
+			return SSH_ERR_INVALID_FORMAT;
+		}
+		chunk = COMPRESS_CHUNK_MIN;
+	} while (cc->zs.avail_out == 0);
+	return 0;
+}
+
+static int
+zlib_uncompress(struct sshcompress_ctx *cc, const u_char *data, size_t len,
+    struct sshbuf *out)
+{
+	size_t chunk = compress_chunk(len * 4);
+	u_char *p;
+	int r, status;
+
+	cc->zs.next_in = (u_char *)data;
+	cc->zs.avail_in = len;
+
+	for (;;) {
+		if ((r = sshbuf_reserve(out, chunk, &p)) != 0)
+			return r;
+		cc->zs.next_out = p;
+		cc->zs.avail_out = chunk;
+		status = inflate(&cc->zs, Z_PARTIAL_FLUSH);
+		if ((r = sshbuf_consume_end(out, cc->zs.avail_out)) != 0)
+			return r;
+		switch (status) {
+		case Z_OK:
+			/* Room left over: all the input has been used */
+			if (cc->zs.avail_out != 0)
+				return 0;
+			break;
+		case Z_BUF_ERROR:
+			/*
+			 * Comments in zlib.h say that we should keep calling
+			 * inflate() until we get an error.  This appears to
+			 * be the error that we get.
+			 */
+			return 0;
+		case Z_DATA_ERROR:
+			return SSH_ERR_INVALID_FORMAT;
+		case Z_MEM_ERROR:
+			return SSH_ERR_ALLOC_FAIL;
+		case Z_STREAM_ERROR:
+		default:
+			cc->failures++;
+			return SSH_ERR_INTERNAL_ERROR;
+		}
+		chunk = MINIMUM(chunk * 2, COMPRESS_CHUNK_MAX);
+	}
+	/* NOTREACHED */
+}
+
+#ifdef HAVE_ZSTD
+static int
+zstd_init(struct sshcompress_ctx *cc, int level)
+{
+	if (cc->mode == COMPRESS_OUT) {
+		if ((cc->zc = ZSTD_createCCtx()) == NULL)
+			return SSH_ERR_ALLOC_FAIL;
+		if (ZSTD_isError(ZSTD_CCtx_setParameter(cc->zc,
+		    ZSTD_c_compressionLevel, level))) {
+			ZSTD_freeCCtx(cc->zc);
+			return SSH_ERR_INTERNAL_ERROR;
+		}
+	} else {
+		if ((cc->zd = ZSTD_createDCtx()) == NULL)
+			return SSH_ERR_ALLOC_FAIL;
+		if (ZSTD_isError(ZSTD_DCtx_setParameter(cc->zd,
+		    ZSTD_d_windowLogMax, ZSTD_WINDOWLOG_LIMIT))) {
+			ZSTD_freeDCtx(cc->zd);
+			return SSH_ERR_INTERNAL_ERROR;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The level of a single threaded zstd stream only changes with a new
+ * frame, so the current frame is ended first. The decoder takes the
+ * following frame as the continuation of the stream.
+ */
+static int
+zstd_set_level(struct sshcompress_ctx *cc, int level, struct sshbuf *out)
+{
+	ZSTD_inBuffer in = { NULL, 0, 0 };
+	ZSTD_outBuffer o;
+	size_t chunk = COMPRESS_CHUNK_MIN, left;
+	u_char *p;
+	int r;
+
+	do {
+		if ((r = sshbuf_reserve(out, chunk, &p)) != 0)
+			return r;
+		o.dst = p;
+		o.size = chunk;
+		o.pos = 0;
+		left = ZSTD_compressStream2(cc->zc, &o, &in, ZSTD_e_end);
+		if ((r = sshbuf_consume_end(out, chunk - o.pos)) != 0)
+			return r;
+		if (ZSTD_isError(left)) {
+			cc->failures++;
+			return SSH_ERR_INVALID_FORMAT;
+		}
+	} while (left != 0);
+	if (ZSTD_isError(ZSTD_CCtx_setParameter(cc->zc,
+	    ZSTD_c_compressionLevel, level))) {
+		cc->failures++;
+		return SSH_ERR_INTERNAL_ERROR;
+	}
+	return 0;
+}
+
+static void
+zstd_end(struct sshcompress_ctx *cc)
+{
+	ZSTD_freeCCtx(cc->zc);
+	ZSTD_freeDCtx(cc->zd);
+}
+
+static int
+zstd_compress(struct sshcompress_ctx *cc, const u_char *data, size_t len,
+    struct sshbuf *out)
+{
+	ZSTD_inBuffer in = { data, len, 0 };
+	ZSTD_outBuffer o;
+	size_t chunk = compress_chunk(ZSTD_compressBound(len)), left;
+	u_char *p;
+	int r;
+
+	/* Flush at the end of each packet, the frame stays open */
+	do {
+		if ((r = sshbuf_reserve(out, chunk, &p)) != 0)
+			return r;
+		o.dst = p;
+		o.size = chunk;
+		o.pos = 0;
+		left = ZSTD_compressStream2(cc->zc, &o, &in, ZSTD_e_flush);
+		if ((r = sshbuf_consume_end(out, chunk - o.pos)) != 0)
+			return r;
+		if (ZSTD_isError(left)) {
+			cc->failures++;
+			return SSH_ERR_INVALID_FORMAT;
+		}
+		chunk = compress_chunk(left);
+	} while (left != 0);
+	return 0;
+}
+
+static int
+zstd_uncompress(struct sshcompress_ctx *cc, const u_char *data, size_t len,
+    struct sshbuf *out)
+{
+	ZSTD_inBuffer in = { data, len, 0 };
+	ZSTD_outBuffer o;
+	size_t chunk = compress_chunk(len * 4), ret;
+	u_char *p;
+	int r;
+
+	for (;;) {
+		if ((r = sshbuf_reserve(out, chunk, &p)) != 0)
+			return r;
+		o.dst = p;
+		o.size = chunk;
+		o.pos = 0;
+		ret = ZSTD_decompressStream(cc->zd, &o, &in);
+		if ((r = sshbuf_consume_end(out, chunk - o.pos)) != 0)
+			return r;
+		if (ZSTD_isError(ret)) {
+			cc->failures++;
+			return SSH_ERR_INVALID_FORMAT;
+		}
+		/* Room left over: all the input has been used */
+		if (in.pos == in.size && o.pos < o.size)
+			return 0;
+		chunk = MINIMUM(chunk * 2, COMPRESS_CHUNK_MAX);
+	}
+	/* NOTREACHED */
+}
+#endif /* HAVE_ZSTD */
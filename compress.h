@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2026 Etersoft
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <sys/types.h>
+
+/*
+ * Packet compression methods, negotiated by name in KEXINIT. Each
+ * direction of a connection has its own stream, flushed at the end of
+ * every packet so the peer can decompress it on its own.
+ */
+
+#define COMPRESS_OUT		1
+#define COMPRESS_IN		0
+
+struct sshbuf;
+struct sshcompress;
+struct sshcompress_ctx;
+
+const struct sshcompress *compress_by_name(const char *);
+const char *compress_name(const struct sshcompress *);
+u_int	 compress_type(const struct sshcompress *);
+int	 compress_default_level(const struct sshcompress *);
+char	*compress_alg_list(char);
+
+/* A level of 0 picks the default level of the method. */
+int	 compress_init(struct sshcompress_ctx **, const struct sshcompress *,
+    int, int);
+void	 compress_free(struct sshcompress_ctx *);
+
+/*
+ * Compresses or decompresses "len" bytes at "data", appending the result
+ * to "out". The output is written straight into the buffer.
+ */
+int	 compress_buffer(struct sshcompress_ctx *, const u_char *data,
+    size_t len, struct sshbuf *out);
+int	 uncompress_buffer(struct sshcompress_ctx *, const u_char *data,
+    size_t len, struct sshbuf *out);
+
+/* Uncompressed and compressed bytes passed through the stream. */
+void	 compress_stats(const struct sshcompress_ctx *, u_int64_t *,
+    u_int64_t *);
+
+/*
+ * The outgoing stream follows the ratio it gets and drops to a fast
+ * level while the data does not compress. Returns how often it did.
+ */
+u_int	 compress_backoffs(const struct sshcompress_ctx *);
+const char *compress_ctx_name(const struct sshcompress_ctx *);
+
+#endif /* COMPRESS_H */
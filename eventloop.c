@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2026 Etersoft
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+# include <sys/epoll.h>
+# define USE_EPOLL
+#endif
+#ifdef HAVE_POLL_H
+# include <poll.h>
+#endif
+
+#include <errno.h>
+#ifdef HAVE_PTHREAD_ATFORK
+# include <pthread.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "eventloop.h"
+
+#define EVENTLOOP_EVENTS	(EVENTLOOP_READ|EVENTLOOP_WRITE)
+#define EVENTLOOP_ALWAYS	0x80	/* not pollable, always ready */
+#define EVENTLOOP_MINFDS	64
+#define EVENTLOOP_MAXREADY	256
+
+struct eventloop {
+	pid_t	 pid;		/* process the interest set belongs to */
+	u_char	*interest;	/* registered events, indexed by fd */
+	int	 ninterest;	/* allocated entries of interest */
+	int	 nalways;	/* descriptors flagged EVENTLOOP_ALWAYS */
+	int	 always_next;	/* iterator over the always ready ones */
+	fd_mask	*rshadow;	/* read set seen by the last sync */
+	fd_mask	*wshadow;	/* write set seen by the last sync */
+	int	 nshadow;	/* allocated words of the shadow sets */
+	int	 nsynced;	/* words compared by the last sync */
+#ifdef USE_EPOLL
+	int	 epfd;
+	struct epoll_event ready[EVENTLOOP_MAXREADY];
+#else
+	struct pollfd *pfd;	/* registered descriptors */
+	int	*slot;		/* index in pfd by fd, or -1 */
+	int	 npfd;		/* used entries of pfd */
+	int	 nalloc;	/* allocated entries of pfd */
+	int	 nholes;	/* removed entries not compacted yet */
+#endif
+	int	 nready;	/* results of the last wait */
+	int	 cur;		/* iterator over the results */
+};
+
+/*
+ * A forked child inherits the loops of its parent, and an epoll instance
+ * is shared across fork(2): a descriptor the child removed would stop
+ * waking the parent, whose interest set still lists it. So a loop is
+ * only changed by the process that owns it. Any other one drops the
+ * inherited state and starts with an empty interest set of its own.
+ * The process id is cached until a fork, where pthread_atfork(3) can
+ * tell about one, as eventloop_set() checks it on every call.
+ */
+static pid_t eventloop_pid;
+static int eventloop_atfork;
+
+#ifdef HAVE_PTHREAD_ATFORK
+static void
+eventloop_atfork_child(void)
+{
+	eventloop_pid = 0;
+}
+#endif
+
+static pid_t
+eventloop_getpid(void)
+{
+	if (!eventloop_atfork)
+		return getpid();
+	if (eventloop_pid == 0)
+		eventloop_pid = getpid();
+	return eventloop_pid;
+}
+
+static void
+eventloop_own(struct eventloop *el)
+{
+	pid_t pid;
+#ifndef USE_EPOLL
+	int i;
+#endif
+
+	if ((pid = eventloop_getpid()) == el->pid)
+		return;
+	el->pid = pid;
+	if (el->interest != NULL)
+		memset(el->interest, 0, el->ninterest);
+	el->nalways = el->always_next = 0;
+	if (el->rshadow != NULL) {
+		memset(el->rshadow, 0, el->nshadow * sizeof(*el->rshadow));
+		memset(el->wshadow, 0, el->nshadow * sizeof(*el->wshadow));
+	}
+	el->nsynced = 0;
+	el->nready = el->cur = 0;
+#ifdef USE_EPOLL
+	/* Only the child's reference to the parent's instance goes */
+	close(el->epfd);
+	el->epfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+	for (i = 0; i < el->ninterest; i++)
+		el->slot[i] = -1;
+	el->npfd = el->nholes = 0;
+#endif
+}
+
+struct eventloop *
+eventloop_new(void)
+{
+	struct eventloop *el;
+
+#ifdef HAVE_PTHREAD_ATFORK
+	if (!eventloop_atfork &&
+	    pthread_atfork(NULL, NULL, eventloop_atfork_child) == 0)
+		eventloop_atfork = 1;
+#endif
+	if ((el = calloc(1, sizeof(*el))) == NULL)
+		return NULL;
+	el->pid = eventloop_getpid();
+#ifdef USE_EPOLL
+	if ((el->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		free(el);
+		return NULL;
+	}
+#endif
+	return el;
+}
+
+void
+eventloop_free(struct eventloop *el)
+{
+	if (el == NULL)
+		return;
+#ifdef USE_EPOLL
+	close(el->epfd);
+#else
+	free(el->pfd);
+	free(el->slot);
+#endif
+	free(el->interest);
+	free(el->rshadow);
+	free(el->wshadow);
+	explicit_bzero(el, sizeof(*el));
+	free(el);
+}
+
+const char *
+eventloop_backend(struct eventloop *el)
+{
+#ifdef USE_EPOLL
+	return "epoll";
+#else
+	return "poll";
+#endif
+}
+
+static int
+eventloop_grow(struct eventloop *el, int fd)
+{
+	u_char *interest;
+#ifndef USE_EPOLL
+	int *slot, i;
+#endif
+	int n;
+
+	if (fd < el->ninterest)
+		return 0;
+	n = MAX(MAX(fd + 1, el->ninterest * 2), EVENTLOOP_MINFDS);
+	if ((interest = reallocarray(el->interest, n, 1)) == NULL)
+		return -1;
+	memset(interest + el->ninterest, 0, n - el->ninterest);
+	el->interest = interest;
+#ifndef USE_EPOLL
+	if ((slot = reallocarray(el->slot, n, sizeof(*slot))) == NULL)
+		return -1;
+	for (i = el->ninterest; i < n; i++)
+		slot[i] = -1;
+	el->slot = slot;
+#endif
+	el->ninterest = n;
+	return 0;
+}
+
+#ifdef USE_EPOLL
+static int
+eventloop_ctl(struct eventloop *el, int fd, u_int old, u_int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ((events & EVENTLOOP_READ) ? EPOLLIN : 0) |
+	    ((events & EVENTLOOP_WRITE) ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+
+	if (events == 0) {
+		/* The descriptor may have been closed already */
+		if (epoll_ctl(el->epfd, EPOLL_CTL_DEL, fd, NULL) == -1 &&
+		    errno != ENOENT && errno != EBADF)
+			return -1;
+		return 0;
+	}
+	if (old == 0) {
+		if (epoll_ctl(el->epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+			return 0;
+		if (errno == EEXIST &&
+		    epoll_ctl(el->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+			return 0;
+		return -1;
+	}
+	if (epoll_ctl(el->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+		return 0;
+	/* A new descriptor reusing the number of a closed one */
+	if (errno == ENOENT &&
+	    epoll_ctl(el->epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+		return 0;
+	return -1;
+}
+#else
+static int
+eventloop_ctl(struct eventloop *el, int fd, u_int old, u_int events)
+{
+	struct pollfd *pfd;
+	int n;
+
+	if (events == 0) {
+		/* Leave a hole, compacted before the next wait */
+		if (el->slot[fd] != -1) {
+			el->pfd[el->slot[fd]].fd = -1;
+			el->pfd[el->slot[fd]].events = 0;
+			el->slot[fd] = -1;
+			el->nholes++;
+		}
+		return 0;
+	}
+	if (el->slot[fd] == -1) {
+		if (el->npfd == el->nalloc) {
+			n = MAX(el->nalloc * 2, EVENTLOOP_MINFDS);
+			if ((pfd = reallocarray(el->pfd, n,
+			    sizeof(*pfd))) == NULL)
+				return -1;
+			el->pfd = pfd;
+			el->nalloc = n;
+		}
+		el->slot[fd] = el->npfd++;
+		el->pfd[el->slot[fd]].fd = fd;
+		el->pfd[el->slot[fd]].revents = 0;
+	}
+	el->pfd[el->slot[fd]].events =
+	    ((events & EVENTLOOP_READ) ? POLLIN : 0) |
+	    ((events & EVENTLOOP_WRITE) ? POLLOUT : 0);
+	return 0;
+}
+
+static void
+eventloop_compact(struct eventloop *el)
+{
+	int i, j;
+
+	for (i = j = 0; i < el->npfd; i++) {
+		if (el->pfd[i].fd == -1)
+			continue;
+		if (i != j) {
+			el->pfd[j] = el->pfd[i];
+			el->slot[el->pfd[j].fd] = j;
+		}
+		j++;
+	}
+	el->npfd = j;
+	el->nholes = 0;
+}
+#endif
+
+int
+eventloop_set(struct eventloop *el, int fd, u_int events)
+{
+	u_int old;
+
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	eventloop_own(el);
+	events &= EVENTLOOP_EVENTS;
+	if (fd >= el->ninterest) {
+		if (events == 0)
+			return 0;
+		if (eventloop_grow(el, fd) == -1)
+			return -1;
+	}
+	old = el->interest[fd];
+	if ((old & EVENTLOOP_EVENTS) == events)
+		return 0;
+
+	if (old & EVENTLOOP_ALWAYS) {
+		if (events != 0) {
+			el->interest[fd] = events | EVENTLOOP_ALWAYS;
+			return 0;
+		}
+		el->nalways--;
+		el->interest[fd] = 0;
+		return 0;
+	}
+	if (eventloop_ctl(el, fd, old, events) == -1) {
+#ifdef USE_EPOLL
+		/*
+		 * Regular files can't be polled with epoll, but select
+		 * and poll always report them as ready. Do the same.
+		 */
+		if (errno == EPERM && old == 0) {
+			el->interest[fd] = events | EVENTLOOP_ALWAYS;
+			el->nalways++;
+			return 0;
+		}
+#endif
+		return -1;
+	}
+	el->interest[fd] = events;
+	return 0;
+}
+
+u_int
+eventloop_get(struct eventloop *el, int fd)
+{
+	eventloop_own(el);
+	if (fd < 0 || fd >= el->ninterest)
+		return 0;
+	return el->interest[fd] & EVENTLOOP_EVENTS;
+}
+
+int
+eventloop_wait(struct eventloop *el, int timeout_ms)
+{
+	int n;
+
+	eventloop_own(el);
+	if (el->nalways > 0)
+		timeout_ms = 0;
+	el->nready = el->cur = el->always_next = 0;
+#ifdef USE_EPOLL
+	n = epoll_wait(el->epfd, el->ready, EVENTLOOP_MAXREADY, timeout_ms);
+#else
+	if (el->nholes > 0)
+		eventloop_compact(el);
+	n = poll(el->pfd, el->npfd, timeout_ms);
+#endif
+	if (n == -1)
+		return -1;
+	el->nready = n;
+	return n + el->nalways;
+}
+
+int
+eventloop_next(struct eventloop *el, int *fdp, u_int *eventsp)
+{
+	u_int want, got;
+	int fd;
+
+#ifdef USE_EPOLL
+	struct epoll_event *ev;
+
+	while (el->cur < el->nready) {
+		ev = &el->ready[el->cur++];
+		fd = ev->data.fd;
+		/* Skip descriptors removed since the wait */
+		if (fd >= el->ninterest ||
+		    (want = el->interest[fd] & EVENTLOOP_EVENTS) == 0)
+			continue;
+		got = 0;
+		if (ev->events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+			got |= EVENTLOOP_READ;
+		if (ev->events & (EPOLLOUT|EPOLLHUP|EPOLLERR))
+			got |= EVENTLOOP_WRITE;
+		if ((got &= want) == 0)
+			continue;
+		*fdp = fd;
+		*eventsp = got;
+		return 1;
+	}
+#else
+	struct pollfd *pfd;
+
+	while (el->nready > 0 && el->cur < el->npfd) {
+		pfd = &el->pfd[el->cur++];
+		if (pfd->fd == -1 || pfd->revents == 0)
+			continue;
+		el->nready--;
+		fd = pfd->fd;
+		want = el->interest[fd] & EVENTLOOP_EVENTS;
+		got = 0;
+		if (pfd->revents & (POLLIN|POLLHUP|POLLERR|POLLNVAL))
+			got |= EVENTLOOP_READ;
+		if (pfd->revents & (POLLOUT|POLLHUP|POLLERR|POLLNVAL))
+			got |= EVENTLOOP_WRITE;
+		pfd->revents = 0;
+		if ((got &= want) == 0)
+			continue;
+		*fdp = fd;
+		*eventsp = got;
+		return 1;
+	}
+#endif
+	while (el->nalways > 0 && el->always_next < el->ninterest) {
+		fd = el->always_next++;
+		if ((el->interest[fd] & EVENTLOOP_ALWAYS) == 0)
+			continue;
+		*fdp = fd;
+		*eventsp = el->interest[fd] & EVENTLOOP_EVENTS;
+		return 1;
+	}
+	return 0;
+}
+
+static int
+eventloop_grow_shadow(struct eventloop *el, int nwords)
+{
+	fd_mask *r, *w;
+	int n;
+
+	if (nwords <= el->nshadow)
+		return 0;
+	n = MAX(nwords, el->nshadow * 2);
+	if ((r = reallocarray(el->rshadow, n, sizeof(*r))) == NULL)
+		return -1;
+	el->rshadow = r;
+	if ((w = reallocarray(el->wshadow, n, sizeof(*w))) == NULL)
+		return -1;
+	el->wshadow = w;
+	memset(r + el->nshadow, 0, (n - el->nshadow) * sizeof(*r));
+	memset(w + el->nshadow, 0, (n - el->nshadow) * sizeof(*w));
+	el->nshadow = n;
+	return 0;
+}
+
+int
+eventloop_sync_fdsets(struct eventloop *el, int nfds,
+    fd_set *readset, fd_set *writeset)
+{
+	fd_mask *r = (fd_mask *)readset, *w = (fd_mask *)writeset;
+	u_long rw, ww, last, diff;
+	int i, b, nwords, nwalk;
+	u_int events;
+
+	eventloop_own(el);
+	nwords = howmany(MAX(nfds, 0), NFDBITS);
+	if (eventloop_grow_shadow(el, nwords) == -1)
+		return -1;
+	/* Bits beyond nfds in the last word are not part of the sets */
+	last = (nfds % NFDBITS) ? ((u_long)1 << (nfds % NFDBITS)) - 1 : ~0UL;
+	nwalk = MAX(nwords, el->nsynced);
+
+	for (i = 0; i < nwalk; i++) {
+		rw = (r != NULL && i < nwords) ? (u_long)r[i] : 0;
+		ww = (w != NULL && i < nwords) ? (u_long)w[i] : 0;
+		if (i == nwords - 1) {
+			rw &= last;
+			ww &= last;
+		}
+		if (rw == (u_long)el->rshadow[i] &&
+		    ww == (u_long)el->wshadow[i])
+			continue;
+		diff = (rw ^ (u_long)el->rshadow[i]) |
+		    (ww ^ (u_long)el->wshadow[i]);
+		for (b = 0; diff != 0; b++, diff >>= 1) {
+			if ((diff & 1) == 0)
+				continue;
+			events = (((rw >> b) & 1) ? EVENTLOOP_READ : 0) |
+			    (((ww >> b) & 1) ? EVENTLOOP_WRITE : 0);
+			if (eventloop_set(el, i * NFDBITS + b, events) == -1)
+				return -1;
+		}
+		el->rshadow[i] = (fd_mask)rw;
+		el->wshadow[i] = (fd_mask)ww;
+	}
+	el->nsynced = nwords;
+	return 0;
+}
+
+void
+eventloop_forget(struct eventloop *el, int fd)
+{
+	fd_mask bit;
+
+	if (fd < 0)
+		return;
+	eventloop_set(el, fd, 0);
+	if (fd / NFDBITS < el->nshadow) {
+		bit = (fd_mask)1 << (fd % NFDBITS);
+		el->rshadow[fd / NFDBITS] &= ~bit;
+		el->wshadow[fd / NFDBITS] &= ~bit;
+	}
+}
+
+int
+eventloop_select(struct eventloop *el, int nfds,
+    fd_set *readset, fd_set *writeset, int timeout_ms)
+{
+	fd_mask *r = (fd_mask *)readset, *w = (fd_mask *)writeset;
+	size_t len = howmany(MAX(nfds, 0), NFDBITS) * sizeof(fd_mask);
+	u_int events;
+	int fd, n;
+
+	if (eventloop_sync_fdsets(el, nfds, readset, writeset) == -1)
+		return -1;
+	if ((n = eventloop_wait(el, timeout_ms)) == -1)
+		return -1;
+	if (r != NULL)
+		memset(r, 0, len);
+	if (w != NULL)
+		memset(w, 0, len);
+	if (n == 0)
+		return 0;
+	for (n = 0; eventloop_next(el, &fd, &events); ) {
+		/* Registered directly rather than through the sets */
+		if (fd >= nfds)
+			continue;
+		if (r != NULL && (events & EVENTLOOP_READ)) {
+			r[fd / NFDBITS] |= (fd_mask)1 << (fd % NFDBITS);
+			n++;
+		}
+		if (w != NULL && (events & EVENTLOOP_WRITE)) {
+			w[fd / NFDBITS] |= (fd_mask)1 << (fd % NFDBITS);
+			n++;
+		}
+	}
+	return n;
+}
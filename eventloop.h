@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2026 Etersoft
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _EVENTLOOP_H
+#define _EVENTLOOP_H
+
+#include <sys/types.h>
+
+/*
+ * Descriptor readiness with a persistent interest set. Descriptors stay
+ * registered between waits, so the cost of a wakeup depends on the number
+ * of ready and changed descriptors rather than on the highest descriptor.
+ * Uses epoll(7) where available and poll(2) otherwise.
+ *
+ * A loop belongs to the process that created it. A forked child that
+ * uses an inherited loop finds it empty and registers its descriptors
+ * anew, without touching the interest set of the parent.
+ */
+
+#define EVENTLOOP_READ		0x01
+#define EVENTLOOP_WRITE		0x02
+
+struct eventloop;
+
+/* Allocate a new event loop. Returns NULL on failure. */
+struct eventloop *eventloop_new(void);
+
+/* Free an event loop. Registered descriptors are not closed. */
+void eventloop_free(struct eventloop *el);
+
+/* Name of the backend in use, for debug output. */
+const char *eventloop_backend(struct eventloop *el);
+
+/*
+ * Set the events of interest for a descriptor, replacing the previous
+ * ones. Zero removes the descriptor. Descriptors should be removed before
+ * they are closed, except the ones a forked child inherited, which its
+ * loops never listed. Returns 0 on success or -1 on error.
+ */
+int eventloop_set(struct eventloop *el, int fd, u_int events);
+
+/* Return the events currently registered for a descriptor. */
+u_int eventloop_get(struct eventloop *el, int fd);
+
+/*
+ * Wait up to timeout_ms milliseconds, forever if negative, for one of the
+ * registered descriptors to become ready. Returns the number of ready
+ * descriptors, 0 on timeout or -1 with errno set.
+ */
+int eventloop_wait(struct eventloop *el, int timeout_ms);
+
+/*
+ * Iterate over the descriptors made ready by the last wait. Returns 1
+ * and fills fdp and eventsp until all have been returned, then 0.
+ * Errors and hangups are reported as the registered events.
+ */
+int eventloop_next(struct eventloop *el, int *fdp, u_int *eventsp);
+
+/*
+ * Bridge for callers that still build select(2) style sets. The first
+ * nfds descriptors of the sets replace the interest set, only the ones
+ * that changed since the previous call reach the kernel. The sets may
+ * be larger than FD_SETSIZE.
+ */
+int eventloop_sync_fdsets(struct eventloop *el, int nfds,
+    fd_set *readset, fd_set *writeset);
+
+/*
+ * Remove a descriptor that is about to be closed or replaced, including
+ * from the sets seen by the last sync, so that a descriptor reusing the
+ * number is registered again even if its bits never went unset.
+ */
+void eventloop_forget(struct eventloop *el, int fd);
+
+/*
+ * Like select(2), with the sets interpreted through
+ * eventloop_sync_fdsets(). On return the sets hold the ready descriptors.
+ */
+int eventloop_select(struct eventloop *el, int nfds,
+    fd_set *readset, fd_set *writeset, int timeout_ms);
+
+#endif /* _EVENTLOOP_H */
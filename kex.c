@@ -40,6 +40,7 @@
 #include "ssh2.h"
 #include "packet.h"
 #include "compat.h"
+#include "compress.h"
 #include "cipher.h"
 #include "sshkey.h"
 #include "kex.h"
@@ -692,19 +693,15 @@ static int
 choose_comp(struct sshcomp *comp, char *client, char *server)
 {
 	char *name = match_list(client, server, NULL);
+	const struct sshcompress *method;
 
 	if (name == NULL)
 		return SSH_ERR_NO_COMPRESS_ALG_MATCH;
-	if (strcmp(name, "zlib@openssh.com") == 0) {
-		comp->type = COMP_DELAYED;
-	} else if (strcmp(name, "zlib") == 0) {
-		comp->type = COMP_ZLIB;
-	} else if (strcmp(name, "none") == 0) {
-		comp->type = COMP_NONE;
-	} else {
+	if ((method = compress_by_name(name)) == NULL) {
 		free(name);
 		return SSH_ERR_INTERNAL_ERROR;
 	}
+	comp->type = compress_type(method);
 	comp->name = name;
 	return 0;
 }
@@ -349,6 +349,12 @@ log_change_level(LogLevel new_log_level)
 	log_init(argv0, new_log_level, log_facility, log_on_stderr);
 }
 
+LogLevel
+log_level_get(void)
+{
+	return log_level;
+}
+
 int
 log_is_on_stderr(void)
 {
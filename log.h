@@ -50,6 +50,7 @@ typedef void (log_handler_fn)(LogLevel, const char *, void *);
 
 void     log_init(char *, LogLevel, SyslogFacility, int);
 void     log_change_level(LogLevel);
+LogLevel log_level_get(void);
 int      log_is_on_stderr(void);
 void     log_redirect_stderr_to(const char *);
 
@@ -80,6 +80,7 @@
 #include "readconf.h"
 #include "clientloop.h"
 #include "ssherr.h"
+#include "resolver.h"
 
 /* from ssh.c */
 extern int tty_flag;
@@ -145,6 +146,7 @@ struct mux_master_state {
 #define MUX_C_CLOSE_FWD		0x10000007
 #define MUX_C_NEW_STDIO_FWD	0x10000008
 #define MUX_C_STOP_LISTENING	0x10000009
+#define MUX_C_STATS		0x1000000a
 #define MUX_C_PROXY		0x1000000f
 #define MUX_S_OK		0x80000001
 #define MUX_S_PERMISSION_DENIED	0x80000002
@@ -154,6 +156,7 @@ struct mux_master_state {
 #define MUX_S_SESSION_OPENED	0x80000006
 #define MUX_S_REMOTE_PORT	0x80000007
 #define MUX_S_TTY_ALLOC_FAIL	0x80000008
+#define MUX_S_STATS		0x8000000a
 #define MUX_S_PROXY		0x8000000f
 
 /* type codes for MUX_C_OPEN_FWD and MUX_C_CLOSE_FWD */
@@ -172,6 +175,7 @@ static int process_mux_open_fwd(u_int, Channel *, Buffer *, Buffer *);
 static int process_mux_close_fwd(u_int, Channel *, Buffer *, Buffer *);
 static int process_mux_stdio_fwd(u_int, Channel *, Buffer *, Buffer *);
 static int process_mux_stop_listening(u_int, Channel *, Buffer *, Buffer *);
+static int process_mux_stats(u_int, Channel *, Buffer *, Buffer *);
 static int process_mux_proxy(u_int, Channel *, Buffer *, Buffer *);
 
 static const struct {
@@ -186,6 +190,7 @@ static const struct {
 	{ MUX_C_CLOSE_FWD, process_mux_close_fwd },
 	{ MUX_C_NEW_STDIO_FWD, process_mux_stdio_fwd },
 	{ MUX_C_STOP_LISTENING, process_mux_stop_listening },
+	{ MUX_C_STATS, process_mux_stats },
 	{ MUX_C_PROXY, process_mux_proxy },
 	{ 0, NULL }
 };
@@ -205,7 +210,7 @@ mux_master_session_cleanup_cb(int cid, void *unused)
 			fatal("%s: channel %d missing control channel %d",
 			    __func__, c->self, c->ctl_chan);
 		c->ctl_chan = -1;
-		cc->remote_id = -1;
+		channel_set_remote_id(cc, -1);
 		chan_rcvd_oclose(cc);
 	}
 	channel_cancel_cleanup(c->self);
@@ -225,7 +230,7 @@ mux_master_control_cleanup_cb(int cid, void *unused)
 		if ((sc = channel_by_id(c->remote_id)) == NULL)
 			fatal("%s: channel %d missing session channel %d",
 			    __func__, c->self, c->remote_id);
-		c->remote_id = -1;
+		channel_set_remote_id(c, -1);
 		sc->ctl_chan = -1;
 		if (sc->type != SSH_CHANNEL_OPEN &&
 		    sc->type != SSH_CHANNEL_OPENING) {
@@ -458,7 +463,7 @@ process_mux_new_session(u_int rid, Channel *c, Buffer *m, Buffer *r)
 	    CHAN_EXTENDED_WRITE, "client-session", /*nonblock*/0);
 
 	nc->ctl_chan = c->self;		/* link session -> control channel */
-	c->remote_id = nc->self; 	/* link control -> session channel */
+	channel_set_remote_id(c, nc->self); 	/* link control -> session channel */
 
 	if (cctx->want_tty && escape_char != 0xffffffff) {
 		channel_register_filter(nc->self,
@@ -516,6 +521,28 @@ process_mux_terminate(u_int rid, Channel *c, Buffer *m, Buffer *r)
 	return 0;
 }
 
+static int
+process_mux_stats(u_int rid, Channel *c, Buffer *m, Buffer *r)
+{
+	struct sshbuf *b;
+	int ret;
+
+	debug2("%s: channel %d: stats request", __func__, c->self);
+
+	if ((b = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((ret = ssh_packet_get_stats(active_state, b)) != 0 ||
+	    (ret = channel_get_stats(b)) != 0 ||
+	    (ret = resolver_get_stats(b)) != 0)
+		fatal("%s: %s", __func__, ssh_err(ret));
+
+	buffer_put_int(r, MUX_S_STATS);
+	buffer_put_int(r, rid);
+	buffer_put_string(r, sshbuf_ptr(b), sshbuf_len(b));
+	sshbuf_free(b);
+	return 0;
+}
+
 static char *
 format_forward(u_int ftype, struct Forward *fwd)
 {
@@ -1021,7 +1048,7 @@ process_mux_stdio_fwd(u_int rid, Channel *c, Buffer *m, Buffer *r)
 	nc = channel_connect_stdio_fwd(chost, cport, new_fd[0], new_fd[1]);
 
 	nc->ctl_chan = c->self;		/* link session -> control channel */
-	c->remote_id = nc->self; 	/* link control -> session channel */
+	channel_set_remote_id(c, nc->self); 	/* link control -> session channel */
 
 	debug2("%s: channel_new: %d linked to control channel %d",
 	    __func__, nc->self, nc->ctl_chan);
@@ -1702,6 +1729,53 @@ mux_client_request_terminate(int fd)
 	muxclient_request_id++;
 }
 
+static void
+mux_client_request_stats(int fd)
+{
+	Buffer m;
+	char *e, *stats;
+	u_int type, rid;
+
+	debug3("%s: entering", __func__);
+
+	buffer_init(&m);
+	buffer_put_int(&m, MUX_C_STATS);
+	buffer_put_int(&m, muxclient_request_id);
+
+	if (mux_client_write_packet(fd, &m) != 0)
+		fatal("%s: write packet: %s", __func__, strerror(errno));
+
+	buffer_clear(&m);
+
+	/* Read their reply */
+	if (mux_client_read_packet(fd, &m) != 0)
+		fatal("%s: read from master failed: %s",
+		    __func__, strerror(errno));
+
+	type = buffer_get_int(&m);
+	if ((rid = buffer_get_int(&m)) != muxclient_request_id)
+		fatal("%s: out of sequence reply: my id %u theirs %u",
+		    __func__, muxclient_request_id, rid);
+	switch (type) {
+	case MUX_S_STATS:
+		break;
+	case MUX_S_PERMISSION_DENIED:
+		e = buffer_get_string(&m, NULL);
+		fatal("Master refused stats request: %s", e);
+	case MUX_S_FAILURE:
+		e = buffer_get_string(&m, NULL);
+		fatal("%s: stats request failed: %s", __func__, e);
+	default:
+		fatal("%s: unexpected response from master 0x%08x",
+		    __func__, type);
+	}
+	stats = buffer_get_string(&m, NULL);
+	fputs(stats, stdout);
+	free(stats);
+	buffer_free(&m);
+	muxclient_request_id++;
+}
+
 static int
 mux_client_forward(int fd, int cancel_flag, u_int ftype, struct Forward *fwd)
 {
@@ -2258,6 +2332,9 @@ muxclient(const char *path)
 			error("%s: master cancel forward request failed",
 			    __func__);
 		exit(0);
+	case SSHMUX_COMMAND_STATS:
+		mux_client_request_stats(sock);
+		exit(0);
 	case SSHMUX_COMMAND_PROXY:
 		mux_client_proxy(sock);
 		return (sock);
@@ -167,7 +167,13 @@
 
 #endif /* WITH_OPENSSL */
 
-#define	KEX_DEFAULT_COMP	"none,zlib@openssh.com"
+#ifdef HAVE_ZSTD
+# define KEX_ZSTD_COMP	"zstd@etersoft.ru,"
+#else
+# define KEX_ZSTD_COMP
+#endif
+
+#define	KEX_DEFAULT_COMP	"none," KEX_ZSTD_COMP "zlib@openssh.com"
 #define	KEX_DEFAULT_LANG	""
 
 #define KEX_CLIENT \
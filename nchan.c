@@ -95,6 +95,8 @@ chan_set_istate(Channel *c, u_int next)
 	debug2("channel %d: input %s -> %s", c->self, istates[c->istate],
 	    istates[next]);
 	c->istate = next;
+	/* a drained input still has to send its EOF */
+	channel_output_wakeup(c);
 }
 static void
 chan_set_ostate(Channel *c, u_int next)
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2026 Etersoft
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _NXCOMPSTUB_NX_H
+#define _NXCOMPSTUB_NX_H
+
+/*
+ * Stand-in for the subset of the nxcomp (libXcomp) interface used by
+ * nxssh, selected with --with-nxcomp-stub. The transport created by
+ * NXTransCreate() is a loopback: whatever it reads from its descriptor
+ * is written back to it. This is enough to build, test and benchmark
+ * the NX code paths without the NX libraries installed.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+
+#define NX_FD_ANY		-1
+
+#define NX_MODE_ANY		-1
+#define NX_MODE_CLIENT		1
+#define NX_MODE_SERVER		2
+
+#define NX_FILE_SESSION		1
+#define NX_FILE_ERRORS		2
+#define NX_FILE_OPTIONS		3
+#define NX_FILE_STATS		4
+
+int NXTransCreate(int fd, int mode, const char *options);
+int NXTransAgent(int fd[2]);
+int NXTransRunning(int fd);
+int NXTransDestroy(int fd);
+
+int NXTransContinue(struct timeval *selectTs);
+
+int NXTransPrepare(int *maxFds, fd_set *readSet, fd_set *writeSet,
+    struct timeval *selectTs);
+int NXTransSelect(int *resultFds, int *errorFds, int *maxFds,
+    fd_set *readSet, fd_set *writeSet, struct timeval *selectTs);
+int NXTransExecute(int *resultFds, int *errorFds, int *maxFds,
+    fd_set *readSet, fd_set *writeSet, struct timeval *selectTs);
+
+const char *NXTransFile(int type);
+
+#endif /* _NXCOMPSTUB_NX_H */
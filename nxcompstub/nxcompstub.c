@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2026 Etersoft
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Loopback stand-in for the NX transport library. It implements the
+ * prepare/select/execute cycle of nxcomp on a single descriptor and
+ * echoes back everything it reads. It has no dependencies on the rest
+ * of the tree, so it can be linked in place of -lXcomp.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "NX.h"
+
+#define NXSTUB_BUFFER_SIZE	65536
+
+static int nxstub_fd = -1;
+
+static char nxstub_buffer[NXSTUB_BUFFER_SIZE];
+static size_t nxstub_start;
+static size_t nxstub_length;
+
+/* Descriptor events added to the caller sets by NXTransPrepare() */
+static int nxstub_want_read;
+static int nxstub_want_write;
+
+static void
+nxstub_shutdown(void)
+{
+	if (nxstub_fd != -1)
+		close(nxstub_fd);
+	nxstub_fd = -1;
+	nxstub_start = nxstub_length = 0;
+	nxstub_want_read = nxstub_want_write = 0;
+}
+
+int
+NXTransCreate(int fd, int mode, const char *options)
+{
+	int flags;
+
+	if (fd < 0 || fd >= FD_SETSIZE) {
+		errno = EBADF;
+		return -1;
+	}
+	if (nxstub_fd != -1) {
+		errno = EBUSY;
+		return -1;
+	}
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -1;
+	nxstub_fd = fd;
+	nxstub_start = nxstub_length = 0;
+	return 1;
+}
+
+int
+NXTransAgent(int fd[2])
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+NXTransRunning(int fd)
+{
+	return nxstub_fd != -1 && (fd == NX_FD_ANY || fd == nxstub_fd);
+}
+
+int
+NXTransDestroy(int fd)
+{
+	if (!NXTransRunning(fd))
+		return 0;
+	nxstub_shutdown();
+	return 1;
+}
+
+int
+NXTransPrepare(int *maxFds, fd_set *readSet, fd_set *writeSet,
+    struct timeval *selectTs)
+{
+	nxstub_want_read = nxstub_want_write = 0;
+	if (nxstub_fd == -1)
+		return 0;
+	if (nxstub_length < sizeof(nxstub_buffer) &&
+	    !FD_ISSET(nxstub_fd, readSet)) {
+		FD_SET(nxstub_fd, readSet);
+		nxstub_want_read = 1;
+	}
+	if (nxstub_length > nxstub_start &&
+	    !FD_ISSET(nxstub_fd, writeSet)) {
+		FD_SET(nxstub_fd, writeSet);
+		nxstub_want_write = 1;
+	}
+	if (*maxFds < nxstub_fd + 1)
+		*maxFds = nxstub_fd + 1;
+	return 1;
+}
+
+int
+NXTransSelect(int *resultFds, int *errorFds, int *maxFds,
+    fd_set *readSet, fd_set *writeSet, struct timeval *selectTs)
+{
+	*resultFds = select(*maxFds, readSet, writeSet, NULL, selectTs);
+	*errorFds = *resultFds < 0 ? errno : 0;
+	return 1;
+}
+
+int
+NXTransExecute(int *resultFds, int *errorFds, int *maxFds,
+    fd_set *readSet, fd_set *writeSet, struct timeval *selectTs)
+{
+	ssize_t r;
+	int fd = nxstub_fd;
+
+	if (fd == -1 || *resultFds <= 0)
+		return nxstub_fd != -1;
+
+	if (nxstub_want_write && FD_ISSET(fd, writeSet)) {
+		FD_CLR(fd, writeSet);
+		(*resultFds)--;
+		r = write(fd, nxstub_buffer + nxstub_start,
+		    nxstub_length - nxstub_start);
+		if (r > 0) {
+			nxstub_start += r;
+			if (nxstub_start == nxstub_length)
+				nxstub_start = nxstub_length = 0;
+		} else if (r < 0 && errno != EAGAIN && errno != EINTR) {
+			nxstub_shutdown();
+		}
+	}
+	if (nxstub_want_read && FD_ISSET(fd, readSet)) {
+		FD_CLR(fd, readSet);
+		(*resultFds)--;
+		if (nxstub_fd == -1)
+			return 0;
+		if (nxstub_start > 0) {
+			memmove(nxstub_buffer, nxstub_buffer + nxstub_start,
+			    nxstub_length - nxstub_start);
+			nxstub_length -= nxstub_start;
+			nxstub_start = 0;
+		}
+		r = read(fd, nxstub_buffer + nxstub_length,
+		    sizeof(nxstub_buffer) - nxstub_length);
+		if (r > 0)
+			nxstub_length += r;
+		else if (r == 0 || (errno != EAGAIN && errno != EINTR))
+			nxstub_shutdown();
+	}
+	nxstub_want_read = nxstub_want_write = 0;
+	return nxstub_fd != -1;
+}
+
+int
+NXTransContinue(struct timeval *selectTs)
+{
+	fd_set readSet, writeSet;
+	int maxFds = 0, resultFds, errorFds;
+
+	FD_ZERO(&readSet);
+	FD_ZERO(&writeSet);
+	if (NXTransPrepare(&maxFds, &readSet, &writeSet, selectTs) == 0)
+		return 0;
+	NXTransSelect(&resultFds, &errorFds, &maxFds, &readSet, &writeSet,
+	    selectTs);
+	NXTransExecute(&resultFds, &errorFds, &maxFds, &readSet, &writeSet,
+	    selectTs);
+	return NXTransRunning(NX_FD_ANY);
+}
+
+const char *
+NXTransFile(int type)
+{
+	return NULL;
+}
@@ -50,6 +50,8 @@ void	 packet_read_expect(int expected_type);
 	ssh_packet_set_timeout(active_state, (timeout), (count))
 #define packet_connection_is_on_socket() \
 	ssh_packet_connection_is_on_socket(active_state)
+#define packet_get_rtt() \
+	ssh_packet_get_rtt(active_state)
 #define packet_set_nonblocking() \
 	ssh_packet_set_nonblocking(active_state)
 #define packet_get_connection_in() \
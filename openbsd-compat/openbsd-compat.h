@@ -168,6 +168,12 @@ int BSDgetopt(int argc, char * const *argv, const char *opts);
 int writev(int, struct iovec *, int);
 #endif
 
+#if defined(HAVE_ACCEPT4) && defined(HAVE_DECL_ACCEPT4) && HAVE_DECL_ACCEPT4 == 0
+# include <sys/types.h>
+# include <sys/socket.h>
+int accept4(int, struct sockaddr *, socklen_t *, int);
+#endif
+
 /* Home grown routines */
 #include "bsd-misc.h"
 #include "bsd-setres_id.h"
@@ -59,12 +59,14 @@
 #include <sys/types.h>
 #include "openbsd-compat/sys-queue.h"
 #include <sys/socket.h>
+#include <sys/uio.h>
 #ifdef HAVE_SYS_TIME_H
 # include <sys/time.h>
 #endif
 
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <errno.h>
@@ -78,8 +80,6 @@
 #include <signal.h>
 #include <time.h>
 
-#include <zlib.h>
-
 #include "buffer.h"	/* typedefs XXX */
 #include "key.h"	/* typedefs XXX */
 
@@ -90,6 +90,7 @@
 #include "ssh1.h"
 #include "ssh2.h"
 #include "cipher.h"
+#include "compress.h"
 #include "sshkey.h"
 #include "kex.h"
 #include "digest.h"
@@ -134,12 +135,37 @@ struct packet_state {
 	u_int64_t bytes;
 };
 
+/* Transport counters for one direction, see ssh_packet_get_stats() */
+struct packet_counters {
+	u_int64_t packets;
+	u_int64_t bytes;		/* on the wire, without the MAC */
+	u_int64_t types[256];		/* packets by message type */
+	double cipher_time;		/* seconds in cipher_crypt() */
+	double mac_time;		/* seconds in mac_compute/mac_check() */
+	double compress_time;		/* seconds compressing */
+};
+
 struct packet {
 	TAILQ_ENTRY(packet) next;
 	u_char type;
 	struct sshbuf *payload;
 };
 
+/*
+ * Output is appended to state->output until it holds PACKET_OUTPUT_SEGMENT
+ * bytes, then the buffer is queued as a segment and a new one is taken
+ * from the pool. Queued segments are written with writev() and go back
+ * to the pool, with their memory, once written.
+ */
+#define PACKET_OUTPUT_SEGMENT	(64 * 1024)
+#define PACKET_OUTPUT_POOL	8
+#define PACKET_OUTPUT_IOV	16
+
+struct output_segment {
+	TAILQ_ENTRY(output_segment) next;
+	struct sshbuf *buf;
+};
+
 struct session_state {
 	/*
 	 * This variable contains the file descriptors used for
@@ -165,22 +191,31 @@ struct session_state {
 	/* Buffer for raw output data going to the socket. */
 	struct sshbuf *output;
 
+	/* Output segments waiting ahead of 'output', and spare ones */
+	TAILQ_HEAD(, output_segment) output_queue;
+	TAILQ_HEAD(, output_segment) output_pool;
+	size_t output_queued;
+	u_int output_pooled;
+
 	/* Buffer for the partial outgoing packet being constructed. */
 	struct sshbuf *outgoing_packet;
 
 	/* Buffer for the incoming packet currently being processed. */
 	struct sshbuf *incoming_packet;
 
+	/*
+	 * Packets decrypted in place are read through a view of the input
+	 * buffer, the owned buffer is kept here meanwhile.
+	 */
+	struct sshbuf *incoming_buffer;
+	int incoming_inplace;
+
 	/* Scratch buffer for packet compression/decompression. */
 	struct sshbuf *compression_buffer;
 
-	/* Incoming/outgoing compression dictionaries */
-	z_stream compression_in_stream;
-	z_stream compression_out_stream;
-	int compression_in_started;
-	int compression_out_started;
-	int compression_in_failures;
-	int compression_out_failures;
+	/* Incoming/outgoing compression streams */
+	struct sshcompress_ctx *compression_in_ctx;
+	struct sshcompress_ctx *compression_out_ctx;
 
 	/*
 	 * Flag indicating whether packet compression/decompression is
@@ -215,10 +250,22 @@ struct session_state {
 	/* Volume-based rekeying */
 	u_int64_t max_blocks_in, max_blocks_out, rekey_limit;
 
+	/* Transport counters since the connection was set up */
+	struct packet_counters counters[MODE_MAX];
+	size_t output_queued_max;
+	u_int kex_count;		/* completed key exchanges */
+	double kex_start;		/* KEXINIT sent, 0 if no kex runs */
+	double kex_time_last, kex_time_total;
+
 	/* Time-based rekeying */
 	u_int32_t rekey_interval;	/* how often in seconds */
 	time_t rekey_time;	/* time of last rekeying */
 
+	/* Early rekeying while the connection is idle */
+	u_int idle_rekey_percent;	/* of a limit used, 0 = never */
+	u_int idle_rekey_time;		/* seconds without channel traffic */
+	double last_activity;		/* last channel message */
+
 	/* Session key for protocol v1 */
 	u_char ssh1_key[SSH_SESSION_KEY_LENGTH];
 	u_int ssh1_keylen;
@@ -272,7 +319,10 @@ ssh_alloc_session_state(void)
 	    (state->outgoing_packet = sshbuf_new()) == NULL ||
 	    (state->incoming_packet = sshbuf_new()) == NULL)
 		goto fail;
+	state->incoming_buffer = state->incoming_packet;
 	TAILQ_INIT(&state->outgoing);
+	TAILQ_INIT(&state->output_queue);
+	TAILQ_INIT(&state->output_pool);
 	TAILQ_INIT(&ssh->private_keys);
 	TAILQ_INIT(&ssh->public_keys);
 	state->connection_in = -1;
@@ -300,6 +350,169 @@ ssh_alloc_session_state(void)
 	return NULL;
 }
 
+/*
+ * Go back to the owned incoming packet buffer. A packet decrypted in
+ * place is only valid until the input buffer changes.
+ */
+static void
+ssh_packet_drop_inplace(struct session_state *state)
+{
+	if (!state->incoming_inplace)
+		return;
+	sshbuf_free(state->incoming_packet);
+	state->incoming_packet = state->incoming_buffer;
+	state->incoming_inplace = 0;
+}
+
+/* Counts a packet of "len" bytes going in direction "mode" */
+static void
+ssh_packet_count(struct session_state *state, int mode, u_char type,
+    u_int len)
+{
+	struct packet_counters *pc = &state->counters[mode];
+
+	pc->packets++;
+	pc->bytes += len;
+	pc->types[type]++;
+	if (type >= SSH2_MSG_CHANNEL_OPEN && state->idle_rekey_percent != 0)
+		state->last_activity = monotime_double();
+}
+
+/* cipher_crypt() with the context of direction "mode", timed */
+static int
+ssh_packet_crypt(struct session_state *state, int mode, u_int seqnr,
+    u_char *dest, const u_char *src, u_int len, u_int aadlen, u_int authlen)
+{
+	double start = monotime_double();
+	int r;
+
+	r = cipher_crypt(mode == MODE_OUT ? state->send_context :
+	    state->receive_context, seqnr, dest, src, len, aadlen, authlen);
+	state->counters[mode].cipher_time += monotime_double() - start;
+	return r;
+}
+
+static int
+ssh_packet_mac_compute(struct session_state *state, struct sshmac *mac,
+    u_int32_t seqnr, const u_char *data, int datalen,
+    u_char *digest, size_t dlen)
+{
+	double start = monotime_double();
+	int r;
+
+	r = mac_compute(mac, seqnr, data, datalen, digest, dlen);
+	state->counters[MODE_OUT].mac_time += monotime_double() - start;
+	return r;
+}
+
+static int
+ssh_packet_mac_check(struct session_state *state, struct sshmac *mac,
+    u_int32_t seqnr, const u_char *data, size_t dlen,
+    const u_char *theirmac, size_t mlen)
+{
+	double start = monotime_double();
+	int r;
+
+	r = mac_check(mac, seqnr, data, dlen, theirmac, mlen);
+	state->counters[MODE_IN].mac_time += monotime_double() - start;
+	return r;
+}
+
+/* Queue the output buffer once it is full and start a new one */
+static int
+ssh_packet_output_seal(struct session_state *state)
+{
+	struct output_segment *seg;
+	struct sshbuf *b;
+	size_t queued = state->output_queued + sshbuf_len(state->output);
+
+	if (queued > state->output_queued_max)
+		state->output_queued_max = queued;
+	if (sshbuf_len(state->output) < PACKET_OUTPUT_SEGMENT)
+		return 0;
+	if ((seg = TAILQ_FIRST(&state->output_pool)) != NULL) {
+		TAILQ_REMOVE(&state->output_pool, seg, next);
+		state->output_pooled--;
+	} else {
+		if ((seg = calloc(1, sizeof(*seg))) == NULL)
+			return SSH_ERR_ALLOC_FAIL;
+		if ((seg->buf = sshbuf_new()) == NULL) {
+			free(seg);
+			return SSH_ERR_ALLOC_FAIL;
+		}
+	}
+	b = seg->buf;
+	seg->buf = state->output;
+	state->output = b;
+	state->output_queued += sshbuf_len(seg->buf);
+	TAILQ_INSERT_TAIL(&state->output_queue, seg, next);
+	return 0;
+}
+
+/* Return a written segment to the pool */
+static void
+ssh_packet_output_recycle(struct session_state *state,
+    struct output_segment *seg)
+{
+	TAILQ_REMOVE(&state->output_queue, seg, next);
+	if (state->output_pooled >= PACKET_OUTPUT_POOL) {
+		sshbuf_free(seg->buf);
+		free(seg);
+		return;
+	}
+	TAILQ_INSERT_HEAD(&state->output_pool, seg, next);
+	state->output_pooled++;
+}
+
+/* Move all the queued output into the output buffer */
+static int
+ssh_packet_output_flatten(struct session_state *state)
+{
+	struct output_segment *seg;
+	struct sshbuf *b;
+	int r;
+
+	if (TAILQ_EMPTY(&state->output_queue))
+		return 0;
+	if ((b = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	while ((seg = TAILQ_FIRST(&state->output_queue)) != NULL) {
+		if ((r = sshbuf_putb(b, seg->buf)) != 0 ||
+		    (r = sshbuf_consume(seg->buf, sshbuf_len(seg->buf))) != 0) {
+			sshbuf_free(b);
+			return r;
+		}
+		ssh_packet_output_recycle(state, seg);
+	}
+	if ((r = sshbuf_putb(b, state->output)) != 0) {
+		sshbuf_free(b);
+		return r;
+	}
+	sshbuf_free(state->output);
+	state->output = b;
+	state->output_queued = 0;
+	return 0;
+}
+
+static void
+ssh_packet_output_free(struct session_state *state)
+{
+	struct output_segment *seg;
+
+	while ((seg = TAILQ_FIRST(&state->output_queue)) != NULL) {
+		TAILQ_REMOVE(&state->output_queue, seg, next);
+		sshbuf_free(seg->buf);
+		free(seg);
+	}
+	while ((seg = TAILQ_FIRST(&state->output_pool)) != NULL) {
+		TAILQ_REMOVE(&state->output_pool, seg, next);
+		sshbuf_free(seg->buf);
+		free(seg);
+	}
+	state->output_queued = 0;
+	state->output_pooled = 0;
+}
+
 void
 ssh_packet_set_input_hook(struct ssh *ssh, ssh_packet_hook_fn *hook, void *ctx)
 {
@@ -607,6 +820,7 @@ void
 ssh_packet_close(struct ssh *ssh)
 {
 	struct session_state *state = ssh->state;
+	u_int64_t raw, comp;
 	u_int mode;
 
 	if (!state->initialized)
@@ -620,34 +834,34 @@ ssh_packet_close(struct ssh *ssh)
 		close(state->connection_out);
 	}
 	sshbuf_free(state->input);
+	ssh_packet_output_free(state);
 	sshbuf_free(state->output);
 	sshbuf_free(state->outgoing_packet);
+	ssh_packet_drop_inplace(state);
 	sshbuf_free(state->incoming_packet);
 	for (mode = 0; mode < MODE_MAX; mode++)
 		kex_free_newkeys(state->newkeys[mode]);
 	if (state->compression_buffer) {
 		sshbuf_free(state->compression_buffer);
-		if (state->compression_out_started) {
-			z_streamp stream = &state->compression_out_stream;
-			debug("compress outgoing: "
-			    "raw data %llu, compressed %llu, factor %.2f",
-				(unsigned long long)stream->total_in,
-				(unsigned long long)stream->total_out,
-				stream->total_in == 0 ? 0.0 :
-				(double) stream->total_out / stream->total_in);
-			if (state->compression_out_failures == 0)
-				deflateEnd(stream);
+		if (state->compression_out_ctx != NULL) {
+			compress_stats(state->compression_out_ctx, &raw, &comp);
+			debug("compress outgoing: %s "
+			    "raw data %llu, compressed %llu, factor %.2f, "
+			    "backed off %u times",
+			    compress_ctx_name(state->compression_out_ctx),
+			    (unsigned long long)raw, (unsigned long long)comp,
+			    raw == 0 ? 0.0 : (double)comp / raw,
+			    compress_backoffs(state->compression_out_ctx));
+			compress_free(state->compression_out_ctx);
 		}
-		if (state->compression_in_started) {
-			z_streamp stream = &state->compression_out_stream;
-			debug("compress incoming: "
+		if (state->compression_in_ctx != NULL) {
+			compress_stats(state->compression_in_ctx, &raw, &comp);
+			debug("compress incoming: %s "
 			    "raw data %llu, compressed %llu, factor %.2f",
-			    (unsigned long long)stream->total_out,
-			    (unsigned long long)stream->total_in,
-			    stream->total_out == 0 ? 0.0 :
-			    (double) stream->total_in / stream->total_out);
-			if (state->compression_in_failures == 0)
-				inflateEnd(stream);
+			    compress_ctx_name(state->compression_in_ctx),
+			    (unsigned long long)raw, (unsigned long long)comp,
+			    raw == 0 ? 0.0 : (double)comp / raw);
+			compress_free(state->compression_in_ctx);
 		}
 	}
 	cipher_free(state->send_context);
@@ -690,149 +904,123 @@ ssh_packet_init_compression(struct ssh *ssh)
 }
 
 static int
-start_compression_out(struct ssh *ssh, int level)
+start_compression_out(struct ssh *ssh, const struct sshcompress *method,
+    int level)
 {
-	if (level < 1 || level > 9)
-		return SSH_ERR_INVALID_ARGUMENT;
-	debug("Enabling compression at level %d.", level);
-	if (ssh->state->compression_out_started == 1)
-		deflateEnd(&ssh->state->compression_out_stream);
-	switch (deflateInit(&ssh->state->compression_out_stream, level)) {
-	case Z_OK:
-		ssh->state->compression_out_started = 1;
-		break;
-	case Z_MEM_ERROR:
-		return SSH_ERR_ALLOC_FAIL;
-	default:
-		return SSH_ERR_INTERNAL_ERROR;
-	}
-	return 0;
+	struct session_state *state = ssh->state;
+
+	if (level == 0)
+		level = compress_default_level(method);
+	debug("Enabling %s compression at level %d.",
+	    compress_name(method), level);
+	compress_free(state->compression_out_ctx);
+	return compress_init(&state->compression_out_ctx, method,
+	    COMPRESS_OUT, level);
 }
 
 static int
-start_compression_in(struct ssh *ssh)
+start_compression_in(struct ssh *ssh, const struct sshcompress *method)
 {
-	if (ssh->state->compression_in_started == 1)
-		inflateEnd(&ssh->state->compression_in_stream);
-	switch (inflateInit(&ssh->state->compression_in_stream)) {
-	case Z_OK:
-		ssh->state->compression_in_started = 1;
-		break;
-	case Z_MEM_ERROR:
-		return SSH_ERR_ALLOC_FAIL;
-	default:
+	struct session_state *state = ssh->state;
+
+	compress_free(state->compression_in_ctx);
+	return compress_init(&state->compression_in_ctx, method,
+	    COMPRESS_IN, 0);
+}
+
+/* Start the negotiated compression method for one direction */
+static int
+start_compression(struct ssh *ssh, struct sshcomp *comp, int mode)
+{
+	const struct sshcompress *method;
+	int r;
+
+	if ((method = compress_by_name(comp->name)) == NULL)
 		return SSH_ERR_INTERNAL_ERROR;
-	}
+	if ((r = ssh_packet_init_compression(ssh)) != 0)
+		return r;
+	if (mode == MODE_OUT)
+		r = start_compression_out(ssh, method, 0);
+	else
+		r = start_compression_in(ssh, method);
+	if (r != 0)
+		return r;
+	comp->enabled = 1;
 	return 0;
 }
 
 int
 ssh_packet_start_compression(struct ssh *ssh, int level)
 {
+	const struct sshcompress *method = compress_by_name("zlib");
 	int r;
 
 	if (ssh->state->packet_compression && !compat20)
 		return SSH_ERR_INTERNAL_ERROR;
+	if (level < 1 || level > 9)
+		return SSH_ERR_INVALID_ARGUMENT;
 	ssh->state->packet_compression = 1;
 	if ((r = ssh_packet_init_compression(ssh)) != 0 ||
-	    (r = start_compression_in(ssh)) != 0 ||
-	    (r = start_compression_out(ssh, level)) != 0)
+	    (r = start_compression_in(ssh, method)) != 0 ||
+	    (r = start_compression_out(ssh, method, level)) != 0)
 		return r;
 	return 0;
 }
 
-/* XXX remove need for separate compression buffer */
+/*
+ * Compress the payload of "*bufp" after its "hdrlen" bytes of header.
+ * The compressed payload goes straight into the scratch buffer behind a
+ * copy of the header, and the two buffers change places.
+ */
 static int
-compress_buffer(struct ssh *ssh, struct sshbuf *in, struct sshbuf *out)
+ssh_packet_compress(struct ssh *ssh, struct sshbuf **bufp, size_t hdrlen)
 {
-	u_char buf[4096];
-	int r, status;
+	struct session_state *state = ssh->state;
+	struct sshbuf *tmp;
+	double start = monotime_double();
+	int r;
 
-	if (ssh->state->compression_out_started != 1)
+	if (state->compression_out_ctx == NULL)
 		return SSH_ERR_INTERNAL_ERROR;
-
-	/* This case is not handled below. */
-	if (sshbuf_len(in) == 0)
-		return 0;
-
-	/* Input is the contents of the input buffer. */
-	if ((ssh->state->compression_out_stream.next_in =
-	    sshbuf_mutable_ptr(in)) == NULL)
+	if (sshbuf_len(*bufp) < hdrlen)
 		return SSH_ERR_INTERNAL_ERROR;
-	ssh->state->compression_out_stream.avail_in = sshbuf_len(in);
-
-	/* Loop compressing until deflate() returns with avail_out != 0. */
-	do {
-		/* Set up fixed-size output buffer. */
-		ssh->state->compression_out_stream.next_out = buf;
-		ssh->state->compression_out_stream.avail_out = sizeof(buf);
-
-		/* Compress as much data into the buffer as possible. */
-		status = deflate(&ssh->state->compression_out_stream,
-		    Z_PARTIAL_FLUSH);
-		switch (status) {
-		case Z_MEM_ERROR:
-			return SSH_ERR_ALLOC_FAIL;
-		case Z_OK:
-			/* Append compressed data to output_buffer. */
-			if ((r = sshbuf_put(out, buf, sizeof(buf) -
-			    ssh->state->compression_out_stream.avail_out)) != 0)
-				return r;
-			break;
-		case Z_STREAM_ERROR:
-		default:
-			ssh->state->compression_out_failures++;
-			return SSH_ERR_INVALID_FORMAT;
-		}
-	} while (ssh->state->compression_out_stream.avail_out == 0);
+	sshbuf_reset(state->compression_buffer);
+	if ((r = sshbuf_put(state->compression_buffer,
+	    sshbuf_ptr(*bufp), hdrlen)) != 0 ||
+	    (r = compress_buffer(state->compression_out_ctx,
+	    sshbuf_ptr(*bufp) + hdrlen, sshbuf_len(*bufp) - hdrlen,
+	    state->compression_buffer)) != 0)
+		return r;
+	state->counters[MODE_OUT].compress_time += monotime_double() - start;
+	tmp = *bufp;
+	*bufp = state->compression_buffer;
+	state->compression_buffer = tmp;
 	return 0;
 }
 
+/* Replace the incoming packet by its decompressed contents */
 static int
-uncompress_buffer(struct ssh *ssh, struct sshbuf *in, struct sshbuf *out)
+ssh_packet_uncompress(struct ssh *ssh)
 {
-	u_char buf[4096];
-	int r, status;
-
-	if (ssh->state->compression_in_started != 1)
-		return SSH_ERR_INTERNAL_ERROR;
+	struct session_state *state = ssh->state;
+	struct sshbuf *tmp;
+	double start = monotime_double();
+	int r;
 
-	if ((ssh->state->compression_in_stream.next_in =
-	    sshbuf_mutable_ptr(in)) == NULL)
+	if (state->compression_in_ctx == NULL || state->incoming_inplace)
 		return SSH_ERR_INTERNAL_ERROR;
-	ssh->state->compression_in_stream.avail_in = sshbuf_len(in);
-
-	for (;;) {
-		/* Set up fixed-size output buffer. */
-		ssh->state->compression_in_stream.next_out = buf;
-		ssh->state->compression_in_stream.avail_out = sizeof(buf);
-
-		status = inflate(&ssh->state->compression_in_stream,
-		    Z_PARTIAL_FLUSH);
-		switch (status) {
-		case Z_OK:
-			if ((r = sshbuf_put(out, buf, sizeof(buf) -
-			    ssh->state->compression_in_stream.avail_out)) != 0)
-				return r;
-			break;
-		case Z_BUF_ERROR:
-			/*
-			 * Comments in zlib.h say that we should keep calling
-			 * inflate() until we get an error.  This appears to
-			 * be the error that we get.
-			 */
-			return 0;
-		case Z_DATA_ERROR:
-			return SSH_ERR_INVALID_FORMAT;
-		case Z_MEM_ERROR:
-			return SSH_ERR_ALLOC_FAIL;
-		case Z_STREAM_ERROR:
-		default:
-			ssh->state->compression_in_failures++;
-			return SSH_ERR_INTERNAL_ERROR;
-		}
-	}
-	/* NOTREACHED */
+	sshbuf_reset(state->compression_buffer);
+	if ((r = uncompress_buffer(state->compression_in_ctx,
+	    sshbuf_ptr(state->incoming_packet),
+	    sshbuf_len(state->incoming_packet),
+	    state->compression_buffer)) != 0)
+		return r;
+	state->counters[MODE_IN].compress_time += monotime_double() - start;
+	tmp = state->incoming_packet;
+	state->incoming_packet = state->incoming_buffer =
+	    state->compression_buffer;
+	state->compression_buffer = tmp;
+	return 0;
 }
 
 /*
@@ -892,20 +1080,9 @@ ssh_packet_send1(struct ssh *ssh)
 	 * packet.
 	 */
 	if (state->packet_compression) {
-		sshbuf_reset(state->compression_buffer);
-		/* Skip padding. */
-		if ((r = sshbuf_consume(state->outgoing_packet, 8)) != 0)
-			goto out;
-		/* padding */
-		if ((r = sshbuf_put(state->compression_buffer,
-		    "\0\0\0\0\0\0\0\0", 8)) != 0)
-			goto out;
-		if ((r = compress_buffer(ssh, state->outgoing_packet,
-		    state->compression_buffer)) != 0)
-			goto out;
-		sshbuf_reset(state->outgoing_packet);
-                if ((r = sshbuf_putb(state->outgoing_packet,
-                    state->compression_buffer)) != 0)
+		/* The padding stays in front, initialized to zero */
+		if ((r = ssh_packet_compress(ssh,
+		    &state->outgoing_packet, 8)) != 0)
 			goto out;
 	}
 	/* Compute packet length without padding (add checksum, remove padding). */
@@ -943,7 +1120,7 @@ ssh_packet_send1(struct ssh *ssh)
 	if ((r = sshbuf_reserve(state->output,
 	    sshbuf_len(state->outgoing_packet), &cp)) != 0)
 		goto out;
-	if ((r = cipher_crypt(state->send_context, 0, cp,
+	if ((r = ssh_packet_crypt(state, MODE_OUT, 0, cp,
 	    sshbuf_ptr(state->outgoing_packet),
 	    sshbuf_len(state->outgoing_packet), 0, 0)) != 0)
 		goto out;
@@ -962,7 +1139,7 @@ ssh_packet_send1(struct ssh *ssh)
 	 * actually sent until ssh_packet_write_wait or ssh_packet_write_poll
 	 * is called.
 	 */
-	r = 0;
+	r = ssh_packet_output_seal(state);
  out:
 	return r;
 }
@@ -982,6 +1159,14 @@ ssh_set_newkeys(struct ssh *ssh, int mode)
 
 	debug2("set_newkeys: mode %d", mode);
 
+	/* NEWKEYS is received last, this ends the key exchange */
+	if (mode == MODE_IN && state->kex_start != 0) {
+		state->kex_time_last = monotime_double() - state->kex_start;
+		state->kex_time_total += state->kex_time_last;
+		state->kex_count++;
+		state->kex_start = 0;
+	}
+
 	if (mode == MODE_OUT) {
 		dir = "output";
 		ccp = &state->send_context;
@@ -1047,16 +1232,8 @@ ssh_set_newkeys(struct ssh *ssh, int mode)
 	if ((comp->type == COMP_ZLIB ||
 	    (comp->type == COMP_DELAYED &&
 	     state->after_authentication)) && comp->enabled == 0) {
-		if ((r = ssh_packet_init_compression(ssh)) < 0)
+		if ((r = start_compression(ssh, comp, mode)) != 0)
 			return r;
-		if (mode == MODE_OUT) {
-			if ((r = start_compression_out(ssh, 6)) != 0)
-				return r;
-		} else {
-			if ((r = start_compression_in(ssh)) != 0)
-				return r;
-		}
-		comp->enabled = 1;
 	}
 	/*
 	 * The 2^(blocksize*2) limit is too expensive for 3DES,
@@ -1074,11 +1251,12 @@ ssh_set_newkeys(struct ssh *ssh, int mode)
 }
 
 #define MAX_PACKETS	(1U<<31)
+
+/* Returns 1 if a key exchange may be started now */
 static int
-ssh_packet_need_rekeying(struct ssh *ssh, u_int outbound_packet_len)
+ssh_packet_may_rekey(struct ssh *ssh)
 {
 	struct session_state *state = ssh->state;
-	u_int32_t out_blocks;
 
 	/* XXX client can't cope with rekeying pre-auth */
 	if (!state->after_authentication)
@@ -1098,6 +1276,17 @@ ssh_packet_need_rekeying(struct ssh *ssh, u_int outbound_packet_len)
 	 */
 	if (state->p_send.packets == 0 && state->p_read.packets == 0)
 		return 0;
+	return 1;
+}
+
+static int
+ssh_packet_need_rekeying(struct ssh *ssh, u_int outbound_packet_len)
+{
+	struct session_state *state = ssh->state;
+	u_int32_t out_blocks;
+
+	if (!ssh_packet_may_rekey(ssh))
+		return 0;
 
 	/* Time-based rekeying */
 	if (state->rekey_interval != 0 &&
@@ -1118,6 +1307,73 @@ ssh_packet_need_rekeying(struct ssh *ssh, u_int outbound_packet_len)
 	    (state->p_read.blocks > state->max_blocks_in));
 }
 
+/* Percentage of the nearest rekey limit used by the current keys */
+static u_int
+ssh_packet_rekey_usage(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	u_int64_t used = 0;
+
+	if (state->rekey_interval != 0)
+		used = (u_int64_t)(monotime() - state->rekey_time) * 100 /
+		    state->rekey_interval;
+	used = MAXIMUM(used, (u_int64_t)state->p_send.packets * 100 /
+	    MAX_PACKETS);
+	used = MAXIMUM(used, (u_int64_t)state->p_read.packets * 100 /
+	    MAX_PACKETS);
+	if (state->max_blocks_out != 0)
+		used = MAXIMUM(used,
+		    state->p_send.blocks * 100 / state->max_blocks_out);
+	if (state->max_blocks_in != 0)
+		used = MAXIMUM(used,
+		    state->p_read.blocks * 100 / state->max_blocks_in);
+	return MINIMUM(used, 100);
+}
+
+/*
+ * Returns 1 if a rekey should be started now, ahead of the limits: the
+ * keys are close enough to a limit and no channel traffic has passed
+ * for a while. The pause of the key exchange then falls on a quiet
+ * link instead of the middle of a later transfer.
+ */
+int
+ssh_packet_want_idle_rekey(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+
+	if (state->idle_rekey_percent == 0 || !ssh_packet_may_rekey(ssh))
+		return 0;
+	if (monotime_double() - state->last_activity < state->idle_rekey_time)
+		return 0;
+	return ssh_packet_rekey_usage(ssh) >= state->idle_rekey_percent;
+}
+
+/*
+ * Seconds until ssh_packet_want_idle_rekey() should be checked again if
+ * the connection stays quiet, or -1 if the limits are not close yet.
+ */
+int
+ssh_packet_get_idle_rekey_timeout(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	double idle;
+	time_t when;
+
+	if (state->idle_rekey_percent == 0 || !ssh_packet_may_rekey(ssh))
+		return -1;
+	if (ssh_packet_rekey_usage(ssh) < state->idle_rekey_percent) {
+		/* Only time gets closer to a limit on a quiet link */
+		if (state->rekey_interval == 0)
+			return -1;
+		when = state->rekey_time + (time_t)state->rekey_interval *
+		    state->idle_rekey_percent / 100 - monotime();
+		return when <= 0 ? 1 : (int)when;
+	}
+	idle = state->idle_rekey_time -
+	    (monotime_double() - state->last_activity);
+	return idle <= 0 ? 0 : (int)idle + 1;
+}
+
 /*
  * Delayed compression for SSH2 is enabled after authentication:
  * This happens on the server side after a SSH2_MSG_USERAUTH_SUCCESS is sent,
@@ -1141,16 +1397,8 @@ ssh_packet_enable_delayed_compress(struct ssh *ssh)
 			continue;
 		comp = &state->newkeys[mode]->comp;
 		if (comp && !comp->enabled && comp->type == COMP_DELAYED) {
-			if ((r = ssh_packet_init_compression(ssh)) != 0)
+			if ((r = start_compression(ssh, comp, mode)) != 0)
 				return r;
-			if (mode == MODE_OUT) {
-				if ((r = start_compression_out(ssh, 6)) != 0)
-					return r;
-			} else {
-				if ((r = start_compression_in(ssh)) != 0)
-					return r;
-			}
-			comp->enabled = 1;
 		}
 	}
 	return 0;
@@ -1207,18 +1455,9 @@ ssh_packet_send2_wrapped(struct ssh *ssh)
 
 	if (comp && comp->enabled) {
 		len = sshbuf_len(state->outgoing_packet);
-		/* skip header, compress only payload */
-		if ((r = sshbuf_consume(state->outgoing_packet, 5)) != 0)
-			goto out;
-		sshbuf_reset(state->compression_buffer);
-		if ((r = compress_buffer(ssh, state->outgoing_packet,
-		    state->compression_buffer)) != 0)
-			goto out;
-		sshbuf_reset(state->outgoing_packet);
-		if ((r = sshbuf_put(state->outgoing_packet,
-		    "\0\0\0\0\0", 5)) != 0 ||
-		    (r = sshbuf_putb(state->outgoing_packet,
-		    state->compression_buffer)) != 0)
+		/* compress only the payload, behind the header */
+		if ((r = ssh_packet_compress(ssh,
+		    &state->outgoing_packet, 5)) != 0)
 			goto out;
 		DBG(debug("compression: raw %d compressed %zd", len,
 		    sshbuf_len(state->outgoing_packet)));
@@ -1280,9 +1519,9 @@ ssh_packet_send2_wrapped(struct ssh *ssh)
 
 	/* compute MAC over seqnr and packet(length fields, payload, padding) */
 	if (mac && mac->enabled && !mac->etm) {
-		if ((r = mac_compute(mac, state->p_send.seqnr,
-		    sshbuf_ptr(state->outgoing_packet), len,
-		    macbuf, sizeof(macbuf))) != 0)
+		if ((r = ssh_packet_mac_compute(state, mac,
+		    state->p_send.seqnr, sshbuf_ptr(state->outgoing_packet),
+		    len, macbuf, sizeof(macbuf))) != 0)
 			goto out;
 		DBG(debug("done calc MAC out #%d", state->p_send.seqnr));
 	}
@@ -1290,7 +1529,7 @@ ssh_packet_send2_wrapped(struct ssh *ssh)
 	if ((r = sshbuf_reserve(state->output,
 	    sshbuf_len(state->outgoing_packet) + authlen, &cp)) != 0)
 		goto out;
-	if ((r = cipher_crypt(state->send_context, state->p_send.seqnr, cp,
+	if ((r = ssh_packet_crypt(state, MODE_OUT, state->p_send.seqnr, cp,
 	    sshbuf_ptr(state->outgoing_packet),
 	    len - aadlen, aadlen, authlen)) != 0)
 		goto out;
@@ -1298,8 +1537,9 @@ ssh_packet_send2_wrapped(struct ssh *ssh)
 	if (mac && mac->enabled) {
 		if (mac->etm) {
 			/* EtM: compute mac over aadlen + cipher text */
-			if ((r = mac_compute(mac, state->p_send.seqnr,
-			    cp, len, macbuf, sizeof(macbuf))) != 0)
+			if ((r = ssh_packet_mac_compute(state, mac,
+			    state->p_send.seqnr, cp, len,
+			    macbuf, sizeof(macbuf))) != 0)
 				goto out;
 			DBG(debug("done calc MAC(EtM) out #%d",
 			    state->p_send.seqnr));
@@ -1319,7 +1559,10 @@ ssh_packet_send2_wrapped(struct ssh *ssh)
 			return SSH_ERR_NEED_REKEY;
 	state->p_send.blocks += len / block_size;
 	state->p_send.bytes += len;
+	ssh_packet_count(state, MODE_OUT, type, len);
 	sshbuf_reset(state->outgoing_packet);
+	if ((r = ssh_packet_output_seal(state)) != 0)
+		goto out;
 
 	if (type == SSH2_MSG_NEWKEYS)
 		r = ssh_set_newkeys(ssh, MODE_OUT);
@@ -1386,8 +1629,10 @@ ssh_packet_send2(struct ssh *ssh)
 	}
 
 	/* rekeying starts with sending KEXINIT */
-	if (type == SSH2_MSG_KEXINIT)
+	if (type == SSH2_MSG_KEXINIT) {
 		state->rekeying = 1;
+		state->kex_start = monotime_double();
+	}
 
 	if ((r = ssh_packet_send2_wrapped(ssh)) != 0)
 		return r;
@@ -1422,6 +1667,116 @@ ssh_packet_send2(struct ssh *ssh)
 	return 0;
 }
 
+/*
+ * Queue up to len bytes of channel data as a run of SSH2_MSG_CHANNEL_DATA
+ * packets, or SSH2_MSG_CHANNEL_EXTENDED_DATA ones if ext is not -1, each
+ * carrying at most maxlen bytes. The output buffer is grown once for the
+ * whole run and the packets are framed, MACed and encrypted in place
+ * there, without the copy through outgoing_packet. The number of bytes
+ * queued is returned in *sentp. It is zero when the packets must take
+ * the generic path, e.g. with compression or during rekeying, and short
+ * when a packet would trigger a rekey.
+ */
+int
+ssh_packet_send2_data(struct ssh *ssh, u_int32_t remote_id, int ext,
+    const u_char *data, size_t len, size_t maxlen, size_t *sentp)
+{
+	struct session_state *state = ssh->state;
+	struct sshenc *enc;
+	struct sshmac *mac;
+	u_char *cp, padlen, macbuf[SSH_DIGEST_MAX_LENGTH];
+	u_int authlen, aadlen, maclen, hdrlen, block_size, plen;
+	size_t n, off, total;
+	int r;
+
+	*sentp = 0;
+	if (!compat20 || state->mux || state->rekeying || state->extra_pad ||
+	    state->newkeys[MODE_OUT] == NULL ||
+	    state->newkeys[MODE_OUT]->comp.enabled ||
+	    sshbuf_len(state->outgoing_packet) != 0 || maxlen == 0)
+		return 0;
+	enc = &state->newkeys[MODE_OUT]->enc;
+	mac = &state->newkeys[MODE_OUT]->mac;
+	/* disable mac for authenticated encryption */
+	if ((authlen = cipher_authlen(enc->cipher)) != 0 || !mac->enabled)
+		mac = NULL;
+	block_size = enc->block_size;
+	aadlen = (mac && mac->etm) || authlen ? 4 : 0;
+	maclen = mac ? mac->mac_len : 0;
+	/* packet_len, pad_len, type, recipient, [data_type], data length */
+	hdrlen = 4 + 1 + 1 + 4 + (ext != -1 ? 4 : 0) + 4;
+
+	/* Size the run with the largest padding, then grow output once */
+	for (total = off = 0; off < len; off += n) {
+		n = MIN(len - off, maxlen);
+		total += hdrlen + n + block_size + 4 + authlen + maclen;
+	}
+	if ((r = sshbuf_allocate(state->output, total)) != 0)
+		return r;
+
+	for (off = 0; off < len; off += n) {
+		n = MIN(len - off, maxlen);
+		plen = hdrlen + n;
+		if (ssh_packet_need_rekeying(ssh, plen))
+			break;
+		/* minimum padding is 4 bytes, not counting EtM length */
+		padlen = block_size - ((plen - aadlen) % block_size);
+		if (padlen < 4)
+			padlen += block_size;
+		if ((r = sshbuf_reserve(state->output,
+		    plen + padlen + authlen, &cp)) != 0)
+			return r;
+		POKE_U32(cp, plen + padlen - 4);
+		cp[4] = padlen;
+		if (ext != -1) {
+			cp[5] = SSH2_MSG_CHANNEL_EXTENDED_DATA;
+			POKE_U32(cp + 6, remote_id);
+			POKE_U32(cp + 10, ext);
+		} else {
+			cp[5] = SSH2_MSG_CHANNEL_DATA;
+			POKE_U32(cp + 6, remote_id);
+		}
+		POKE_U32(cp + hdrlen - 4, n);
+		memcpy(cp + hdrlen, data + off, n);
+		if (!cipher_ctx_is_plaintext(state->send_context))
+			arc4random_buf(cp + plen, padlen);
+		else
+			explicit_bzero(cp + plen, padlen);
+		plen += padlen;
+
+		if (mac && !mac->etm) {
+			if ((r = ssh_packet_mac_compute(state, mac,
+			    state->p_send.seqnr, cp, plen,
+			    macbuf, sizeof(macbuf))) != 0)
+				return r;
+		}
+		if ((r = ssh_packet_crypt(state, MODE_OUT, state->p_send.seqnr,
+		    cp, cp, plen - aadlen, aadlen, authlen)) != 0)
+			return r;
+		if (mac) {
+			if (mac->etm && (r = ssh_packet_mac_compute(state, mac,
+			    state->p_send.seqnr, cp, plen,
+			    macbuf, sizeof(macbuf))) != 0)
+				return r;
+			if ((r = sshbuf_put(state->output, macbuf, maclen)) != 0)
+				return r;
+		}
+		*sentp += n;
+
+		if (++state->p_send.seqnr == 0)
+			logit("outgoing seqnr wraps around");
+		if (++state->p_send.packets == 0)
+			if (!(ssh->compat & SSH_BUG_NOREKEY))
+				return SSH_ERR_NEED_REKEY;
+		state->p_send.blocks += plen / block_size;
+		state->p_send.bytes += plen;
+		ssh_packet_count(state, MODE_OUT, ext != -1 ?
+		    SSH2_MSG_CHANNEL_EXTENDED_DATA : SSH2_MSG_CHANNEL_DATA,
+		    plen);
+	}
+	return ssh_packet_output_seal(state);
+}
+
 /*
  * Waits until a packet has been received, and returns its type.  Note that
  * no other data is processed until this returns, so this function should not
@@ -1652,7 +2007,7 @@ ssh_packet_read_poll1(struct ssh *ssh, u_char *typep)
 	sshbuf_reset(state->incoming_packet);
 	if ((r = sshbuf_reserve(state->incoming_packet, padded_len, &p)) != 0)
 		goto out;
-	if ((r = cipher_crypt(state->receive_context, 0, p,
+	if ((r = ssh_packet_crypt(state, MODE_IN, 0, p,
 	    sshbuf_ptr(state->input), padded_len, 0, 0)) != 0)
 		goto out;
 
@@ -1695,13 +2050,7 @@ ssh_packet_read_poll1(struct ssh *ssh, u_char *typep)
 		goto out;
 
 	if (state->packet_compression) {
-		sshbuf_reset(state->compression_buffer);
-		if ((r = uncompress_buffer(ssh, state->incoming_packet,
-		    state->compression_buffer)) != 0)
-			goto out;
-		sshbuf_reset(state->incoming_packet);
-		if ((r = sshbuf_putb(state->incoming_packet,
-		    state->compression_buffer)) != 0)
+		if ((r = ssh_packet_uncompress(ssh)) != 0)
 			goto out;
 	}
 	state->p_read.packets++;
@@ -1770,6 +2119,8 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 	struct sshcomp *comp = NULL;
 	int r;
 
+	ssh_packet_drop_inplace(state);
+
 	if (state->mux)
 		return ssh_packet_read_poll2_mux(ssh, typep, seqnr_p);
 
@@ -1817,7 +2168,7 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 		if ((r = sshbuf_reserve(state->incoming_packet, block_size,
 		    &cp)) != 0)
 			goto out;
-		if ((r = cipher_crypt(state->receive_context,
+		if ((r = ssh_packet_crypt(state, MODE_IN,
 		    state->p_send.seqnr, cp, sshbuf_ptr(state->input),
 		    block_size, 0, 0)) != 0)
 			goto out;
@@ -1873,7 +2224,7 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 #endif
 	/* EtM: check mac over encrypted input */
 	if (mac && mac->enabled && mac->etm) {
-		if ((r = mac_check(mac, state->p_read.seqnr,
+		if ((r = ssh_packet_mac_check(state, mac, state->p_read.seqnr,
 		    sshbuf_ptr(state->input), aadlen + need,
 		    sshbuf_ptr(state->input) + aadlen + need + authlen,
 		    maclen)) != 0) {
@@ -1882,18 +2233,41 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 			goto out;
 		}
 	}
-	if ((r = sshbuf_reserve(state->incoming_packet, aadlen + need,
-	    &cp)) != 0)
-		goto out;
-	if ((r = cipher_crypt(state->receive_context, state->p_read.seqnr, cp,
-	    sshbuf_ptr(state->input), need, aadlen, authlen)) != 0)
-		goto out;
+	if (aadlen && (comp == NULL || !comp->enabled) &&
+	    state->hook_in == NULL) {
+		/*
+		 * The whole packet is in the input buffer: decrypt it in
+		 * place and read it from there, without a copy.
+		 */
+		if ((cp = sshbuf_mutable_ptr(state->input)) == NULL) {
+			r = SSH_ERR_INTERNAL_ERROR;
+			goto out;
+		}
+		if ((r = ssh_packet_crypt(state, MODE_IN,
+		    state->p_read.seqnr, cp, cp, need, aadlen, authlen)) != 0)
+			goto out;
+		if ((state->incoming_packet =
+		    sshbuf_from(cp, aadlen + need)) == NULL) {
+			state->incoming_packet = state->incoming_buffer;
+			r = SSH_ERR_ALLOC_FAIL;
+			goto out;
+		}
+		state->incoming_inplace = 1;
+	} else {
+		if ((r = sshbuf_reserve(state->incoming_packet, aadlen + need,
+		    &cp)) != 0)
+			goto out;
+		if ((r = ssh_packet_crypt(state, MODE_IN,
+		    state->p_read.seqnr, cp, sshbuf_ptr(state->input),
+		    need, aadlen, authlen)) != 0)
+			goto out;
+	}
 	if ((r = sshbuf_consume(state->input, aadlen + need + authlen)) != 0)
 		goto out;
 	if (mac && mac->enabled) {
 		/* Not EtM: check MAC over cleartext */
-		if (!mac->etm && (r = mac_check(mac, state->p_read.seqnr,
-		    sshbuf_ptr(state->incoming_packet),
+		if (!mac->etm && (r = ssh_packet_mac_check(state, mac,
+		    state->p_read.seqnr, sshbuf_ptr(state->incoming_packet),
 		    sshbuf_len(state->incoming_packet),
 		    sshbuf_ptr(state->input), maclen)) != 0) {
 			if (r != SSH_ERR_MAC_INVALID)
@@ -1939,13 +2313,7 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 	DBG(debug("input: len before de-compress %zd",
 	    sshbuf_len(state->incoming_packet)));
 	if (comp && comp->enabled) {
-		sshbuf_reset(state->compression_buffer);
-		if ((r = uncompress_buffer(ssh, state->incoming_packet,
-		    state->compression_buffer)) != 0)
-			goto out;
-		sshbuf_reset(state->incoming_packet);
-		if ((r = sshbuf_putb(state->incoming_packet,
-		    state->compression_buffer)) != 0)
+		if ((r = ssh_packet_uncompress(ssh)) != 0)
 			goto out;
 		DBG(debug("input: len after de-compress %zd",
 		    sshbuf_len(state->incoming_packet)));
@@ -1956,6 +2324,7 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 	 */
 	if ((r = sshbuf_get_u8(state->incoming_packet, typep)) != 0)
 		goto out;
+	ssh_packet_count(state, MODE_IN, *typep, state->packlen + 4);
 	if (ssh_packet_log_type(*typep))
 		debug3("receive packet: type %u", *typep);
 	if (*typep < SSH2_MSG_MIN || *typep >= SSH2_MSG_LOCAL_MIN) {
@@ -2084,6 +2453,7 @@ ssh_packet_process_incoming(struct ssh *ssh, const char *buf, u_int len)
 	struct session_state *state = ssh->state;
 	int r;
 
+	ssh_packet_drop_inplace(state);
 	if (state->packet_discard) {
 		state->keep_alive_timeouts = 0; /* ?? */
 		if (len >= state->packet_discard) {
@@ -2247,20 +2617,36 @@ int
 ssh_packet_write_poll(struct ssh *ssh)
 {
 	struct session_state *state = ssh->state;
-	int len = sshbuf_len(state->output);
-	int r;
+	struct output_segment *seg, *tmp;
+	struct iovec iov[PACKET_OUTPUT_IOV];
+	size_t seglen;
+	ssize_t len;
+	int r, n = 0;
+
+	TAILQ_FOREACH(seg, &state->output_queue, next) {
+		if (n == PACKET_OUTPUT_IOV)
+			break;
+		iov[n].iov_base = (void *)sshbuf_ptr(seg->buf);
+		iov[n++].iov_len = sshbuf_len(seg->buf);
+	}
+	/* the output buffer goes last, after all the queued segments */
+	if (seg == NULL && n < PACKET_OUTPUT_IOV &&
+	    sshbuf_len(state->output) > 0) {
+		iov[n].iov_base = (void *)sshbuf_ptr(state->output);
+		iov[n++].iov_len = sshbuf_len(state->output);
+	}
 
-	if (len > 0) {
+	if (n > 0) {
 		#ifdef TEST
-		logit("NX> 280 Writing: %d bytes to fd: %d in context: 8",
-			len, connection_out);
+		logit("NX> 280 Writing: %zu bytes to fd: %d in context: 8",
+			state->output_queued + sshbuf_len(state->output),
+			state->connection_out);
 		#endif
 
-		len = write(state->connection_out,
-		    sshbuf_ptr(state->output), len);
+		len = writev(state->connection_out, iov, n);
 
 		#ifdef TEST
-		logit("NX> 280 Written: %d bytes error: %d in context: 8",
+		logit("NX> 280 Written: %zd bytes error: %d in context: 8",
 			len, (len < 0 ? errno : 0));
 		#endif
 
@@ -2272,7 +2658,18 @@ ssh_packet_write_poll(struct ssh *ssh)
 		}
 		if (len == 0)
 			return SSH_ERR_CONN_CLOSED;
-		if ((r = sshbuf_consume(state->output, len)) != 0)
+		TAILQ_FOREACH_SAFE(seg, &state->output_queue, next, tmp) {
+			seglen = MINIMUM((size_t)len, sshbuf_len(seg->buf));
+			if ((r = sshbuf_consume(seg->buf, seglen)) != 0)
+				return r;
+			state->output_queued -= seglen;
+			len -= seglen;
+			if (sshbuf_len(seg->buf) != 0)
+				break;
+			ssh_packet_output_recycle(state, seg);
+		}
+		if (len > 0 &&
+		    (r = sshbuf_consume(state->output, len)) != 0)
 			return r;
 	}
 	return 0;
@@ -2348,7 +2745,7 @@ ssh_packet_write_wait(struct ssh *ssh)
 int
 ssh_packet_have_data_to_write(struct ssh *ssh)
 {
-	return sshbuf_len(ssh->state->output) != 0;
+	return ssh->state->output_queued + sshbuf_len(ssh->state->output) != 0;
 }
 
 /* Returns true if there is not too much data to write to the connection. */
@@ -2357,9 +2754,97 @@ int
 ssh_packet_not_very_much_data_to_write(struct ssh *ssh)
 {
 	if (ssh->state->interactive_mode)
-		return sshbuf_len(ssh->state->output) < 16384;
+		return ssh->state->output_queued +
+		    sshbuf_len(ssh->state->output) < 16384;
 	else
-		return sshbuf_len(ssh->state->output) < 128 * 1024;
+		return ssh->state->output_queued +
+		    sshbuf_len(ssh->state->output) < 128 * 1024;
+}
+
+/* Returns the number of bytes queued for the connection. */
+
+size_t
+ssh_packet_output_len(struct ssh *ssh)
+{
+	return ssh->state->output_queued + sshbuf_len(ssh->state->output);
+}
+
+/*
+ * Appends the transport counters to "b" as text, one "name value" pair
+ * per line. Times are in milliseconds.
+ */
+int
+ssh_packet_get_stats(struct ssh *ssh, struct sshbuf *b)
+{
+	static const char *dir[MODE_MAX] = { "in", "out" };
+	struct session_state *state = ssh->state;
+	struct sshcompress_ctx *cc;
+	struct packet_counters *pc;
+	u_int64_t raw, comp;
+	int mode, type, r;
+
+	for (mode = 0; mode < MODE_MAX; mode++) {
+		pc = &state->counters[mode];
+		if ((r = sshbuf_putf(b, "%s.packets %llu\n"
+		    "%s.bytes %llu\n"
+		    "%s.cipher_ms %.3f\n"
+		    "%s.mac_ms %.3f\n"
+		    "%s.compress_ms %.3f\n",
+		    dir[mode], (unsigned long long)pc->packets,
+		    dir[mode], (unsigned long long)pc->bytes,
+		    dir[mode], pc->cipher_time * 1000,
+		    dir[mode], pc->mac_time * 1000,
+		    dir[mode], pc->compress_time * 1000)) != 0)
+			return r;
+		cc = mode == MODE_OUT ? state->compression_out_ctx :
+		    state->compression_in_ctx;
+		if (cc != NULL) {
+			compress_stats(cc, &raw, &comp);
+			if ((r = sshbuf_putf(b, "%s.compress_raw %llu\n"
+			    "%s.compress_bytes %llu\n",
+			    dir[mode], (unsigned long long)raw,
+			    dir[mode], (unsigned long long)comp)) != 0)
+				return r;
+		}
+		for (type = 0; type < 256; type++) {
+			if (pc->types[type] == 0)
+				continue;
+			if ((r = sshbuf_putf(b, "%s.msg.%d %llu\n", dir[mode],
+			    type, (unsigned long long)pc->types[type])) != 0)
+				return r;
+		}
+	}
+	return sshbuf_putf(b, "out.queue_bytes %zu\n"
+	    "out.queue_bytes_max %zu\n"
+	    "kex.count %u\n"
+	    "kex.last_ms %.3f\n"
+	    "kex.total_ms %.3f\n",
+	    state->output_queued + sshbuf_len(state->output),
+	    state->output_queued_max, state->kex_count,
+	    state->kex_time_last * 1000, state->kex_time_total * 1000);
+}
+
+/*
+ * Smoothed round trip time of the connection in seconds as the kernel
+ * measures it, 0 when it is not known.
+ */
+double
+ssh_packet_get_rtt(struct ssh *ssh)
+{
+#if defined(TCP_INFO) && defined(HAVE_STRUCT_TCP_INFO_TCPI_RTT)
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	if (!ssh_packet_connection_is_on_socket(ssh))
+		return 0;
+	memset(&ti, 0, sizeof(ti));
+	if (getsockopt(ssh->state->connection_in, IPPROTO_TCP, TCP_INFO,
+	    &ti, &len) == -1)
+		return 0;
+	return ti.tcpi_rtt / 1000000.0;
+#else
+	return 0;
+#endif
 }
 
 void
@@ -2534,6 +3019,15 @@ ssh_packet_set_rekey_limits(struct ssh *ssh, u_int64_t bytes, u_int32_t seconds)
 	ssh->state->rekey_interval = seconds;
 }
 
+void
+ssh_packet_set_idle_rekey(struct ssh *ssh, u_int percent, u_int seconds)
+{
+	debug3("rekey when idle for %u seconds at %u%% of the limits",
+	    seconds, percent);
+	ssh->state->idle_rekey_percent = percent;
+	ssh->state->idle_rekey_time = seconds;
+}
+
 time_t
 ssh_packet_get_rekey_timeout(struct ssh *ssh)
 {
@@ -2559,12 +3053,18 @@ ssh_packet_set_authenticated(struct ssh *ssh)
 void *
 ssh_packet_get_input(struct ssh *ssh)
 {
+	ssh_packet_drop_inplace(ssh->state);
 	return (void *)ssh->state->input;
 }
 
 void *
 ssh_packet_get_output(struct ssh *ssh)
 {
+	int r;
+
+	/* callers expect all the output in one buffer */
+	if ((r = ssh_packet_output_flatten(ssh->state)) != 0)
+		fatal("%s: %s", __func__, ssh_err(r));
 	return (void *)ssh->state->output;
 }
 
@@ -2703,7 +3203,8 @@ ssh_packet_get_state(struct ssh *ssh, struct sshbuf *m)
 		return r;
 	if (cipher_get_keycontext(state->receive_context, p) != (int)rlen)
 		return SSH_ERR_INTERNAL_ERROR;
-	if ((r = sshbuf_put_stringb(m, state->input)) != 0 ||
+	if ((r = ssh_packet_output_flatten(state)) != 0 ||
+	    (r = sshbuf_put_stringb(m, state->input)) != 0 ||
 	    (r = sshbuf_put_stringb(m, state->output)) != 0)
 		return r;
 
@@ -2888,6 +3389,8 @@ ssh_packet_set_state(struct ssh *ssh, struct sshbuf *m)
 		return r;
 
 	sshbuf_reset(state->input);
+	if ((r = ssh_packet_output_flatten(state)) != 0)
+		return r;
 	sshbuf_reset(state->output);
 	if ((r = sshbuf_get_string_direct(m, &input, &ilen)) != 0 ||
 	    (r = sshbuf_get_string_direct(m, &output, &olen)) != 0 ||
@@ -3104,7 +3607,7 @@ ssh_packet_send_mux(struct ssh *ssh)
 		/* sshbuf_dump(state->output, stderr); */
 	}
 	sshbuf_reset(state->outgoing_packet);
-	return 0;
+	return ssh_packet_output_seal(state);
 }
 
 /* send it */
@@ -115,6 +115,8 @@ int	 ssh_packet_log_type(u_char);
 int	 ssh_packet_send1(struct ssh *);
 int	 ssh_packet_send2_wrapped(struct ssh *);
 int	 ssh_packet_send2(struct ssh *);
+int	 ssh_packet_send2_data(struct ssh *, u_int32_t, int,
+	    const u_char *, size_t, size_t, size_t *);
 
 int      ssh_packet_read(struct ssh *);
 int	 ssh_packet_read_expect(struct ssh *, u_int type);
@@ -133,13 +135,16 @@ void     ssh_packet_send_debug(struct ssh *, const char *fmt, ...) __attribute__
 
 int	 ssh_set_newkeys(struct ssh *, int mode);
 void	 ssh_packet_get_bytes(struct ssh *, u_int64_t *, u_int64_t *);
+int	 ssh_packet_get_stats(struct ssh *, struct sshbuf *);
 
 int	 ssh_packet_write_poll(struct ssh *);
 int	 ssh_packet_write_wait(struct ssh *);
 int      ssh_packet_have_data_to_write(struct ssh *);
 int      ssh_packet_not_very_much_data_to_write(struct ssh *);
+size_t	 ssh_packet_output_len(struct ssh *);
 
 int	 ssh_packet_connection_is_on_socket(struct ssh *);
+double	 ssh_packet_get_rtt(struct ssh *);
 int	 ssh_packet_remaining(struct ssh *);
 void	 ssh_packet_send_ignore(struct ssh *, int);
 
@@ -161,6 +166,9 @@ int	 ssh_local_port(struct ssh *);
 
 void	 ssh_packet_set_rekey_limits(struct ssh *, u_int64_t, u_int32_t);
 time_t	 ssh_packet_get_rekey_timeout(struct ssh *);
+void	 ssh_packet_set_idle_rekey(struct ssh *, u_int, u_int);
+int	 ssh_packet_want_idle_rekey(struct ssh *);
+int	 ssh_packet_get_idle_rekey_timeout(struct ssh *);
 
 void	*ssh_packet_get_input(struct ssh *);
 void	*ssh_packet_get_output(struct ssh *);
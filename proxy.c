@@ -20,6 +20,9 @@
 #include "openbsd-compat/sys-queue.h"
 #include "channels.h"
 #include "xmalloc.h"
+#include "misc.h"
+#include "monitor_fdpass.h"
+#include "atomicio.h"
 
 /*
  * Used in NX network related functions.
@@ -27,6 +30,7 @@
 
 #include "NX.h"
 #include "proxy.h"
+#include "eventloop.h"
 
 #include <errno.h>
 #include <string.h>
@@ -36,6 +40,12 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
 
 #include <signal.h>
 #include <netdb.h>
@@ -81,13 +91,207 @@
 #undef NX_REPLACE_STANDARD_DESCRIPTORS
 
 /*
- * Close selectively the read and write ends of
- * the proxy and channel pipes in the proxy loop.
- * This is just for reference as it is better to
- * close all the descriptors at the first failure.
+ * Move the data between the channel and the proxy
+ * descriptors in the server side loop by splicing
+ * it through a pipe, so that it never leaves the
+ * kernel. The loop falls back to the read() and
+ * write() copy if the kernel refuses to splice
+ * any of the involved descriptors.
+ */
+
+#define NX_SPLICE_DESCRIPTORS
+
+#ifndef HAVE_SPLICE
+#undef NX_SPLICE_DESCRIPTORS
+#endif
+
+/*
+ * Amount of data that can be queued in each
+ * direction of the server side loop before we
+ * stop reading from the input descriptor.
+ */
+
+#define NX_RELAY_BUFFER_SIZE  (256 * 1024)
+
+/*
+ * Socket settings for the type of link given
+ * by the "link=" option of the switch command.
+ * Interactive links keep the unsent data to a
+ * minimum, so that the user input doesn't sit
+ * behind the bulk data. Their socket buffers
+ * follow the bandwidth-delay product sampled
+ * with TCP_INFO, between the given limits. On
+ * a LAN the buffers are left to the kernel and
+ * a large queue is sent in full segments. The
+ * last entry is used when no link is given.
+ */
+
+typedef struct
+{
+        const char *link;
+
+        int lowdelay;
+        int cork;
+
+        int notsent_lowat;
+
+        int min_buffer;
+        int max_buffer;
+
+} NXSocketProfile;
+
+static NXSocketProfile nx_socket_profiles[] =
+{
+        { "modem", 1, 0,  16384,  16384,   65536 },
+        { "isdn",  1, 0,  16384,  16384,  131072 },
+        { "adsl",  1, 0,  32768,  65536,  524288 },
+        { "wan",   1, 0,  65536, 131072, 4194304 },
+        { "lan",   0, 1, 262144,      0,       0 },
+        { NULL,    1, 0,      0,      0,       0 }
+};
+
+/*
+ * How often the relay samples its output socket
+ * and the amount of queued data that makes it
+ * cork the output, in the profiles using it.
+ */
+
+#define NX_SOCKET_TUNE_INTERVAL   1000000
+#define NX_SOCKET_CORK_THRESHOLD  (64 * 1024)
+
+/*
+ * Wait for the SSH and the NX descriptors on a
+ * persistent event set, based on epoll() where
+ * available, instead of running a select() on
+ * the merged sets. The descriptors set by the
+ * callers and by NXTransPrepare() are synced
+ * with the event set incrementally, so that a
+ * wakeup costs in proportion to the descriptors
+ * that are ready or have changed. This replaces
+ * NXTransSelect(), that in our configuration is
+ * just a select() on the merged sets.
+ */
+
+#define NX_EVENT_SELECT
+
+/*
+ * Timing histograms kept by the NX loops. The
+ * bucket N counts the samples shorter than
+ * NX_STATS_FIRST_BUCKET << N microseconds, the
+ * last bucket counts all the longer samples.
+ */
+
+#define NX_STATS_BUCKETS       16
+#define NX_STATS_FIRST_BUCKET  64
+
+typedef struct
+{
+        unsigned long long count;
+        unsigned long long total;
+        unsigned long long max;
+
+        unsigned long long buckets[NX_STATS_BUCKETS];
+
+} NXHistogram;
+
+/*
+ * Time spent waiting in select and handling
+ * the descriptors between two selects. The
+ * timestamp is taken each time the loop goes
+ * in or out of select and is also used as the
+ * current time by the relay counters.
+ */
+
+typedef struct
+{
+        NXHistogram wait;
+        NXHistogram handle;
+
+        unsigned long long start;
+        unsigned long long last;
+
+} NXStats;
+
+/*
+ * One direction of the server side loop. Data
+ * read from the input descriptor is queued in a
+ * bounded ring buffer, or in the pipe when the
+ * descriptors can be spliced, until the output
+ * descriptor becomes writable. Each direction
+ * is closed independently, so that the peer
+ * can still send its data after it has seen
+ * the end of the other direction.
+ */
+
+typedef struct
+{
+        const char *name;
+
+        int in_fd;
+        int out_fd;
+
+        int in_open;
+        int out_open;
+
+        char *data;
+        int size;
+        int start;
+        int length;
+
+        int pipe_fds[2];
+        int piped;
+        int splice;
+
+        int lazy;
+
+        unsigned long long bytes;
+        unsigned long long written;
+
+        unsigned long long reads;
+        unsigned long long writes;
+        unsigned long long blocked;
+
+        unsigned long long queued;
+        unsigned long long stall;
+
+        NXSocketProfile *profile;
+
+        int tune;
+        int buffer;
+        int corked;
+
+        unsigned long long tuned;
+
+} NXRelay;
+
+/*
+ * A session served by the relay daemon. The
+ * control descriptor is the connection used
+ * to hand over the session descriptors and
+ * then the switch options. It is kept open
+ * until the end of the session, as the nxssh
+ * process waits for it to be closed.
  */
 
-#undef NX_SELECTIVELY_CLOSE_DESCRIPTORS
+#define NX_DAEMON_HANDOVER_FDS  3
+
+typedef struct NXSession
+{
+        int id;
+
+        int control;
+
+        int fds[NX_DAEMON_HANDOVER_FDS + 1];
+        int received;
+
+        char options[1024];
+        int length;
+
+        NXRelay relays[2];
+
+        struct NXSession *next;
+
+} NXSession;
 
 /*
  * Use a well-known log file and share it with the
@@ -163,6 +367,8 @@ char nx_switch_cookie[256]   = { 0 };
 char nx_switch_host[256]     = { 0 };
 int  nx_switch_proxy         = -1;
 int  nx_switch_port          = -1;
+char nx_switch_path[128]     = { 0 };
+int  nx_switch_pair          = -1;
 int  nx_switch_in            = -1;
 int  nx_switch_out           = -1;
 char nx_switch_mode[256]     = { 0 };
@@ -177,17 +383,15 @@ int  nx_switch_forward       = -1;
 const char *nx_switch_command = "NX> 299 Switch connection to: ";
 
 /*
- * Buffer the input while looking for the command.
- * The buffering happens by flushing the input when
- * a newline is received. This means that all input
- * should be terminated with a newline or it will
- * remain in the buffer and will never be sent to
- * the packet interface.
+ * Scan the input while looking for the command.
+ * Only the bytes that may be part of the command
+ * are held back, so there is no limit on the
+ * amount or the kind of data going through.
  */
 
-static int nx_check_input(Buffer *buffer, char *data, int *length, int limit);
+static int nx_check_input(Buffer *buffer, int *matched, char *data, int *length, int limit);
 
-static int nx_check_switch_command(Buffer *buffer, char *start);
+static int nx_check_switch_command(Buffer *buffer);
 static int nx_check_switch_parameters(char *command);
 
 /*
@@ -203,6 +407,15 @@ static int nx_check_host_port_and_cookie(char *command, char *host, char *port,
 static int nx_check_host_port_and_descriptors(char *command, char *host, char *port, char *in, char *out);
 static int nx_check_port_and_accept(char *command, char *port, char *accept);
 static int nx_check_descriptors(char *command, char *in, char *out);
+static int nx_check_local_endpoint(char *command, char *path, char *pair, char *cookie, char *in, char *out);
+static int nx_check_local_forward(char *command, char *path, char *pair);
+
+/*
+ * Describe the endpoint of the switch in the
+ * log output.
+ */
+
+static const char *nx_switch_target();
 
 /*
  * Connect to the proxy over a socketpair or
@@ -212,6 +425,29 @@ static int nx_check_descriptors(char *command, char *in, char *out);
 static int nx_open_internal_proxy_connection();
 static int nx_open_external_proxy_connection();
 
+/*
+ * Connect to a proxy on the same host through
+ * a Unix socket or use a socket inherited from
+ * the parent, without the TCP stack and the
+ * name resolution.
+ */
+
+static int nx_open_local_proxy_connection();
+
+/*
+ * Resolve the host of the switch command. Nu-
+ * meric addresses don't go to the resolver.
+ */
+
+static int nx_resolve_switch_host(struct in_addr *address);
+
+/*
+ * Accept the connection to be forwarded on a
+ * Unix socket or take the inherited socket.
+ */
+
+static int nx_switch_forward_local(Channel *channel);
+
 /*
  * Redirect the log output.
  */
@@ -225,6 +461,81 @@ static void nx_redirect_log_output();
 
 void nx_run_server_side_loop(int proxy_fd);
 
+/*
+ * Manage one direction of the server side loop.
+ * Read and write return -1 if the direction was
+ * closed because of an error. A lazy relay only
+ * holds a buffer while there is data queued and
+ * doesn't use the splice pipe.
+ */
+
+static void nx_relay_init(NXRelay *relay, const char *name, int in_fd, int out_fd,
+                              NXSocketProfile *profile, int lazy);
+static void nx_relay_free(NXRelay *relay);
+
+static int nx_relay_wants_read(NXRelay *relay);
+static int nx_relay_wants_write(NXRelay *relay);
+
+static int nx_relay_read(NXRelay *relay);
+static int nx_relay_write(NXRelay *relay);
+
+static void nx_relay_check_eof(NXRelay *relay);
+static void nx_relay_close(NXRelay *relay);
+
+static void nx_relay_tune(NXRelay *relay);
+
+/*
+ * Hand over the server side loop to the relay
+ * daemon listening at the given path. Returns
+ * 1 if the daemon took the descriptors.
+ */
+
+static int nx_handover_server_side_loop(const char *path, int proxy_fd);
+
+/*
+ * Serve the sessions in the relay daemon.
+ */
+
+static struct eventloop *nx_daemon_events = NULL;
+
+static NXSession **nx_daemon_fds = NULL;
+static int nx_daemon_fds_size = 0;
+
+static NXSession *nx_daemon_sessions = NULL;
+static int nx_daemon_count = 0;
+
+static void nx_daemon_accept(int listen_fd);
+static void nx_daemon_receive(NXSession *session);
+static void nx_daemon_relay(NXSession *session, int fd, u_int events);
+static void nx_daemon_update(NXSession *session);
+static void nx_daemon_map(NXSession *session, int fd);
+static void nx_daemon_free(NXSession *session);
+static void nx_daemon_forget(int fd);
+
+/*
+ * Always available timing and throughput counters,
+ * dumped in key=value form at the end of the loops
+ * or when the server side loop gets a SIGUSR1.
+ */
+
+static NXStats nx_relay_stats;
+static NXStats nx_proxy_stats;
+
+static volatile sig_atomic_t nx_stats_requested = 0;
+
+static unsigned long long nx_stats_time();
+
+static void nx_stats_init(NXStats *stats);
+static void nx_stats_add(NXHistogram *histogram, unsigned long long value);
+
+static unsigned long long nx_stats_enter_wait(NXStats *stats);
+static unsigned long long nx_stats_leave_wait(NXStats *stats);
+
+static void nx_stats_dump(NXStats *stats, const char *reason,
+                              NXRelay *relays, int count);
+static void nx_stats_dump_relays(NXStats *stats, NXRelay *relays, int count);
+static void nx_stats_dump_histogram(const char *name, NXHistogram *histogram);
+
 /*
  * Run a simple loop that lets the NX proxy on
  * the client connect to an agent running on
@@ -240,12 +551,27 @@ void nx_run_client_side_loop(int proxy_fd);
  */
 
 static Buffer nx_input_buffer;
+static int nx_input_matched = 0;
+
+/*
+ * Wait on the persistent event set. Falls back
+ * to select() if the set can't be created.
+ */
+
+#ifdef NX_EVENT_SELECT
+
+static struct eventloop *nx_proxy_events = NULL;
+static int nx_proxy_events_failed = 0;
+
+static int nx_proxy_event_select(int maxfds, fd_set *readfds, fd_set *writefds,
+                                     struct timeval *timeout);
+
+#endif
 
 /*
  * Utilities to log in the NX format.
  */
 
-static void nx_dump_buffer(Buffer *buffer);
 static void nx_dump_string(char *string);
 
 #if defined(DEBUG) || defined(TIME)
@@ -264,6 +590,7 @@ static int nx_diff_timestamp(struct timeval ts1, struct timeval ts2);
 
 static void nx_catch_timeout_signal(int number);
 static void nx_catch_pipe_signal(int number);
+static void nx_catch_stats_signal(int number);
 
 /*
  * Safe version of string functions. They are able
@@ -271,8 +598,6 @@ static void nx_catch_pipe_signal(int number);
  * a null.
  */
 
-static char *nx_search_string_in_buffer(Buffer *buffer, char *start, const char *string);
-static char *nx_remove_string_in_buffer(Buffer *buffer, char *start, int length);
 static char *nx_search_newline_in_buffer(Buffer *buffer, char *start);
 static char *nx_remove_newline_in_string(char *start, int length);
 static char *nx_toupper_string(char *start);
@@ -301,6 +626,24 @@ static int nx_set_blocking(int fd);
 static int nx_set_nodelay(int fd);
 static int nx_set_keepalive(int fd);
 static int nx_set_lowdelay(int fd);
+static int nx_set_tos(int fd, int tos, const char *name);
+
+/*
+ * Apply the profile selected by the switch
+ * options to TCP sockets.
+ */
+
+static NXSocketProfile *nx_get_socket_profile(const char *options);
+
+static void nx_set_profile_options(int fd, int blocking, NXSocketProfile *profile);
+
+static int nx_socket_is_tcp(int fd);
+
+static void nx_set_notsent_lowat(int fd, int bytes);
+static void nx_set_buffers(int fd, int bytes);
+static void nx_set_cork(int fd, int cork);
+
+static int nx_tune_socket(int fd, NXSocketProfile *profile, int *buffer);
 
 void nx_proxy_init()
 {
@@ -317,9 +660,13 @@ int nx_proxy_select(int maxfds, fd_set *readfds, fd_set *writefds,
 
         if (nx_switch_internal == 1 && NXTransRunning(NX_FD_ANY) == 1)
         {
-                fd_set t_readfds, t_writefds;
+                fd_set *t_readfds = NULL;
+                fd_set *t_writefds = NULL;
+
                 struct timeval t_timeout;
 
+                size_t t_size;
+
                 int n, r, e;
 
                 if (exceptfds != NULL)
@@ -333,18 +680,27 @@ int nx_proxy_select(int maxfds, fd_set *readfds, fd_set *writefds,
                 debug("NX> 280 Going to run a new NX loop");
                 #endif
 
+                /*
+                 * The proxy needs both the sets. Make the
+                 * missing ones as large as the caller's,
+                 * as the descriptors can be beyond the
+                 * FD_SETSIZE.
+                 */
+
+                t_size = howmany(MAX(maxfds, FD_SETSIZE), NFDBITS) * sizeof(fd_mask);
+
                 if (readfds == NULL)
                 {
-                        FD_ZERO(&t_readfds);
+                        t_readfds = xcalloc(1, t_size);
 
-                        readfds = &t_readfds;
+                        readfds = t_readfds;
                 }
 
                 if (writefds == NULL)
                 {
-                        FD_ZERO(&t_writefds);
+                        t_writefds = xcalloc(1, t_size);
 
-                        writefds = &t_writefds;
+                        writefds = t_writefds;
                 }
 
                 if (timeout == NULL)
@@ -370,18 +726,36 @@ int nx_proxy_select(int maxfds, fd_set *readfds, fd_set *writefds,
                          * proxy to run its own loop.
                          */
 
+                        nx_stats_enter_wait(&nx_proxy_stats);
+
+                        #ifdef NX_EVENT_SELECT
+
+                        r = nx_proxy_event_select(n, readfds, writefds, timeout);
+
+                        e = errno;
+
+                        #else
+
                         NXTransSelect(&r, &e, &n, readfds, writefds, timeout);
 
-                        NXTransExecute(&r, &e, &n, readfds, writefds, timeout);
+                        #endif
 
-                        errno = e;
+                        nx_stats_leave_wait(&nx_proxy_stats);
 
-                        return r;
+                        NXTransExecute(&r, &e, &n, readfds, writefds, timeout);
                 }
                 else
                 {
-                        return 0;
+                        r = 0;
+                        e = 0;
                 }
+
+                free(t_readfds);
+                free(t_writefds);
+
+                errno = e;
+
+                return r;
         }
         else
         {
@@ -389,10 +763,118 @@ int nx_proxy_select(int maxfds, fd_set *readfds, fd_set *writefds,
                 debug("NX> 280 The NX transport is not running");
                 #endif
 
+                #ifdef NX_EVENT_SELECT
+
+                if (exceptfds == NULL)
+                {
+                        return nx_proxy_event_select(maxfds, readfds, writefds, timeout);
+                }
+
+                #endif
+
                 return select(maxfds, readfds, writefds, exceptfds, timeout);
         }
 }
 
+int nx_proxy_running()
+{
+        /*
+         * The NX transport merges its own descriptors
+         * in the select sets, so the client loop must
+         * wait through nx_proxy_select() until the
+         * transport is gone.
+         */
+
+        return (nx_switch_internal == 1 && NXTransRunning(NX_FD_ANY) == 1);
+}
+
+void nx_proxy_forget_fd(int fd)
+{
+        #ifdef NX_EVENT_SELECT
+
+        /*
+         * The set only sees the changes in the select
+         * sets, so a descriptor replaced while its bit
+         * stays set would never be registered again.
+         */
+
+        if (nx_proxy_events != NULL)
+        {
+                eventloop_forget(nx_proxy_events, fd);
+        }
+
+        #endif
+}
+
+#ifdef NX_EVENT_SELECT
+
+int nx_proxy_event_select(int maxfds, fd_set *readfds, fd_set *writefds,
+                              struct timeval *timeout)
+{
+        int timeout_ms;
+        int result;
+
+        if (nx_proxy_events == NULL && nx_proxy_events_failed == 0)
+        {
+                nx_proxy_events = eventloop_new();
+
+                if (nx_proxy_events == NULL)
+                {
+                        error("NX> 280 Can't create the event set: %s. Using select",
+                                  strerror(errno));
+
+                        nx_proxy_events_failed = 1;
+                }
+                else
+                {
+                        debug("NX> 280 Using %s for the NX select",
+                                  eventloop_backend(nx_proxy_events));
+                }
+        }
+
+        if (nx_proxy_events == NULL)
+        {
+                return select(maxfds, readfds, writefds, NULL, timeout);
+        }
+
+        if (timeout != NULL)
+        {
+                timeout_ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+        }
+        else
+        {
+                timeout_ms = -1;
+        }
+
+        result = eventloop_select(nx_proxy_events, maxfds, readfds, writefds, timeout_ms);
+
+        if (result < 0)
+        {
+                /*
+                 * Don't let the caller take the descriptors
+                 * of interest for the ready ones.
+                 */
+
+                int saved_errno = errno;
+
+                if (readfds != NULL)
+                {
+                        memset(readfds, 0, howmany(maxfds, NFDBITS) * sizeof(fd_mask));
+                }
+
+                if (writefds != NULL)
+                {
+                        memset(writefds, 0, howmany(maxfds, NFDBITS) * sizeof(fd_mask));
+                }
+
+                errno = saved_errno;
+        }
+
+        return result;
+}
+
+#endif
+
 int nx_check_channel_input(Channel *channel, char *data, int *length, int limit)
 {
         debug("NX> 285 Going to check input for fd: %d", channel->rfd);
@@ -414,10 +896,40 @@ int nx_check_channel_input(Channel *channel, char *data, int *length, int limit)
         /*
          * It returns true if more data has been
          * produced for the channel. The switch
-         * command is removed from the buffer.
+         * command is removed from the data.
+         */
+
+        return nx_check_input(&channel->nx_buffer, &channel->nx_matched,
+                                  data, length, limit);
+}
+
+int nx_flush_channel_input(Channel *channel, char *data, int limit)
+{
+        int held = channel->nx_matched;
+
+        /*
+         * The command can't be completed anymore.
+         * A full match is the command itself, so
+         * only the leading part is data.
          */
 
-        return nx_check_input(&channel->nx_buffer, data, length, limit);
+        if (held <= 0 || held >= (int) strlen(nx_switch_command))
+        {
+                return 0;
+        }
+
+        if (held > limit)
+        {
+                fatal("NX> 298 No room to return: %d held bytes", held);
+        }
+
+        debug("NX> 280 Returning: %d held bytes at end of input", held);
+
+        memcpy(data, nx_switch_command, held);
+
+        channel->nx_matched = 0;
+
+        return held;
 }
 
 int nx_check_standard_input()
@@ -452,7 +964,7 @@ int nx_check_standard_input()
 
                 for (;;)
                 {
-                        result = read(fd, data, 1024 - 1);
+                        result = read(fd, data, 1024 - 1 - NX_SWITCH_HOLD_SIZE);
 
                         if (result < 0 && errno == EINTR)
                         {
@@ -470,7 +982,8 @@ int nx_check_standard_input()
                          * mand. Any other data is discarded.
                          */
 
-                        nx_check_input(&nx_input_buffer, data, &result, 1024 - 1);
+                        nx_check_input(&nx_input_buffer, &nx_input_matched,
+                                           data, &result, 1024 - 1);
 
                         if (result > 0)
                         {
@@ -479,8 +992,6 @@ int nx_check_standard_input()
                                 nx_remove_newline_in_string(data, result);
 
                                 error("NX> 289 Discarding spurious data: '%s'", data);
-
-                                buffer_clear(&nx_input_buffer);
                         }
 
                         break;
@@ -498,137 +1009,211 @@ nx_check_standard_input_error:
         return -1;
 }
 
-int nx_check_input(Buffer *buffer, char *data, int *length, int limit)
+int nx_check_input(Buffer *buffer, int *matched, char *data, int *length, int limit)
 {
-        char *start;
-        char *current;
-        char *end;
+        int command_length = strlen(nx_switch_command);
+
+        int in  = 0;
+        int out = 0;
+
+        int held;
+        int count;
+
+        char *candidate;
 
         /*
-         * Append data to the buffer.
+         * The data is scanned once, as it arrives. Only
+         * the bytes that may belong to the command are
+         * held back, everything else is returned in
+         * place. Bytes matching the leading part of
+         * the command are not stored, as they are the
+         * first '*matched' characters of the command
+         * itself. The rest of the command line is
+         * collected in the buffer until its newline.
          */
 
-        if (buffer_len(buffer) + *length >= (16*1024 - 1))
+        if (*matched > 0 && *matched < command_length)
         {
-                error("\r\nNX> 288 Buffer length of: %d bytes exceeded",
-                              16*1024);
+                held = *matched;
 
-                fatal("NX> 290 Don't use the -B option with binary data");
-        }
+                while (in < *length && *matched < command_length &&
+                           data[in] == nx_switch_command[*matched])
+                {
+                        (*matched)++;
 
-        debug("NX> 280 Adding: %d bytes to the temporary buffer",
-                      *length);
+                        in++;
+                }
 
-        buffer_append(buffer, data, *length);
+                if (*matched == command_length)
+                {
+                        debug("NX> 280 Switch command found across reads");
 
-        debug("NX> 280 Dumping content of the temporary buffer:");
+                        out = 0;
+                }
+                else if (in == *length)
+                {
+                        *length = 0;
 
-        nx_dump_buffer(buffer);
+                        return 1;
+                }
+                else
+                {
+                        /*
+                         * It was not the command. Return the held
+                         * bytes in front of the new data. As the
+                         * first character of the command doesn't
+                         * appear again in the command, the match
+                         * can restart from the current position.
+                         */
 
-        /*
-         * Check if buffer contains the switch command.
-         */
+                        if (*length + held > limit)
+                        {
+                                fatal("NX> 298 No room to return: %d held bytes", held);
+                        }
 
-        start = nx_search_string_in_buffer(buffer, NULL, nx_switch_command);
+                        memmove(data + held, data, *length);
+                        memcpy(data, nx_switch_command, held);
 
-        if (start != NULL)
-        {
-                debug("NX> 280 Switch command maybe found at position: %d",
-                              (int) (start - (char *) buffer_ptr(buffer)));
+                        *length += held;
 
-                /*
-                 * Verify the host and port and wipe out
-                 * the command from the buffer.
-                 */
+                        in += held;
+                        out = in;
 
-                nx_switch_received = nx_check_switch_command(buffer, start);
+                        *matched = 0;
+                }
         }
 
-        /*
-         * Place back the remaining data in
-         * the original buffer.
-         */
+        while (in < *length)
+        {
+                if (*matched == command_length)
+                {
+                        /*
+                         * Collect the parameters up to the end
+                         * of the command line.
+                         */
 
-        current = data;
-        *length = 0;
+                        for (count = 0; in + count < *length; count++)
+                        {
+                                if (data[in + count] == '\n' || data[in + count] == '\r' ||
+                                        data[in + count] == '\0')
+                                {
+                                        break;
+                                }
+                        }
 
-        for (;;)
-        {
-                start = buffer_ptr(buffer);
+                        if (command_length + buffer_len(buffer) + count >= NX_SWITCH_COMMAND_SIZE)
+                        {
+                                error("\r\nNX> 288 Switch command exceeds: %d bytes",
+                                          NX_SWITCH_COMMAND_SIZE);
 
-                end = nx_search_newline_in_buffer(buffer, start);
+                                fatal("\r\nNX> 298 Parse error in the switch parameters");
+                        }
 
-                if (end == NULL || *length + (end - start + 1) > limit)
-                {
-                        break;
-                }
+                        buffer_append(buffer, data + in, count);
 
-                debug("NX> 280 Adding: %d bytes to the returned buffer",
-                             (int) (end - start + 1));
+                        in += count;
 
-                buffer_get(buffer, current, end - start + 1);
+                        if (in == *length)
+                        {
+                                break;
+                        }
 
-                current += end - start + 1;
-                *length += end - start + 1;
-        }
+                        /*
+                         * Wipe out the command together with
+                         * its terminating newline.
+                         */
 
-        debug("NX> 280 Left: %d bytes in the temporary buffer",
-                    buffer_len(buffer));
+                        in++;
 
-        return 1;
-}
+                        *matched = 0;
 
-int nx_check_switch_command(Buffer *buffer, char *start)
-{
-        char *command;
-        char *end;
+                        nx_switch_received = nx_check_switch_command(buffer);
 
-        int length = buffer_len(buffer) - (start - (char *) buffer_ptr(buffer));
+                        buffer_clear(buffer);
 
-        debug("NX> 280 Searching newline with: %d bytes remaining", length);
+                        continue;
+                }
 
-        if ((end = nx_search_newline_in_buffer(buffer, start)) == NULL)
-        {
-                fatal("NX> 290 Can't find the terminating newline in buffer:");
+                candidate = memchr(data + in, nx_switch_command[0], *length - in);
 
-                return 0;
-        }
+                count = (candidate == NULL ? *length : candidate - data) - in;
 
-        /*
-         * Copy the command string to a temporary.
-         */
+                if (out != in)
+                {
+                        memmove(data + out, data + in, count);
+                }
+
+                in  += count;
+                out += count;
+
+                if (candidate == NULL)
+                {
+                        break;
+                }
+
+                for (count = 0; in + count < *length && count < command_length; count++)
+                {
+                        if (data[in + count] != nx_switch_command[count])
+                        {
+                                break;
+                        }
+                }
 
-        length = end - start;
+                if (count == command_length)
+                {
+                        debug("NX> 280 Switch command found at position: %d", in);
+
+                        *matched = command_length;
 
-        debug("NX> 280 Checking command with length: %d", length);
+                        in += count;
+                }
+                else if (in + count == *length)
+                {
+                        /*
+                         * The data ends with what could be the
+                         * beginning of the command. Hold it back
+                         * until we get the rest.
+                         */
 
-        command = xmalloc(length + 1);
+                        debug("NX> 280 Holding: %d bytes of a possible switch command",
+                                  count);
 
-        if (command == NULL)
-        {
-                fatal("NX> 298 Out of memory checking the command string");
+                        *matched = count;
 
-                return -1;
+                        in += count;
+                }
+                else
+                {
+                        data[out++] = data[in++];
+                }
         }
 
-        memcpy(command, start, length);
+        *length = out;
 
-        *(command + length) = '\0';
+        return 1;
+}
 
-        debug("NX> 280 Analyzing command string:");
+int nx_check_switch_command(Buffer *buffer)
+{
+        char command[NX_SWITCH_COMMAND_SIZE];
 
-        nx_dump_string(command);
+        int length = strlen(nx_switch_command);
 
         /*
-         * Get rid of the command fingerprint from
-         * buffer until the terminating newline.
+         * Put back the command fingerprint in front
+         * of the parameters collected in the buffer.
          */
 
-        nx_remove_string_in_buffer(buffer, start, length);
+        memcpy(command, nx_switch_command, length);
+        memcpy(command + length, buffer_ptr(buffer), buffer_len(buffer));
+
+        length += buffer_len(buffer);
+
+        *(command + length) = '\0';
 
-        debug("NX> 280 Content of the temporary buffer:");
+        debug("NX> 280 Analyzing command string with length: %d", length);
 
-        nx_dump_buffer(buffer);
+        nx_dump_string(command);
 
         if (nx_check_switch_parameters(command) <= 0)
         {
@@ -657,6 +1242,11 @@ int nx_check_switch_parameters(char *command)
         char in[16]   = { 0 };
         char out[16]  = { 0 };
 
+        char path[128]    = { 0 };
+        char pair[16]     = { 0 };
+        char listen[128]  = { 0 };
+        char inherit[16]  = { 0 };
+
         if (command == NULL || *command == '\0')
         {
                 return -1;
@@ -674,6 +1264,8 @@ int nx_check_switch_parameters(char *command)
                 nx_check_specifier_and_options(command, options) <= 0 &&
                     nx_check_specifier_and_mode(command, mode) <= 0 &&
                         nx_check_port_and_accept(command, port, accept) <= 0 &&
+                            nx_check_local_forward(command, listen, inherit) <= 0 &&
+                                nx_check_local_endpoint(command, path, pair, cookie, in, out) <= 0 &&
                                 nx_check_host_port_and_descriptors(command, host, port, in, out) <= 0 &&
                                         nx_check_descriptors(command, in, out) <= 0 &&
                                             nx_check_host_port_and_cookie(command, host, port, cookie) <= 0 &&
@@ -683,12 +1275,44 @@ int nx_check_switch_parameters(char *command)
                 return -1;
         }
 
+        /*
+         * A Unix socket path or an inherited socket
+         * replace the host and port of an outbound
+         * connection.
+         */
+
+        if (*path != '\0' || *pair != '\0')
+        {
+                strcpy(nx_switch_path, path);
+
+                nx_switch_pair = (*pair != '\0' ? atoi(pair) : -1);
+
+                logit("NX> 285 Identified local endpoint: %s", nx_switch_target());
+
+                if (*cookie != '\0')
+                {
+                        strcpy(nx_switch_cookie, cookie);
+
+                        logit("NX> 285 Identified cookie: %s", nx_switch_cookie);
+                }
+
+                if (*in != '\0' && *out != '\0')
+                {
+                        nx_switch_in  = atoi(in);
+                        nx_switch_out = atoi(out);
+
+                        logit("NX> 285 Identified descriptors in: %d out: %d", nx_switch_in, nx_switch_out);
+                }
+
+                nx_switch_internal = 0;
+        }
+
         /*
          * If at least host and port were given
          * we need an outbound connection.
          */
 
-        if (*host != '\0' && *port != '\0')
+        else if (*host != '\0' && *port != '\0')
         {
                 strcpy(nx_switch_host, host);
 
@@ -733,6 +1357,16 @@ int nx_check_switch_parameters(char *command)
 
                 nx_switch_forward = 2;
         }
+        else if (*listen != '\0' || *inherit != '\0')
+        {
+                strcpy(nx_switch_path, listen);
+
+                nx_switch_pair = (*inherit != '\0' ? atoi(inherit) : -1);
+
+                logit("NX> 285 Identified local forward: %s", nx_switch_target());
+
+                nx_switch_forward = 2;
+        }
         else
         {
                 logit("NX> 285 Identified internal connection");
@@ -859,6 +1493,133 @@ int nx_check_descriptors(char *command, char *in, char *out)
         return 1;
 }
 
+int nx_check_local_endpoint(char *command, char *path, char *pair, char *cookie, char *in, char *out)
+{
+        char match[256]  = { 0 };
+        char kind[8]     = { 0 };
+        char target[128] = { 0 };
+
+        int position = -1;
+
+        int result;
+
+        /*
+         * Look for "unix:" followed by the path of
+         * the socket or "fd:" followed by an inher-
+         * ited descriptor, optionally followed by
+         * the cookie or by the input and output fd
+         * descriptors.
+         */
+
+        snprintf(match, 255, "%s%%7[a-z]:%%107[^ ]%%n", nx_switch_command);
+
+        debug("NX> 280 Searching with matching string:");
+
+        nx_dump_string(match);
+
+        result = sscanf(command, match, kind, target, &position);
+
+        if (result != 2 || position < 0)
+        {
+                return -1;
+        }
+
+        command += position;
+
+        if (*command != '\0' && sscanf(command, " cookie: %32s", cookie) != 1 &&
+                sscanf(command, " in: %5[0-9] out: %5[0-9]", in, out) != 2)
+        {
+                *cookie = *in = *out = '\0';
+
+                return -1;
+        }
+
+        if (strcmp(kind, "unix") == 0 && *target == '/')
+        {
+                strcpy(path, target);
+        }
+        else if (strcmp(kind, "fd") == 0 && strlen(target) <= 5 &&
+                     strspn(target, "0123456789") == strlen(target))
+        {
+                strcpy(pair, target);
+        }
+        else
+        {
+                *cookie = *in = *out = '\0';
+
+                return -1;
+        }
+
+        return 1;
+}
+
+int nx_check_local_forward(char *command, char *path, char *pair)
+{
+        char match[256]  = { 0 };
+
+        int result;
+
+        /*
+         * Look for the path of the Unix socket to
+         * listen on or for the inherited socket.
+         */
+
+        snprintf(match, 255, "%s SSH unix: %%107s", nx_switch_command);
+
+        debug("NX> 280 Searching with matching string:");
+
+        nx_dump_string(match);
+
+        result = sscanf(command, match, path);
+
+        if (result == 1 && *path == '/')
+        {
+                return 1;
+        }
+
+        *path = '\0';
+
+        snprintf(match, 255, "%s SSH fd: %%5[0-9]", nx_switch_command);
+
+        debug("NX> 280 Searching with matching string:");
+
+        nx_dump_string(match);
+
+        result = sscanf(command, match, pair);
+
+        if (result != 1)
+        {
+                return -1;
+        }
+
+        return 1;
+}
+
+const char *nx_switch_target()
+{
+        /*
+         * Large enough for any host and port, so
+         * that the name is never cut short.
+         */
+
+        static char target[sizeof(nx_switch_host) + sizeof(":-2147483648")];
+
+        if (*nx_switch_path != '\0')
+        {
+                snprintf(target, sizeof(target), "unix:%s", nx_switch_path);
+        }
+        else if (nx_switch_pair != -1)
+        {
+                snprintf(target, sizeof(target), "fd:%d", nx_switch_pair);
+        }
+        else
+        {
+                snprintf(target, sizeof(target), "%s:%d", nx_switch_host, nx_switch_port);
+        }
+
+        return target;
+}
+
 int nx_check_host_port_and_cookie(char *command, char *host, char *port, char *cookie)
 {
         char match[256]  = { 0 };
@@ -1025,7 +1786,11 @@ int nx_check_specifier(char *command)
 
 int nx_open_proxy_connection()
 {
-        if (*nx_switch_host != '\0' && nx_switch_port != -1)
+        if (*nx_switch_path != '\0' || nx_switch_pair != -1)
+        {
+                return nx_open_local_proxy_connection();
+        }
+        else if (*nx_switch_host != '\0' && nx_switch_port != -1)
         {
                 return nx_open_external_proxy_connection();
         }
@@ -1050,6 +1815,13 @@ int nx_close_proxy_connection()
 
         debug("NX> 280 Switch proxy is: %d", nx_switch_proxy);
 
+        if (nx_proxy_stats.wait.count > 0)
+        {
+                nx_stats_dump(&nx_proxy_stats, "end", NULL, 0);
+
+                nx_stats_init(&nx_proxy_stats);
+        }
+
         if (nx_switch_proxy != -1)
         {
                 debug("NX> 280 Waiting for the NX transport to terminate");
@@ -1171,8 +1943,6 @@ int nx_open_external_proxy_connection()
 {
         int proxy_fd;
 
-        int remote_ip_addr;
-
         void (*handler)(int) = signal(SIGALRM, nx_catch_timeout_signal);
 
         /*
@@ -1184,8 +1954,6 @@ int nx_open_external_proxy_connection()
 
         struct sockaddr_in addr;
 
-        struct hostent *host = gethostbyname(nx_switch_host);
-
         int flag = 1;
 
         int result;
@@ -1200,35 +1968,15 @@ int nx_open_external_proxy_connection()
         logit("\r\nNX> 291 Connecting to: %s:%d",
                     nx_switch_host, nx_switch_port);
 
-        if (host == NULL)
-        {
-                /*
-                 * On some Unices gethostbyname() doesn't
-                 * accept IP addresses, so try inet_addr.
-                 */
-
-                unsigned int address;
-
-                address = (unsigned int) inet_addr(nx_switch_host);
-
-                if (address == INADDR_NONE)
-                {
-                        fatal("\r\nNX> 297 Can't resolve address of host: %s",
-                                  nx_switch_host);
-
-                        goto nx_open_proxy_connection_error;
-                }
+        memset(&addr, 0, sizeof(addr));
 
-                remote_ip_addr = (int) address;
-        }
-        else
+        if (nx_resolve_switch_host(&addr.sin_addr) < 0)
         {
-                remote_ip_addr = (*((int *) host -> h_addr_list[0]));
+                goto nx_open_proxy_connection_error;
         }
 
         addr.sin_family = AF_INET;
         addr.sin_port = htons(nx_switch_port);
-        addr.sin_addr.s_addr = remote_ip_addr;
 
         for (;;)
         {
@@ -1308,56 +2056,174 @@ nx_open_proxy_connection_error:
         return -1;
 }
 
-int nx_check_proxy_authentication(int proxy_fd)
+int nx_open_local_proxy_connection()
 {
-        if (*nx_switch_cookie != '\0')
-        {
-                char string[256];
+        struct sockaddr_un addr;
 
-                /*
-                 * String must be terminated with a space.
-                 */
+        struct stat info;
 
-                snprintf(string, 255, "NXSSH-%s cookie=%s ", NX_ADVERTISE_VERSION,
-                             nx_toupper_string(nx_switch_cookie));
+        int retry_connect = 4;
+
+        int proxy_fd;
 
+        if (nx_switch_pair != -1)
+        {
                 /*
-                 * This should not be required.
+                 * The socket is already connected to
+                 * the proxy.
                  */
 
-                *(string + 255) = '\0';
+                if (fstat(nx_switch_pair, &info) < 0 || !S_ISSOCK(info.st_mode))
+                {
+                        fatal("\r\nNX> 297 Descriptor: %d is not a socket",
+                                  nx_switch_pair);
 
-                logit("NX> 285 Sending authentication cookie: %s",
-                          nx_switch_cookie);
+                        return -1;
+                }
 
-                write(proxy_fd, string, strlen(string));
+                logit("\r\nNX> 291 Using inherited socket: %d", nx_switch_pair);
 
-                return 1;
+                proxy_fd = nx_switch_pair;
+
+                nx_set_socket_options(proxy_fd, 0);
+
+                return proxy_fd;
         }
 
-        return 0;
-}
+        memset(&addr, 0, sizeof(addr));
 
-int nx_switch_client_side_descriptors(Channel *channel, int proxy_fd)
-{
-        /*
-         * This is executed on the NX client side to
-         * reassign the SSH channel's descriptors to
-         * the socket we opened with the proxy.
-         */
+        addr.sun_family = AF_UNIX;
 
-        if (nx_switch_internal == 1 &&
-                strcmp("unencrypted", nx_switch_mode) == 0)
+        if (strlcpy(addr.sun_path, nx_switch_path,
+                        sizeof(addr.sun_path)) >= sizeof(addr.sun_path))
         {
-                /*
-                 * Enter the client-side I/O loop.
-                 */
-
-                nx_check_switch = 0;
+                fatal("\r\nNX> 297 Socket path too long: %s", nx_switch_path);
 
-                nx_run_client_side_loop(proxy_fd);
+                return -1;
+        }
 
-                logit("NX> 285 Client side loop completed");
+        logit("\r\nNX> 291 Connecting to: unix:%s", nx_switch_path);
+
+        for (;;)
+        {
+                proxy_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+                if (proxy_fd == -1)
+                {
+                        fatal("\r\nNX> 296 Can't create the connecting socket");
+
+                        return -1;
+                }
+
+                if (connect(proxy_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+                {
+                        break;
+                }
+
+                close(proxy_fd);
+
+                /*
+                 * The proxy may still be setting up
+                 * the socket.
+                 */
+
+                if (--retry_connect > 0)
+                {
+                        error("NX> 294 Connection to: unix:%s failed. Retrying",
+                                   nx_switch_path);
+
+                        nx_wait_timeout(3);
+                }
+                else
+                {
+                        fatal("NX> 290 Failed connection to: unix:%s error: %s",
+                                   nx_switch_path, strerror(errno));
+
+                        return -1;
+                }
+        }
+
+        debug("NX> 294 Connected to proxy at: unix:%s", nx_switch_path);
+
+        nx_set_socket_options(proxy_fd, 0);
+
+        return proxy_fd;
+}
+
+int nx_resolve_switch_host(struct in_addr *address)
+{
+        struct hostent *host;
+
+        if (inet_aton(nx_switch_host, address) != 0)
+        {
+                return 1;
+        }
+
+        host = gethostbyname(nx_switch_host);
+
+        if (host == NULL || host -> h_addrtype != AF_INET)
+        {
+                fatal("\r\nNX> 297 Can't resolve address of host: %s",
+                          nx_switch_host);
+
+                return -1;
+        }
+
+        memcpy(address, host -> h_addr_list[0], sizeof(*address));
+
+        return 1;
+}
+
+int nx_check_proxy_authentication(int proxy_fd)
+{
+        if (*nx_switch_cookie != '\0')
+        {
+                char string[256];
+
+                /*
+                 * String must be terminated with a space.
+                 */
+
+                snprintf(string, 255, "NXSSH-%s cookie=%s ", NX_ADVERTISE_VERSION,
+                             nx_toupper_string(nx_switch_cookie));
+
+                /*
+                 * This should not be required.
+                 */
+
+                *(string + 255) = '\0';
+
+                logit("NX> 285 Sending authentication cookie: %s",
+                          nx_switch_cookie);
+
+                write(proxy_fd, string, strlen(string));
+
+                return 1;
+        }
+
+        return 0;
+}
+
+int nx_switch_client_side_descriptors(Channel *channel, int proxy_fd)
+{
+        /*
+         * This is executed on the NX client side to
+         * reassign the SSH channel's descriptors to
+         * the socket we opened with the proxy.
+         */
+
+        if (nx_switch_internal == 1 &&
+                strcmp("unencrypted", nx_switch_mode) == 0)
+        {
+                /*
+                 * Enter the client-side I/O loop.
+                 */
+
+                nx_check_switch = 0;
+
+                nx_run_client_side_loop(proxy_fd);
+
+                logit("NX> 285 Client side loop completed");
 
                 exit(0);
         }
@@ -1374,11 +2240,30 @@ int nx_switch_client_side_descriptors(Channel *channel, int proxy_fd)
                 logit("NX> 285 Switching descriptors: %d and: %d to: %d",
                             channel->rfd, channel->wfd, proxy_fd);
 
+                /*
+                 * The descriptors are going to refer to a
+                 * different file. Drop them from the channel
+                 * events before, so they are registered anew.
+                 */
+
+                channel_forget_fd(channel->rfd);
+                channel_forget_fd(channel->wfd);
+
+                /*
+                 * From now on the channel carries the NX
+                 * display traffic. Let it be scheduled as
+                 * the X11 channels.
+                 */
+
+                channel_set_output_class(channel, CHAN_SCHED_DISPLAY);
+
                 if (dup2(proxy_fd, channel->rfd) < 0 || dup2(proxy_fd, channel->wfd) < 0)
                 {
                         fatal("\r\nNX> 292 Can't redirect I/O to channel descriptors");
                 }
 
+                channel_fds_replaced(channel);
+
                 close(proxy_fd);
 
                 /*
@@ -1424,14 +2309,16 @@ void nx_switch_server_side_descriptors()
          * from the NX server.
          */
 
+        const char *relay_path;
+
         int proxy_fd;
 
         proxy_fd = nx_open_proxy_connection();
 
         if (proxy_fd < 0)
         {
-                fatal("NX> 290 Can't switch communication to: %s:%d",
-                          nx_switch_host, nx_switch_port);
+                fatal("NX> 290 Can't switch communication to: %s",
+                          nx_switch_target());
         }
 
         /*
@@ -1482,11 +2369,21 @@ void nx_switch_server_side_descriptors()
                               nx_switch_in, nx_switch_out);
         }
 
+        nx_check_switch = 0;
+
         /*
-         * Enter the server-side I/O loop.
+         * Let the relay daemon run the loop, if one
+         * is available, or enter the server-side I/O
+         * loop.
          */
 
-        nx_check_switch = 0;
+        relay_path = nx_get_environment("NX_RELAY_SOCKET");
+
+        if (relay_path != NULL && *relay_path != '\0' &&
+                nx_handover_server_side_loop(relay_path, proxy_fd) == 1)
+        {
+                return;
+        }
 
         nx_run_server_side_loop(proxy_fd);
 }
@@ -1502,6 +2399,14 @@ int nx_switch_forward_descriptors(Channel *channel)
 
         if (nx_switch_in >= 0 && nx_switch_out >= 0)
         {
+                /*
+                 * Drop the descriptors from the channel
+                 * events, so they are registered anew.
+                 */
+
+                channel_forget_fd(channel->rfd);
+                channel_forget_fd(channel->wfd);
+
                 if (dup2(nx_switch_in,  channel->rfd) < 0)
                 {
                         fatal("NX> 290 Can't duplicate descriptor: %d to: %d error: '%s'",
@@ -1523,6 +2428,8 @@ int nx_switch_forward_descriptors(Channel *channel)
                         logit("NX> 285 Duplicated descriptor: %d to: %d",
                                   nx_switch_out, channel->wfd);
                 }
+
+                channel_fds_replaced(channel);
         }
         else
         {
@@ -1553,34 +2460,20 @@ int nx_switch_forward_port(Channel *channel)
         int remote_ip_addr;
         struct sockaddr_in tcp_addr;
 
-        struct hostent *host = gethostbyname(nx_switch_host);
+        struct in_addr address;
 
-        if (host == NULL)
+        if (*nx_switch_path != '\0' || nx_switch_pair != -1)
         {
-                /*
-                 * On some Unices gethostbyname() doesn't
-                 * accept IP addresses, so try inet_addr.
-                 */
-
-                unsigned int address;
-
-                address = (unsigned int) inet_addr(nx_switch_host);
-
-                if (address == INADDR_NONE)
-                {
-                        fatal("\r\nNX> 297 Can't resolve address of host: %s",
-                                      nx_switch_host);
-
-                        goto nx_switch_forward_port_error;
-                }
-
-                remote_ip_addr = (int) address;
+                return nx_switch_forward_local(channel);
         }
-        else
+
+        if (nx_resolve_switch_host(&address) < 0)
         {
-                remote_ip_addr = (*((int *) host -> h_addr_list[0]));
+                goto nx_switch_forward_port_error;
         }
 
+        remote_ip_addr = (int) address.s_addr;
+
         if (remote_ip_addr == 0)
         {
                 fatal("\r\nNX> 297 Cannot accept connections from unknown host: %s",
@@ -1722,11 +2615,16 @@ int nx_switch_forward_port(Channel *channel)
 
         nx_set_socket_options(new_fd, 0);
 
+        channel_forget_fd(channel->rfd);
+        channel_forget_fd(channel->wfd);
+
         if (dup2(new_fd, channel->rfd) < 0 || dup2(new_fd, channel->wfd) < 0)
         {
                 fatal("\r\nNX> 297 Can't redirect port to channel descriptors");
         }
 
+        channel_fds_replaced(channel);
+
         nx_check_switch = 0;
 
         return 1;
@@ -1738,399 +2636,1561 @@ nx_switch_forward_port_error:
         return -1;
 }
 
-void nx_run_server_side_loop(int proxy_fd)
+int nx_switch_forward_local(Channel *channel)
 {
-        /*
-         * This loop is run on the NX server side when the program
-         * is run with the option -B. The loop just copies from the
-         * standard input to the proxy descriptor and from the proxy
-         * descriptor to to the standard output. The standard input
-         * and the standard output of the process are connected by
-         * the NX server to the SSHD's descriptors, so what this
-         * loop does is actually to connect the client side proxy
-         * to an agent running on the NX server.
-         */
-
-        char data[64 * 1024];
+        struct sockaddr_un addr;
 
-        fd_set set;
-
-        int proxy_in  = dup(proxy_fd);
-        int proxy_out = dup(proxy_fd);
-
-        #ifdef NX_REPLACE_STANDARD_DESCRIPTORS
-
-        int channel_in  = fileno(stdin);
-        int channel_out = fileno(stdout);
+        struct stat info;
 
-        #else
+        int retry_accept = 4;
 
-        int channel_in  = nx_switch_in;
-        int channel_out = nx_switch_out;
+        int proxy_fd = -1;
+        int new_fd   = -1;
 
-        #endif
+        uid_t euid;
+        gid_t egid;
 
-        int proxy_in_open   = 1;
-        int channel_in_open = 1;
+        if (nx_switch_pair != -1)
+        {
+                if (fstat(nx_switch_pair, &info) < 0 || !S_ISSOCK(info.st_mode))
+                {
+                        fatal("\r\nNX> 297 Descriptor: %d is not a socket",
+                                      nx_switch_pair);
 
-        int in_fd;
-        int out_fd;
-        int failed_fd;
+                        return -1;
+                }
 
-        int selected;
-        int written;
-        int length;
+                new_fd = nx_switch_pair;
 
-        int result;
+                goto nx_switch_forward_local_done;
+        }
 
-        #if defined(DEBUG) || defined(TIME)
+        memset(&addr, 0, sizeof(addr));
 
-        struct timeval last_ts = nx_get_timestamp();
+        addr.sun_family = AF_UNIX;
 
-        int diff_ts;
+        if (strlcpy(addr.sun_path, nx_switch_path,
+                        sizeof(addr.sun_path)) >= sizeof(addr.sun_path))
+        {
+                fatal("\r\nNX> 297 Socket path too long: %s", nx_switch_path);
 
-        #endif
+                return -1;
+        }
 
         /*
-         * If requested, redirect the debug output.
+         * Remove a socket left behind by a previous
+         * session, but nothing else.
          */
 
-        if (nx_switch_log == 1)
+        if (lstat(nx_switch_path, &info) == 0 && S_ISSOCK(info.st_mode))
         {
-                nx_redirect_log_output();
+                unlink(nx_switch_path);
         }
 
-        close(proxy_fd);
-
-        /*
-         * Set the preferred NX options on all the
-         * involved descriptors. We want blocking
-         * operations on the sockets so that we can
-         * rely on the NX proxy for the buffering
-         * and minimize the context switches.
-         */
-
-        nx_set_socket_options(proxy_in, 1);
-        nx_set_socket_options(proxy_out, 1);
+        proxy_fd = socket(AF_UNIX, SOCK_STREAM, 0);
 
-        nx_set_socket_options(channel_in, 1);
-        nx_set_socket_options(channel_out, 1);
+        if (proxy_fd == -1)
+        {
+                fatal("\r\nNX> 297 Can't create socket error: %s",
+                              strerror(errno));
 
-        signal(SIGPIPE, nx_catch_pipe_signal);
+                return -1;
+        }
 
-        logit("NX> 285 Entering the server side NX loop with proxy at: %s:%d",
-                     nx_switch_host, nx_switch_port);
+        if (bind(proxy_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+                listen(proxy_fd, 4) == -1)
+        {
+                fatal("\r\nNX> 297 Can't listen on: unix:%s error: %s",
+                              nx_switch_path, strerror(errno));
 
-        FD_ZERO(&set);
+                goto nx_switch_forward_local_error;
+        }
 
-nx_run_server_side_loop_start:
+        logit("NX> 291 Waiting for local connection on: unix:%s",
+                  nx_switch_path);
 
-        while (proxy_in_open || channel_in_open)
+        for (;;)
         {
-                selected = 0;
-
-                /*
-                 * Put logging in #ifdef DEBUG to
-                 * save the function calls.
-                 */
+                struct pollfd pfd;
 
-                if (proxy_in_open)
-                {
-                        /*
-                         * Debug output is printed with logit(),
-                         * here, to override the settings that
-                         * might have been passed in the config
-                         * files.
-                         */
+                int result;
 
-                        #ifdef DEBUG
-                        logit("NX> 280 Selecting proxy descriptor");
-                        #endif
+                pfd.fd = proxy_fd;
+                pfd.events = POLLIN;
 
-                        FD_SET(proxy_in, &set);
+                result = poll(&pfd, 1, 20 * 1000);
 
-                        if (proxy_in >= selected)
-                        {
-                                selected = proxy_in + 1;
-                        }
+                if (result == -1)
+                {
+                        fatal("\r\nNX> 297 Call to poll failed error: %s",
+                                      strerror(errno));
 
+                        goto nx_switch_forward_local_error;
                 }
-
-                if (channel_in_open)
+                else if (result > 0)
                 {
-                        #ifdef DEBUG
-                        logit("NX> 280 Selecting channel descriptor");
-                        #endif
+                        new_fd = accept(proxy_fd, NULL, NULL);
 
-                        FD_SET(channel_in, &set);
-
-                        if (channel_in >= selected)
+                        if (new_fd == -1)
                         {
-                                selected = channel_in + 1;
+                                fatal("\r\nNX> 297 Call to accept failed error: %s",
+                                          strerror(errno));
+
+                                goto nx_switch_forward_local_error;
                         }
-                }
 
-                /*
-                 * We could exit when the first end is gone,
-                 * anyway we try to keep the link up to send
-                 * the pending data that would eventually
-                 * come.
-                 */
+                        /*
+                         * Only the user running the session
+                         * is allowed to connect.
+                         */
 
-                #if defined(DEBUG) || defined(TIME)
+                        if (getpeereid(new_fd, &euid, &egid) == 0 &&
+                                euid == getuid())
+                        {
+                                break;
+                        }
 
-                diff_ts = nx_diff_timestamp(last_ts, nx_get_timestamp());
+                        fatal("NX> 297 Refused connection on: unix:%s from uid: %d",
+                                  nx_switch_path, (int) euid);
 
-                #ifdef TIME
+                        goto nx_switch_forward_local_error;
+                }
 
-                if (diff_ts > 20)
+                if (--retry_accept == 0)
                 {
-                        logit("NX> 280 TIME! Spent: %d ms handling messages",
-                                  diff_ts);
-                }
+                        fatal("\r\nNX> 297 Local connection on: unix:%s could not be established",
+                                      nx_switch_path);
 
-                #endif
+                        goto nx_switch_forward_local_error;
+                }
+        }
 
-                last_ts = nx_get_timestamp();
+        close(proxy_fd);
 
-                logit("NX> 280 Entering select at: %s", nx_dump_timestamp());
+        unlink(nx_switch_path);
 
-                #endif
+nx_switch_forward_local_done:
 
-                selected = select(selected, &set, NULL, NULL, NULL);
+        nx_set_socket_options(new_fd, 0);
 
-                #if defined(DEBUG) || defined(TIME)
+        channel_forget_fd(channel->rfd);
+        channel_forget_fd(channel->wfd);
 
-                diff_ts = nx_diff_timestamp(last_ts, nx_get_timestamp());
+        if (dup2(new_fd, channel->rfd) < 0 || dup2(new_fd, channel->wfd) < 0)
+        {
+                fatal("\r\nNX> 297 Can't redirect socket to channel descriptors");
+        }
 
-                logit("NX> 280 Out of select with result: %d at: %s after: %d ms",
-                          selected, nx_dump_timestamp(), diff_ts);
+        channel_fds_replaced(channel);
 
-                #ifdef TIME
+        nx_check_switch = 0;
 
-                if (diff_ts > 20)
-                {
-                        logit("NX> 280 TIME! Spent: %d ms waiting for data",
-                                  diff_ts);
-                }
+        return 1;
 
-                #endif
+nx_switch_forward_local_error:
 
-                last_ts = nx_get_timestamp();
+        if (new_fd != -1)
+        {
+                close(new_fd);
+        }
 
-                #endif
+        close(proxy_fd);
 
-                if (selected <= 0)
-                {
-                        if (selected < 0)
-                        {
-                                #ifdef DEBUG
-                                logit("NX> 280 Got error: %d in select: '%s' at: %s",
-                                          errno, strerror(errno), nx_dump_timestamp());
-                                #endif
+        unlink(nx_switch_path);
 
-                                if (errno == EINTR)
+        return -1;
+}
+
+void nx_run_server_side_loop(int proxy_fd)
+{
+        /*
+         * This loop is run on the NX server side when the program
+         * is run with the option -B. The loop just copies from the
+         * standard input to the proxy descriptor and from the proxy
+         * descriptor to to the standard output. The standard input
+         * and the standard output of the process are connected by
+         * the NX server to the SSHD's descriptors, so what this
+         * loop does is actually to connect the client side proxy
+         * to an agent running on the NX server.
+         */
+
+        NXRelay relays[2];
+
+        NXRelay *relay;
+
+        NXSocketProfile *profile;
+
+        fd_set readfds;
+        fd_set writefds;
+
+        int proxy_in  = dup(proxy_fd);
+        int proxy_out = dup(proxy_fd);
+
+        #ifdef NX_REPLACE_STANDARD_DESCRIPTORS
+
+        int channel_in  = fileno(stdin);
+        int channel_out = fileno(stdout);
+
+        #else
+
+        int channel_in  = nx_switch_in;
+        int channel_out = nx_switch_out;
+
+        #endif
+
+        int selected;
+        int maxfd;
+        int i;
+
+        #ifdef TIME
+
+        unsigned long long spent;
+
+        #endif
+
+        /*
+         * If requested, redirect the debug output.
+         */
+
+        if (nx_switch_log == 1)
+        {
+                nx_redirect_log_output();
+        }
+
+        close(proxy_fd);
+
+        /*
+         * Each direction must be able to shut down
+         * its output without affecting the input of
+         * the other, so give them their own copy of
+         * the channel descriptor if it is shared.
+         */
+
+        if (channel_in == channel_out)
+        {
+                channel_out = dup(channel_in);
+        }
+
+        /*
+         * Set the preferred NX options on all the
+         * involved descriptors. The descriptors are
+         * non-blocking, so that a slow reader on one
+         * side can't stall the opposite direction.
+         */
+
+        nx_set_socket_options(proxy_in, 0);
+        nx_set_socket_options(proxy_out, 0);
+
+        nx_set_socket_options(channel_in, 0);
+        nx_set_socket_options(channel_out, 0);
+
+        signal(SIGPIPE, nx_catch_pipe_signal);
+
+        nx_stats_init(&nx_relay_stats);
+
+        signal(SIGUSR1, nx_catch_stats_signal);
+
+        profile = nx_get_socket_profile(nx_switch_options);
+
+        nx_relay_init(&relays[0], "channel", channel_in, proxy_out, profile, 0);
+        nx_relay_init(&relays[1], "proxy", proxy_in, channel_out, profile, 0);
+
+        logit("NX> 285 Entering the server side NX loop with proxy at: %s",
+                     nx_switch_target());
+
+        for (;;)
+        {
+                if (nx_stats_requested == 1)
+                {
+                        nx_stats_requested = 0;
+
+                        nx_stats_dump(&nx_relay_stats, "signal", relays, 2);
+                }
+
+                FD_ZERO(&readfds);
+                FD_ZERO(&writefds);
+
+                maxfd = -1;
+
+                for (i = 0; i < 2; i++)
+                {
+                        relay = &relays[i];
+
+                        if (nx_relay_wants_read(relay) == 1)
+                        {
+                                FD_SET(relay->in_fd, &readfds);
+
+                                maxfd = MAX(maxfd, relay->in_fd);
+                        }
+
+                        if (nx_relay_wants_write(relay) == 1)
+                        {
+                                FD_SET(relay->out_fd, &writefds);
+
+                                maxfd = MAX(maxfd, relay->out_fd);
+                        }
+                }
+
+                /*
+                 * Keep the link up until both the directions
+                 * are closed, so that the pending data is
+                 * delivered to the other end.
+                 */
+
+                if (maxfd == -1)
+                {
+                        break;
+                }
+
+                #ifdef TIME
+
+                spent = nx_stats_enter_wait(&nx_relay_stats);
+
+                if (spent > 20000)
+                {
+                        logit("NX> 280 TIME! Spent: %llu ms handling messages",
+                                  spent / 1000);
+                }
+
+                #else
+
+                nx_stats_enter_wait(&nx_relay_stats);
+
+                #endif
+
+                #ifdef DEBUG
+                logit("NX> 280 Entering select at: %s", nx_dump_timestamp());
+                #endif
+
+                selected = select(maxfd + 1, &readfds, &writefds, NULL, NULL);
+
+                #ifdef TIME
+
+                spent = nx_stats_leave_wait(&nx_relay_stats);
+
+                if (spent > 20000)
+                {
+                        logit("NX> 280 TIME! Spent: %llu ms waiting for data",
+                                  spent / 1000);
+                }
+
+                #else
+
+                nx_stats_leave_wait(&nx_relay_stats);
+
+                #endif
+
+                #ifdef DEBUG
+                logit("NX> 280 Out of select with result: %d at: %s",
+                          selected, nx_dump_timestamp());
+                #endif
+
+                if (selected < 0)
+                {
+                        if (errno == EINTR)
+                        {
+                                continue;
+                        }
+
+                        error("NX> 280 Failed select on relay descriptors: %s",
+                                  strerror(errno));
+
+                        break;
+                }
+
+                for (i = 0; i < 2; i++)
+                {
+                        relay = &relays[i];
+
+                        if (relay->out_open == 1 && FD_ISSET(relay->out_fd, &writefds))
+                        {
+                                nx_relay_write(relay);
+                        }
+
+                        /*
+                         * Try to write the data as soon as it is
+                         * read. The output is usually writable
+                         * and this saves a trip through select.
+                         */
+
+                        if (relay->in_open == 1 && FD_ISSET(relay->in_fd, &readfds) &&
+                                nx_relay_read(relay) > 0)
+                        {
+                                nx_relay_write(relay);
+                        }
+
+                        nx_relay_check_eof(relay);
+                }
+        }
+
+        logit("NX> 280 Relayed: %llu bytes from channel to proxy and: %llu bytes "
+                  "from proxy to channel", relays[0].bytes, relays[1].bytes);
+
+        nx_stats_dump(&nx_relay_stats, "end", relays, 2);
+
+        signal(SIGUSR1, SIG_DFL);
+
+        for (i = 0; i < 2; i++)
+        {
+                relay = &relays[i];
+
+                if (relay->in_fd != -1)
+                {
+                        close(relay->in_fd);
+                }
+
+                if (relay->out_fd != -1)
+                {
+                        close(relay->out_fd);
+                }
+
+                nx_relay_free(relay);
+        }
+
+        error("NX> 280 Exiting from the server side loop");
+}
+
+void nx_relay_init(NXRelay *relay, const char *name, int in_fd, int out_fd,
+                       NXSocketProfile *profile, int lazy)
+{
+        #if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+
+        int size;
+
+        #endif
+
+        memset(relay, 0, sizeof(NXRelay));
+
+        relay->name = name;
+
+        relay->in_fd  = in_fd;
+        relay->out_fd = out_fd;
+
+        relay->in_open  = 1;
+        relay->out_open = 1;
+
+        relay->size = NX_RELAY_BUFFER_SIZE;
+
+        relay->pipe_fds[0] = -1;
+        relay->pipe_fds[1] = -1;
+
+        relay->lazy = lazy;
+
+        /*
+         * Adapt the output to the link if it is
+         * a TCP socket and the profile asks for it.
+         */
+
+        relay->profile = profile;
+
+        if ((relay->profile->max_buffer > 0 || relay->profile->cork == 1) &&
+                nx_socket_is_tcp(out_fd) == 1)
+        {
+                relay->tune = 1;
+
+                relay->buffer = relay->profile->max_buffer;
+        }
+
+        if (lazy == 1)
+        {
+                return;
+        }
+
+        #ifdef NX_SPLICE_DESCRIPTORS
+
+        /*
+         * The pipe replaces the ring buffer as long
+         * as the descriptors can be spliced. Try to
+         * make it as large as the buffer.
+         */
+
+        if (pipe(relay->pipe_fds) == 0)
+        {
+                #if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+
+                /*
+                 * The kernel may round the size up or cap
+                 * it. Never queue more than the pipe takes,
+                 * or a full pipe would be spliced into.
+                 */
+
+                if ((size = fcntl(relay->pipe_fds[1], F_SETPIPE_SZ, relay->size)) < 0)
+                {
+                        size = fcntl(relay->pipe_fds[1], F_GETPIPE_SZ);
+                }
+
+                if (size > 0)
+                {
+                        relay->size = size;
+                }
+
+                #endif
+
+                debug("NX> 280 Splicing %s data through pipe: %d,%d", name,
+                          relay->pipe_fds[0], relay->pipe_fds[1]);
+
+                relay->splice = 1;
+
+                return;
+        }
+
+        error("NX> 280 Can't create the %s splice pipe: %s", name,
+                  strerror(errno));
+
+        relay->pipe_fds[0] = -1;
+        relay->pipe_fds[1] = -1;
+
+        #endif
+
+        relay->data = xmalloc(relay->size);
+}
+
+void nx_relay_free(NXRelay *relay)
+{
+        if (relay->pipe_fds[0] != -1)
+        {
+                close(relay->pipe_fds[0]);
+                close(relay->pipe_fds[1]);
+
+                relay->pipe_fds[0] = -1;
+                relay->pipe_fds[1] = -1;
+        }
+
+        free(relay->data);
+
+        relay->data = NULL;
+}
+
+int nx_relay_wants_read(NXRelay *relay)
+{
+        if (relay->in_open == 0)
+        {
+                return 0;
+        }
+
+        if (relay->splice == 1)
+        {
+                return (relay->piped < relay->size);
+        }
+
+        return (relay->length < relay->size);
+}
+
+int nx_relay_wants_write(NXRelay *relay)
+{
+        return (relay->out_open == 1 &&
+                    (relay->length > 0 || relay->piped > 0));
+}
+
+int nx_relay_read(NXRelay *relay)
+{
+        struct iovec iov[2];
+
+        int tail;
+        int space;
+        int result;
+
+        #ifdef NX_SPLICE_DESCRIPTORS
+
+        if (relay->splice == 1)
+        {
+                do
+                {
+                        relay->reads++;
+
+                        result = splice(relay->in_fd, NULL, relay->pipe_fds[1], NULL,
+                                            relay->size - relay->piped,
+                                                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                }
+                while (result < 0 && errno == EINTR);
+
+                if (result < 0 && (errno == EINVAL || errno == ENOSYS) &&
+                        relay->piped == 0)
+                {
+                        /*
+                         * Nothing was moved. Read the data in
+                         * the usual way from now on.
+                         */
+
+                        logit("NX> 280 Can't splice %s data. Falling back to copy",
+                                  relay->name);
+
+                        nx_relay_free(relay);
+
+                        relay->splice = 0;
+
+                        relay->data = xmalloc(relay->size);
+                }
+                else
+                {
+                        if (result > 0)
+                        {
+                                relay->piped += result;
+                        }
+
+                        goto nx_relay_read_result;
+                }
+        }
+
+        #endif
+
+        if (relay->data == NULL)
+        {
+                relay->data = xmalloc(relay->size);
+        }
+
+        tail  = (relay->start + relay->length) % relay->size;
+        space = relay->size - relay->length;
+
+        iov[0].iov_base = relay->data + tail;
+        iov[0].iov_len  = MIN(space, relay->size - tail);
+
+        iov[1].iov_base = relay->data;
+        iov[1].iov_len  = space - iov[0].iov_len;
+
+        do
+        {
+                relay->reads++;
+
+                result = readv(relay->in_fd, iov, (iov[1].iov_len > 0 ? 2 : 1));
+        }
+        while (result < 0 && errno == EINTR);
+
+        if (result > 0)
+        {
+                relay->length += result;
+        }
+
+nx_relay_read_result:
+
+        #ifdef DEBUG
+        logit("NX> 280 Read: %d bytes from %s descriptor: %d at: %s",
+                  result, relay->name, relay->in_fd, nx_dump_timestamp());
+        #endif
+
+        if (result > 0)
+        {
+                /*
+                 * Note when the queue stopped being
+                 * empty to measure how long the data
+                 * waits for the output.
+                 */
+
+                if (relay->queued == 0)
+                {
+                        relay->queued = nx_relay_stats.last;
+                }
+
+                relay->bytes += result;
+
+                return result;
+        }
+        else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+                return 0;
+        }
+
+        /*
+         * Stop reading but let the queued data
+         * reach the output descriptor.
+         */
+
+        relay->in_open = 0;
+
+        if (result < 0)
+        {
+                error("NX> 290 Failed read on %s descriptor: %s",
+                          relay->name, strerror(errno));
+
+                return -1;
+        }
+
+        debug("NX> 280 End of input on %s descriptor: %d",
+                  relay->name, relay->in_fd);
+
+        return 0;
+}
+
+int nx_relay_write(NXRelay *relay)
+{
+        struct iovec iov[2];
+
+        int result;
+
+        if (relay->tune == 1)
+        {
+                nx_relay_tune(relay);
+        }
+
+        #ifdef NX_SPLICE_DESCRIPTORS
+
+        if (relay->piped > 0)
+        {
+                do
+                {
+                        relay->writes++;
+
+                        result = splice(relay->pipe_fds[0], NULL, relay->out_fd, NULL,
+                                            relay->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                }
+                while (result < 0 && errno == EINTR);
+
+                if (result < 0 && (errno == EINVAL || errno == ENOSYS))
+                {
+                        /*
+                         * The output descriptor doesn't accept
+                         * the splice. Pull back what is in the
+                         * pipe and write it the usual way.
+                         */
+
+                        logit("NX> 280 Can't splice %s data. Falling back to copy",
+                                  relay->name);
+
+                        relay->data = xmalloc(relay->size);
+
+                        while (relay->length < relay->piped)
+                        {
+                                result = read(relay->pipe_fds[0], relay->data + relay->length,
+                                                  relay->piped - relay->length);
+
+                                if (result < 0 && errno == EINTR)
                                 {
                                         continue;
                                 }
+                                else if (result <= 0)
+                                {
+                                        fatal("NX> 290 Failed read on %s pipe: %s",
+                                                  relay->name, strerror(errno));
+                                }
+
+                                relay->length += result;
+                        }
+
+                        close(relay->pipe_fds[0]);
+                        close(relay->pipe_fds[1]);
+
+                        relay->pipe_fds[0] = -1;
+                        relay->pipe_fds[1] = -1;
+
+                        relay->start  = 0;
+                        relay->piped  = 0;
+                        relay->splice = 0;
+                }
+                else
+                {
+                        if (result > 0)
+                        {
+                                relay->piped -= result;
+                        }
+
+                        goto nx_relay_write_result;
+                }
+        }
+
+        #endif
+
+        iov[0].iov_base = relay->data + relay->start;
+        iov[0].iov_len  = MIN(relay->length, relay->size - relay->start);
+
+        iov[1].iov_base = relay->data;
+        iov[1].iov_len  = relay->length - iov[0].iov_len;
+
+        do
+        {
+                relay->writes++;
+
+                result = writev(relay->out_fd, iov, (iov[1].iov_len > 0 ? 2 : 1));
+        }
+        while (result < 0 && errno == EINTR);
+
+        if (result > 0)
+        {
+                relay->start   = (relay->start + result) % relay->size;
+                relay->length -= result;
+
+                if (relay->length == 0)
+                {
+                        relay->start = 0;
+
+                        if (relay->lazy == 1)
+                        {
+                                free(relay->data);
+
+                                relay->data = NULL;
+                        }
+                }
+        }
+
+nx_relay_write_result:
+
+        #ifdef DEBUG
+        logit("NX> 280 Written: %d bytes to %s descriptor: %d at: %s",
+                  result, relay->name, relay->out_fd, nx_dump_timestamp());
+        #endif
+
+        if (result > 0)
+        {
+                relay->written += result;
+
+                if (relay->length == 0 && relay->piped == 0 && relay->queued != 0)
+                {
+                        relay->stall = MAX(relay->stall, nx_relay_stats.last - relay->queued);
+
+                        relay->queued = 0;
+                }
+
+                /*
+                 * Push out the last partial segment.
+                 */
+
+                if (relay->corked == 1 && relay->length == 0 && relay->piped == 0)
+                {
+                        nx_set_cork(relay->out_fd, 0);
+
+                        relay->corked = 0;
+                }
+
+                return result;
+        }
+        else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+                relay->blocked++;
+
+                return 0;
+        }
+
+        error("NX> 290 Failed write on %s descriptor: %s", relay->name,
+                  (result < 0 ? strerror(errno) : "no data written"));
+
+        nx_relay_close(relay);
+
+        return -1;
+}
+
+void nx_relay_tune(NXRelay *relay)
+{
+        /*
+         * Sample the link at most once per interval.
+         * Cork the output while a large queue is
+         * written, so that it goes in full segments.
+         */
+
+        if (relay->profile->max_buffer > 0 &&
+                nx_relay_stats.last - relay->tuned >= NX_SOCKET_TUNE_INTERVAL)
+        {
+                relay->tuned = nx_relay_stats.last;
+
+                if (nx_tune_socket(relay->out_fd, relay->profile, &relay->buffer) < 0)
+                {
+                        relay->tune = relay->profile->cork;
+                }
+        }
+
+        if (relay->profile->cork == 1 && relay->corked == 0 &&
+                relay->length + relay->piped >= NX_SOCKET_CORK_THRESHOLD)
+        {
+                nx_set_cork(relay->out_fd, 1);
+
+                relay->corked = 1;
+        }
+}
+
+void nx_relay_check_eof(NXRelay *relay)
+{
+        /*
+         * Propagate the end of the input to the
+         * output once the queued data has been
+         * written. Sockets are only shut down for
+         * writing, as the other direction may be
+         * still using the same socket for reading.
+         */
+
+        if (relay->in_open == 0 && relay->out_open == 1 &&
+                relay->length == 0 && relay->piped == 0)
+        {
+                if (shutdown(relay->out_fd, SHUT_WR) < 0)
+                {
+                        close(relay->out_fd);
+
+                        relay->out_fd = -1;
+                }
+
+                relay->out_open = 0;
+
+                logit("NX> 280 Closed %s direction after: %llu bytes",
+                          relay->name, relay->bytes);
+        }
+}
+
+void nx_relay_close(NXRelay *relay)
+{
+        /*
+         * The output is gone. Discard what is queued
+         * and stop reading from the input, but leave
+         * the other direction running.
+         */
+
+        relay->in_open  = 0;
+        relay->out_open = 0;
+
+        relay->start  = 0;
+        relay->length = 0;
+
+        /*
+         * Close the input, so that the peer writing
+         * to it gets an error instead of filling the
+         * socket buffer.
+         */
+
+        nx_daemon_forget(relay->in_fd);
+
+        close(relay->in_fd);
+
+        relay->in_fd = -1;
+
+        relay->queued = 0;
+
+        if (relay->piped > 0 || relay->lazy == 1)
+        {
+                nx_relay_free(relay);
+
+                relay->piped  = 0;
+                relay->splice = 0;
+        }
+
+        logit("NX> 280 Closed %s direction after: %llu bytes",
+                  relay->name, relay->bytes);
+}
+
+int nx_handover_server_side_loop(const char *path, int proxy_fd)
+{
+        struct sockaddr_un addr;
+
+        int fd;
+        int fds[NX_DAEMON_HANDOVER_FDS];
+        int i;
+
+        size_t length;
+        ssize_t result;
+
+        char ack;
+
+        if (strlen(path) >= sizeof(addr.sun_path))
+        {
+                error("NX> 280 Relay daemon socket path too long: %s", path);
+
+                return 0;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+
+        addr.sun_family = AF_UNIX;
+
+        strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        {
+                error("NX> 280 Can't create the relay daemon socket: %s",
+                          strerror(errno));
+
+                return 0;
+        }
+
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        {
+                logit("NX> 280 Can't connect to the relay daemon at: %s: %s. "
+                          "Running the loop locally", path, strerror(errno));
+
+                close(fd);
+
+                return 0;
+        }
+
+        fds[0] = nx_switch_in;
+        fds[1] = nx_switch_out;
+        fds[2] = proxy_fd;
+
+        for (i = 0; i < NX_DAEMON_HANDOVER_FDS; i++)
+        {
+                if (mm_send_fd(fd, fds[i]) < 0)
+                {
+                        close(fd);
+
+                        return 0;
+                }
+        }
+
+        /*
+         * The daemon doesn't know the options of the
+         * switch command. Pass them along, so that it
+         * uses the same socket profile.
+         */
+
+        length = strlen(nx_switch_options) + 1;
+
+        if (atomicio(vwrite, fd, nx_switch_options, length) != length)
+        {
+                error("NX> 280 Can't send the options to the relay daemon at: %s: %s",
+                          path, strerror(errno));
+
+                close(fd);
+
+                return 0;
+        }
+
+        /*
+         * Wait for the daemon to confirm that it got
+         * all the descriptors. If it fails, it closes
+         * its copies and we can still run the loop.
+         */
+
+        if (read(fd, &ack, 1) != 1)
+        {
+                error("NX> 280 The relay daemon at: %s refused the session", path);
+
+                close(fd);
+
+                return 0;
+        }
+
+        logit("NX> 285 Handed over the server side loop to the relay daemon at: %s",
+                  path);
+
+        /*
+         * SSHD stops writing the client data to the
+         * session input as soon as this process is
+         * gone. Drop our copies of the descriptors
+         * and stay around until the daemon closes
+         * the connection at the end of the session.
+         */
+
+        close(nx_switch_in);
+
+        if (nx_switch_out != nx_switch_in)
+        {
+                close(nx_switch_out);
+        }
+
+        close(proxy_fd);
+
+        while ((result = read(fd, &ack, 1)) != 0 && (result > 0 || errno == EINTR))
+        {
+                continue;
+        }
+
+        close(fd);
+
+        logit("NX> 285 Relay daemon at: %s closed the session", path);
+
+        return 1;
+}
+
+void nx_run_relay_daemon(const char *path)
+{
+        /*
+         * Run the server side loop of many sessions
+         * in a single process. Each nxssh -B process
+         * connects to the socket, passes its channel
+         * and proxy descriptors and its options, and
+         * sleeps until the session ends. Sessions
+         * only hold a buffer while data is queued, so
+         * the idle ones cost little more than their
+         * descriptors.
+         */
+
+        struct sockaddr_un addr;
+
+        NXSession *session;
+
+        mode_t old_umask;
+
+        u_int events;
+
+        int listen_fd;
+        int fd;
+        int n;
+
+        if (strlen(path) >= sizeof(addr.sun_path))
+        {
+                fatal("NX> 290 Relay daemon socket path too long: %s", path);
+        }
+
+        memset(&addr, 0, sizeof(addr));
+
+        addr.sun_family = AF_UNIX;
+
+        strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+        if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        {
+                fatal("NX> 290 Can't create the relay daemon socket: %s",
+                          strerror(errno));
+        }
+
+        unlink(path);
+
+        old_umask = umask(0177);
+
+        if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+                listen(listen_fd, SOMAXCONN) < 0)
+        {
+                fatal("NX> 290 Can't listen on relay daemon socket: %s: %s",
+                          path, strerror(errno));
+        }
+
+        umask(old_umask);
+
+        nx_set_nonblocking(listen_fd);
+
+        if ((nx_daemon_events = eventloop_new()) == NULL ||
+                eventloop_set(nx_daemon_events, listen_fd, EVENTLOOP_READ) < 0)
+        {
+                fatal("NX> 290 Can't create the relay daemon event set: %s",
+                          strerror(errno));
+        }
+
+        signal(SIGPIPE, nx_catch_pipe_signal);
+
+        nx_stats_init(&nx_relay_stats);
+
+        signal(SIGUSR1, nx_catch_stats_signal);
+
+        logit("NX> 285 Relay daemon listening at: %s using: %s", path,
+                  eventloop_backend(nx_daemon_events));
+
+        for (;;)
+        {
+                if (nx_stats_requested == 1)
+                {
+                        nx_stats_requested = 0;
+
+                        nx_stats_dump(&nx_relay_stats, "signal", NULL, 0);
+
+                        logit("NX> 280 Stats: sessions=%d", nx_daemon_count);
+
+                        for (session = nx_daemon_sessions; session != NULL;
+                                 session = session->next)
+                        {
+                                logit("NX> 280 Stats: session=%d", session->id);
+
+                                nx_stats_dump_relays(&nx_relay_stats, session->relays, 2);
                         }
+                }
+
+                nx_stats_enter_wait(&nx_relay_stats);
+
+                n = eventloop_wait(nx_daemon_events, -1);
+
+                nx_stats_leave_wait(&nx_relay_stats);
 
-                        error("NX> 280 Failed select on input descriptors");
+                if (n < 0)
+                {
+                        if (errno == EINTR)
+                        {
+                                continue;
+                        }
 
-                        goto nx_run_server_side_loop_end;
+                        fatal("NX> 290 Failed wait on relay daemon descriptors: %s",
+                                  strerror(errno));
                 }
 
-                while (selected-- > 0)
+                while (eventloop_next(nx_daemon_events, &fd, &events) == 1)
                 {
-                        if (FD_ISSET(channel_in, &set))
+                        if (fd == listen_fd)
                         {
-                                #ifdef DEBUG
-                                logit("NX> 280 Channel in descriptor is selected");
-                                #endif
+                                nx_daemon_accept(listen_fd);
 
-                                in_fd  = channel_in;
-                                out_fd = proxy_out;
+                                continue;
                         }
-                        else
+
+                        /*
+                         * The session may have been closed while
+                         * handling the previous descriptors.
+                         */
+
+                        if (fd >= nx_daemon_fds_size || nx_daemon_fds[fd] == NULL)
                         {
-                                #ifdef DEBUG
-                                logit("NX> 280 Proxy in descriptor is selected");
-                                #endif
+                                continue;
+                        }
 
-                                in_fd  = proxy_in;
-                                out_fd = channel_out;
+                        session = nx_daemon_fds[fd];
+
+                        if (fd == session->control)
+                        {
+                                nx_daemon_receive(session);
                         }
+                        else
+                        {
+                                nx_daemon_relay(session, fd, events);
+                        }
+                }
+        }
+}
+
+void nx_daemon_accept(int listen_fd)
+{
+        static int last_id = 0;
 
-                        FD_CLR(in_fd, &set);
+        NXSession *session;
 
-                        for (;;)
+        uid_t uid = (uid_t) -1;
+        gid_t gid;
+
+        int fd;
+
+        for (;;)
+        {
+                if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+                {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                                errno != EINTR && errno != ECONNABORTED)
                         {
-                                #ifdef DEBUG
-                                logit("NX> 280 Going to read from descriptor: %d at: %s",
-                                          in_fd, nx_dump_timestamp());
-                                #endif
+                                error("NX> 290 Failed accept on relay daemon socket: %s",
+                                          strerror(errno));
+                        }
 
-                                length = read(in_fd, data, sizeof(data));
+                        return;
+                }
 
-                                #ifdef DEBUG
-                                logit("NX> 280 Read: %d bytes from descriptor: %d at: %s",
-                                          length, in_fd, nx_dump_timestamp());
-                                #endif
+                if (getpeereid(fd, &uid, &gid) < 0 || uid != getuid())
+                {
+                        error("NX> 290 Refusing relay session from uid: %ld",
+                                  (long) uid);
 
-                                if (length <= 0)
-                                {
-                                        if (length < 0)
-                                        {
-                                                #ifdef DEBUG
-                                                logit("NX> 280 Got error: %d in read: '%s' at: %s",
-                                                          errno, strerror(errno), nx_dump_timestamp());
-                                                #endif
-
-                                                if (errno == EINTR)
-                                                {
-                                                        continue;
-                                                }
-                                        }
-
-                                        #ifdef DEBUG
-                                        logit("NX> 280 Error reading from descriptor: %d at: %s",
-                                                  in_fd, nx_dump_timestamp());
-                                        #endif
-
-                                        failed_fd = in_fd;
-
-                                        goto nx_run_server_side_loop_error;
-                                }
+                        close(fd);
 
-                                written = 0;
+                        continue;
+                }
 
-                                for (;;)
-                                {
-                                        result = write(out_fd, data + written, length - written);
-
-                                        if (result <= 0)
-                                        {
-                                                if (result < 0)
-                                                {
-                                                        #ifdef DEBUG
-                                                        logit("NX> 280 Got error: %d in write: '%s' at: %s",
-                                                                  errno, strerror(errno), nx_dump_timestamp());
-                                                        #endif
-
-                                                        if (errno == EINTR || errno == EAGAIN)
-                                                        {
-                                                                continue;
-                                                        }
-                                                }
-
-                                                #ifdef DEBUG
-                                                logit("NX> 280 Error writing to descriptor: %d at: %s",
-                                                          out_fd, nx_dump_timestamp());
-                                                #endif
-
-                                                failed_fd = out_fd;
-
-                                                goto nx_run_server_side_loop_error;
-                                        }
-
-                                        #ifdef DEBUG
-                                        logit("NX> 280 Written: %d bytes to descriptor: %d at: %s",
-                                                  result, out_fd, nx_dump_timestamp());
-                                        #endif
-
-                                        written += result;
-
-                                        if (written == length)
-                                        {
-                                                break;
-                                        }
-                                }
+                nx_set_nonblocking(fd);
 
-                                break;
-                        }
+                session = xcalloc(1, sizeof(NXSession));
+
+                session->id = ++last_id;
+
+                session->control = fd;
+
+                nx_daemon_map(session, fd);
+
+                if (eventloop_set(nx_daemon_events, fd, EVENTLOOP_READ) < 0)
+                {
+                        error("NX> 290 Can't watch relay session descriptor: %d: %s",
+                                  fd, strerror(errno));
+
+                        nx_daemon_free(session);
+
+                        continue;
                 }
+
+                session->next = nx_daemon_sessions;
+
+                nx_daemon_sessions = session;
+
+                nx_daemon_count++;
         }
+}
 
-nx_run_server_side_loop_end:
+void nx_daemon_receive(NXSession *session)
+{
+        NXSocketProfile *profile;
 
-        error("NX> 280 Exiting from the server side loop");
+        int proxy_out;
+        int fd;
 
-        return;
+        int result;
 
-nx_run_server_side_loop_error:
+        /*
+         * Each descriptor comes with its own byte,
+         * so a readable socket always has one ready.
+         */
+
+        if (session->received < NX_DAEMON_HANDOVER_FDS)
+        {
+                if ((fd = mm_receive_fd(session->control)) < 0)
+                {
+                        error("NX> 290 Failed handover of relay session: %d", session->id);
+
+                        nx_daemon_free(session);
+
+                        return;
+                }
+
+                nx_daemon_map(session, fd);
+
+                session->fds[session->received++] = fd;
+
+                return;
+        }
+
+        /*
+         * The options follow the descriptors and
+         * end with a null.
+         */
 
-        #ifdef NX_SELECTIVELY_CLOSE_DESCRIPTORS
+        result = read(session->control, session->options + session->length,
+                          sizeof(session->options) - session->length);
 
-        if (failed_fd == proxy_in)
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                               errno == EINTR))
         {
-                error("NX> 290 Failed read on proxy descriptor");
+                return;
+        }
+        else if (result <= 0)
+        {
+                error("NX> 290 Failed handover of relay session: %d", session->id);
 
-                close(proxy_in);
-                close(channel_out);
+                nx_daemon_free(session);
 
-                proxy_in_open = 0;
+                return;
         }
-        else if (failed_fd == proxy_out)
+
+        session->length += result;
+
+        if (memchr(session->options, '\0', session->length) == NULL)
         {
-                error("NX> 290 Failed write on proxy descriptor");
+                if (session->length == sizeof(session->options))
+                {
+                        error("NX> 290 Options too long in relay session: %d",
+                                  session->id);
 
-                close(proxy_out);
-                close(channel_in);
+                        nx_daemon_free(session);
+                }
 
-                channel_in_open = 0;
+                return;
         }
-        else if (failed_fd == channel_in)
+
+        profile = nx_get_socket_profile(session->options);
+
+        /*
+         * The proxy socket is used for both the
+         * directions. Give each its own copy, as
+         * in the server side loop.
+         */
+
+        if ((proxy_out = dup(session->fds[2])) < 0)
         {
-                error("NX> 290 Failed read on channel descriptor");
+                error("NX> 290 Can't duplicate proxy descriptor of relay session: %d",
+                          session->id);
 
-                close(proxy_out);
-                close(channel_in);
+                nx_daemon_free(session);
 
-                channel_in_open = 0;
+                return;
         }
-        else
+
+        nx_daemon_map(session, proxy_out);
+
+        session->fds[session->received++] = proxy_out;
+
+        for (fd = 0; fd < session->received; fd++)
+        {
+                nx_set_profile_options(session->fds[fd], 0, profile);
+        }
+
+        nx_relay_init(&session->relays[0], "channel", session->fds[0], proxy_out,
+                          profile, 1);
+        nx_relay_init(&session->relays[1], "proxy", session->fds[2], session->fds[1],
+                          profile, 1);
+
+        /*
+         * Keep the control connection open but stop
+         * watching it. Closing it tells the nxssh
+         * process that the session is over.
+         */
+
+        eventloop_set(nx_daemon_events, session->control, 0);
+
+        if (write(session->control, "", 1) != 1)
+        {
+                error("NX> 290 Can't confirm relay session: %d", session->id);
+        }
+
+        logit("NX> 285 Relaying session: %d channel: %d,%d proxy: %d,%d sessions: %d "
+                  "options: '%s'", session->id, session->fds[0], session->fds[1],
+                      session->fds[2], proxy_out, nx_daemon_count, session->options);
+
+        nx_daemon_update(session);
+}
+
+void nx_daemon_relay(NXSession *session, int fd, u_int events)
+{
+        NXRelay *relay;
+
+        int out_fd;
+        int i;
+
+        for (i = 0; i < 2; i++)
         {
-                error("NX> 290 Failed write on channel descriptor");
+                relay = &session->relays[i];
+
+                if (relay->out_open == 1 && fd == relay->out_fd &&
+                        (events & EVENTLOOP_WRITE))
+                {
+                        nx_relay_write(relay);
+                }
+
+                if (relay->in_open == 1 && fd == relay->in_fd &&
+                        (events & EVENTLOOP_READ) && nx_relay_read(relay) > 0)
+                {
+                        nx_relay_write(relay);
+                }
+
+                /*
+                 * The output may be closed instead of shut
+                 * down. Remove it from the set beforehand.
+                 */
+
+                out_fd = relay->out_fd;
+
+                if (relay->in_open == 0 && relay->out_open == 1)
+                {
+                        eventloop_set(nx_daemon_events, out_fd, 0);
+                }
 
-                close(proxy_in);
-                close(channel_out);
+                nx_relay_check_eof(relay);
 
-                proxy_in_open = 0;
+                if (relay->out_fd == -1 && out_fd != -1)
+                {
+                        nx_daemon_fds[out_fd] = NULL;
+                }
         }
 
-        #else /* #ifdef NX_SELECTIVELY_CLOSE_DESCRIPTORS */
+        nx_daemon_update(session);
+}
+
+void nx_daemon_update(NXSession *session)
+{
+        NXRelay *relay;
+
+        int active = 0;
+        int i;
 
-        if (failed_fd == proxy_in)
+        for (i = 0; i < 2; i++)
         {
-                error("NX> 290 Failed read on proxy descriptor");
+                relay = &session->relays[i];
+
+                if (relay->in_fd != -1)
+                {
+                        eventloop_set(nx_daemon_events, relay->in_fd,
+                                          nx_relay_wants_read(relay) ? EVENTLOOP_READ : 0);
+                }
+
+                if (relay->out_fd != -1)
+                {
+                        eventloop_set(nx_daemon_events, relay->out_fd,
+                                          nx_relay_wants_write(relay) ? EVENTLOOP_WRITE : 0);
+                }
+
+                if (relay->in_open == 1 || relay->out_open == 1)
+                {
+                        active = 1;
+                }
         }
-        else if (failed_fd == proxy_out)
+
+        if (active == 0)
         {
-                error("NX> 290 Failed write on proxy descriptor");
+                logit("NX> 280 Relayed session: %d: %llu bytes from channel to proxy "
+                          "and: %llu bytes from proxy to channel", session->id,
+                              session->relays[0].bytes, session->relays[1].bytes);
+
+                nx_daemon_free(session);
         }
-        else if (failed_fd == channel_in)
+}
+
+void nx_daemon_map(NXSession *session, int fd)
+{
+        int size;
+
+        if (fd >= nx_daemon_fds_size)
         {
-                error("NX> 290 Failed read on channel descriptor");
+                size = MAX(fd + 1, nx_daemon_fds_size * 2);
+
+                nx_daemon_fds = xreallocarray(nx_daemon_fds, size, sizeof(NXSession *));
+
+                memset(nx_daemon_fds + nx_daemon_fds_size, 0,
+                           (size - nx_daemon_fds_size) * sizeof(NXSession *));
+
+                nx_daemon_fds_size = size;
         }
-        else
+
+        nx_daemon_fds[fd] = session;
+}
+
+void nx_daemon_forget(int fd)
+{
+        /*
+         * Remove a relay descriptor from the daemon
+         * set before it is closed. Another copy of
+         * the socket would keep it registered.
+         */
+
+        if (nx_daemon_events != NULL && fd >= 0 && fd < nx_daemon_fds_size)
         {
-                error("NX> 290 Failed write on channel descriptor");
+                eventloop_set(nx_daemon_events, fd, 0);
+
+                nx_daemon_fds[fd] = NULL;
         }
+}
 
-        close(proxy_in);
-        close(proxy_out);
+void nx_daemon_free(NXSession *session)
+{
+        NXSession **link;
 
-        close(channel_out);
-        close(channel_in);
+        int fd;
+        int i;
 
-        proxy_in_open = 0;
-        channel_in_open = 0;
+        /*
+         * Descriptors closed before the end of the
+         * session may have been reused by another
+         * one. Only release those that are still
+         * mapped to this session.
+         */
 
-        #endif /* #ifdef NX_SELECTIVELY_CLOSE_DESCRIPTORS */
+        eventloop_set(nx_daemon_events, session->control, 0);
 
-        signal(SIGPIPE, nx_catch_pipe_signal);
+        nx_daemon_fds[session->control] = NULL;
+
+        close(session->control);
+
+        /*
+         * The relays are only set up once the copy
+         * of the proxy descriptor has been added.
+         */
+
+        if (session->received > NX_DAEMON_HANDOVER_FDS)
+        {
+                for (i = 0; i < 2; i++)
+                {
+                        nx_relay_free(&session->relays[i]);
+                }
+        }
+
+        for (i = 0; i < session->received; i++)
+        {
+                fd = session->fds[i];
+
+                if (fd < nx_daemon_fds_size && nx_daemon_fds[fd] == session)
+                {
+                        eventloop_set(nx_daemon_events, fd, 0);
+
+                        nx_daemon_fds[fd] = NULL;
+
+                        close(fd);
+                }
+        }
+
+        for (link = &nx_daemon_sessions; *link != NULL; link = &(*link)->next)
+        {
+                if (*link == session)
+                {
+                        *link = session->next;
+
+                        nx_daemon_count--;
+
+                        break;
+                }
+        }
 
-        goto nx_run_server_side_loop_start;
+        free(session);
 }
 
 void nx_run_client_side_loop(int proxy_fd)
@@ -2180,45 +4240,151 @@ void nx_catch_pipe_signal(int number)
 {
 }
 
-void nx_dump_buffer(Buffer *buffer)
+void nx_catch_stats_signal(int number)
 {
-        unsigned int i;
-        unsigned int l;
+        nx_stats_requested = 1;
+}
 
-        unsigned char *p = buffer->d;
+unsigned long long nx_stats_time()
+{
+        return (unsigned long long) (monotime_double() * 1000000);
+}
 
-        char line[136];
+void nx_stats_init(NXStats *stats)
+{
+        memset(stats, 0, sizeof(NXStats));
 
-        debug("---");
+        stats->start = nx_stats_time();
+        stats->last  = stats->start;
+}
 
-        for (i = buffer->off, l = 0; i < buffer->size; i++, l++)
+void nx_stats_add(NXHistogram *histogram, unsigned long long value)
+{
+        int bucket = 0;
+
+        while (bucket < NX_STATS_BUCKETS - 1 &&
+                   value >= ((unsigned long long) NX_STATS_FIRST_BUCKET << bucket))
         {
-                line[l] = p[i];
+                bucket++;
+        }
 
-                if (line[l] == '%')
-                {
-                        line[l] = '?';
-                }
+        histogram->buckets[bucket]++;
 
-                if (l == 134)
-                {
-                        line[l]     = '\\';
-                        line[l + 1] = '\0';
+        histogram->count++;
+        histogram->total += value;
 
-                        debug("%s", line);
+        if (value > histogram->max)
+        {
+                histogram->max = value;
+        }
+}
 
-                        l = 0;
+unsigned long long nx_stats_enter_wait(NXStats *stats)
+{
+        unsigned long long now = nx_stats_time();
+        unsigned long long spent = 0;
+
+        /*
+         * The first wait has no handling before
+         * it, unless the stats were initialized.
+         */
+
+        if (stats->last != 0)
+        {
+                spent = now - stats->last;
+
+                nx_stats_add(&stats->handle, spent);
+        }
+        else
+        {
+                stats->start = now;
+        }
+
+        stats->last = now;
+
+        return spent;
+}
+
+unsigned long long nx_stats_leave_wait(NXStats *stats)
+{
+        unsigned long long now = nx_stats_time();
+        unsigned long long spent = now - stats->last;
+
+        nx_stats_add(&stats->wait, spent);
+
+        stats->last = now;
+
+        return spent;
+}
+
+void nx_stats_dump(NXStats *stats, const char *reason,
+                       NXRelay *relays, int count)
+{
+        /*
+         * One line per record, so that the values
+         * can be extracted from the log with the
+         * usual tools.
+         */
+
+        logit("NX> 280 Stats: reason=%s elapsed_us=%llu first_bucket_us=%d buckets=%d",
+                  reason, nx_stats_time() - stats->start, NX_STATS_FIRST_BUCKET,
+                      NX_STATS_BUCKETS);
+
+        nx_stats_dump_histogram("wait", &stats->wait);
+        nx_stats_dump_histogram("handle", &stats->handle);
+
+        nx_stats_dump_relays(stats, relays, count);
+}
+
+void nx_stats_dump_relays(NXStats *stats, NXRelay *relays, int count)
+{
+        NXRelay *relay;
+
+        unsigned long long stall;
+
+        int i;
+
+        for (i = 0; i < count; i++)
+        {
+                relay = &relays[i];
+
+                /*
+                 * Account the data that is still waiting
+                 * for the output.
+                 */
+
+                stall = relay->stall;
+
+                if (relay->queued != 0)
+                {
+                        stall = MAX(stall, stats->last - relay->queued);
                 }
+
+                logit("NX> 280 Stats: direction=%s bytes_in=%llu bytes_out=%llu "
+                          "reads=%llu writes=%llu blocked=%llu max_stall_us=%llu",
+                              relay->name, relay->bytes, relay->written, relay->reads,
+                                  relay->writes, relay->blocked, stall);
         }
+}
 
-        line[l] = '\0';
+void nx_stats_dump_histogram(const char *name, NXHistogram *histogram)
+{
+        char buckets[NX_STATS_BUCKETS * 21];
 
-        if (line[0] != '\0')
+        int length = 0;
+        int i;
+
+        buckets[0] = '\0';
+
+        for (i = 0; i < NX_STATS_BUCKETS; i++)
         {
-            debug("%s", line);
+                length += snprintf(buckets + length, sizeof(buckets) - length,
+                                       "%s%llu", (i > 0 ? "," : ""), histogram->buckets[i]);
         }
 
-        debug("---");
+        logit("NX> 280 Stats: histogram=%s count=%llu total_us=%llu max_us=%llu "
+                  "hist=%s", name, histogram->count, histogram->total,
+                      histogram->max, buckets);
 }
 
 void nx_dump_string(char *string)
@@ -2313,80 +4479,6 @@ char *nx_dump_timestamp()
 
 #endif
 
-char *nx_search_string_in_buffer(Buffer *buffer, char *start, const char *string)
-{
-        char *end;
-        char *found;
-
-        int temporary;
-
-        if (start == NULL)
-        {
-                start = buffer_ptr(buffer);
-        }
-
-        /*
-         * Ensure buffer is either null-terminated
-         * or terminated by a newline.
-         */
-
-        end = nx_search_newline_in_buffer(buffer, start);
-
-        if (end == NULL)
-        {
-                return NULL;
-        }
-
-        temporary = *end;
-
-        *end = '\0';
-
-        found = strstr(start, string);
-
-        *end = temporary;
-
-        return found;
-}
-
-char *nx_remove_string_in_buffer(Buffer *buffer, char *start, int length)
-{
-        int left;
-        int right;
-
-        char *temporary = xmalloc(buffer_len(buffer));
-
-        if (temporary == NULL)
-        {
-                fatal("NX> 298 Out of memory creating the temporary string");
-
-                return NULL;
-        }
-
-        left = start - (char *) buffer_ptr(buffer);
-
-        debug("NX> 280 Lefthand remaining bytes are: %d", left);
-
-        memcpy(temporary, buffer_ptr(buffer), left);
-
-        debug("NX> 280 Righthand remaining bytes are: %d", left);
-
-        right = buffer_len(buffer) - left - length - 1;
-
-        memcpy(temporary + left, start + length + 1, right);
-
-        left += right;
-
-        debug("NX> 280 Total remaining bytes are: %d", left);
-
-        buffer_clear(buffer);
-
-        buffer_append(buffer, temporary, left);
-
-        xfree(temporary);
-
-        return buffer_ptr(buffer);
-}
-
 char *nx_search_char_in_buffer(Buffer *buffer, char *start, int value)
 {
         char *end;
@@ -2487,6 +4579,11 @@ void nx_wait_timeout(int seconds)
 }
 
 void nx_set_socket_options(int fd, int blocking)
+{
+        nx_set_profile_options(fd, blocking, nx_get_socket_profile(nx_switch_options));
+}
+
+void nx_set_profile_options(int fd, int blocking, NXSocketProfile *profile)
 {
         /*
          * This is unused at the moment but declared
@@ -2508,7 +4605,207 @@ void nx_set_socket_options(int fd, int blocking)
         }
 
         nx_set_nodelay(fd);
-        nx_set_lowdelay(fd);
+
+        if (profile->lowdelay == 1)
+        {
+                nx_set_lowdelay(fd);
+        }
+        else
+        {
+                nx_set_tos(fd, IPTOS_THROUGHPUT, "IPTOS_THROUGHPUT");
+        }
+
+        if (profile->link == NULL || nx_socket_is_tcp(fd) == 0)
+        {
+                return;
+        }
+
+        debug("NX> 286 Using socket profile: %s on descriptor: %d",
+                  profile->link, fd);
+
+        if (profile->notsent_lowat > 0)
+        {
+                nx_set_notsent_lowat(fd, profile->notsent_lowat);
+        }
+
+        /*
+         * Start from the largest buffer and let
+         * the relay adapt it to the link.
+         */
+
+        if (profile->max_buffer > 0)
+        {
+                nx_set_buffers(fd, profile->max_buffer);
+        }
+}
+
+NXSocketProfile *nx_get_socket_profile(const char *options)
+{
+        NXSocketProfile *profile;
+
+        const char *value;
+
+        int length;
+
+        /*
+         * The options are only known after the
+         * switch, so don't cache the result.
+         */
+
+        for (value = options; (value = strstr(value, "link=")) != NULL;
+                 value += 5)
+        {
+                if (value == options || *(value - 1) == ',')
+                {
+                        break;
+                }
+        }
+
+        for (profile = nx_socket_profiles; profile->link != NULL; profile++)
+        {
+                if (value == NULL)
+                {
+                        continue;
+                }
+
+                length = strlen(profile->link);
+
+                if (strncmp(value + 5, profile->link, length) == 0 &&
+                        (value[5 + length] == '\0' || value[5 + length] == ',' ||
+                             value[5 + length] == ':'))
+                {
+                        break;
+                }
+        }
+
+        return profile;
+}
+
+int nx_socket_is_tcp(int fd)
+{
+        struct sockaddr_storage addr;
+
+        socklen_t length = sizeof(addr);
+
+        int type;
+
+        if (getsockname(fd, (struct sockaddr *) &addr, &length) < 0 ||
+                (addr.ss_family != AF_INET && addr.ss_family != AF_INET6))
+        {
+                return 0;
+        }
+
+        length = sizeof(type);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) < 0 ||
+                type != SOCK_STREAM)
+        {
+                return 0;
+        }
+
+        return 1;
+}
+
+void nx_set_notsent_lowat(int fd, int bytes)
+{
+        #ifdef TCP_NOTSENT_LOWAT
+
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes)) < 0)
+        {
+                debug("NX> 286 Failed to set TCP_NOTSENT_LOWAT on descriptor: %d: %s",
+                          fd, strerror(errno));
+
+                return;
+        }
+
+        debug("NX> 286 Set TCP_NOTSENT_LOWAT to: %d on descriptor: %d", bytes, fd);
+
+        #endif
+}
+
+void nx_set_buffers(int fd, int bytes)
+{
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes)) < 0 ||
+                setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) < 0)
+        {
+                debug("NX> 286 Failed to set the socket buffers on descriptor: %d: %s",
+                          fd, strerror(errno));
+
+                return;
+        }
+
+        debug("NX> 286 Set socket buffers to: %d on descriptor: %d", bytes, fd);
+}
+
+void nx_set_cork(int fd, int cork)
+{
+        #ifdef TCP_CORK
+
+        if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) < 0)
+        {
+                debug("NX> 286 Failed to set TCP_CORK on descriptor: %d: %s",
+                          fd, strerror(errno));
+        }
+
+        #endif
+}
+
+int nx_tune_socket(int fd, NXSocketProfile *profile, int *buffer)
+{
+        #ifdef TCP_INFO
+
+        struct tcp_info info;
+
+        socklen_t length = sizeof(info);
+
+        unsigned long long bdp;
+        unsigned long long rate;
+
+        int target;
+
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) < 0)
+        {
+                return -1;
+        }
+
+        if (info.tcpi_rtt == 0 || info.tcpi_snd_cwnd == 0)
+        {
+                return 0;
+        }
+
+        /*
+         * The congestion window is what the link
+         * is currently taking in a round trip, so
+         * it measures both the delivery rate and
+         * the bandwidth-delay product. Keep twice
+         * as much in the buffers, so that the link
+         * doesn't starve between our writes.
+         */
+
+        bdp  = (unsigned long long) info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+        rate = bdp * 1000000 / info.tcpi_rtt;
+
+        target = MIN(MAX(2 * bdp, (unsigned long long) profile->min_buffer),
+                         (unsigned long long) profile->max_buffer);
+
+        if (*buffer == 0 || target > *buffer + *buffer / 4 ||
+                target < *buffer - *buffer / 4)
+        {
+                debug("NX> 286 Sampled rtt: %u us rate: %llu bytes/s on descriptor: %d. "
+                          "Setting buffers to: %d", info.tcpi_rtt, rate, fd, target);
+
+                nx_set_buffers(fd, target);
+
+                *buffer = target;
+        }
+
+        return 1;
+
+        #else
+
+        return -1;
+
+        #endif
 }
 
 static int nx_set_nonblocking(int fd)
@@ -2633,10 +4930,15 @@ static int nx_set_keepalive(int fd)
 }
 
 static int nx_set_lowdelay(int fd)
+{
+        return nx_set_tos(fd, IPTOS_LOWDELAY, "IPTOS_LOWDELAY");
+}
+
+static int nx_set_tos(int fd, int tos, const char *name)
 {
         int result;
 
-        int flag = IPTOS_LOWDELAY;
+        int flag = tos;
 
         #if defined(__CYGWIN32__)
 
@@ -2644,7 +4946,7 @@ static int nx_set_lowdelay(int fd)
 
         #endif
 
-        debug("NX> 286 Trying IPTOS_LOWDELAY on descriptor: %d", fd);
+        debug("NX> 286 Trying %s on descriptor: %d", name, fd);
 
         result = setsockopt(fd, IPPROTO_IP, IP_TOS, &flag, sizeof(flag));
 
@@ -2673,15 +4975,15 @@ static int nx_set_lowdelay(int fd)
 
         if (result < 0)
         {
-                error("NX> 286 Failed to set IPTOS_LOWDELAY on descriptor: %d", fd);
+                error("NX> 286 Failed to set %s on descriptor: %d", name, fd);
         }
         else if (result == 0)
         {
-                debug("NX> 286 Option IPTOS_LOWDELAY not supported on: %d", fd);
+                debug("NX> 286 Option %s not supported on: %d", name, fd);
         }
         else
         {
-                debug("NX> 286 Set IPTOS_LOWDELAY on descriptor: %d", fd);
+                debug("NX> 286 Set %s on descriptor: %d", name, fd);
         }
 
         return result;
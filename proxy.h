@@ -45,6 +45,8 @@ extern char nx_switch_cookie[256];
 extern char nx_switch_host[256];
 extern int  nx_switch_proxy;
 extern int  nx_switch_port;
+extern char nx_switch_path[128];
+extern int  nx_switch_pair;
 extern int  nx_switch_in;
 extern int  nx_switch_out;
 extern char nx_switch_mode[256];
@@ -53,16 +55,35 @@ extern int  nx_switch_internal;
 extern int  nx_switch_forward;
 
 /*
- * Buffer the input while looking for the command.
- * The buffering happens by flushing the input when
- * a newline is received. This means that all input
- * should be terminated with a newline or it will
- * remain in the buffer and will never be sent to
- * the packet interface.
+ * Look for the command in the input as it is read.
+ * Data that can't be part of the command is left
+ * in place. The command is removed together with
+ * its terminating newline. A partial match at the
+ * end of the data is held back and returned in
+ * front of the next read if it turns out not to
+ * be the command, so the caller must leave room
+ * for NX_SWITCH_HOLD_SIZE bytes after the data.
  */
 
+#define NX_SWITCH_HOLD_SIZE     32
+
+/*
+ * Maximum length of the switch command including
+ * its parameters.
+ */
+
+#define NX_SWITCH_COMMAND_SIZE  256
+
 int nx_check_channel_input(Channel *channel, char *data, int *length, int limit);
 
+/*
+ * Return the bytes held back as a possible switch
+ * command when the channel input ends. Returns the
+ * number of bytes copied to data.
+ */
+
+int nx_flush_channel_input(Channel *channel, char *data, int limit);
+
 /*
  * Init buffer
  */
@@ -76,6 +97,20 @@ void nx_proxy_init();
 int nx_proxy_select(int maxfds, fd_set *readfds, fd_set *writefds,
                         fd_set *exceptfds, struct timeval *timeout);
 
+/*
+ * Tell if the client loop must wait through
+ * nx_proxy_select() with the select sets.
+ */
+
+int nx_proxy_running();
+
+/*
+ * Drop a descriptor about to be closed or replaced
+ * from the event set used by nx_proxy_select().
+ */
+
+void nx_proxy_forget_fd(int fd);
+
 /*
  * Connect to the NX transport.
  */
@@ -127,6 +162,14 @@ int nx_check_standard_input();
 
 void nx_switch_server_side_descriptors();
 
+/*
+ * Run the server side loop of the sessions handed
+ * over on the given Unix socket. The nxssh -B pro-
+ * cesses find it in NX_RELAY_SOCKET. Never returns.
+ */
+
+void nx_run_relay_daemon(const char *path);
+
 /*
  * Set the preferred options for using the socket
  * with NX.
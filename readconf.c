@@ -67,6 +67,7 @@
 #if defined(HAVE_STRNVIS) && defined(HAVE_VIS_H) && !defined(BROKEN_STRNVIS)
 # include <vis.h>
 #endif
+#include "openbsd-compat/sys-queue.h"
 
 #include "xmalloc.h"
 #include "ssh.h"
@@ -76,6 +77,8 @@
 #include "log.h"
 #include "sshkey.h"
 #include "misc.h"
+#include "buffer.h"
+#include "channels.h"
 #include "readconf.h"
 #include "match.h"
 #include "kex.h"
@@ -169,14 +172,15 @@ typedef enum {
 	oGlobalKnownHostsFile, oUserKnownHostsFile, oConnectionAttempts,
 	oBatchMode, oCheckHostIP, oStrictHostKeyChecking, oHostKeyAdd, oOnlyCheck,
 	oCompression, oCompressionLevel, oTCPKeepAlive, oNumberOfPasswordPrompts,
-	oUsePrivilegedPort, oLogLevel, oCiphers, oProtocol, oMacs,
+	oUsePrivilegedPort, oLogLevel, oCiphers, oCipherThreads, oProtocol, oMacs,
 	oPubkeyAuthentication,
 	oKbdInteractiveAuthentication, oKbdInteractiveDevices, oHostKeyAlias,
 	oDynamicForward, oPreferredAuthentications, oHostbasedAuthentication,
 	oHostKeyAlgorithms, oBindAddress, oPKCS11Provider,
 	oClearAllForwardings, oNoHostAuthenticationForLocalhost,
-	oEnableSSHKeysign, oRekeyLimit, oVerifyHostKeyDNS, oConnectTimeout,
-	oAddressFamily, oGssAuthentication, oGssDelegateCreds,
+	oEnableSSHKeysign, oRekeyLimit, oRekeyIdle, oChannelWindowMax,
+	oChannelScheduler, oChannelAcceptBatch, oVerifyHostKeyDNS,
+	oConnectTimeout, oAddressFamily, oGssAuthentication, oGssDelegateCreds,
 	oServerAliveInterval, oServerAliveCountMax, oIdentitiesOnly,
 	oSendEnv, oControlPath, oControlMaster, oControlPersist,
 	oHashKnownHosts,
@@ -264,6 +268,7 @@ static struct {
 	{ "port", oPort },
 	{ "cipher", oCipher },
 	{ "ciphers", oCiphers },
+	{ "cipherthreads", oCipherThreads },
 	{ "macs", oMacs },
 	{ "protocol", oProtocol },
 	{ "remoteforward", oRemoteForward },
@@ -294,6 +299,10 @@ static struct {
 	{ "verifyhostkeydns", oVerifyHostKeyDNS },
 	{ "nohostauthenticationforlocalhost", oNoHostAuthenticationForLocalhost },
 	{ "rekeylimit", oRekeyLimit },
+	{ "rekeyidle", oRekeyIdle },
+	{ "channelwindowmax", oChannelWindowMax },
+	{ "channelscheduler", oChannelScheduler },
+	{ "channelacceptbatch", oChannelAcceptBatch },
 	{ "connecttimeout", oConnectTimeout },
 	{ "addressfamily", oAddressFamily },
 	{ "serveraliveinterval", oServerAliveInterval },
@@ -1071,6 +1080,63 @@ parse_time:
 		}
 		break;
 
+	case oRekeyIdle:
+		arg = strdelim(&s);
+		if (!arg || *arg == '\0')
+			fatal("%.200s line %d: Missing argument.", filename,
+			    linenum);
+		if (strcmp(arg, "no") == 0)
+			value = 0;
+		else {
+			value = strtol(arg, &endofnumber, 10);
+			if (arg == endofnumber || *endofnumber != '\0' ||
+			    value < 1 || value > 100)
+				fatal("%.200s line %d: Bad RekeyIdle "
+				    "percentage '%s'.", filename, linenum, arg);
+		}
+		if (*activep && options->rekey_idle_percent == -1)
+			options->rekey_idle_percent = value;
+		if (s != NULL && *s != '\0') { /* optional idle time */
+			intptr = &options->rekey_idle_time;
+			goto parse_time;
+		}
+		break;
+
+	case oChannelWindowMax:
+		arg = strdelim(&s);
+		if (!arg || *arg == '\0')
+			fatal("%.200s line %d: Missing argument.", filename,
+			    linenum);
+		if (strcmp(arg, "none") == 0) {
+			val64 = 0;
+		} else {
+			if (scan_scaled(arg, &val64) == -1)
+				fatal("%.200s line %d: Bad number '%s': %s",
+				    filename, linenum, arg, strerror(errno));
+			if (val64 < 0 || val64 > 1024 * 1024 * 1024)
+				fatal("%.200s line %d: Bad ChannelWindowMax "
+				    "'%s'.", filename, linenum, arg);
+		}
+		if (*activep && options->channel_window_max == -1)
+			options->channel_window_max = val64;
+		break;
+
+	case oChannelScheduler:
+		arg = strdelim(&s);
+		if (!arg || *arg == '\0')
+			fatal("%.200s line %d: Missing argument.", filename,
+			    linenum);
+		if (!channel_scheduler_valid(arg))
+			fatal("%.200s line %d: Bad ChannelScheduler '%s'.",
+			    filename, linenum, arg);
+		if (*activep && options->channel_scheduler == NULL)
+			options->channel_scheduler = xstrdup(arg);
+		break;
+
+	case oChannelAcceptBatch:
+		intptr = &options->channel_accept_batch;
+		goto parse_int;
+
 	case oIdentityFile:
 		arg = strdelim(&s);
 		if (!arg || *arg == '\0')
@@ -1230,6 +1296,10 @@ parse_int:
 			options->ciphers = xstrdup(arg);
 		break;
 
+	case oCipherThreads:
+		intptr = &options->cipher_threads;
+		goto parse_int;
+
 	case oMacs:
 		arg = strdelim(&s);
 		if (!arg || *arg == '\0')
@@ -1848,6 +1918,7 @@ initialize_options(Options * options)
 	options->number_of_password_prompts = -1;
 	options->cipher = -1;
 	options->ciphers = NULL;
+	options->cipher_threads = -1;
 	options->macs = NULL;
 	options->kex_algorithms = NULL;
 	options->hostkeyalgorithms = NULL;
@@ -1878,6 +1949,11 @@ initialize_options(Options * options)
 	options->identities_only = - 1;
 	options->rekey_limit = - 1;
 	options->rekey_interval = -1;
+	options->rekey_idle_percent = -1;
+	options->rekey_idle_time = -1;
+	options->channel_window_max = -1;
+	options->channel_scheduler = NULL;
+	options->channel_accept_batch = -1;
 	options->verify_host_key_dns = -1;
 	options->server_alive_interval = -1;
 	options->server_alive_count_max = -1;
@@ -2006,6 +2082,8 @@ fill_default_options(Options * options)
 		options->address_family = AF_UNSPEC;
 	if (options->connection_attempts == -1)
 		options->connection_attempts = 1;
+	if (options->cipher_threads == -1)
+		options->cipher_threads = 0;
 	if (options->number_of_password_prompts == -1)
 		options->number_of_password_prompts = 3;
 	/* Selected in ssh_login(). */
@@ -2060,6 +2138,16 @@ fill_default_options(Options * options)
 		options->rekey_limit = 0;
 	if (options->rekey_interval == -1)
 		options->rekey_interval = 0;
+	if (options->rekey_idle_percent == -1)
+		options->rekey_idle_percent = 75;
+	if (options->rekey_idle_time == -1)
+		options->rekey_idle_time = 1;
+	if (options->channel_window_max == -1)
+		options->channel_window_max = 16 * 1024 * 1024;
+	if (options->channel_scheduler == NULL)
+		options->channel_scheduler = xstrdup("drr");
+	if (options->channel_accept_batch == -1)
+		options->channel_accept_batch = CHAN_ACCEPT_BATCH;
 	if (options->verify_host_key_dns == -1)
 		options->verify_host_key_dns = 0;
 	if (options->server_alive_interval == -1)
@@ -2595,9 +2683,11 @@ dump_client_config(Options *o, const char *host)
 
 	/* Integer options */
 	dump_cfg_int(oCanonicalizeMaxDots, o->canonicalize_max_dots);
+	dump_cfg_int(oChannelAcceptBatch, o->channel_accept_batch);
 #ifdef WITH_SSH1
 	dump_cfg_int(oCompressionLevel, o->compression_level);
 #endif
+	dump_cfg_int(oCipherThreads, o->cipher_threads);
 	dump_cfg_int(oConnectionAttempts, o->connection_attempts);
 	dump_cfg_int(oForwardX11Timeout, o->forward_x11_timeout);
 	dump_cfg_int(oNumberOfPasswordPrompts, o->number_of_password_prompts);
@@ -2606,6 +2696,7 @@ dump_client_config(Options *o, const char *host)
 
 	/* String options */
 	dump_cfg_string(oBindAddress, o->bind_address);
+	dump_cfg_string(oChannelScheduler, o->channel_scheduler);
 	dump_cfg_string(oCiphers, o->ciphers ? o->ciphers : KEX_CLIENT_ENCRYPT);
 	dump_cfg_string(oControlPath, o->control_path);
 	dump_cfg_string(oHostKeyAlgorithms, o->hostkeyalgorithms);
@@ -2693,6 +2784,17 @@ dump_client_config(Options *o, const char *host)
 	printf("rekeylimit %llu %d\n",
 	    (unsigned long long)o->rekey_limit, o->rekey_interval);
 
+	/* oRekeyIdle */
+	if (o->rekey_idle_percent == 0)
+		printf("rekeyidle no\n");
+	else
+		printf("rekeyidle %d %d\n", o->rekey_idle_percent,
+		    o->rekey_idle_time);
+
+	/* oChannelWindowMax */
+	printf("channelwindowmax %llu\n",
+	    (unsigned long long)o->channel_window_max);
+
 	/* oStreamLocalBindMask */
 	printf("streamlocalbindmask 0%o\n",
 	    o->fwd_opts.streamlocal_bind_mask);
@@ -90,6 +90,7 @@ typedef struct {
 						 * prompts. */
 	int     cipher;		/* Cipher to use. */
 	char   *ciphers;	/* SSH2 ciphers in order of preference. */
+	int     cipher_threads;	/* AES-CTR keystream threads. */
 	char   *macs;		/* SSH2 macs in order of preference. */
 	char   *hostkeyalgorithms;	/* SSH2 server key types in order of preference. */
 	char   *kex_algorithms;	/* SSH2 kex methods in order of preference. */
@@ -138,6 +139,11 @@ typedef struct {
 	int	enable_ssh_keysign;
 	int64_t rekey_limit;
 	int	rekey_interval;
+	int	rekey_idle_percent;
+	int	rekey_idle_time;
+	int64_t channel_window_max;
+	char   *channel_scheduler;	/* channel output scheduler */
+	int	channel_accept_batch;	/* accepts per listener wakeup */
 	int	no_host_authentication_for_localhost;
 	int	identities_only;
 	int	server_alive_interval;
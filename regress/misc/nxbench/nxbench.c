@@ -0,0 +1,375 @@
+/*
+ * Benchmark for the NX code paths: nx_proxy_select(), the switch
+ * command scanner and nx_run_server_side_loop(). Meant to be linked
+ * with the NX transport stand-in (configure --with-nxcomp-stub).
+ *
+ * Placed in the public domain
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_ERR_H
+# include <err.h>
+#endif
+
+#include "xmalloc.h"
+#include "buffer.h"
+#include "log.h"
+#include "misc.h"
+#include "ssh.h"
+#include "readconf.h"
+#include "openbsd-compat/sys-queue.h"
+#include "channels.h"
+
+#include "NX.h"
+#include "proxy.h"
+
+Options options;	/* XXX - needed for linking */
+
+extern void nx_run_server_side_loop(int);
+
+#define CHUNK_SIZE	(64 * 1024)
+
+struct latency {
+	u_int64_t count;
+	double total, min, max;
+};
+
+static int do_verbose = 0;
+
+void
+cleanup_exit(int i)
+{
+	_exit(i);
+}
+
+static void
+latency_add(struct latency *l, double value)
+{
+	if (l->count == 0 || value < l->min)
+		l->min = value;
+	if (value > l->max)
+		l->max = value;
+	l->total += value;
+	l->count++;
+}
+
+static void
+drain(int fd)
+{
+	char buf[4096];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/*
+ * Wake up nx_proxy_select() on "ready" out of "nfds" descriptors per
+ * iteration, with the stand-in transport taking part in the cycle.
+ */
+static void
+bench_select(int nfds, int ready, u_int iterations)
+{
+	int (*pairs)[2], trans[2], maxfd = 0, fd, i, r, next = 0;
+	size_t setlen;
+	fd_set *readset;
+	struct latency l;
+	struct timeval tv;
+	double start, t;
+	u_int n;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, trans) == -1)
+		err(1, "socketpair");
+	if (NXTransCreate(trans[1], NX_MODE_SERVER, "") < 0)
+		err(1, "NXTransCreate");
+	set_nonblock(trans[0]);
+	nx_switch_internal = 1;
+
+	pairs = xcalloc(nfds, sizeof(*pairs));
+	for (i = 0; i < nfds; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]) == -1)
+			err(1, "socketpair (raise the descriptor limit?)");
+		set_nonblock(pairs[i][0]);
+		maxfd = MAX(maxfd, pairs[i][0]);
+	}
+	setlen = howmany(maxfd + 1, NFDBITS) * sizeof(fd_mask);
+	readset = xcalloc(1, setlen);
+
+	memset(&l, 0, sizeof(l));
+	start = monotime_double();
+	for (n = 0; n < iterations; n++) {
+		for (i = 0; i < ready; i++) {
+			if (write(pairs[next][1], "x", 1) != 1)
+				err(1, "write");
+			next = (next + 1) % nfds;
+		}
+		if (write(trans[0], "x", 1) != 1)
+			err(1, "write");
+		memset(readset, 0, setlen);
+		for (i = 0; i < nfds; i++)
+			FD_SET(pairs[i][0], readset);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+
+		t = monotime_double();
+		r = nx_proxy_select(maxfd + 1, readset, NULL, NULL, &tv);
+		latency_add(&l, monotime_double() - t);
+
+		if (r < 0)
+			err(1, "nx_proxy_select");
+		for (fd = 0; fd <= maxfd; fd++)
+			if (FD_ISSET(fd, readset))
+				drain(fd);
+		drain(trans[0]);
+	}
+	t = monotime_double() - start;
+
+	printf("select: fds=%d ready=%d iterations=%u wakeups_per_s=%.0f "
+	    "avg_us=%.1f min_us=%.1f max_us=%.1f\n", nfds, ready, iterations,
+	    iterations / t, l.total * 1e6 / l.count, l.min * 1e6, l.max * 1e6);
+
+	for (i = 0; i < nfds; i++) {
+		close(pairs[i][0]);
+		close(pairs[i][1]);
+	}
+	free(pairs);
+	free(readset);
+	NXTransDestroy(trans[1]);
+	close(trans[0]);
+	nx_switch_internal = -1;
+}
+
+/*
+ * Feed synthetic channel data through the switch command scanner.
+ * The data has frequent partial matches of the command, but never
+ * the whole of it.
+ */
+static void
+bench_switch(u_int megabytes)
+{
+	static const char *noise[] = { "N", "NX", "NX> ", "NX> 29", "NX> 299 " };
+	Channel c;
+	char *template, *data;
+	struct latency l;
+	u_int64_t total = 0, limit = (u_int64_t)megabytes << 20;
+	size_t i, len;
+	int length;
+	double t;
+
+	template = xmalloc(CHUNK_SIZE);
+	data = xmalloc(CHUNK_SIZE + NX_SWITCH_HOLD_SIZE);
+	for (i = 0; i < CHUNK_SIZE; i++)
+		template[i] = arc4random_uniform(256);
+	for (i = 0; i + 16 < CHUNK_SIZE; i += 97 + arc4random_uniform(64)) {
+		len = strlen(noise[i % 5]);
+		memcpy(template + i, noise[i % 5], len);
+	}
+
+	memset(&c, 0, sizeof(c));
+	c.rfd = -1;
+	c.ctype = "session";
+	buffer_init(&c.nx_buffer);
+
+	memset(&l, 0, sizeof(l));
+	while (total < limit) {
+		memcpy(data, template, CHUNK_SIZE);
+		length = CHUNK_SIZE;
+		t = monotime_double();
+		nx_check_channel_input(&c, data, &length,
+		    CHUNK_SIZE + NX_SWITCH_HOLD_SIZE);
+		latency_add(&l, monotime_double() - t);
+		total += CHUNK_SIZE;
+	}
+
+	printf("switch: megabytes=%u chunk=%d mb_per_s=%.1f avg_us=%.1f "
+	    "max_us=%.1f\n", megabytes, CHUNK_SIZE,
+	    total / l.total / (1 << 20), l.total * 1e6 / l.count,
+	    l.max * 1e6);
+
+	buffer_free(&c.nx_buffer);
+	free(template);
+	free(data);
+}
+
+/*
+ * Push data both ways through the server side loop, run in a child
+ * process between a channel and a proxy socket pair.
+ */
+static void
+bench_relay(u_int megabytes)
+{
+	int channel[2], proxy[2], i, status;
+	u_int64_t limit = (u_int64_t)megabytes << 20;
+	u_int64_t sent[2] = { 0, 0 }, received[2] = { 0, 0 };
+	struct pollfd pfd[2];
+	char *buf;
+	ssize_t r;
+	pid_t pid;
+	double t;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, channel) == -1 ||
+	    socketpair(AF_UNIX, SOCK_STREAM, 0, proxy) == -1)
+		err(1, "socketpair");
+
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		close(channel[0]);
+		close(proxy[0]);
+		nx_switch_in = nx_switch_out = channel[1];
+		nx_run_server_side_loop(proxy[1]);
+		_exit(0);
+	}
+	close(channel[1]);
+	close(proxy[1]);
+	set_nonblock(channel[0]);
+	set_nonblock(proxy[0]);
+
+	buf = xmalloc(CHUNK_SIZE);
+	memset(buf, 'x', CHUNK_SIZE);
+	pfd[0].fd = channel[0];
+	pfd[1].fd = proxy[0];
+
+	t = monotime_double();
+	while (received[0] < limit || received[1] < limit) {
+		for (i = 0; i < 2; i++) {
+			pfd[i].events = POLLIN;
+			if (sent[i] < limit)
+				pfd[i].events |= POLLOUT;
+		}
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		for (i = 0; i < 2; i++) {
+			if ((pfd[i].revents & POLLOUT) && sent[i] < limit) {
+				r = write(pfd[i].fd, buf,
+				    MIN(CHUNK_SIZE, limit - sent[i]));
+				if (r > 0 && (sent[i] += r) == limit)
+					shutdown(pfd[i].fd, SHUT_WR);
+			}
+			if (pfd[i].revents & (POLLIN|POLLHUP)) {
+				r = read(pfd[i].fd, buf, CHUNK_SIZE);
+				if (r == 0 && received[i] < limit)
+					errx(1, "relay: early end of data");
+				if (r > 0)
+					received[i] += r;
+			}
+		}
+	}
+	t = monotime_double() - t;
+
+	close(channel[0]);
+	close(proxy[0]);
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+
+	printf("relay: megabytes=%u seconds=%.3f mb_per_s=%.1f\n",
+	    megabytes, t, 2.0 * megabytes / t);
+	free(buf);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "Usage: nxbench [-hv] [-b select|switch|relay] [-i iterations]\n"
+	    "               [-n fds] [-r ready] [-s megabytes]\n"
+	    "\n"
+	    "Options:\n"
+	    "    -h               Display this help\n"
+	    "    -v               Turn on verbose logging\n"
+	    "    -b benchmark     Run only the named benchmark\n"
+	    "    -i iterations    Wakeups for the select benchmark\n"
+	    "    -n fds           Descriptors for the select benchmark\n"
+	    "    -r ready         Descriptors made ready per wakeup\n"
+	    "    -s megabytes     Data for the switch and relay benchmarks\n");
+}
+
+static void
+badusage(const char *bad)
+{
+	fprintf(stderr, "Invalid options\n");
+	fprintf(stderr, "%s\n", bad);
+	usage();
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *bench = NULL, *errstr;
+	u_int iterations = 100000, megabytes = 256;
+	int ch, nfds = 64, ready = 1;
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	while ((ch = getopt(argc, argv, "hvb:i:n:r:s:")) != -1) {
+		switch (ch) {
+		case 'h':
+			usage();
+			return 0;
+		case 'v':
+			do_verbose = 1;
+			break;
+		case 'b':
+			bench = optarg;
+			break;
+		case 'i':
+			iterations = strtonum(optarg, 1, UINT_MAX, &errstr);
+			if (errstr != NULL)
+				badusage("Invalid iterations (-i)");
+			break;
+		case 'n':
+			nfds = strtonum(optarg, 1, 1 << 20, &errstr);
+			if (errstr != NULL)
+				badusage("Invalid number of descriptors (-n)");
+			break;
+		case 'r':
+			ready = strtonum(optarg, 1, 1 << 20, &errstr);
+			if (errstr != NULL)
+				badusage("Invalid number of ready descriptors (-r)");
+			break;
+		case 's':
+			megabytes = strtonum(optarg, 1, 1 << 20, &errstr);
+			if (errstr != NULL)
+				badusage("Invalid size (-s)");
+			break;
+		default:
+			badusage("unsupported flag");
+		}
+	}
+	if (ready > nfds)
+		badusage("More ready descriptors (-r) than descriptors (-n)");
+
+	log_init(argv[0], do_verbose ? SYSLOG_LEVEL_DEBUG1 :
+	    SYSLOG_LEVEL_ERROR, SYSLOG_FACILITY_USER, 1);
+	nx_proxy_init();
+
+	if (bench != NULL && strcmp(bench, "select") != 0 &&
+	    strcmp(bench, "switch") != 0 && strcmp(bench, "relay") != 0)
+		badusage("Unknown benchmark (-b)");
+
+	if (bench == NULL || strcmp(bench, "select") == 0)
+		bench_select(nfds, ready, iterations);
+	if (bench == NULL || strcmp(bench, "switch") == 0)
+		bench_switch(megabytes);
+	if (bench == NULL || strcmp(bench, "relay") == 0)
+		bench_relay(megabytes);
+
+	return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Regress test for the threaded AES-CTR keystream, checked against the
+ * output of the inline cipher
+ *
+ * Placed in the public domain
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "../test_helper/test_helper.h"
+
+#include "cipher.h"
+
+#define DATA_LEN	(1024 * 1024 + 4096)
+#define BLOCK		16
+
+/*
+ * Chunk sizes, used in turn, that start and end around the 32KB
+ * keystream slots of the threaded cipher and cover many slots at once.
+ */
+static const u_int chunks[] = {
+	16, 32752, 32, 32768, 48, 65536 + 16, 16, 131072, 4096, 32784,
+	98304, 208
+};
+
+/* Counters that carry over one byte, eight bytes and the whole block */
+static const u_char ivs[][BLOCK] = {
+	{ 0 },
+	{ 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+	  0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xf0 },
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x80 },
+	{ 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf0, 0x00 },
+};
+
+static const u_int nthreads[] = { 1, 2, 3, 8 };
+
+/*
+ * Encrypts "src" in chunks with "threads" keystream threads, next to an
+ * inline context whose counter the threaded one has to follow.
+ */
+static void
+crypt_chunks(const struct sshcipher *c, const u_char *key, const u_char *iv,
+    u_int threads, const u_char *src, u_char *dest, u_char *scratch,
+    size_t len)
+{
+	struct sshcipher_ctx *cc = NULL, *ref = NULL;
+	u_char civ[BLOCK], riv[BLOCK];
+	size_t off, n;
+	u_int i;
+
+	ASSERT_INT_EQ(cipher_set_threads(0), 0);
+	ASSERT_INT_EQ(cipher_init(&ref, c, key, cipher_keylen(c), iv, BLOCK,
+	    CIPHER_ENCRYPT), 0);
+	ASSERT_INT_EQ(cipher_set_threads(threads), 0);
+	ASSERT_INT_EQ(cipher_init(&cc, c, key, cipher_keylen(c), iv, BLOCK,
+	    CIPHER_ENCRYPT), 0);
+	for (off = 0, i = 0; off < len; off += n, i++) {
+		n = MIN(chunks[i % (sizeof(chunks) / sizeof(chunks[0]))],
+		    len - off);
+		ASSERT_INT_EQ(cipher_crypt(cc, 0, dest + off, src + off, n,
+		    0, 0), 0);
+		ASSERT_INT_EQ(cipher_crypt(ref, 0, scratch, src + off, n,
+		    0, 0), 0);
+		ASSERT_INT_EQ(cipher_get_keyiv(cc, civ, BLOCK), 0);
+		ASSERT_INT_EQ(cipher_get_keyiv(ref, riv, BLOCK), 0);
+		ASSERT_MEM_EQ(civ, riv, BLOCK);
+	}
+	cipher_free(cc);
+	cipher_free(ref);
+	ASSERT_INT_EQ(cipher_set_threads(0), 0);
+}
+
+void
+tests(void)
+{
+	const struct sshcipher *c;
+	struct sshcipher_ctx *ref;
+	u_char key[32], *src, *expect, *got, *scratch;
+	char name[64];
+	size_t i, j;
+
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = i * 7 + 1;
+	src = malloc(DATA_LEN);
+	expect = malloc(DATA_LEN);
+	got = malloc(DATA_LEN);
+	scratch = malloc(DATA_LEN);
+	ASSERT_PTR_NE(src, NULL);
+	ASSERT_PTR_NE(expect, NULL);
+	ASSERT_PTR_NE(got, NULL);
+	ASSERT_PTR_NE(scratch, NULL);
+	for (i = 0; i < DATA_LEN; i++)
+		src[i] = (i * 2654435761U) >> 13;
+
+	c = cipher_by_name("aes128-ctr");
+	ASSERT_PTR_NE(c, NULL);
+
+	TEST_START("cipher_set_threads limits");
+	ASSERT_INT_EQ(cipher_set_threads(0), 0);
+#ifdef WITH_CTR_THREADS
+	ASSERT_INT_NE(cipher_set_threads(1000), 0);
+#endif
+	TEST_DONE();
+
+	for (i = 0; i < sizeof(ivs) / sizeof(ivs[0]); i++) {
+		ref = NULL;
+		ASSERT_INT_EQ(cipher_set_threads(0), 0);
+		ASSERT_INT_EQ(cipher_init(&ref, c, key, cipher_keylen(c),
+		    ivs[i], BLOCK, CIPHER_ENCRYPT), 0);
+		ASSERT_INT_EQ(cipher_crypt(ref, 0, expect, src, DATA_LEN,
+		    0, 0), 0);
+		cipher_free(ref);
+
+		for (j = 0; j < sizeof(nthreads) / sizeof(nthreads[0]); j++) {
+			snprintf(name, sizeof(name), "aes128-ctr iv %zu "
+			    "threads %u", i, nthreads[j]);
+			TEST_START(name);
+			memset(got, 0, DATA_LEN);
+			crypt_chunks(c, key, ivs[i], nthreads[j], src, got,
+			    scratch, DATA_LEN);
+			ASSERT_MEM_EQ(got, expect, DATA_LEN);
+			TEST_DONE();
+		}
+	}
+
+	free(src);
+	free(expect);
+	free(got);
+	free(scratch);
+}
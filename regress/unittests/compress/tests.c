@@ -0,0 +1,199 @@
+/*
+ * Regress test for compress.h packet compression methods
+ *
+ * Placed in the public domain
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "../test_helper/test_helper.h"
+
+#include "compress.h"
+#include "sshbuf.h"
+#include "ssherr.h"
+
+#define PACKET_MAX	32768
+
+/* Words repeated in random order, which every method compresses well */
+static void
+fill_text(u_char *p, size_t len, u_int32_t *seed)
+{
+	static const char *words[] = {
+		"window ", "channel ", "packet ", "session ", "forward ",
+		"cipher ", "compress ", "buffer ", "\n", "proxy "
+	};
+	const char *w;
+	size_t n;
+
+	while (len > 0) {
+		*seed = *seed * 1103515245 + 12345;
+		w = words[(*seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+		n = MIN(strlen(w), len);
+		memcpy(p, w, n);
+		p += n;
+		len -= n;
+	}
+}
+
+/* Data that no method can shrink */
+static void
+fill_random(u_char *p, size_t len, u_int32_t *seed)
+{
+	while (len-- > 0) {
+		*seed ^= *seed << 13;
+		*seed ^= *seed >> 17;
+		*seed ^= *seed << 5;
+		*p++ = *seed >> 11;
+	}
+}
+
+/*
+ * Passes "len" bytes through both streams in packets of varying size,
+ * checking that each packet comes out as it went in.
+ */
+static void
+round_trip(struct sshcompress_ctx *out, struct sshcompress_ctx *in,
+    const u_char *data, size_t len)
+{
+	struct sshbuf *z, *raw;
+	size_t off, n;
+	u_int i;
+
+	z = sshbuf_new();
+	raw = sshbuf_new();
+	ASSERT_PTR_NE(z, NULL);
+	ASSERT_PTR_NE(raw, NULL);
+	for (off = 0, i = 0; off < len; off += n, i++) {
+		n = MIN(len - off, (i * 7919) % PACKET_MAX + 1);
+		sshbuf_reset(z);
+		sshbuf_reset(raw);
+		ASSERT_INT_EQ(compress_buffer(out, data + off, n, z), 0);
+		ASSERT_SIZE_T_GT(sshbuf_len(z), 0);
+		ASSERT_INT_EQ(uncompress_buffer(in, sshbuf_ptr(z),
+		    sshbuf_len(z), raw), 0);
+		ASSERT_SIZE_T_EQ(sshbuf_len(raw), n);
+		ASSERT_MEM_EQ(sshbuf_ptr(raw), data + off, n);
+	}
+	sshbuf_free(z);
+	sshbuf_free(raw);
+}
+
+static void
+test_method(const struct sshcompress *c, u_char *data, size_t len)
+{
+	struct sshcompress_ctx *out, *in;
+	struct sshbuf *z;
+	u_int64_t raw, compressed, raw_in, compressed_in;
+	u_int32_t seed = 1;
+	char name[128];
+	u_int backoffs;
+	size_t third = len / 3;
+
+	snprintf(name, sizeof(name), "%s bad arguments", compress_name(c));
+	TEST_START(name);
+	ASSERT_INT_EQ(compress_init(&out, c, COMPRESS_OUT, -1),
+	    SSH_ERR_INVALID_ARGUMENT);
+	ASSERT_INT_EQ(compress_init(&out, c, COMPRESS_OUT, 1000),
+	    SSH_ERR_INVALID_ARGUMENT);
+	ASSERT_INT_EQ(compress_init(&in, c, COMPRESS_IN, 0), 0);
+	z = sshbuf_new();
+	ASSERT_PTR_NE(z, NULL);
+	ASSERT_INT_NE(compress_buffer(in, data, 16, z), 0);
+	ASSERT_SIZE_T_EQ(sshbuf_len(z), 0);
+	sshbuf_free(z);
+	compress_free(in);
+	TEST_DONE();
+
+	snprintf(name, sizeof(name), "%s text", compress_name(c));
+	TEST_START(name);
+	fill_text(data, len, &seed);
+	ASSERT_INT_EQ(compress_init(&out, c, COMPRESS_OUT, 0), 0);
+	ASSERT_INT_EQ(compress_init(&in, c, COMPRESS_IN, 0), 0);
+	round_trip(out, in, data, len);
+	compress_stats(out, &raw, &compressed);
+	ASSERT_U64_EQ(raw, len);
+	ASSERT_U64_LT(compressed, len / 4);
+	compress_stats(in, &raw_in, &compressed_in);
+	ASSERT_U64_EQ(raw_in, raw);
+	ASSERT_U64_EQ(compressed_in, compressed);
+	ASSERT_U_INT_EQ(compress_backoffs(out), 0);
+	compress_free(out);
+	compress_free(in);
+	TEST_DONE();
+
+	snprintf(name, sizeof(name), "%s fastest level", compress_name(c));
+	TEST_START(name);
+	ASSERT_INT_EQ(compress_init(&out, c, COMPRESS_OUT, 1), 0);
+	ASSERT_INT_EQ(compress_init(&in, c, COMPRESS_IN, 0), 0);
+	round_trip(out, in, data, third);
+	compress_free(out);
+	compress_free(in);
+	TEST_DONE();
+
+	/*
+	 * Random data in the middle makes the outgoing stream drop to
+	 * its fast level, and the text after it brings it back up. The
+	 * level changes in the middle of the stream, which the incoming
+	 * side has to follow.
+	 */
+	snprintf(name, sizeof(name), "%s level changes", compress_name(c));
+	TEST_START(name);
+	fill_random(data + third, third, &seed);
+	ASSERT_INT_EQ(compress_init(&out, c, COMPRESS_OUT, 0), 0);
+	ASSERT_INT_EQ(compress_init(&in, c, COMPRESS_IN, 0), 0);
+	round_trip(out, in, data, 2 * third);
+	backoffs = compress_backoffs(out);
+	ASSERT_U_INT_GT(backoffs, 0);
+	compress_stats(out, &raw, &compressed);
+	round_trip(out, in, data, third);
+	compress_stats(out, &raw_in, &compressed_in);
+	/* The text compresses again once the stream is back up */
+	ASSERT_U64_LT(compressed_in - compressed, third / 2);
+	compress_free(out);
+	compress_free(in);
+	TEST_DONE();
+}
+
+void
+tests(void)
+{
+	const struct sshcompress *c;
+	struct sshcompress_ctx *cc;
+	char *list, *cp, *name;
+	size_t len = 3 * 1024 * 1024;
+	u_char *data;
+
+	data = calloc(1, len);
+	ASSERT_PTR_NE(data, NULL);
+
+	TEST_START("compress_by_name");
+	ASSERT_PTR_NE(compress_by_name("zlib"), NULL);
+	ASSERT_PTR_NE(compress_by_name("zlib@openssh.com"), NULL);
+	ASSERT_PTR_EQ(compress_by_name("lzma"), NULL);
+	c = compress_by_name("none");
+	ASSERT_PTR_NE(c, NULL);
+	ASSERT_INT_NE(compress_init(&cc, c, COMPRESS_OUT, 0), 0);
+	ASSERT_PTR_EQ(cc, NULL);
+	TEST_DONE();
+
+	list = compress_alg_list(',');
+	ASSERT_PTR_NE(list, NULL);
+	for (cp = list; (name = strsep(&cp, ",")) != NULL; ) {
+		if (strcmp(name, "none") == 0)
+			continue;
+		c = compress_by_name(name);
+		ASSERT_PTR_NE(c, NULL);
+		test_method(c, data, len);
+	}
+	free(list);
+	free(data);
+}
@@ -0,0 +1,214 @@
+/*
+ * Regress test for eventloop.h descriptor readiness API
+ *
+ * Placed in the public domain
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/wait.h>
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+#include <stdio.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../test_helper/test_helper.h"
+
+#include "eventloop.h"
+
+#define NPIPES 8
+
+/*
+ * Runs in a child forked with "rfd" registered and "sfd" in the synced
+ * sets, both readable. The child sees an empty loop, waits with a loop
+ * of its own and removes both again. Returns the first failure, if any.
+ */
+static int
+child_events(struct eventloop *el, int rfd, int sfd)
+{
+	int fd;
+	u_int events;
+
+	if (eventloop_get(el, rfd) != 0 || eventloop_get(el, sfd) != 0)
+		return 1;
+	if (eventloop_wait(el, 0) != 0)
+		return 2;
+	if (eventloop_set(el, rfd, EVENTLOOP_READ) != 0)
+		return 3;
+	if (eventloop_wait(el, 1000) != 1 ||
+	    eventloop_next(el, &fd, &events) != 1 || fd != rfd)
+		return 4;
+	if (eventloop_set(el, rfd, 0) != 0)
+		return 5;
+	eventloop_forget(el, sfd);
+	eventloop_free(el);
+	return 0;
+}
+
+void
+tests(void)
+{
+	struct eventloop *el;
+	pid_t pid;
+	int p[NPIPES][2], i, fd, n, seen, status;
+	u_int events;
+	fd_set *rset, *wset;
+	size_t setlen;
+
+	for (i = 0; i < NPIPES; i++)
+		ASSERT_INT_EQ(pipe(p[i]), 0);
+
+	TEST_START("eventloop_new");
+	el = eventloop_new();
+	ASSERT_PTR_NE(el, NULL);
+	ASSERT_PTR_NE(eventloop_backend(el), NULL);
+	TEST_DONE();
+
+	TEST_START("eventloop_set / eventloop_get");
+	for (i = 0; i < NPIPES; i++) {
+		ASSERT_INT_EQ(eventloop_set(el, p[i][0], EVENTLOOP_READ), 0);
+		ASSERT_U_INT_EQ(eventloop_get(el, p[i][0]), EVENTLOOP_READ);
+	}
+	ASSERT_U_INT_EQ(eventloop_get(el, 100000), 0);
+	ASSERT_INT_EQ(eventloop_set(el, -1, EVENTLOOP_READ), -1);
+	TEST_DONE();
+
+	TEST_START("eventloop_wait timeout");
+	ASSERT_INT_EQ(eventloop_wait(el, 0), 0);
+	ASSERT_INT_EQ(eventloop_next(el, &fd, &events), 0);
+	TEST_DONE();
+
+	TEST_START("eventloop_wait ready");
+	ASSERT_INT_EQ(write(p[3][1], "x", 1), 1);
+	ASSERT_INT_EQ(write(p[6][1], "x", 1), 1);
+	ASSERT_INT_EQ(eventloop_wait(el, 1000), 2);
+	for (seen = 0; eventloop_next(el, &fd, &events); ) {
+		ASSERT_U_INT_EQ(events, EVENTLOOP_READ);
+		ASSERT_INT_EQ(fd == p[3][0] || fd == p[6][0], 1);
+		seen++;
+	}
+	ASSERT_INT_EQ(seen, 2);
+	TEST_DONE();
+
+	TEST_START("eventloop_set remove");
+	ASSERT_INT_EQ(eventloop_set(el, p[3][0], 0), 0);
+	ASSERT_U_INT_EQ(eventloop_get(el, p[3][0]), 0);
+	ASSERT_INT_EQ(eventloop_wait(el, 1000), 1);
+	ASSERT_INT_EQ(eventloop_next(el, &fd, &events), 1);
+	ASSERT_INT_EQ(fd, p[6][0]);
+	ASSERT_INT_EQ(eventloop_next(el, &fd, &events), 0);
+	TEST_DONE();
+
+	TEST_START("eventloop_set write");
+	ASSERT_INT_EQ(eventloop_set(el, p[0][1], EVENTLOOP_WRITE), 0);
+	ASSERT_INT_EQ(eventloop_wait(el, 1000), 2);
+	for (seen = 0; eventloop_next(el, &fd, &events); seen++) {
+		if (fd == p[0][1])
+			ASSERT_U_INT_EQ(events, EVENTLOOP_WRITE);
+		else
+			ASSERT_INT_EQ(fd, p[6][0]);
+	}
+	ASSERT_INT_EQ(seen, 2);
+	ASSERT_INT_EQ(eventloop_set(el, p[0][1], 0), 0);
+	TEST_DONE();
+
+	TEST_START("eventloop_select");
+	n = 0;
+	for (i = 0; i < NPIPES; i++) {
+		ASSERT_INT_EQ(eventloop_set(el, p[i][0], 0), 0);
+		n = MAX(n, MAX(p[i][0], p[i][1]) + 1);
+	}
+	setlen = howmany(n, NFDBITS) * sizeof(fd_mask);
+	rset = calloc(1, setlen);
+	wset = calloc(1, setlen);
+	ASSERT_PTR_NE(rset, NULL);
+	ASSERT_PTR_NE(wset, NULL);
+	FD_SET(p[1][0], rset);
+	FD_SET(p[6][0], rset);
+	FD_SET(p[2][1], wset);
+	ASSERT_INT_EQ(eventloop_select(el, n, rset, wset, 1000), 2);
+	ASSERT_INT_EQ(FD_ISSET(p[6][0], rset) != 0, 1);
+	ASSERT_INT_EQ(FD_ISSET(p[1][0], rset) != 0, 0);
+	ASSERT_INT_EQ(FD_ISSET(p[2][1], wset) != 0, 1);
+	TEST_DONE();
+
+	TEST_START("eventloop_select unchanged sets");
+	memset(rset, 0, setlen);
+	memset(wset, 0, setlen);
+	FD_SET(p[1][0], rset);
+	FD_SET(p[6][0], rset);
+	FD_SET(p[2][1], wset);
+	ASSERT_INT_EQ(eventloop_select(el, n, rset, wset, 1000), 2);
+	ASSERT_U_INT_EQ(eventloop_get(el, p[1][0]), EVENTLOOP_READ);
+	ASSERT_U_INT_EQ(eventloop_get(el, p[2][1]), EVENTLOOP_WRITE);
+	TEST_DONE();
+
+	TEST_START("eventloop_select removed descriptors");
+	memset(rset, 0, setlen);
+	memset(wset, 0, setlen);
+	FD_SET(p[1][0], rset);
+	ASSERT_INT_EQ(eventloop_select(el, n, rset, wset, 0), 0);
+	ASSERT_U_INT_EQ(eventloop_get(el, p[6][0]), 0);
+	ASSERT_U_INT_EQ(eventloop_get(el, p[2][1]), 0);
+	ASSERT_U_INT_EQ(eventloop_get(el, p[1][0]), EVENTLOOP_READ);
+	TEST_DONE();
+
+	TEST_START("eventloop_forget reused descriptor");
+	fd = p[1][0];
+	eventloop_forget(el, fd);
+	ASSERT_U_INT_EQ(eventloop_get(el, fd), 0);
+	close(p[1][0]);
+	close(p[1][1]);
+	ASSERT_INT_EQ(pipe(p[1]), 0);
+	ASSERT_INT_EQ(p[1][0], fd);
+	ASSERT_INT_EQ(write(p[1][1], "x", 1), 1);
+	/* The same sets as last time, but the new pipe is watched */
+	memset(rset, 0, setlen);
+	memset(wset, 0, setlen);
+	FD_SET(p[1][0], rset);
+	ASSERT_INT_EQ(eventloop_select(el, n, rset, wset, 1000), 1);
+	ASSERT_INT_EQ(FD_ISSET(p[1][0], rset) != 0, 1);
+	TEST_DONE();
+
+	TEST_START("eventloop fork");
+	ASSERT_INT_EQ(write(p[5][1], "x", 1), 1);
+	ASSERT_INT_EQ(eventloop_set(el, p[5][0], EVENTLOOP_READ), 0);
+	pid = fork();
+	ASSERT_INT_NE(pid, -1);
+	if (pid == 0)
+		_exit(child_events(el, p[5][0], p[1][0]));
+	ASSERT_INT_EQ(waitpid(pid, &status, 0), pid);
+	ASSERT_INT_NE(WIFEXITED(status), 0);
+	ASSERT_INT_EQ(WEXITSTATUS(status), 0);
+	/* What the child removed is still watched here */
+	ASSERT_U_INT_EQ(eventloop_get(el, p[5][0]), EVENTLOOP_READ);
+	ASSERT_INT_EQ(eventloop_wait(el, 1000), 2);
+	for (seen = 0; eventloop_next(el, &fd, &events); seen++)
+		ASSERT_INT_EQ(fd == p[5][0] || fd == p[1][0], 1);
+	ASSERT_INT_EQ(seen, 2);
+	ASSERT_INT_EQ(eventloop_set(el, p[5][0], 0), 0);
+	memset(rset, 0, setlen);
+	memset(wset, 0, setlen);
+	FD_SET(p[1][0], rset);
+	ASSERT_INT_EQ(eventloop_select(el, n, rset, wset, 1000), 1);
+	ASSERT_INT_EQ(FD_ISSET(p[1][0], rset) != 0, 1);
+	TEST_DONE();
+
+	TEST_START("eventloop_free");
+	free(rset);
+	free(wset);
+	eventloop_free(el);
+	for (i = 0; i < NPIPES; i++) {
+		close(p[i][0]);
+		close(p[i][1]);
+	}
+	TEST_DONE();
+}
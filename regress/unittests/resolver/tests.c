@@ -0,0 +1,271 @@
+/*
+ * Regress test for the resolver.c cache, as used when names are resolved
+ * without worker threads
+ *
+ * Placed in the public domain
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <netdb.h>
+#include <stdio.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../test_helper/test_helper.h"
+
+/*
+ * The resolver is built into the test, so that its calls to getaddrinfo(3)
+ * go to test_getaddrinfo(), which answers made-up names and counts the
+ * lookups that were not served from the cache.
+ */
+static int test_getaddrinfo(const char *, const char *,
+    const struct addrinfo *, struct addrinfo **);
+
+#define getaddrinfo test_getaddrinfo
+#include "resolver.c"
+#undef getaddrinfo
+
+#define TEST_PORT	4000
+
+static u_int lookups;
+static int temporary_failure;
+
+/* "host<n>.test" is in 192.0.2.0/24, anything else does not exist */
+static int
+test_getaddrinfo(const char *host, const char *serv,
+    const struct addrinfo *hints, struct addrinfo **res)
+{
+	struct addrinfo nhints;
+	char addr[32];
+	u_int n;
+
+	nhints = *hints;
+	nhints.ai_flags |= AI_NUMERICHOST;
+	if ((hints->ai_flags & AI_NUMERICHOST) != 0)
+		return getaddrinfo(host, serv, &nhints, res);
+	lookups++;
+	if (temporary_failure)
+		return EAI_AGAIN;
+	if (sscanf(host, "host%u.test", &n) != 1)
+		return EAI_NONAME;
+	snprintf(addr, sizeof(addr), "192.0.2.%u", n % 256);
+	return getaddrinfo(addr, serv, &nhints, res);
+}
+
+static void
+init_hints(struct addrinfo *hints, int family)
+{
+	memset(hints, 0, sizeof(*hints));
+	hints->ai_family = family;
+	hints->ai_socktype = SOCK_STREAM;
+}
+
+/* Resolves "host", which must be answered without a query */
+static int
+lookup(const char *host, int port, int family, struct addrinfo **resp)
+{
+	struct addrinfo hints;
+	int gaierr;
+
+	init_hints(&hints, family);
+	ASSERT_PTR_EQ(resolver_start(host, port, &hints, resp, &gaierr), NULL);
+	if (gaierr != 0)
+		ASSERT_PTR_EQ(*resp, NULL);
+	else
+		ASSERT_PTR_NE(*resp, NULL);
+	return gaierr;
+}
+
+static void
+check_answer(struct addrinfo *ai, const char *addr, int port)
+{
+	struct sockaddr_in *sin;
+	char buf[64];
+
+	ASSERT_PTR_NE(ai, NULL);
+	ASSERT_INT_EQ(ai->ai_family, AF_INET);
+	ASSERT_PTR_EQ(ai->ai_next, NULL);
+	sin = (struct sockaddr_in *)ai->ai_addr;
+	ASSERT_INT_EQ(ntohs(sin->sin_port), port);
+	ASSERT_PTR_NE(inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof(buf)),
+	    NULL);
+	ASSERT_STRING_EQ(buf, addr);
+}
+
+/* Makes the cached answer for "host" out of date */
+static void
+expire(const char *host, int family)
+{
+	struct resolver_entry key, *e;
+
+	memset(&key, 0, sizeof(key));
+	key.host = (char *)host;
+	key.family = family;
+	key.socktype = SOCK_STREAM;
+	e = RB_FIND(resolver_tree, &resolver_names, &key);
+	ASSERT_PTR_NE(e, NULL);
+	ASSERT_INT_EQ(e->cached, 1);
+	e->expires = monotime() - 1;
+}
+
+/* The child checks its cache and exits with the first failure, if any */
+static int
+child_lookups(void)
+{
+	struct addrinfo *ai;
+	struct addrinfo hints;
+	u_int before = lookups;
+	int gaierr;
+
+	init_hints(&hints, AF_INET);
+	if (resolver_start("host1.test", 22, &hints, &ai, &gaierr) != NULL ||
+	    gaierr != 0 || ai == NULL)
+		return 1;
+	resolver_freeaddrinfo(ai);
+	if (lookups != before)
+		return 2;
+	if (resolver_start("host9.test", 22, &hints, &ai, &gaierr) != NULL ||
+	    gaierr != 0 || ai == NULL)
+		return 3;
+	resolver_freeaddrinfo(ai);
+	if (lookups != before + 1)
+		return 4;
+	if (resolver_fd() != -1)
+		return 5;
+	return 0;
+}
+
+void
+tests(void)
+{
+	struct addrinfo *ai, *ai2;
+	char host[32];
+	pid_t pid;
+	int status;
+	u_int i, before;
+
+#ifdef RESOLVER_THREADS
+	/* Resolve synchronously, as when no worker can be started */
+	resolver_broken = 1;
+#endif
+
+	TEST_START("resolver address");
+	ASSERT_INT_EQ(lookup("192.0.2.77", TEST_PORT, AF_INET, &ai), 0);
+	check_answer(ai, "192.0.2.77", TEST_PORT);
+	resolver_freeaddrinfo(ai);
+	ASSERT_U_INT_EQ(lookups, 0);
+	ASSERT_U_INT_EQ(resolver_ncached, 0);
+	TEST_DONE();
+
+	TEST_START("resolver name");
+	ASSERT_INT_EQ(lookup("host1.test", TEST_PORT, AF_INET, &ai), 0);
+	check_answer(ai, "192.0.2.1", TEST_PORT);
+	resolver_freeaddrinfo(ai);
+	ASSERT_U_INT_EQ(lookups, 1);
+	ASSERT_INT_EQ(resolver_fd(), -1);
+	TEST_DONE();
+
+	TEST_START("resolver cache hit");
+	ASSERT_INT_EQ(lookup("host1.test", 22, AF_INET, &ai), 0);
+	ASSERT_INT_EQ(lookup("host1.test", TEST_PORT, AF_INET, &ai2), 0);
+	ASSERT_U_INT_EQ(lookups, 1);
+	/* One answer, copied with the port of each lookup */
+	check_answer(ai, "192.0.2.1", 22);
+	check_answer(ai2, "192.0.2.1", TEST_PORT);
+	ASSERT_PTR_NE(ai->ai_addr, ai2->ai_addr);
+	resolver_freeaddrinfo(ai);
+	resolver_freeaddrinfo(ai2);
+	ASSERT_U64_EQ(resolver_stats.hits, 2);
+	TEST_DONE();
+
+	TEST_START("resolver hints");
+	/* Another family is another name to the cache */
+	ASSERT_INT_EQ(lookup("host1.test", TEST_PORT, AF_UNSPEC, &ai), 0);
+	resolver_freeaddrinfo(ai);
+	ASSERT_U_INT_EQ(lookups, 2);
+	ASSERT_U_INT_EQ(resolver_ncached, 2);
+	TEST_DONE();
+
+	TEST_START("resolver expiry");
+	expire("host1.test", AF_INET);
+	ASSERT_INT_EQ(lookup("host1.test", TEST_PORT, AF_INET, &ai), 0);
+	check_answer(ai, "192.0.2.1", TEST_PORT);
+	resolver_freeaddrinfo(ai);
+	ASSERT_U_INT_EQ(lookups, 3);
+	ASSERT_U_INT_EQ(resolver_ncached, 2);
+	TEST_DONE();
+
+	TEST_START("resolver negative cache");
+	ASSERT_INT_EQ(lookup("nowhere.test", TEST_PORT, AF_INET, &ai),
+	    EAI_NONAME);
+	ASSERT_INT_EQ(lookup("nowhere.test", TEST_PORT, AF_INET, &ai),
+	    EAI_NONAME);
+	ASSERT_U_INT_EQ(lookups, 4);
+	ASSERT_U64_EQ(resolver_stats.negative_hits, 1);
+	expire("nowhere.test", AF_INET);
+	ASSERT_INT_EQ(lookup("nowhere.test", TEST_PORT, AF_INET, &ai),
+	    EAI_NONAME);
+	ASSERT_U_INT_EQ(lookups, 5);
+	TEST_DONE();
+
+	TEST_START("resolver temporary failure");
+	temporary_failure = 1;
+	ASSERT_INT_EQ(lookup("host2.test", TEST_PORT, AF_INET, &ai),
+	    EAI_AGAIN);
+	temporary_failure = 0;
+	/* Not kept: the next lookup asks again */
+	ASSERT_INT_EQ(lookup("host2.test", TEST_PORT, AF_INET, &ai), 0);
+	check_answer(ai, "192.0.2.2", TEST_PORT);
+	resolver_freeaddrinfo(ai);
+	ASSERT_U_INT_EQ(lookups, 7);
+	TEST_DONE();
+
+	TEST_START("resolver fork");
+	before = lookups;
+	ASSERT_INT_EQ(lookup("host1.test", TEST_PORT, AF_INET, &ai), 0);
+	resolver_freeaddrinfo(ai);
+	ASSERT_U_INT_EQ(lookups, before);
+	pid = fork();
+	ASSERT_INT_NE(pid, -1);
+	if (pid == 0)
+		_exit(child_lookups());
+	ASSERT_INT_EQ(waitpid(pid, &status, 0), pid);
+	ASSERT_INT_NE(WIFEXITED(status), 0);
+	ASSERT_INT_EQ(WEXITSTATUS(status), 0);
+	/* The child's lookups do not reach the parent's cache */
+	ASSERT_INT_EQ(lookup("host9.test", TEST_PORT, AF_INET, &ai), 0);
+	resolver_freeaddrinfo(ai);
+	ASSERT_U_INT_EQ(lookups, before + 1);
+	TEST_DONE();
+
+	TEST_START("resolver cache limit");
+	for (i = 0; i <= RESOLVER_CACHE_MAX; i++) {
+		snprintf(host, sizeof(host), "host%u.test", 1000 + i);
+		ASSERT_INT_EQ(lookup(host, TEST_PORT, AF_INET, &ai), 0);
+		resolver_freeaddrinfo(ai);
+	}
+	ASSERT_U_INT_EQ(resolver_ncached, RESOLVER_CACHE_MAX);
+	before = lookups;
+	/* The oldest names went first */
+	ASSERT_INT_EQ(lookup("host1256.test", TEST_PORT, AF_INET, &ai), 0);
+	resolver_freeaddrinfo(ai);
+	ASSERT_U_INT_EQ(lookups, before);
+	ASSERT_INT_EQ(lookup("host1000.test", TEST_PORT, AF_INET, &ai), 0);
+	check_answer(ai, "192.0.2.232", TEST_PORT);
+	resolver_freeaddrinfo(ai);
+	ASSERT_U_INT_EQ(lookups, before + 1);
+	TEST_DONE();
+}
@@ -27,10 +27,10 @@ void sshbuf_tests(void);
 void
 sshbuf_tests(void)
 {
-	struct sshbuf *p1;
+	struct sshbuf *p1, b1;
 	const u_char *cdp;
 	u_char *dp;
-	size_t sz;
+	size_t sz, sz2;
 	int r;
 
 	TEST_START("allocate sshbuf");
@@ -237,4 +237,24 @@ sshbuf_tests(void)
 	ASSERT_SIZE_T_EQ(sshbuf_avail(p1), 1223);
 	sshbuf_free(p1);
 	TEST_DONE();
+
+	TEST_START("release and reuse storage");
+	sshbuf_init(&b1);
+	ASSERT_INT_EQ(sshbuf_reserve(&b1, 1000, &dp), 0);
+	memset(dp, 0xd7, 1000);
+	sz = sshbuf_alloc(&b1);
+	ASSERT_SIZE_T_GE(sz, 1000);
+	dp = sshbuf_release(&b1, &sz2);
+	ASSERT_PTR_NE(dp, NULL);
+	ASSERT_SIZE_T_EQ(sz2, sz);
+	ASSERT_MEM_ZERO_EQ(dp, sz);
+	sshbuf_init_storage(&b1, dp, sz);
+	ASSERT_SIZE_T_EQ(sshbuf_len(&b1), 0);
+	ASSERT_SIZE_T_EQ(sshbuf_alloc(&b1), sz);
+	ASSERT_INT_EQ(sshbuf_put_u32(&b1, 0x12345678), 0);
+	ASSERT_PTR_EQ(sshbuf_ptr(&b1), dp);
+	ASSERT_U32_EQ(PEEK_U32(sshbuf_ptr(&b1)), 0x12345678);
+	ASSERT_PTR_EQ(sshbuf_release(&b1, &sz2), dp);
+	free(dp);
+	TEST_DONE();
 }
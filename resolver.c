@@ -0,0 +1,594 @@
+/*
+ * Copyright (c) 2026 Etersoft
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#ifdef WITH_RESOLVER_THREADS
+#include <pthread.h>
+#include <signal.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "openbsd-compat/sys-queue.h"
+#include "openbsd-compat/sys-tree.h"
+
+#include "log.h"
+#include "misc.h"
+#include "sshbuf.h"
+#include "xmalloc.h"
+#include "resolver.h"
+
+/* The replacement getaddrinfo(3) is not safe to run in threads */
+#if defined(WITH_RESOLVER_THREADS) && defined(HAVE_GETADDRINFO)
+# define RESOLVER_THREADS
+#endif
+
+/*
+ * A name is QUEUED for a worker, RUNNING in one, ANSWERED but not yet
+ * seen by the main thread, or CACHED until it expires. The state and
+ * the lists shared with the workers are under the lock; the tree, the
+ * cache list and the "cached" flag belong to the main thread.
+ */
+#define RESOLVER_QUEUED		0
+#define RESOLVER_RUNNING	1
+#define RESOLVER_ANSWERED	2
+#define RESOLVER_CACHED		3
+
+struct resolver_query;
+
+struct resolver_entry {
+	RB_ENTRY(resolver_entry) tree_entry;
+	TAILQ_ENTRY(resolver_entry) next;	/* job, answer or cache list */
+	char		*host;
+	int		 flags;
+	int		 family;
+	int		 socktype;
+	int		 protocol;
+	int		 state;
+	int		 cached;
+	int		 gaierr;
+	struct addrinfo	*ai;			/* from getaddrinfo(3) */
+	time_t		 expires;
+	TAILQ_HEAD(, resolver_query) queries;
+};
+
+struct resolver_query {
+	TAILQ_ENTRY(resolver_query) next;
+	struct resolver_entry *entry;		/* NULL once answered */
+	int		 port;
+	int		 gaierr;
+	struct addrinfo	*ai;
+	resolver_cb	*cb;
+	void		*arg;
+};
+
+TAILQ_HEAD(resolver_list, resolver_entry);
+TAILQ_HEAD(resolver_query_list, resolver_query);
+
+static int
+resolver_cmp(struct resolver_entry *a, struct resolver_entry *b)
+{
+	if (a->family != b->family)
+		return a->family < b->family ? -1 : 1;
+	if (a->socktype != b->socktype)
+		return a->socktype < b->socktype ? -1 : 1;
+	if (a->protocol != b->protocol)
+		return a->protocol < b->protocol ? -1 : 1;
+	if (a->flags != b->flags)
+		return a->flags < b->flags ? -1 : 1;
+	return strcmp(a->host, b->host);
+}
+
+RB_HEAD(resolver_tree, resolver_entry);
+RB_GENERATE_STATIC(resolver_tree, resolver_entry, tree_entry, resolver_cmp);
+
+static struct resolver_tree resolver_names = RB_INITIALIZER(&resolver_names);
+static struct resolver_list resolver_cache =
+    TAILQ_HEAD_INITIALIZER(resolver_cache);
+static struct resolver_query_list resolver_ready =
+    TAILQ_HEAD_INITIALIZER(resolver_ready);
+static u_int resolver_ncached;
+static u_int resolver_npending;
+
+static struct {
+	unsigned long long lookups;
+	unsigned long long hits;
+	unsigned long long negative_hits;
+	unsigned long long shared;
+	unsigned long long threaded;
+} resolver_stats;
+
+#ifdef RESOLVER_THREADS
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_wakeup = PTHREAD_COND_INITIALIZER;
+static struct resolver_list resolver_jobs =
+    TAILQ_HEAD_INITIALIZER(resolver_jobs);
+static struct resolver_list resolver_answers =
+    TAILQ_HEAD_INITIALIZER(resolver_answers);
+static u_int resolver_njobs, resolver_nthreads, resolver_idle;
+static int resolver_pipe[2] = { -1, -1 };
+static int resolver_registered, resolver_broken;
+static volatile sig_atomic_t resolver_forked;
+#endif
+
+/*
+ * Copies the INET and INET6 addresses of a getaddrinfo(3) answer with
+ * "port" filled in. Each address is one allocation, as for the AF_UNIX
+ * addresses made up by the channel code.
+ */
+static struct addrinfo *
+resolver_copy(const struct addrinfo *ai, int port)
+{
+	struct addrinfo *ret = NULL, **tailp = &ret, *n;
+
+	for (; ai != NULL; ai = ai->ai_next) {
+		if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+			continue;
+		n = xcalloc(1, sizeof(*n) + ai->ai_addrlen);
+		n->ai_flags = ai->ai_flags;
+		n->ai_family = ai->ai_family;
+		n->ai_socktype = ai->ai_socktype;
+		n->ai_protocol = ai->ai_protocol;
+		n->ai_addrlen = ai->ai_addrlen;
+		n->ai_addr = (struct sockaddr *)(n + 1);
+		memcpy(n->ai_addr, ai->ai_addr, ai->ai_addrlen);
+		if (n->ai_family == AF_INET)
+			((struct sockaddr_in *)n->ai_addr)->sin_port =
+			    htons(port);
+		else
+			((struct sockaddr_in6 *)n->ai_addr)->sin6_port =
+			    htons(port);
+		*tailp = n;
+		tailp = &n->ai_next;
+	}
+	return ret;
+}
+
+void
+resolver_freeaddrinfo(struct addrinfo *ai)
+{
+	struct addrinfo *next;
+
+	for (; ai != NULL; ai = next) {
+		next = ai->ai_next;
+		free(ai);
+	}
+}
+
+static void
+resolver_answer(struct resolver_entry *e, int port,
+    struct addrinfo **resp, int *gaierrp)
+{
+	*resp = NULL;
+	if ((*gaierrp = e->gaierr) == 0 &&
+	    (*resp = resolver_copy(e->ai, port)) == NULL)
+		*gaierrp = EAI_NONAME;
+}
+
+static void
+resolver_evict(struct resolver_entry *e)
+{
+	RB_REMOVE(resolver_tree, &resolver_names, e);
+	TAILQ_REMOVE(&resolver_cache, e, next);
+	resolver_ncached--;
+	if (e->ai != NULL)
+		freeaddrinfo(e->ai);
+	free(e->host);
+	free(e);
+}
+
+/*
+ * Keeps an answer for later lookups. Temporary failures expire at once
+ * and are only shared by the queries already waiting for them.
+ */
+static void
+resolver_keep(struct resolver_entry *e)
+{
+	time_t ttl = 0;
+
+	if (e->gaierr == 0)
+		ttl = RESOLVER_CACHE_TTL;
+	else if (e->gaierr == EAI_NONAME)
+		ttl = RESOLVER_NEGATIVE_TTL;
+#ifdef EAI_NODATA
+	else if (e->gaierr == EAI_NODATA)
+		ttl = RESOLVER_NEGATIVE_TTL;
+#endif
+	e->state = RESOLVER_CACHED;
+	e->cached = 1;
+	e->expires = monotime() + ttl;
+	TAILQ_INSERT_TAIL(&resolver_cache, e, next);
+	resolver_ncached++;
+	while (resolver_ncached > RESOLVER_CACHE_MAX)
+		resolver_evict(TAILQ_FIRST(&resolver_cache));
+}
+
+#ifdef RESOLVER_THREADS
+static void *
+resolver_worker_main(void *arg)
+{
+	struct resolver_entry *e;
+	struct addrinfo hints, *ai;
+	int gaierr;
+	char c = 0;
+
+	pthread_mutex_lock(&resolver_lock);
+	for (;;) {
+		while ((e = TAILQ_FIRST(&resolver_jobs)) == NULL) {
+			resolver_idle++;
+			pthread_cond_wait(&resolver_wakeup, &resolver_lock);
+			resolver_idle--;
+		}
+		TAILQ_REMOVE(&resolver_jobs, e, next);
+		resolver_njobs--;
+		e->state = RESOLVER_RUNNING;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_flags = e->flags;
+		hints.ai_family = e->family;
+		hints.ai_socktype = e->socktype;
+		hints.ai_protocol = e->protocol;
+		pthread_mutex_unlock(&resolver_lock);
+
+		ai = NULL;
+		gaierr = getaddrinfo(e->host, NULL, &hints, &ai);
+
+		pthread_mutex_lock(&resolver_lock);
+		e->gaierr = gaierr;
+		e->ai = ai;
+		e->state = RESOLVER_ANSWERED;
+		if (TAILQ_EMPTY(&resolver_answers))
+			(void)write(resolver_pipe[1], &c, 1);
+		TAILQ_INSERT_TAIL(&resolver_answers, e, next);
+	}
+	/* NOTREACHED */
+	return NULL;
+}
+
+static int
+resolver_spawn(void)
+{
+	sigset_t all, saved;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int r;
+
+	if (pthread_attr_init(&attr) != 0)
+		return -1;
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	/* Signals are for the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	r = pthread_create(&thread, &attr, resolver_worker_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	pthread_attr_destroy(&attr);
+	if (r != 0) {
+		error("%s: pthread_create: %s", __func__, strerror(r));
+		return -1;
+	}
+	resolver_nthreads++;
+	return 0;
+}
+
+/* Hands the queued jobs to idle workers, starting more as needed */
+static int
+resolver_kick(void)
+{
+	if (resolver_njobs > resolver_idle &&
+	    resolver_nthreads < RESOLVER_MAX_THREADS)
+		resolver_spawn();
+	if (resolver_nthreads == 0)
+		return -1;
+	pthread_cond_broadcast(&resolver_wakeup);
+	return 0;
+}
+
+static int
+resolver_open_pipe(void)
+{
+	int p[2];
+
+	if (pipe(p) == -1) {
+		error("%s: pipe: %s", __func__, strerror(errno));
+		return -1;
+	}
+	if (fcntl(p[0], F_SETFD, FD_CLOEXEC) == -1 ||
+	    fcntl(p[1], F_SETFD, FD_CLOEXEC) == -1 ||
+	    set_nonblock(p[0]) == -1 || set_nonblock(p[1]) == -1) {
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+	resolver_pipe[0] = p[0];
+	resolver_pipe[1] = p[1];
+	return 0;
+}
+
+static void
+resolver_atfork_prepare(void)
+{
+	pthread_mutex_lock(&resolver_lock);
+}
+
+static void
+resolver_atfork_parent(void)
+{
+	pthread_mutex_unlock(&resolver_lock);
+}
+
+static void
+resolver_atfork_child(void)
+{
+	pthread_mutex_unlock(&resolver_lock);
+	resolver_forked = 1;
+}
+
+/*
+ * The workers stay with the parent. The child redoes the lookups they
+ * were running in workers of its own, and gets a pipe of its own, so
+ * that the parent's workers do not wake it.
+ */
+static void
+resolver_after_fork(void)
+{
+	struct resolver_entry *e;
+	int p[2];
+	char c = 0;
+
+	resolver_forked = 0;
+	resolver_nthreads = resolver_idle = 0;
+	pthread_cond_init(&resolver_wakeup, NULL);
+	RB_FOREACH(e, resolver_tree, &resolver_names) {
+		if (e->state != RESOLVER_RUNNING)
+			continue;
+		e->state = RESOLVER_QUEUED;
+		TAILQ_INSERT_TAIL(&resolver_jobs, e, next);
+		resolver_njobs++;
+	}
+	p[0] = resolver_pipe[0];
+	p[1] = resolver_pipe[1];
+	if (resolver_open_pipe() != 0)
+		fatal("%s: cannot set up the resolver", __func__);
+	close(p[0]);
+	close(p[1]);
+	if (!TAILQ_EMPTY(&resolver_answers))
+		(void)write(resolver_pipe[1], &c, 1);
+	if (resolver_njobs > 0 && resolver_kick() != 0)
+		fatal("%s: cannot start the resolver", __func__);
+}
+
+/* Queues a lookup for the workers. Returns -1 if there are none. */
+static int
+resolver_queue(struct resolver_entry *e)
+{
+	int r;
+
+	if (resolver_broken)
+		return -1;
+	if (!resolver_registered) {
+		if (pthread_atfork(resolver_atfork_prepare,
+		    resolver_atfork_parent, resolver_atfork_child) != 0 ||
+		    resolver_open_pipe() != 0) {
+			resolver_broken = 1;
+			return -1;
+		}
+		resolver_registered = 1;
+	}
+	pthread_mutex_lock(&resolver_lock);
+	e->state = RESOLVER_QUEUED;
+	TAILQ_INSERT_TAIL(&resolver_jobs, e, next);
+	resolver_njobs++;
+	if ((r = resolver_kick()) != 0) {
+		TAILQ_REMOVE(&resolver_jobs, e, next);
+		resolver_njobs--;
+		resolver_broken = 1;
+		verbose("%s: resolving names synchronously", __func__);
+	}
+	pthread_mutex_unlock(&resolver_lock);
+	if (r == 0) {
+		resolver_npending++;
+		resolver_stats.threaded++;
+	}
+	return r;
+}
+#endif /* RESOLVER_THREADS */
+
+struct resolver_query *
+resolver_start(const char *host, int port, const struct addrinfo *hints,
+    struct addrinfo **resp, int *gaierrp)
+{
+	struct resolver_entry key, *e;
+	struct resolver_query *q;
+	struct addrinfo nhints, *ai;
+
+	*resp = NULL;
+	*gaierrp = 0;
+	resolver_stats.lookups++;
+#ifdef RESOLVER_THREADS
+	if (resolver_forked)
+		resolver_after_fork();
+#endif
+
+	/* Addresses need no lookup */
+	nhints = *hints;
+	nhints.ai_flags |= AI_NUMERICHOST;
+	if (getaddrinfo(host, NULL, &nhints, &ai) == 0) {
+		if ((*resp = resolver_copy(ai, port)) == NULL)
+			*gaierrp = EAI_NONAME;
+		freeaddrinfo(ai);
+		return NULL;
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.host = (char *)host;
+	key.flags = hints->ai_flags;
+	key.family = hints->ai_family;
+	key.socktype = hints->ai_socktype;
+	key.protocol = hints->ai_protocol;
+	if ((e = RB_FIND(resolver_tree, &resolver_names, &key)) != NULL &&
+	    e->cached && e->expires <= monotime()) {
+		resolver_evict(e);
+		e = NULL;
+	}
+	if (e == NULL) {
+		e = xcalloc(1, sizeof(*e));
+		e->host = xstrdup(host);
+		e->flags = key.flags;
+		e->family = key.family;
+		e->socktype = key.socktype;
+		e->protocol = key.protocol;
+		TAILQ_INIT(&e->queries);
+		RB_INSERT(resolver_tree, &resolver_names, e);
+#ifdef RESOLVER_THREADS
+		if (resolver_queue(e) != 0)
+#endif
+		{
+			nhints = *hints;
+			e->gaierr = getaddrinfo(host, NULL, &nhints, &e->ai);
+			resolver_keep(e);
+		}
+	} else if (!e->cached)
+		resolver_stats.shared++;
+	else {
+		if (e->gaierr == 0)
+			resolver_stats.hits++;
+		else
+			resolver_stats.negative_hits++;
+		TAILQ_REMOVE(&resolver_cache, e, next);
+		TAILQ_INSERT_TAIL(&resolver_cache, e, next);
+	}
+
+	if (e->cached) {
+		resolver_answer(e, port, resp, gaierrp);
+		return NULL;
+	}
+	q = xcalloc(1, sizeof(*q));
+	q->entry = e;
+	q->port = port;
+	TAILQ_INSERT_TAIL(&e->queries, q, next);
+	return q;
+}
+
+void
+resolver_notify(struct resolver_query *q, resolver_cb *cb, void *arg)
+{
+	q->cb = cb;
+	q->arg = arg;
+}
+
+void
+resolver_cancel(struct resolver_query *q)
+{
+	if (q == NULL)
+		return;
+	if (q->entry != NULL)
+		TAILQ_REMOVE(&q->entry->queries, q, next);
+	else {
+		TAILQ_REMOVE(&resolver_ready, q, next);
+		resolver_freeaddrinfo(q->ai);
+	}
+	free(q);
+}
+
+int
+resolver_fd(void)
+{
+#ifdef RESOLVER_THREADS
+	if (resolver_forked)
+		resolver_after_fork();
+	if (resolver_npending > 0)
+		return resolver_pipe[0];
+#endif
+	return -1;
+}
+
+/*
+ * All answers are taken before the first callback runs, as a callback
+ * may start or cancel queries.
+ */
+void
+resolver_dispatch(void)
+{
+#ifdef RESOLVER_THREADS
+	struct resolver_list answers = TAILQ_HEAD_INITIALIZER(answers);
+	struct resolver_entry *e;
+	struct resolver_query *q;
+	char buf[64];
+
+	if (resolver_forked)
+		resolver_after_fork();
+	if (resolver_npending == 0)
+		return;
+	while (read(resolver_pipe[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&resolver_lock);
+	while ((e = TAILQ_FIRST(&resolver_answers)) != NULL) {
+		TAILQ_REMOVE(&resolver_answers, e, next);
+		TAILQ_INSERT_TAIL(&answers, e, next);
+	}
+	pthread_mutex_unlock(&resolver_lock);
+
+	while ((e = TAILQ_FIRST(&answers)) != NULL) {
+		TAILQ_REMOVE(&answers, e, next);
+		resolver_npending--;
+		debug3("%s: %s: %s", __func__, e->host,
+		    e->gaierr == 0 ? "resolved" : ssh_gai_strerror(e->gaierr));
+		while ((q = TAILQ_FIRST(&e->queries)) != NULL) {
+			TAILQ_REMOVE(&e->queries, q, next);
+			resolver_answer(e, q->port, &q->ai, &q->gaierr);
+			q->entry = NULL;
+			TAILQ_INSERT_TAIL(&resolver_ready, q, next);
+		}
+		resolver_keep(e);
+	}
+	while ((q = TAILQ_FIRST(&resolver_ready)) != NULL) {
+		TAILQ_REMOVE(&resolver_ready, q, next);
+		q->cb(q->gaierr, q->ai, q->arg);
+		free(q);
+	}
+#endif
+}
+
+int
+resolver_get_stats(struct sshbuf *b)
+{
+	u_int threads = 0;
+
+#ifdef RESOLVER_THREADS
+	threads = resolver_nthreads;
+#endif
+	return sshbuf_putf(b, "resolver.lookups %llu\n"
+	    "resolver.cache_hits %llu\n"
+	    "resolver.negative_hits %llu\n"
+	    "resolver.shared %llu\n"
+	    "resolver.threaded %llu\n"
+	    "resolver.pending %u\n"
+	    "resolver.cached %u\n"
+	    "resolver.threads %u\n",
+	    resolver_stats.lookups, resolver_stats.hits,
+	    resolver_stats.negative_hits, resolver_stats.shared,
+	    resolver_stats.threaded, resolver_npending, resolver_ncached,
+	    threads);
+}
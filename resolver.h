@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2026 Etersoft
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _RESOLVER_H
+#define _RESOLVER_H
+
+#include <sys/types.h>
+
+/*
+ * Name resolution off the event loop. Lookups that cannot be answered at
+ * once run getaddrinfo(3) on a few worker threads, and the results are
+ * handed back to the main thread through a descriptor the event loop
+ * waits on. Answers, including "no such host", are kept in a small cache
+ * for a short while, and lookups of a name already being resolved wait
+ * for the same answer. Without threads every lookup is answered at once.
+ */
+
+#define RESOLVER_MAX_THREADS	4	/* worker threads */
+#define RESOLVER_CACHE_MAX	256	/* cached names */
+#define RESOLVER_CACHE_TTL	30	/* seconds an address is kept */
+#define RESOLVER_NEGATIVE_TTL	5	/* seconds "no such host" is kept */
+
+struct addrinfo;
+struct sshbuf;
+struct resolver_query;
+
+/*
+ * Called from resolver_dispatch() with the answer to a query: either
+ * a getaddrinfo(3) error or a list of addresses, which belongs to the
+ * callee and is freed with resolver_freeaddrinfo().
+ */
+typedef void resolver_cb(int gaierr, struct addrinfo *ai, void *arg);
+
+/*
+ * Looks up "host" for the family, socket type and protocol of "hints",
+ * with "port" filled into the addresses. If the answer is at hand, it is
+ * stored in *resp, or the error in *gaierrp, and NULL is returned.
+ * Otherwise a query is returned, whose callback must be set with
+ * resolver_notify() before returning to the event loop.
+ */
+struct resolver_query *resolver_start(const char *host, int port,
+    const struct addrinfo *hints, struct addrinfo **resp, int *gaierrp);
+
+void resolver_notify(struct resolver_query *q, resolver_cb *cb, void *arg);
+
+/* Drops a query. Its callback is not called. */
+void resolver_cancel(struct resolver_query *q);
+
+/*
+ * Returns the descriptor that becomes readable when queries are
+ * answered, or -1 if no query is outstanding.
+ */
+int resolver_fd(void);
+
+/* Calls the callbacks of the queries answered so far. */
+void resolver_dispatch(void);
+
+/* Frees addresses returned by resolver_start() or passed to a callback. */
+void resolver_freeaddrinfo(struct addrinfo *ai);
+
+/* Appends the resolver counters in "name value" lines. */
+int resolver_get_stats(struct sshbuf *b);
+
+#endif /* _RESOLVER_H */
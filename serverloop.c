@@ -48,6 +48,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pwd.h>
 #include <signal.h>
 #include <string.h>
@@ -65,6 +66,7 @@
 #include "canohost.h"
 #include "sshpty.h"
 #include "channels.h"
+#include "eventloop.h"
 #include "compat.h"
 #include "ssh2.h"
 #include "key.h"
@@ -129,17 +131,18 @@ notify_parent(void)
 		(void)write(notify_pipe[1], "", 1);
 }
 static void
-notify_prepare(fd_set *readset)
+notify_prepare(void)
 {
 	if (notify_pipe[0] != -1)
-		FD_SET(notify_pipe[0], readset);
+		channel_want_fd(notify_pipe[0], EVENTLOOP_READ);
 }
 static void
-notify_done(fd_set *readset)
+notify_done(void)
 {
 	char c;
 
-	if (notify_pipe[0] != -1 && FD_ISSET(notify_pipe[0], readset))
+	if (notify_pipe[0] != -1 &&
+	    channel_fd_ready(notify_pipe[0], EVENTLOOP_READ))
 		while (read(notify_pipe[0], &c, 1) != -1)
 			debug2("notify_done: reading");
 }
@@ -190,24 +193,21 @@ client_alive_check(void)
 }
 
 /*
- * Sleep in select() until we can do something.  This will initialize the
- * select masks.  Upon return, the masks will indicate which descriptors
- * have data or can accept data.  Optionally, a maximum time can be specified
- * for the duration of the wait (0 = infinite).
+ * Sleep until we can do something.  Upon return, channel_fd_ready()
+ * tells which descriptors have data or can accept data.  Optionally, a
+ * maximum time can be specified for the duration of the wait
+ * (0 = infinite).
  */
 static void
 wait_until_can_do_something(int connection_in, int connection_out,
-    fd_set **readsetp, fd_set **writesetp, int *maxfdp,
-    u_int *nallocp, u_int64_t max_time_ms)
+    u_int64_t max_time_ms)
 {
-	struct timeval tv, *tvp;
-	int ret;
+	int ret, timeout_ms;
 	time_t minwait_secs = 0;
 	int client_alive_scheduled = 0;
 
-	/* Allocate and update select() masks for channel descriptors. */
-	channel_prepare_select(readsetp, writesetp, maxfdp, nallocp,
-	    &minwait_secs, 0);
+	/* State what the channel descriptors wait for. */
+	channel_prepare_poll(&minwait_secs, 0);
 
 	/* XXX need proper deadline system for rekey/client alive */
 	if (minwait_secs != 0)
@@ -234,15 +234,15 @@ wait_until_can_do_something(int connection_in, int connection_out,
 	/* wrong: bad condition XXX */
 	if (channel_not_very_much_buffered_data())
 #endif
-	FD_SET(connection_in, *readsetp);
-	notify_prepare(*readsetp);
+	channel_want_fd(connection_in, EVENTLOOP_READ);
+	notify_prepare();
 
 	/*
 	 * If we have buffered packet data going to the client, mark that
 	 * descriptor.
 	 */
 	if (packet_have_data_to_write())
-		FD_SET(connection_out, *writesetp);
+		channel_want_fd(connection_out, EVENTLOOP_WRITE);
 
 	/*
 	 * If child has terminated and there is enough buffer space to read
@@ -253,25 +253,20 @@ wait_until_can_do_something(int connection_in, int connection_out,
 			max_time_ms = 100;
 
 	if (max_time_ms == 0)
-		tvp = NULL;
-	else {
-		tv.tv_sec = max_time_ms / 1000;
-		tv.tv_usec = 1000 * (max_time_ms % 1000);
-		tvp = &tv;
-	}
+		timeout_ms = -1;
+	else
+		timeout_ms = MINIMUM(max_time_ms, INT_MAX);
 
 	/* Wait for something to happen, or the timeout to expire. */
-	ret = select((*maxfdp)+1, *readsetp, *writesetp, NULL, tvp);
+	ret = channel_poll(timeout_ms);
 
 	if (ret == -1) {
-		memset(*readsetp, 0, *nallocp);
-		memset(*writesetp, 0, *nallocp);
 		if (errno != EINTR)
-			error("select: %.100s", strerror(errno));
+			error("poll: %.100s", strerror(errno));
 	} else if (ret == 0 && client_alive_scheduled)
 		client_alive_check();
 
-	notify_done(*readsetp);
+	notify_done();
 }
 
 /*
@@ -279,14 +274,14 @@ wait_until_can_do_something(int connection_in, int connection_out,
  * in buffers and processed later.
  */
 static int
-process_input(fd_set *readset, int connection_in)
+process_input(int connection_in)
 {
 	struct ssh *ssh = active_state; /* XXX */
 	int len;
 	char buf[16384];
 
 	/* Read and buffer any input data from the client. */
-	if (FD_ISSET(connection_in, readset)) {
+	if (channel_fd_ready(connection_in, EVENTLOOP_READ)) {
 		len = read(connection_in, buf, sizeof(buf));
 		if (len == 0) {
 			verbose("Connection closed by %.100s port %d",
@@ -313,10 +308,10 @@ process_input(fd_set *readset, int connection_in)
  * Sends data from internal buffers to client program stdin.
  */
 static void
-process_output(fd_set *writeset, int connection_out)
+process_output(int connection_out)
 {
 	/* Send any buffered packet data to the client. */
-	if (FD_ISSET(connection_out, writeset))
+	if (channel_fd_ready(connection_out, EVENTLOOP_WRITE))
 		packet_write_poll();
 }
 
@@ -351,9 +346,7 @@ collect_children(void)
 void
 server_loop2(Authctxt *authctxt)
 {
-	fd_set *readset = NULL, *writeset = NULL;
-	int max_fd;
-	u_int nalloc = 0, connection_in, connection_out;
+	u_int connection_in, connection_out;
 	u_int64_t rekey_timeout_ms = 0;
 
 	debug("Entering interactive session for SSH2.");
@@ -371,9 +364,6 @@ server_loop2(Authctxt *authctxt)
 
 	notify_setup();
 
-	max_fd = MAXIMUM(connection_in, connection_out);
-	max_fd = MAXIMUM(max_fd, notify_pipe[0]);
-
 	server_init_dispatch();
 
 	for (;;) {
@@ -389,7 +379,7 @@ server_loop2(Authctxt *authctxt)
 			rekey_timeout_ms = 0;
 
 		wait_until_can_do_something(connection_in, connection_out,
-		    &readset, &writeset, &max_fd, &nalloc, rekey_timeout_ms);
+		    rekey_timeout_ms);
 
 		if (received_sigterm) {
 			logit("Exiting on signal %d", (int)received_sigterm);
@@ -399,16 +389,13 @@ server_loop2(Authctxt *authctxt)
 
 		collect_children();
 		if (!ssh_packet_is_rekeying(active_state))
-			channel_after_select(readset, writeset);
-		if (process_input(readset, connection_in) < 0)
+			channel_after_poll();
+		if (process_input(connection_in) < 0)
 			break;
-		process_output(writeset, connection_out);
+		process_output(connection_out);
 	}
 	collect_children();
 
-	free(readset);
-	free(writeset);
-
 	/* free all channels, no more reads and writes */
 	channel_free_all();
 
@@ -606,7 +593,7 @@ server_input_channel_open(int type, u_int32_t seq, void *ctxt)
 	}
 	if (c != NULL) {
 		debug("server_input_channel_open: confirm %s", ctype);
-		c->remote_id = rchan;
+		channel_set_remote_id(c, rchan);
 		c->remote_window = rwindow;
 		c->remote_maxpacket = rmaxpack;
 		if (c->type != SSH_CHANNEL_CONNECTING) {
@@ -103,6 +103,7 @@
 #include "canohost.h"
 #include "compat.h"
 #include "cipher.h"
+#include "compress.h"
 #include "digest.h"
 #include "packet.h"
 #include "buffer.h"
@@ -335,6 +336,7 @@ usage(void)
 "             [-P [proxy_user:proxy_password@]proxy_hostname:proxy_port]\n"
 "             [-S ctl_path] [-W host:port] [-w local_tun[:remote_tun]]\n"
 "             [user@]hostname [command]\n"
+"       nxssh -nxrelayd socket_path\n"
 	);
 	exit(255);
 }
@@ -712,6 +714,16 @@ main(int ac, char **av)
 
 	__progname = ssh_get_progname(av[0]);
 
+	/*
+	 * Run as the relay daemon serving the server side
+	 * loops handed over by the nxssh -B processes.
+	 */
+	if (ac > 2 && strcmp(av[1], "-nxrelayd") == 0) {
+		log_init(__progname, SYSLOG_LEVEL_INFO, SYSLOG_FACILITY_USER, 1);
+		nx_run_relay_daemon(av[2]);
+		exit(0);
+	}
+
 #ifndef HAVE_SETPROCTITLE
 	/* Prepare for later setproctitle emulation */
 	/* Save argv so it isn't clobbered by setproctitle() emulation */
@@ -862,6 +874,8 @@ main(int ac, char **av)
 				muxclient_command = SSHMUX_COMMAND_CANCEL_FWD;
 			else if (strcmp(optarg, "proxy") == 0)
 				muxclient_command = SSHMUX_COMMAND_PROXY;
+			else if (strcmp(optarg, "stats") == 0)
+				muxclient_command = SSHMUX_COMMAND_STATS;
 			else
 				fatal("Invalid multiplex command.");
 			break;
@@ -878,6 +892,8 @@ main(int ac, char **av)
 				cp = mac_alg_list('\n');
 			else if (strcmp(optarg, "kex") == 0)
 				cp = kex_alg_list('\n');
+			else if (strcmp(optarg, "compression") == 0)
+				cp = compress_alg_list('\n');
 			else if (strcmp(optarg, "key") == 0)
 				cp = sshkey_alg_list(0, 0, 0, '\n');
 			else if (strcmp(optarg, "key-cert") == 0)
@@ -1438,6 +1454,15 @@ main(int ac, char **av)
 	if (options.port == 0)
 		options.port = default_ssh_port();
 	channel_set_af(options.address_family);
+	channel_set_window_max(options.channel_window_max);
+	if (channel_set_scheduler(options.channel_scheduler) != 0)
+		fatal("Unsupported ChannelScheduler \"%s\"",
+		    options.channel_scheduler);
+	if (options.channel_accept_batch < 1 ||
+	    options.channel_accept_batch > CHAN_ACCEPT_BATCH_MAX)
+		fatal("Invalid ChannelAcceptBatch %d",
+		    options.channel_accept_batch);
+	channel_set_accept_batch(options.channel_accept_batch);
 
 	/* Tidy and check options */
 	if (options.host_key_alias != NULL)
@@ -1454,6 +1479,9 @@ main(int ac, char **av)
 	}
 	if (options.connection_attempts <= 0)
 		fatal("Invalid number of ConnectionAttempts");
+	if (options.cipher_threads < 0 ||
+	    cipher_set_threads(options.cipher_threads) != 0)
+		fatal("Invalid number of CipherThreads");
 #ifndef HAVE_CYGWIN
 	if (original_effective_uid != 0)
 		options.use_privileged_port = 0;
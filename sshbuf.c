@@ -144,6 +144,36 @@ sshbuf_init(struct sshbuf *ret)
 		ret->alloc = 0;
 }
 
+void
+sshbuf_init_storage(struct sshbuf *ret, u_char *d, size_t alloc)
+{
+	explicit_bzero(ret, sizeof(*ret));
+	ret->alloc = alloc;
+	ret->max_size = SSHBUF_SIZE_MAX;
+	ret->readonly = 0;
+	ret->dont_free = 1;
+	ret->refcount = 1;
+	ret->cd = ret->d = d;
+}
+
+u_char *
+sshbuf_release(struct sshbuf *buf, size_t *allocp)
+{
+	u_char *d;
+
+	*allocp = 0;
+	if (sshbuf_check_sanity(buf) != 0 || !buf->dont_free ||
+	    buf->readonly || buf->refcount != 1 || buf->parent != NULL) {
+		sshbuf_free(buf);
+		return NULL;
+	}
+	d = buf->d;
+	*allocp = buf->alloc;
+	explicit_bzero(d, buf->alloc);
+	explicit_bzero(buf, sizeof(*buf));
+	return d;
+}
+
 void
 sshbuf_free(struct sshbuf *buf)
 {
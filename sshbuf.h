@@ -57,6 +57,19 @@ struct sshbuf {
  * only included to allow compat with buffer_* in OpenSSH)
  */
 void sshbuf_init(struct sshbuf *buf);
+
+/*
+ * Like sshbuf_init(), but takes "alloc" bytes of storage at "d", which
+ * must have been obtained from malloc(3).  Used by pools of storage.
+ */
+void sshbuf_init_storage(struct sshbuf *buf, u_char *d, size_t alloc);
+
+/*
+ * Frees a buffer set up by sshbuf_init(), but returns its storage,
+ * cleared, instead of freeing it.  The size of the storage is stored in
+ * *allocp.  Returns NULL if the buffer has no storage of its own.
+ */
+u_char *sshbuf_release(struct sshbuf *buf, size_t *allocp);
 #endif
 
 /*
@@ -114,6 +127,11 @@ int	sshbuf_set_max_size(struct sshbuf *buf, size_t max_size);
  */
 size_t	sshbuf_len(const struct sshbuf *buf);
 
+/*
+ * Return the allocation size of buf
+ */
+size_t	sshbuf_alloc(const struct sshbuf *buf);
+
 /*
  * Returns number of bytes left in buffer before hitting max_size.
  */
@@ -303,11 +321,6 @@ char *sshbuf_dup_string(struct sshbuf *buf);
 /* Internal definitions follow. Exposed for regress tests */
 #ifdef SSHBUF_INTERNAL
 
-/*
- * Return the allocation size of buf
- */
-size_t	sshbuf_alloc(const struct sshbuf *buf);
-
 /*
  * Increment the reference count of buf.
  */
@@ -196,7 +196,8 @@ ssh_kex2(char *host, struct sockaddr *hostaddr, u_short port)
 	    compat_cipher_proposal(options.ciphers);
 	myproposal[PROPOSAL_COMP_ALGS_CTOS] =
 	    myproposal[PROPOSAL_COMP_ALGS_STOC] = options.compression ?
-	    "zlib@openssh.com,zlib,none" : "none,zlib@openssh.com,zlib";
+	    KEX_ZSTD_COMP "zlib@openssh.com,zlib,none" :
+	    "none," KEX_ZSTD_COMP "zlib@openssh.com,zlib";
 	myproposal[PROPOSAL_MAC_ALGS_CTOS] =
 	    myproposal[PROPOSAL_MAC_ALGS_STOC] = options.macs;
 	if (options.hostkeyalgorithms != NULL) {
@@ -217,6 +218,9 @@ ssh_kex2(char *host, struct sockaddr *hostaddr, u_short port)
 	if (options.rekey_limit || options.rekey_interval)
 		packet_set_rekey_limits((u_int32_t)options.rekey_limit,
 		    (time_t)options.rekey_interval);
+	if (options.rekey_idle_percent > 0)
+		ssh_packet_set_idle_rekey(active_state,
+		    options.rekey_idle_percent, options.rekey_idle_time);
 
 	/* start key exchange */
 	if ((r = kex_setup(active_state, myproposal)) != 0)
@@ -147,6 +147,7 @@ int nx_check_proxy_authentication(int proxy_fd) {return 0;}
 int nx_switch_client_side_descriptors(Channel *channel, int proxy_fd) {return 0;}
 int nx_switch_forward_descriptors(Channel *channel) {return 0;}
 int nx_check_channel_input(Channel *channel, char *data, int *length, int limit) {return 0;}
+int nx_flush_channel_input(Channel *channel, char *data, int limit) {return 0;}
 int nx_switch_forward_port(Channel *channel) {return 0;}
 int nx_proxy_select (int maxfds, fd_set *readfds, fd_set *writefds,
                          fd_set *exceptfds, struct timeval *timeout)
@@ -154,6 +155,7 @@ int nx_proxy_select (int maxfds, fd_set *readfds, fd_set *writefds,
   return select(maxfds, readfds, writefds, exceptfds, timeout);
 }
 void nx_set_socket_options(int fd, int blocking) {}
+void nx_proxy_forget_fd(int fd) {}
 
 /* Server configuration options. */
 ServerOptions options;